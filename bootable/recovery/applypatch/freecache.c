@@ -11,7 +11,73 @@
 
 #include "applypatch.h"
 
-static int EliminateOpenFiles(char** files, int file_count) {
+typedef struct {
+  char* path;
+  off_t bytes;     // space the file occupies on disk
+  time_t mtime;
+} ExpendableFile;
+
+// A set of strings, open-addressed.  Only ever grows.
+typedef struct {
+  char** slots;
+  int size;        // a power of two
+  int count;
+} PathSet;
+
+static unsigned int HashPath(const char* path) {
+  unsigned int h = 5381;
+  while (*path) h = h * 33 + (unsigned char)*path++;
+  return h;
+}
+
+static int PathSetContains(const PathSet* set, const char* path) {
+  if (set->size == 0) return 0;
+  unsigned int mask = set->size - 1;
+  unsigned int i = HashPath(path) & mask;
+  for (; set->slots[i] != NULL; i = (i + 1) & mask) {
+    if (strcmp(set->slots[i], path) == 0) return 1;
+  }
+  return 0;
+}
+
+static int PathSetAdd(PathSet* set, const char* path) {
+  if (PathSetContains(set, path)) return 0;
+
+  if ((set->count + 1) * 2 > set->size) {
+    int size = set->size ? set->size * 2 : 64;
+    char** slots = calloc(size, sizeof(char*));
+    if (slots == NULL) return -1;
+    int j;
+    for (j = 0; j < set->size; ++j) {
+      if (set->slots[j] == NULL) continue;
+      unsigned int i = HashPath(set->slots[j]) & (size - 1);
+      while (slots[i] != NULL) i = (i + 1) & (size - 1);
+      slots[i] = set->slots[j];
+    }
+    free(set->slots);
+    set->slots = slots;
+    set->size = size;
+  }
+
+  char* copy = strdup(path);
+  if (copy == NULL) return -1;
+  unsigned int mask = set->size - 1;
+  unsigned int i = HashPath(path) & mask;
+  while (set->slots[i] != NULL) i = (i + 1) & mask;
+  set->slots[i] = copy;
+  ++set->count;
+  return 0;
+}
+
+static void PathSetFree(PathSet* set) {
+  int i;
+  for (i = 0; i < set->size; ++i) free(set->slots[i]);
+  free(set->slots);
+}
+
+// Collects every file under /cache that some process has open, in one
+// pass over /proc/<pid>/fd.
+static int FindOpenCacheFiles(PathSet* open_files) {
   DIR* d;
   struct dirent* de;
   d = opendir("/proc");
@@ -48,19 +114,11 @@ static int EliminateOpenFiles(char** files, int file_count) {
       count = readlink(fd_path, link, sizeof(link)-1);
       if (count >= 0) {
         link[count] = '\0';
-
-        // This is inefficient, but it should only matter if there are
-        // lots of files in /cache, and lots of them are open (neither
-        // of which should be true, especially in recovery).
-        if (strncmp(link, "/cache/", 7) == 0) {
-          int j;
-          for (j = 0; j < file_count; ++j) {
-            if (files[j] && strcmp(files[j], link) == 0) {
-              printf("%s is open by %s\n", link, de->d_name);
-              free(files[j]);
-              files[j] = NULL;
-            }
-          }
+        if (strncmp(link, "/cache/", 7) == 0 &&
+            PathSetAdd(open_files, link) < 0) {
+          closedir(fdd);
+          closedir(d);
+          return -1;
         }
       }
     }
@@ -71,12 +129,21 @@ static int EliminateOpenFiles(char** files, int file_count) {
   return 0;
 }
 
-int FindExpendableFiles(char*** names, int* entries) {
+static int FindExpendableFiles(ExpendableFile** files, int* entries) {
   DIR* d;
   struct dirent* de;
   int size = 32;
   *entries = 0;
-  *names = malloc(size * sizeof(char*));
+  *files = malloc(size * sizeof(ExpendableFile));
+  if (*files == NULL) return -1;
+
+  PathSet open_files = { NULL, 0, 0 };
+  if (FindOpenCacheFiles(&open_files) < 0) {
+    PathSetFree(&open_files);
+    free(*files);
+    *files = NULL;
+    return -1;
+  }
 
   char path[FILENAME_MAX];
 
@@ -104,24 +171,42 @@ int FindExpendableFiles(char*** names, int* entries) {
       if (strcmp(path, CACHE_TEMP_SOURCE) == 0) continue;
 
       struct stat st;
-      if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
-        if (*entries >= size) {
-          size *= 2;
-          *names = realloc(*names, size * sizeof(char*));
-        }
-        (*names)[(*entries)++] = strdup(path);
+      if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+
+      if (PathSetContains(&open_files, path)) {
+        printf("%s is open\n", path);
+        continue;
+      }
+
+      if (*entries >= size) {
+        size *= 2;
+        ExpendableFile* bigger = realloc(*files, size * sizeof(ExpendableFile));
+        if (bigger == NULL) break;
+        *files = bigger;
       }
+      ExpendableFile* f = &(*files)[*entries];
+      f->path = strdup(path);
+      if (f->path == NULL) break;
+      f->bytes = (off_t)st.st_blocks * 512;
+      f->mtime = st.st_mtime;
+      ++*entries;
     }
 
     closedir(d);
   }
 
-  printf("%d regular files in deletable directories\n", *entries);
-
-  if (EliminateOpenFiles(*names, *entries) < 0) {
-    return -1;
-  }
+  PathSetFree(&open_files);
+  printf("%d unopened regular files in deletable directories\n", *entries);
+  return 0;
+}
 
+// Largest first, so as few files as possible go; among files of the
+// same size the least recently modified goes first.
+static int CompareExpendable(const void* a, const void* b) {
+  const ExpendableFile* fa = (const ExpendableFile*)a;
+  const ExpendableFile* fb = (const ExpendableFile*)b;
+  if (fa->bytes != fb->bytes) return fa->bytes > fb->bytes ? -1 : 1;
+  if (fa->mtime != fb->mtime) return fa->mtime < fb->mtime ? -1 : 1;
   return 0;
 }
 
@@ -134,39 +219,43 @@ int MakeFreeSpaceOnCache(size_t bytes_needed) {
     return 0;
   }
 
-  char** names;
+  ExpendableFile* files;
   int entries;
 
-  if (FindExpendableFiles(&names, &entries) < 0) {
+  if (FindExpendableFiles(&files, &entries) < 0) {
     return -1;
   }
 
   if (entries == 0) {
     // nothing we can delete to free up space!
     printf("no files can be deleted to free space on /cache\n");
+    free(files);
     return -1;
   }
 
-  // We could try to be smarter about which files to delete:  the
-  // biggest ones?  the smallest ones that will free up enough space?
-  // the oldest?  the newest?
-  //
-  // Instead, we'll be dumb.
+  qsort(files, entries, sizeof(ExpendableFile), CompareExpendable);
 
+  size_t free_before = free_now;
+  int deleted = 0;
   int i;
   for (i = 0; i < entries && free_now < bytes_needed; ++i) {
-    if (names[i]) {
-      unlink(names[i]);
-      free_now = FreeSpaceForFile("/cache");
-      printf("deleted %s; now %ld bytes free\n", names[i], (long)free_now);
-      free(names[i]);
+    if (unlink(files[i].path) != 0) {
+      printf("failed to delete %s: %s\n", files[i].path, strerror(errno));
+      continue;
     }
+    ++deleted;
+    free_now = FreeSpaceForFile("/cache");
+    printf("deleted %s (%ld bytes); now %ld bytes free\n",
+           files[i].path, (long)files[i].bytes, (long)free_now);
   }
 
-  for (; i < entries; ++i) {
-    free(names[i]);
+  printf("deleted %d files, reclaimed %ld bytes on /cache\n",
+         deleted, (long)(free_now - free_before));
+
+  for (i = 0; i < entries; ++i) {
+    free(files[i].path);
   }
-  free(names);
+  free(files);
 
   return (free_now >= bytes_needed) ? 0 : -1;
 }
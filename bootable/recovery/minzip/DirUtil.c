@@ -20,9 +20,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <dirent.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include "DirUtil.h"
 
@@ -165,116 +167,461 @@ dirCreateHierarchy(const char *path, int mode,
     return 0;
 }
 
-int
-dirUnlinkHierarchy(const char *path)
+/* Parallel tree walker behind dirUnlinkHierarchy() and
+ * dirSetHierarchyPermissions().
+ *
+ * Each directory is a WalkNode.  Workers scan directories with
+ * fstatat() and friends relative to the directory's fd, handle
+ * non-directories on the spot, and queue subdirectories on their own
+ * deque.  A worker takes its newest node (depth first, so the tree in
+ * flight stays small) and steals the oldest from another worker when its
+ * own deque is empty.  A node is finished, post-order, only once its
+ * own scan and every subdirectory under it are done; that is where
+ * directories are removed or get their permissions.
+ */
+
+#define WALK_MAX_THREADS 4
+
+typedef struct WalkNode {
+    struct WalkNode *parent;
+    char *path;
+    int pending;        // own scan + unfinished subdirectories
+    int failed;         // something below could not be handled
+} WalkNode;
+
+typedef struct {
+    pthread_mutex_t lock;
+    WalkNode **nodes;   // ring; owner uses the tail, thieves the head
+    int alloc;
+    int head;
+    int count;
+} WalkDeque;
+
+typedef struct Walk Walk;
+
+typedef struct {
+    /* A non-directory entry of the directory open as dfd; type is its
+     * DT_ type, DT_LNK for symlinks.
+     */
+    int (*visitFile)(Walk *walk, int dfd, const char *name,
+            unsigned char type);
+    /* A directory whose whole subtree has been visited. */
+    int (*finishDir)(Walk *walk, const char *path);
+    /* Whether a directory with a failure somewhere below it is still
+     * finished.
+     */
+    int finishAfterFailure;
+} WalkOps;
+
+struct Walk {
+    const WalkOps *ops;
+    int uid, gid, dirMode, fileMode;
+
+    WalkDeque deques[WALK_MAX_THREADS];
+    int workers;
+
+    pthread_mutex_t lock;       // everything below, and WalkNode counts
+    pthread_cond_t cond;
+    int outstanding;            // nodes queued or being scanned
+    int pushes;                 // bumped on every queued node
+    int error;                  // errno of the first failure
+};
+
+typedef struct {
+    Walk *walk;
+    int self;
+} WalkWorker;
+
+static void
+walkFail(Walk *walk, WalkNode *node, int err)
 {
-    struct stat st;
-    DIR *dir;
-    struct dirent *de;
-    int fail = 0;
+    pthread_mutex_lock(&walk->lock);
+    if (walk->error == 0) {
+        walk->error = err ? err : EIO;
+    }
+    if (node != NULL) {
+        node->failed = 1;
+    }
+    pthread_mutex_unlock(&walk->lock);
+}
 
-    /* is it a file or directory? */
-    if (lstat(path, &st) < 0) {
-        return -1;
+static int
+walkPush(Walk *walk, int self, WalkNode *node)
+{
+    WalkDeque *dq = &walk->deques[self];
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count == dq->alloc) {
+        int alloc = dq->alloc ? dq->alloc * 2 : 64;
+        WalkNode **nodes = malloc(alloc * sizeof(*nodes));
+        if (nodes == NULL) {
+            pthread_mutex_unlock(&dq->lock);
+            return -1;
+        }
+        int i;
+        for (i = 0; i < dq->count; i++) {
+            nodes[i] = dq->nodes[(dq->head + i) % dq->alloc];
+        }
+        free(dq->nodes);
+        dq->nodes = nodes;
+        dq->alloc = alloc;
+        dq->head = 0;
     }
+    /* Count it before anyone can take it, so the walk can't look done.
+     */
+    pthread_mutex_lock(&walk->lock);
+    walk->outstanding++;
+    walk->pushes++;
+    pthread_cond_signal(&walk->cond);
+    pthread_mutex_unlock(&walk->lock);
 
-    /* a file, so unlink it */
-    if (!S_ISDIR(st.st_mode)) {
-        return unlink(path);
+    dq->nodes[(dq->head + dq->count) % dq->alloc] = node;
+    dq->count++;
+    pthread_mutex_unlock(&dq->lock);
+    return 0;
+}
+
+static WalkNode *
+walkTake(Walk *walk, int self)
+{
+    WalkNode *node = NULL;
+    WalkDeque *dq = &walk->deques[self];
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count > 0) {
+        dq->count--;
+        node = dq->nodes[(dq->head + dq->count) % dq->alloc];
     }
+    pthread_mutex_unlock(&dq->lock);
 
-    /* a directory, so open handle */
-    dir = opendir(path);
+    int i;
+    for (i = 1; node == NULL && i < walk->workers; i++) {
+        dq = &walk->deques[(self + i) % walk->workers];
+        pthread_mutex_lock(&dq->lock);
+        if (dq->count > 0) {
+            node = dq->nodes[dq->head];
+            dq->head = (dq->head + 1) % dq->alloc;
+            dq->count--;
+        }
+        pthread_mutex_unlock(&dq->lock);
+    }
+    return node;
+}
+
+/* Drops one pending count from node and finishes it, and then its
+ * ancestors, as they run out of pending work.
+ */
+static void
+walkRelease(Walk *walk, WalkNode *node)
+{
+    pthread_mutex_lock(&walk->lock);
+    while (node != NULL && --node->pending == 0) {
+        int failed = node->failed;
+        pthread_mutex_unlock(&walk->lock);
+
+        if ((!failed || walk->ops->finishAfterFailure) &&
+                walk->ops->finishDir(walk, node->path) < 0) {
+            failed = 1;
+            walkFail(walk, NULL, errno);
+        }
+
+        pthread_mutex_lock(&walk->lock);
+        WalkNode *parent = node->parent;
+        if (failed && parent != NULL) {
+            parent->failed = 1;
+        }
+        free(node->path);
+        free(node);
+        node = parent;
+    }
+    pthread_mutex_unlock(&walk->lock);
+}
+
+static void
+walkScan(Walk *walk, int self, WalkNode *node)
+{
+    int fd = open(node->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    DIR *dir = fd < 0 ? NULL : fdopendir(fd);
     if (dir == NULL) {
-        return -1;
+        walkFail(walk, node, errno);
+        if (fd >= 0) {
+            close(fd);
+        }
+        walkRelease(walk, node);
+        return;
     }
 
-    /* recurse over components */
-    errno = 0;
+    size_t pathLen = strlen(node->path);
+    struct dirent *de;
     while ((de = readdir(dir)) != NULL) {
-//TODO: don't blow the stack
-        char dn[PATH_MAX];
         if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
             continue;
         }
-        snprintf(dn, sizeof(dn), "%s/%s", path, de->d_name);
-        if (dirUnlinkHierarchy(dn) < 0) {
-            fail = 1;
+
+        unsigned char type = de->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                walkFail(walk, node, errno);
+                continue;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR :
+                    S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
+        }
+
+        if (type != DT_DIR) {
+            if (walk->ops->visitFile(walk, fd, de->d_name, type) < 0) {
+                walkFail(walk, node, errno);
+            }
+            continue;
+        }
+
+        size_t len = pathLen + 1 + strlen(de->d_name) + 1;
+        if (len > PATH_MAX) {
+            walkFail(walk, node, ENAMETOOLONG);
+            continue;
+        }
+        WalkNode *child = malloc(sizeof(*child));
+        char *path = malloc(len);
+        if (child == NULL || path == NULL) {
+            free(child);
+            free(path);
+            walkFail(walk, node, ENOMEM);
+            continue;
+        }
+        snprintf(path, len, "%s/%s", node->path, de->d_name);
+        child->parent = node;
+        child->path = path;
+        child->pending = 1;
+        child->failed = 0;
+
+        pthread_mutex_lock(&walk->lock);
+        node->pending++;
+        pthread_mutex_unlock(&walk->lock);
+        if (walkPush(walk, self, child) < 0) {
+            free(path);
+            free(child);
+            walkFail(walk, node, ENOMEM);
+            pthread_mutex_lock(&walk->lock);
+            node->pending--;
+            pthread_mutex_unlock(&walk->lock);
+        }
+    }
+    closedir(dir);
+
+    walkRelease(walk, node);
+}
+
+static void *
+walkWorker(void *arg)
+{
+    WalkWorker *worker = (WalkWorker *)arg;
+    Walk *walk = worker->walk;
+
+    for (;;) {
+        pthread_mutex_lock(&walk->lock);
+        int pushes = walk->pushes;
+        pthread_mutex_unlock(&walk->lock);
+
+        WalkNode *node = walkTake(walk, worker->self);
+        if (node != NULL) {
+            walkScan(walk, worker->self, node);
+            pthread_mutex_lock(&walk->lock);
+            if (--walk->outstanding == 0) {
+                pthread_cond_broadcast(&walk->cond);
+            }
+            pthread_mutex_unlock(&walk->lock);
+            continue;
+        }
+
+        /* Nothing to take; sleep unless more was queued meanwhile.
+         */
+        pthread_mutex_lock(&walk->lock);
+        if (walk->outstanding == 0) {
+            pthread_mutex_unlock(&walk->lock);
             break;
         }
-        errno = 0;
+        if (walk->pushes == pushes) {
+            pthread_cond_wait(&walk->cond, &walk->lock);
+        }
+        pthread_mutex_unlock(&walk->lock);
     }
-    /* in case readdir or unlink_recursive failed */
-    if (fail || errno < 0) {
-        int save = errno;
-        closedir(dir);
-        errno = save;
+    return NULL;
+}
+
+/* Walks the directory at path on up to WALK_MAX_THREADS threads,
+ * including the caller's.  Returns 0, or -1 with errno set from the
+ * first failure; the walk carries on past failures, but unless the ops
+ * say otherwise a directory with a failure somewhere below it is not
+ * finished.  Symlinks to directories are never followed.
+ */
+static int
+walkHierarchy(Walk *walk, const char *path)
+{
+    WalkNode *root = malloc(sizeof(*root));
+    if (root == NULL || (root->path = strdup(path)) == NULL) {
+        free(root);
+        errno = ENOMEM;
         return -1;
     }
+    root->parent = NULL;
+    root->pending = 1;
+    root->failed = 0;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    walk->workers = cpus < 2 ? 2 : cpus > WALK_MAX_THREADS ?
+            WALK_MAX_THREADS : cpus;
+    memset(walk->deques, 0, sizeof(walk->deques));
+    pthread_mutex_init(&walk->lock, NULL);
+    pthread_cond_init(&walk->cond, NULL);
+    walk->outstanding = 0;
+    walk->pushes = 0;
+    walk->error = 0;
+
+    int i;
+    for (i = 0; i < walk->workers; i++) {
+        pthread_mutex_init(&walk->deques[i].lock, NULL);
+    }
+
+    if (walkPush(walk, 0, root) < 0) {
+        free(root->path);
+        free(root);
+        walk->error = ENOMEM;
+    } else {
+        WalkWorker workers[WALK_MAX_THREADS];
+        pthread_t threads[WALK_MAX_THREADS];
+        int started = 1;
+        for (i = 0; i < walk->workers; i++) {
+            workers[i].walk = walk;
+            workers[i].self = i;
+        }
+        for (i = 1; i < walk->workers; i++) {
+            if (pthread_create(&threads[i], NULL, walkWorker, &workers[i])) {
+                break;
+            }
+            started++;
+        }
+        walkWorker(&workers[0]);
+        for (i = 1; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
 
-    /* close directory handle */
-    if (closedir(dir) < 0) {
+    for (i = 0; i < walk->workers; i++) {
+        pthread_mutex_destroy(&walk->deques[i].lock);
+        free(walk->deques[i].nodes);
+    }
+    pthread_cond_destroy(&walk->cond);
+    pthread_mutex_destroy(&walk->lock);
+
+    if (walk->error != 0) {
+        errno = walk->error;
         return -1;
     }
+    return 0;
+}
+
+static int
+unlinkFile(Walk *walk, int dfd, const char *name, unsigned char type)
+{
+    return unlinkat(dfd, name, 0);
+}
 
-    /* delete target directory */
+static int
+unlinkDir(Walk *walk, const char *path)
+{
     return rmdir(path);
 }
 
+/* A directory that still has something in it can't be removed. */
+static const WalkOps gUnlinkOps = { unlinkFile, unlinkDir, 0 };
+
 int
-dirSetHierarchyPermissions(const char *path,
-        int uid, int gid, int dirMode, int fileMode)
+dirUnlinkHierarchy(const char *path)
 {
     struct stat st;
-    if (lstat(path, &st)) {
+
+    /* is it a file or directory? */
+    if (lstat(path, &st) < 0) {
         return -1;
     }
 
+    /* a file, so unlink it */
+    if (!S_ISDIR(st.st_mode)) {
+        return unlink(path);
+    }
+
+    /* a directory; children go before their parents */
+    Walk walk;
+    walk.ops = &gUnlinkOps;
+    return walkHierarchy(&walk, path);
+}
+
+static int
+setFilePermissions(Walk *walk, int dfd, const char *name, unsigned char type)
+{
     /* ignore symlinks */
-    if (S_ISLNK(st.st_mode)) {
+    if (type == DT_LNK) {
         return 0;
     }
-
-    /* directories and files get different permissions */
-    if (chown(path, uid, gid) ||
-        chmod(path, S_ISDIR(st.st_mode) ? dirMode : fileMode)) {
+    if (fchownat(dfd, name, walk->uid, walk->gid, AT_SYMLINK_NOFOLLOW) ||
+        fchmodat(dfd, name, walk->fileMode, 0)) {
         return -1;
     }
+    return 0;
+}
 
-    /* recurse over directory components */
-    if (S_ISDIR(st.st_mode)) {
-        DIR *dir = opendir(path);
-        if (dir == NULL) {
-            return -1;
-        }
+static int
+setDirPermissions(Walk *walk, const char *path)
+{
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (fd < 0) {
+        return -1;
+    }
+    int ret = 0;
+    if (fchown(fd, walk->uid, walk->gid) || fchmod(fd, walk->dirMode)) {
+        ret = -1;
+    }
+    int err = errno;
+    close(fd);
+    errno = err;
+    return ret;
+}
 
-        errno = 0;
-        const struct dirent *de;
-        while (errno == 0 && (de = readdir(dir)) != NULL) {
-            if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
-                continue;
-            }
+/* Every directory gets its permissions, whatever happened below it. */
+static const WalkOps gPermissionOps =
+        { setFilePermissions, setDirPermissions, 1 };
 
-            char dn[PATH_MAX];
-            snprintf(dn, sizeof(dn), "%s/%s", path, de->d_name);
-            if (!dirSetHierarchyPermissions(dn, uid, gid, dirMode, fileMode)) {
-                errno = 0;
-            } else if (errno == 0) {
-                errno = -1;
-            }
-        }
+int
+dirSetHierarchyPermissions(const char *path,
+        int uid, int gid, int dirMode, int fileMode)
+{
+    struct stat st;
+    if (lstat(path, &st)) {
+        return -1;
+    }
 
-        if (errno != 0) {
-            int save = errno;
-            closedir(dir);
-            errno = save;
-            return -1;
-        }
+    /* ignore symlinks */
+    if (S_ISLNK(st.st_mode)) {
+        return 0;
+    }
 
-        if (closedir(dir)) {
+    /* directories and files get different permissions */
+    if (!S_ISDIR(st.st_mode)) {
+        if (chown(path, uid, gid) || chmod(path, fileMode)) {
             return -1;
         }
+        return 0;
     }
 
-    return 0;
+    /* A directory's own permissions are set after everything below it,
+     * so a restrictive dirMode can't get in the way of the walk.
+     */
+    Walk walk;
+    walk.ops = &gPermissionOps;
+    walk.uid = uid;
+    walk.gid = gid;
+    walk.dirMode = dirMode;
+    walk.fileMode = fileMode;
+    return walkHierarchy(&walk, path);
 }
@@ -16,9 +16,26 @@ include $(CLEAR_VARS)
 LOCAL_SRC_FILES := flash_image.c
 LOCAL_MODULE := flash_image
 LOCAL_MODULE_TAGS := eng
-LOCAL_STATIC_LIBRARIES := libmtdutils
+LOCAL_STATIC_LIBRARIES := libmtdutils libmincrypt
 LOCAL_SHARED_LIBRARIES := libcutils libc
 include $(BUILD_EXECUTABLE)
 
+# Host benchmark running mtdutils and flash_image against the flash
+# simulator, see the comments at the top of mtdsim.h and mtd_bench.c.
+ifeq ($(HOST_OS),linux)
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := \
+	mtd_bench.c \
+	mtdsim.c \
+	mtdutils.c \
+	mounts.c
+LOCAL_CFLAGS := -D_GNU_SOURCE
+LOCAL_MODULE := mtd_bench
+LOCAL_MODULE_TAGS := debug
+LOCAL_STATIC_LIBRARIES := libmincrypt libcutils liblog
+LOCAL_LDLIBS := -lpthread
+include $(BUILD_HOST_EXECUTABLE)
+endif
+
 endif	# TARGET_ARCH == arm
 endif	# !TARGET_SIMULATOR
@@ -16,6 +16,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -37,8 +38,8 @@ void die(const char *msg, ...) {
     va_end(args);
 
     if (err != 0) {
-        strlcat(buf, ": ", sizeof(buf));
-        strlcat(buf, strerror(err), sizeof(buf));
+        size_t len = strlen(buf);
+        snprintf(buf + len, sizeof(buf) - len, ": %s", strerror(err));
     }
 
     fprintf(stderr, "%s\n", buf);
@@ -94,6 +95,7 @@ int main(int argc, char **argv) {
 
     MtdWriteContext *out = mtd_write_partition(partition);
     if (out == NULL) die("error writing %s", argv[1]);
+    mtd_write_skip_unchanged(out, NULL, 0);
 
     char buf[HEADER_SIZE];
     memset(buf, 0, headerlen);
@@ -19,6 +19,8 @@
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <unistd.h>
+#include <poll.h>
 #include <sys/mount.h>
 
 #include "mounts.h"
@@ -30,16 +32,36 @@ struct MountedVolume {
     const char *flags;
 };
 
+/* The table is only re-read when it may have changed: after recovery's
+ * own mounts and unmounts (see invalidate_mounted_volumes()), or when
+ * the kernel flags /proc/self/mounts, which it does for any change to
+ * the mount namespace.
+ */
 typedef struct {
     MountedVolume *volumes;
     int volumes_allocd;
     int volume_count;
+
+    /* Open-addressed hash tables holding 1 + an index into volumes,
+     * or 0 for an empty slot.
+     */
+    int *by_device;
+    int *by_mount_point;
+    int buckets;        // a power of two, at least twice volume_count
+
+    int fd;             // PROC_MOUNTS_FILENAME, kept open to poll it
+    int valid;
 } MountsState;
 
 static MountsState g_mounts_state = {
     NULL,   // volumes
     0,      // volumes_allocd
-    0       // volume_count
+    0,      // volume_count
+    NULL,   // by_device
+    NULL,   // by_mount_point
+    0,      // buckets
+    -1,     // fd
+    0       // valid
 };
 
 static inline void
@@ -54,16 +76,180 @@ free_volume_internals(const MountedVolume *volume, int zero)
     }
 }
 
-#define PROC_MOUNTS_FILENAME   "/proc/mounts"
+#define PROC_MOUNTS_FILENAME   "/proc/self/mounts"
+
+static unsigned int
+hash_string(const char *s)
+{
+    unsigned int h = 5381;
+    while (*s != '\0') {
+        h = h * 33 + (unsigned char)*s++;
+    }
+    return h;
+}
+
+static inline const char *
+volume_key(const MountedVolume *volume, int by_mount_point)
+{
+    return by_mount_point ? volume->mount_point : volume->device;
+}
+
+/* Like the linear search this replaces, the first volume listed for a
+ * key wins.
+ */
+static void
+hash_volume(int *table, int index, int by_mount_point)
+{
+    const char *key = volume_key(&g_mounts_state.volumes[index],
+            by_mount_point);
+    unsigned int mask = g_mounts_state.buckets - 1;
+    unsigned int slot = hash_string(key) & mask;
+    while (table[slot] != 0) {
+        const MountedVolume *v = &g_mounts_state.volumes[table[slot] - 1];
+        if (strcmp(volume_key(v, by_mount_point), key) == 0) {
+            return;
+        }
+        slot = (slot + 1) & mask;
+    }
+    table[slot] = index + 1;
+}
+
+static const MountedVolume *
+find_hashed_volume(const int *table, const char *key, int by_mount_point)
+{
+    if (table == NULL) {
+        return NULL;
+    }
+    unsigned int mask = g_mounts_state.buckets - 1;
+    unsigned int slot = hash_string(key) & mask;
+    while (table[slot] != 0) {
+        const MountedVolume *v = &g_mounts_state.volumes[table[slot] - 1];
+        const char *k = volume_key(v, by_mount_point);
+        /* May be null if it was unmounted and we haven't rescanned.
+         */
+        if (k != NULL && strcmp(k, key) == 0) {
+            return v;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return NULL;
+}
+
+static int
+build_volume_hashes()
+{
+    int buckets = 16;
+    while (buckets < g_mounts_state.volume_count * 2) {
+        buckets *= 2;
+    }
+    if (buckets != g_mounts_state.buckets) {
+        free(g_mounts_state.by_device);
+        free(g_mounts_state.by_mount_point);
+        g_mounts_state.by_device = malloc(buckets * sizeof(int));
+        g_mounts_state.by_mount_point = malloc(buckets * sizeof(int));
+        g_mounts_state.buckets = buckets;
+        if (g_mounts_state.by_device == NULL ||
+                g_mounts_state.by_mount_point == NULL) {
+            free(g_mounts_state.by_device);
+            free(g_mounts_state.by_mount_point);
+            g_mounts_state.by_device = NULL;
+            g_mounts_state.by_mount_point = NULL;
+            g_mounts_state.buckets = 0;
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    memset(g_mounts_state.by_device, 0, buckets * sizeof(int));
+    memset(g_mounts_state.by_mount_point, 0, buckets * sizeof(int));
+
+    int i;
+    for (i = 0; i < g_mounts_state.volume_count; i++) {
+        hash_volume(g_mounts_state.by_device, i, 0);
+        hash_volume(g_mounts_state.by_mount_point, i, 1);
+    }
+    return 0;
+}
+
+/* Reads all of PROC_MOUNTS_FILENAME into a malloc()ed, nul-terminated
+ * buffer.  The file is kept open afterwards so it can be polled.
+ */
+static char *
+read_proc_mounts(ssize_t *p_nbytes)
+{
+    if (g_mounts_state.fd < 0) {
+        g_mounts_state.fd = open(PROC_MOUNTS_FILENAME, O_RDONLY);
+        if (g_mounts_state.fd < 0) {
+            return NULL;
+        }
+    } else if (lseek(g_mounts_state.fd, 0, SEEK_SET) != 0) {
+        return NULL;
+    }
+
+    size_t size = 4096;
+    ssize_t nbytes = 0;
+    char *buf = malloc(size);
+    while (buf != NULL) {
+        ssize_t r = read(g_mounts_state.fd, buf + nbytes, size - nbytes - 1);
+        if (r < 0) {
+            free(buf);
+            return NULL;
+        }
+        if (r == 0) {
+            break;
+        }
+        nbytes += r;
+        if (nbytes == (ssize_t)size - 1) {
+            char *bigger = realloc(buf, size * 2);
+            if (bigger == NULL) {
+                free(buf);
+            }
+            buf = bigger;
+            size *= 2;
+        }
+    }
+    if (buf == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    buf[nbytes] = '\0';
+    *p_nbytes = nbytes;
+    return buf;
+}
+
+static int
+mounts_changed()
+{
+    if (!g_mounts_state.valid || g_mounts_state.fd < 0) {
+        return 1;
+    }
+    struct pollfd pfd;
+    pfd.fd = g_mounts_state.fd;
+    pfd.events = POLLPRI;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) < 0) {
+        return 1;
+    }
+    return (pfd.revents & (POLLERR | POLLPRI)) != 0;
+}
+
+void
+invalidate_mounted_volumes()
+{
+    g_mounts_state.valid = 0;
+}
 
 int
 scan_mounted_volumes()
 {
-    char buf[2048];
+    char *buf;
     const char *bufp;
-    int fd;
     ssize_t nbytes;
 
+    if (!mounts_changed()) {
+        return 0;
+    }
+    g_mounts_state.valid = 0;
+
     if (g_mounts_state.volumes == NULL) {
         const int numv = 32;
         MountedVolume *volumes = malloc(numv * sizeof(*volumes));
@@ -84,18 +270,12 @@ scan_mounted_volumes()
     }
     g_mounts_state.volume_count = 0;
 
-    /* Open and read the file contents.
+    /* Read the file contents.
      */
-    fd = open(PROC_MOUNTS_FILENAME, O_RDONLY);
-    if (fd < 0) {
+    buf = read_proc_mounts(&nbytes);
+    if (buf == NULL) {
         goto bail;
     }
-    nbytes = read(fd, buf, sizeof(buf) - 1);
-    close(fd);
-    if (nbytes < 0) {
-        goto bail;
-    }
-    buf[nbytes] = '\0';
 
     /* Parse the contents of the file, which looks like:
      *
@@ -124,6 +304,22 @@ scan_mounted_volumes()
         matches = sscanf(bufp, "%63s %63s %63s %127s",
                 device, mount_point, filesystem, flags);
 
+        if (matches == 4 &&
+                g_mounts_state.volume_count == g_mounts_state.volumes_allocd) {
+            int numv = g_mounts_state.volumes_allocd * 2;
+            MountedVolume *volumes = realloc(g_mounts_state.volumes,
+                    numv * sizeof(*volumes));
+            if (volumes == NULL) {
+                free(buf);
+                errno = ENOMEM;
+                goto bail;
+            }
+            memset(volumes + g_mounts_state.volumes_allocd, 0,
+                    (numv - g_mounts_state.volumes_allocd) * sizeof(*volumes));
+            g_mounts_state.volumes = volumes;
+            g_mounts_state.volumes_allocd = numv;
+        }
+
         if (matches == 4) {
             device[sizeof(device)-1] = '\0';
             mount_point[sizeof(mount_point)-1] = '\0';
@@ -152,6 +348,12 @@ printf("matches was %d on <<%.40s>>\n", matches, bufp);
         }
     }
 
+    free(buf);
+
+    if (build_volume_hashes() < 0) {
+        goto bail;
+    }
+    g_mounts_state.valid = 1;
     return 0;
 
 bail:
@@ -163,39 +365,13 @@ bail:
 const MountedVolume *
 find_mounted_volume_by_device(const char *device)
 {
-    if (g_mounts_state.volumes != NULL) {
-        int i;
-        for (i = 0; i < g_mounts_state.volume_count; i++) {
-            MountedVolume *v = &g_mounts_state.volumes[i];
-            /* May be null if it was unmounted and we haven't rescanned.
-             */
-            if (v->device != NULL) {
-                if (strcmp(v->device, device) == 0) {
-                    return v;
-                }
-            }
-        }
-    }
-    return NULL;
+    return find_hashed_volume(g_mounts_state.by_device, device, 0);
 }
 
 const MountedVolume *
 find_mounted_volume_by_mount_point(const char *mount_point)
 {
-    if (g_mounts_state.volumes != NULL) {
-        int i;
-        for (i = 0; i < g_mounts_state.volume_count; i++) {
-            MountedVolume *v = &g_mounts_state.volumes[i];
-            /* May be null if it was unmounted and we haven't rescanned.
-             */
-            if (v->mount_point != NULL) {
-                if (strcmp(v->mount_point, mount_point) == 0) {
-                    return v;
-                }
-            }
-        }
-    }
-    return NULL;
+    return find_hashed_volume(g_mounts_state.by_mount_point, mount_point, 1);
 }
 
 int
@@ -208,6 +384,7 @@ unmount_mounted_volume(const MountedVolume *volume)
     int ret = umount(volume->mount_point);
     if (ret == 0) {
         free_volume_internals(volume, 1);
+        invalidate_mounted_volumes();
         return 0;
     }
     return ret;
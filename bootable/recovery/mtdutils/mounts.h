@@ -19,8 +19,15 @@
 
 typedef struct MountedVolume MountedVolume;
 
+/* Cheap when nothing has been mounted or unmounted since the last scan.
+ */
 int scan_mounted_volumes(void);
 
+/* Makes the next scan re-read the table; call after mounting something.
+ * unmount_mounted_volume() does this itself.
+ */
+void invalidate_mounted_volumes(void);
+
 const MountedVolume *find_mounted_volume_by_device(const char *device);
 
 const MountedVolume *
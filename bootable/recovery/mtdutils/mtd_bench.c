@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * mtd_bench: runs mtdutils against the flash simulator on the host and
+ * reports throughput for writing an image with mtd_write_data, reading
+ * it back with mtd_read_data, rewriting it unchanged, erasing the
+ * partition, and flashing it with flash_image.
+ *
+ *   mtd_bench -s 32 -e 128 -b 3 -E 4 -F 1 -l 25,200,2000
+ *
+ * writes a 32M partition with 128k erase blocks, 3 factory-bad blocks,
+ * 4 blocks that need ECC correction and 1 that cannot be read back,
+ * with NAND-like page read, page program and block erase times.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "mtdutils.h"
+#include "mtdsim.h"
+
+/* flash_image is a program of its own; run its main() in-process so it
+ * talks to the simulator too.
+ */
+#define main flash_image_main
+#include "flash_image.c"
+#undef main
+
+#define BENCH_PARTITION "bench"
+
+static const MtdPartition *s_partition;
+static char *s_image;
+static size_t s_image_size;
+static size_t s_chunk = 64 * 1024;
+
+static long long now_usec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void report(const char *name, long long usec, const MtdSimStats *before)
+{
+    MtdSimStats after;
+    mtdsim_get_stats(&after);
+    printf("%-12s %8.2f MB/s %9.1f ms   %6ld pages read %6ld programmed "
+           "%5ld blocks erased\n",
+           name, s_image_size / (usec / 1e6) / (1024 * 1024), usec / 1e3,
+           after.pages_read - before->pages_read,
+           after.pages_programmed - before->pages_programmed,
+           after.blocks_erased - before->blocks_erased);
+}
+
+static int write_image(int skip_unchanged)
+{
+    MtdWriteContext *ctx = mtd_write_partition(s_partition);
+    if (ctx == NULL) return -1;
+    if (skip_unchanged) mtd_write_skip_unchanged(ctx, NULL, 0);
+
+    size_t done = 0;
+    while (done < s_image_size) {
+        size_t len = s_image_size - done < s_chunk ? s_image_size - done : s_chunk;
+        if (mtd_write_data(ctx, s_image + done, len) != (ssize_t) len) break;
+        done += len;
+    }
+    int ok = done == s_image_size;
+    if (mtd_erase_blocks(ctx, -1) == (off_t) -1) ok = 0;
+    if (mtd_write_close(ctx)) ok = 0;
+    return ok ? 0 : -1;
+}
+
+static int read_image()
+{
+    MtdReadContext *ctx = mtd_read_partition(s_partition);
+    if (ctx == NULL) return -1;
+
+    char *data = malloc(s_chunk);
+    size_t done = 0;
+    int ok = data != NULL;
+    while (ok && done < s_image_size) {
+        size_t len = s_image_size - done < s_chunk ? s_image_size - done : s_chunk;
+        if (mtd_read_data(ctx, data, len) != (ssize_t) len ||
+            memcmp(data, s_image + done, len) != 0) {
+            fprintf(stderr, "read back wrong data at %zu\n", done);
+            ok = 0;
+        }
+        done += len;
+    }
+    free(data);
+    mtd_read_close(ctx);
+    return ok ? 0 : -1;
+}
+
+static int erase_partition()
+{
+    return mtd_erase_partitions(&s_partition, 1, NULL);
+}
+
+static void usage(const char *s)
+{
+    fprintf(stderr, "usage: %s [-d <dir>] [-s <partition MB>] "
+            "[-e <erase block KB>] [-c <chunk KB>] [-b <bad blocks>] "
+            "[-E <corrected ECC blocks>] [-F <failed ECC blocks>] "
+            "[-l <read us>,<program us>,<erase us>]\n", s);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = "/tmp";
+    unsigned int size = 16 * 1024 * 1024;
+    unsigned int erase_size = 128 * 1024;
+    int bad = 0, corrected = 0, failed = 0;
+    int read_us = 0, program_us = 0, erase_us = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:s:e:c:b:E:F:l:")) != -1) {
+        switch (opt) {
+            case 'd': dir = optarg; break;
+            case 's': size = atoi(optarg) * 1024 * 1024; break;
+            case 'e': erase_size = atoi(optarg) * 1024; break;
+            case 'c': s_chunk = atoi(optarg) * 1024; break;
+            case 'b': bad = atoi(optarg); break;
+            case 'E': corrected = atoi(optarg); break;
+            case 'F': failed = atoi(optarg); break;
+            case 'l':
+                if (sscanf(optarg, "%d,%d,%d",
+                           &read_us, &program_us, &erase_us) != 3) {
+                    usage(argv[0]);
+                }
+                break;
+            default: usage(argv[0]);
+        }
+    }
+    if (erase_size == 0 || size < erase_size || s_chunk == 0) usage(argv[0]);
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s/mtd_bench.%d.img", dir, getpid());
+    char image_path[256];
+    snprintf(image_path, sizeof(image_path), "%s/mtd_bench.%d.src", dir, getpid());
+
+    int index = mtdsim_add_partition(BENCH_PARTITION, path, size, erase_size);
+    if (index < 0) {
+        fprintf(stderr, "can't create %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    // Spread the bad and ECC blocks over the partition
+    int blocks = size / erase_size;
+    int spare = bad + failed + 1;
+    if (spare >= blocks) usage(argv[0]);
+    int i;
+    for (i = 0; i < bad; ++i) {
+        mtdsim_mark_bad(index, (i * 2 + 1) * blocks / (bad * 2));
+    }
+    for (i = 0; i < corrected; ++i) {
+        mtdsim_inject_ecc(index, (i * 3 + 1) * blocks / (corrected * 3), 1, 0);
+    }
+    for (i = 0; i < failed; ++i) {
+        mtdsim_inject_ecc(index, (i * 5 + 2) * blocks / (failed * 5), 0, 1);
+    }
+    mtdsim_set_latency(read_us, program_us, erase_us);
+
+    mtd_set_backend(mtdsim_backend());
+    if (mtd_scan_partitions() <= 0 ||
+        (s_partition = mtd_find_partition_by_name(BENCH_PARTITION)) == NULL) {
+        fprintf(stderr, "simulated partition not found\n");
+        return 1;
+    }
+
+    // Leave room for blocks that go bad, and end on a partial block
+    s_image_size = (size_t) (blocks - spare) * erase_size - erase_size / 2;
+    s_image = malloc(s_image_size);
+    if (s_image == NULL) return 1;
+    srand(1);
+    size_t j;
+    for (j = 0; j < s_image_size; ++j) s_image[j] = rand();
+
+    FILE *f = fopen(image_path, "wb");
+    if (f == NULL || fwrite(s_image, 1, s_image_size, f) != s_image_size ||
+        fclose(f) != 0) {
+        fprintf(stderr, "can't write %s: %s\n", image_path, strerror(errno));
+        return 1;
+    }
+
+    printf("partition %u KB, erase block %u KB, image %zu KB, chunk %zu KB\n",
+           size / 1024, erase_size / 1024, s_image_size / 1024, s_chunk / 1024);
+
+    MtdSimStats stats;
+    long long start;
+    int r = 0;
+
+    mtdsim_get_stats(&stats);
+    start = now_usec();
+    if (write_image(0)) r = -1;
+    report("write", now_usec() - start, &stats);
+
+    mtdsim_get_stats(&stats);
+    start = now_usec();
+    if (read_image()) r = -1;
+    report("read", now_usec() - start, &stats);
+
+    mtdsim_get_stats(&stats);
+    start = now_usec();
+    if (write_image(1)) r = -1;
+    report("rewrite", now_usec() - start, &stats);
+
+    mtdsim_get_stats(&stats);
+    start = now_usec();
+    if (erase_partition()) r = -1;
+    report("erase", now_usec() - start, &stats);
+
+    mtdsim_get_stats(&stats);
+    start = now_usec();
+    char *flash_argv[] = { "flash_image", BENCH_PARTITION, image_path, NULL };
+    if (flash_image_main(3, flash_argv)) r = -1;
+    report("flash_image", now_usec() - start, &stats);
+    if (read_image()) r = -1;
+
+    unlink(path);
+    unlink(image_path);
+    if (r) fprintf(stderr, "mtd_bench: errors, see above\n");
+    return r ? 1 : 0;
+}
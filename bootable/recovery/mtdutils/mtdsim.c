@@ -0,0 +1,383 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <mtd/mtd-user.h>
+
+#include "mtdsim.h"
+
+#define MTDSIM_MAX_PARTITIONS 16
+#define MTDSIM_MAX_FDS 1024
+#define MTDSIM_PAGE_SIZE 2048
+
+typedef struct {
+    char *name;
+    char *path;
+    unsigned int size;
+    unsigned int erase_size;
+    unsigned char *bad;         // per block
+    int *ecc_corrected;         // per block, added on each read
+    int *ecc_failed;
+    struct mtd_ecc_stats ecc_stats;
+} SimPartition;
+
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static SimPartition s_partitions[MTDSIM_MAX_PARTITIONS];
+static int s_partition_count = 0;
+static int s_fd_partition[MTDSIM_MAX_FDS];  // device index + 1, 0 if none
+
+static int s_read_us = 0;
+static int s_program_us = 0;
+static int s_erase_us = 0;
+static MtdSimStats s_stats;
+
+int mtdsim_add_partition(const char *name, const char *path,
+        unsigned int size, unsigned int erase_size)
+{
+    if (s_partition_count == MTDSIM_MAX_PARTITIONS || erase_size == 0 ||
+        size % erase_size != 0 || erase_size % MTDSIM_PAGE_SIZE != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+
+    char *erased = malloc(erase_size);
+    if (erased == NULL) {
+        close(fd);
+        return -1;
+    }
+    memset(erased, 0xff, erase_size);
+    unsigned int pos;
+    for (pos = 0; pos < size; pos += erase_size) {
+        if (write(fd, erased, erase_size) != (ssize_t) erase_size) {
+            free(erased);
+            close(fd);
+            return -1;
+        }
+    }
+    free(erased);
+    close(fd);
+
+    int blocks = size / erase_size;
+    SimPartition *p = &s_partitions[s_partition_count];
+    p->name = strdup(name);
+    p->path = strdup(path);
+    p->size = size;
+    p->erase_size = erase_size;
+    p->bad = calloc(blocks, 1);
+    p->ecc_corrected = calloc(blocks, sizeof(int));
+    p->ecc_failed = calloc(blocks, sizeof(int));
+    memset(&p->ecc_stats, 0, sizeof(p->ecc_stats));
+    if (p->name == NULL || p->path == NULL || p->bad == NULL ||
+        p->ecc_corrected == NULL || p->ecc_failed == NULL) {
+        free(p->name);
+        free(p->path);
+        free(p->bad);
+        free(p->ecc_corrected);
+        free(p->ecc_failed);
+        errno = ENOMEM;
+        return -1;
+    }
+    return s_partition_count++;
+}
+
+static SimPartition *find_partition(int device_index, int block)
+{
+    if (device_index < 0 || device_index >= s_partition_count) return NULL;
+    SimPartition *p = &s_partitions[device_index];
+    if (block < 0 || block >= (int) (p->size / p->erase_size)) return NULL;
+    return p;
+}
+
+int mtdsim_mark_bad(int device_index, int block)
+{
+    SimPartition *p = find_partition(device_index, block);
+    if (p == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&s_lock);
+    p->bad[block] = 1;
+    pthread_mutex_unlock(&s_lock);
+    return 0;
+}
+
+int mtdsim_inject_ecc(int device_index, int block, int corrected, int failed)
+{
+    SimPartition *p = find_partition(device_index, block);
+    if (p == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&s_lock);
+    p->ecc_corrected[block] = corrected;
+    p->ecc_failed[block] = failed;
+    pthread_mutex_unlock(&s_lock);
+    return 0;
+}
+
+void mtdsim_set_latency(int read_us, int program_us, int erase_us)
+{
+    pthread_mutex_lock(&s_lock);
+    s_read_us = read_us;
+    s_program_us = program_us;
+    s_erase_us = erase_us;
+    pthread_mutex_unlock(&s_lock);
+}
+
+void mtdsim_get_stats(MtdSimStats *stats)
+{
+    pthread_mutex_lock(&s_lock);
+    *stats = s_stats;
+    pthread_mutex_unlock(&s_lock);
+}
+
+static SimPartition *fd_partition(int fd)
+{
+    SimPartition *p = NULL;
+    pthread_mutex_lock(&s_lock);
+    if (fd >= 0 && fd < MTDSIM_MAX_FDS && s_fd_partition[fd] != 0) {
+        p = &s_partitions[s_fd_partition[fd] - 1];
+    }
+    pthread_mutex_unlock(&s_lock);
+    return p;
+}
+
+static void sleep_us(long us)
+{
+    if (us > 0) usleep(us);
+}
+
+static ssize_t sim_read_partitions(char *buf, size_t len)
+{
+    size_t used = snprintf(buf, len, "dev:    size   erasesize  name\n");
+    int i;
+    for (i = 0; i < s_partition_count && used < len; ++i) {
+        const SimPartition *p = &s_partitions[i];
+        used += snprintf(buf + used, len - used, "mtd%d: %08x %08x \"%s\"\n",
+                i, p->size, p->erase_size, p->name);
+    }
+    return used < len ? used : len;
+}
+
+static int sim_open(int device_index, int flags)
+{
+    if (device_index < 0 || device_index >= s_partition_count) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    int fd = open(s_partitions[device_index].path, flags & O_ACCMODE);
+    if (fd < 0) return -1;
+    if (fd >= MTDSIM_MAX_FDS) {
+        close(fd);
+        errno = EMFILE;
+        return -1;
+    }
+    pthread_mutex_lock(&s_lock);
+    s_fd_partition[fd] = device_index + 1;
+    pthread_mutex_unlock(&s_lock);
+    return fd;
+}
+
+static ssize_t sim_read(int fd, void *buf, size_t len)
+{
+    SimPartition *p = fd_partition(fd);
+    if (p == NULL) return read(fd, buf, len);
+
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    ssize_t n = read(fd, buf, len);
+    if (n <= 0) return n;
+
+    // As with the kernel driver the read succeeds regardless; ECC trouble
+    // shows in the counters (and, if uncorrectable, in the data)
+    pthread_mutex_lock(&s_lock);
+    off_t block_pos = pos - pos % p->erase_size;
+    for (; block_pos < pos + n; block_pos += p->erase_size) {
+        int block = block_pos / p->erase_size;
+        p->ecc_stats.corrected += p->ecc_corrected[block];
+        if (p->ecc_failed[block]) {
+            p->ecc_stats.failed += p->ecc_failed[block];
+            off_t flip = block_pos > pos ? block_pos : pos;
+            ((char *) buf)[flip - pos] ^= 1;
+        }
+    }
+    long pages = (n + MTDSIM_PAGE_SIZE - 1) / MTDSIM_PAGE_SIZE;
+    s_stats.pages_read += pages;
+    long us = pages * s_read_us;
+    pthread_mutex_unlock(&s_lock);
+
+    sleep_us(us);
+    return n;
+}
+
+static ssize_t sim_write(int fd, const void *buf, size_t len)
+{
+    SimPartition *p = fd_partition(fd);
+    if (p == NULL) return write(fd, buf, len);
+
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (pos < 0) return -1;
+    if (pos + len > p->size) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    pthread_mutex_lock(&s_lock);
+    off_t block_pos = pos - pos % p->erase_size;
+    for (; block_pos < (off_t) (pos + len); block_pos += p->erase_size) {
+        if (p->bad[block_pos / p->erase_size]) {
+            pthread_mutex_unlock(&s_lock);
+            errno = EIO;
+            return -1;
+        }
+    }
+    long pages = (len + MTDSIM_PAGE_SIZE - 1) / MTDSIM_PAGE_SIZE;
+    s_stats.pages_programmed += pages;
+    long us = pages * s_program_us;
+    pthread_mutex_unlock(&s_lock);
+
+    // Programming can only clear bits
+    unsigned char *cells = malloc(len);
+    if (cells == NULL) return -1;
+    if (pread(fd, cells, len, pos) != (ssize_t) len) {
+        free(cells);
+        errno = EIO;
+        return -1;
+    }
+    size_t i;
+    for (i = 0; i < len; ++i) cells[i] &= ((const unsigned char *) buf)[i];
+    ssize_t n = pwrite(fd, cells, len, pos);
+    free(cells);
+    if (n != (ssize_t) len) {
+        errno = EIO;
+        return -1;
+    }
+    lseek(fd, pos + len, SEEK_SET);
+
+    sleep_us(us);
+    return len;
+}
+
+static int sim_erase(SimPartition *p, int fd, const struct erase_info_user *ei)
+{
+    if (ei->start % p->erase_size != 0 || ei->length % p->erase_size != 0 ||
+        ei->start + ei->length > p->size) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&s_lock);
+    unsigned int pos;
+    for (pos = ei->start; pos < ei->start + ei->length; pos += p->erase_size) {
+        if (p->bad[pos / p->erase_size]) {
+            pthread_mutex_unlock(&s_lock);
+            errno = EIO;
+            return -1;
+        }
+    }
+    long blocks = ei->length / p->erase_size;
+    s_stats.blocks_erased += blocks;
+    long us = blocks * s_erase_us;
+    pthread_mutex_unlock(&s_lock);
+
+    char *erased = malloc(p->erase_size);
+    if (erased == NULL) return -1;
+    memset(erased, 0xff, p->erase_size);
+    for (pos = ei->start; pos < ei->start + ei->length; pos += p->erase_size) {
+        if (pwrite(fd, erased, p->erase_size, pos) != (ssize_t) p->erase_size) {
+            free(erased);
+            errno = EIO;
+            return -1;
+        }
+    }
+    free(erased);
+
+    sleep_us(us);
+    return 0;
+}
+
+static int sim_ioctl(int fd, unsigned long request, void *arg)
+{
+    SimPartition *p = fd_partition(fd);
+    if (p == NULL) {
+        errno = ENOTTY;
+        return -1;
+    }
+
+    if (request == MEMGETINFO) {
+        struct mtd_info_user *info = (struct mtd_info_user *) arg;
+        memset(info, 0, sizeof(*info));
+        info->type = MTD_NANDFLASH;
+        info->flags = MTD_CAP_NANDFLASH;
+        info->size = p->size;
+        info->erasesize = p->erase_size;
+        info->writesize = MTDSIM_PAGE_SIZE;
+        info->oobsize = MTDSIM_PAGE_SIZE / 32;
+        return 0;
+    } else if (request == MEMERASE) {
+        return sim_erase(p, fd, (const struct erase_info_user *) arg);
+    } else if (request == MEMGETBADBLOCK) {
+        loff_t pos = *(const loff_t *) arg;
+        if (pos < 0 || pos >= p->size) {
+            errno = EINVAL;
+            return -1;
+        }
+        pthread_mutex_lock(&s_lock);
+        int bad = p->bad[pos / p->erase_size];
+        pthread_mutex_unlock(&s_lock);
+        return bad;
+    } else if (request == ECCGETSTATS) {
+        pthread_mutex_lock(&s_lock);
+        *(struct mtd_ecc_stats *) arg = p->ecc_stats;
+        pthread_mutex_unlock(&s_lock);
+        return 0;
+    }
+
+    errno = ENOTTY;
+    return -1;
+}
+
+static int sim_close(int fd)
+{
+    pthread_mutex_lock(&s_lock);
+    if (fd >= 0 && fd < MTDSIM_MAX_FDS) s_fd_partition[fd] = 0;
+    pthread_mutex_unlock(&s_lock);
+    return close(fd);
+}
+
+static const MtdBackend s_sim_backend = {
+    sim_read_partitions,
+    sim_open,
+    sim_read,
+    sim_write,
+    sim_ioctl,
+    sim_close,
+};
+
+const MtdBackend *mtdsim_backend(void)
+{
+    return &s_sim_backend;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MTDSIM_H_
+#define MTDSIM_H_
+
+#include "mtdutils.h"
+
+/* A NAND flash simulator for running mtdutils on a host.  Each partition
+ * is backed by a regular file.  Programming can only clear bits, as on
+ * real NAND, so writing a block without erasing it first shows up as a
+ * verification error.  Install it with mtd_set_backend(mtdsim_backend()).
+ */
+
+/* Creates (or truncates) path as an erased partition and returns its
+ * device index, or -1.  size must be a multiple of erase_size, and
+ * erase_size a multiple of the 2k page size.
+ */
+int mtdsim_add_partition(const char *name, const char *path,
+        unsigned int size, unsigned int erase_size);
+
+/* Erasing or programming a bad block fails with EIO, and
+ * MEMGETBADBLOCK reports it.
+ */
+int mtdsim_mark_bad(int device_index, int block);
+
+/* Every read touching the block adds these to the ECC counters.  If
+ * failed is nonzero the data read back has a flipped bit.
+ */
+int mtdsim_inject_ecc(int device_index, int block, int corrected, int failed);
+
+/* Microseconds per page read, per page programmed, per block erased */
+void mtdsim_set_latency(int read_us, int program_us, int erase_us);
+
+typedef struct {
+    long pages_read;
+    long pages_programmed;
+    long blocks_erased;
+} MtdSimStats;
+
+void mtdsim_get_stats(MtdSimStats *stats);
+
+const MtdBackend *mtdsim_backend(void);
+
+#endif  // MTDSIM_H_
@@ -15,18 +15,23 @@
  */
 
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/mount.h>  // for _IOW, _IOR, mount()
 #include <sys/stat.h>
 #include <mtd/mtd-user.h>
 #undef NDEBUG
 #include <assert.h>
 
+#include "mincrypt/sha.h"
 #include "mtdutils.h"
+#include "mounts.h"
 
 struct MtdPartition {
     int device_index;
@@ -40,17 +45,44 @@ struct MtdReadContext {
     char *buffer;
     size_t consumed;
     int fd;
+
+    unsigned char *bad_blocks;  // bitmap, one bit per erase block
+    struct mtd_ecc_stats ecc_stats;  // counters as of the last check
 };
 
+/* Blocks handed to the writer thread but not yet on flash.  The caller
+ * keeps filling the next slot while the thread erases, writes and
+ * verifies the oldest one, so producing the image (reading a file,
+ * applying a patch) overlaps with the flash I/O instead of waiting on it.
+ */
+#define MTD_WRITE_QUEUE_DEPTH 4
+
 struct MtdWriteContext {
     const MtdPartition *partition;
-    char *buffer;
-    size_t stored;
+    char *buffer;       // MTD_WRITE_QUEUE_DEPTH erase blocks, used as a ring
+    size_t stored;      // bytes in the block being filled
     int fd;
 
     off_t* bad_block_offsets;
     int bad_block_alloc;
     int bad_block_count;
+
+    // Shared with the writer thread, protected by lock
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int head;           // oldest queued block
+    int queued;         // complete blocks queued or being written
+    int error;          // errno of the first failed block, 0 if none
+    int stopping;
+
+    char *verify;       // read-back buffer, only used by the writer thread
+
+    // Set by mtd_write_skip_unchanged() before any data is written
+    int skip_unchanged;
+    unsigned char *digests;  // SHA-1 per erase block as on flash, or NULL
+    int digest_count;
+    int unchanged;      // blocks left alone, counted by the writer thread
 };
 
 typedef struct {
@@ -67,12 +99,51 @@ static MtdState g_mtd_state = {
 
 #define MTD_PROC_FILENAME   "/proc/mtd"
 
+/* The kernel MTD driver, which is what everything but the host tools
+ * uses.
+ */
+static ssize_t kernel_read_partitions(char *buf, size_t len)
+{
+    int fd = open(MTD_PROC_FILENAME, O_RDONLY);
+    if (fd < 0) return -1;
+    ssize_t nbytes = read(fd, buf, len);
+    close(fd);
+    return nbytes;
+}
+
+static int kernel_open(int device_index, int flags)
+{
+    char mtddevname[32];
+    sprintf(mtddevname, "/dev/mtd/mtd%d", device_index);
+    return open(mtddevname, flags);
+}
+
+static int kernel_ioctl(int fd, unsigned long request, void *arg)
+{
+    return ioctl(fd, request, arg);
+}
+
+static const MtdBackend g_kernel_backend = {
+    kernel_read_partitions,
+    kernel_open,
+    read,
+    write,
+    kernel_ioctl,
+    close,
+};
+
+static const MtdBackend *g_backend = &g_kernel_backend;
+
+void mtd_set_backend(const MtdBackend *backend)
+{
+    g_backend = backend != NULL ? backend : &g_kernel_backend;
+}
+
 int
 mtd_scan_partitions()
 {
     char buf[2048];
     const char *bufp;
-    int fd;
     int i;
     ssize_t nbytes;
 
@@ -102,14 +173,9 @@ mtd_scan_partitions()
         p->device_index = -1;
     }
 
-    /* Open and read the file contents.
+    /* Read the file contents.
      */
-    fd = open(MTD_PROC_FILENAME, O_RDONLY);
-    if (fd < 0) {
-        goto bail;
-    }
-    nbytes = read(fd, buf, sizeof(buf) - 1);
-    close(fd);
+    nbytes = g_backend->read_partitions(buf, sizeof(buf) - 1);
     if (nbytes < 0) {
         goto bail;
     }
@@ -210,6 +276,9 @@ mtd_mount_partition(const MtdPartition *partition, const char *mount_point,
             printf("Mount %s on %s read-only\n", devname, mount_point);
         }
     }
+    if (rv >= 0) {
+        invalidate_mounted_volumes();
+    }
 #if 1   //TODO: figure out why this is happening; remove include of stat.h
     if (rv >= 0) {
         /* For some reason, the x bits sometimes aren't set on the root
@@ -238,14 +307,12 @@ int
 mtd_partition_info(const MtdPartition *partition,
         size_t *total_size, size_t *erase_size, size_t *write_size)
 {
-    char mtddevname[32];
-    sprintf(mtddevname, "/dev/mtd/mtd%d", partition->device_index);
-    int fd = open(mtddevname, O_RDONLY);
+    int fd = g_backend->open(partition->device_index, O_RDONLY);
     if (fd < 0) return -1;
 
     struct mtd_info_user mtd_info;
-    int ret = ioctl(fd, MEMGETINFO, &mtd_info);
-    close(fd);
+    int ret = g_backend->ioctl(fd, MEMGETINFO, &mtd_info);
+    g_backend->close(fd);
     if (ret < 0) return -1;
 
     if (total_size != NULL) *total_size = mtd_info.size;
@@ -265,12 +332,41 @@ MtdReadContext *mtd_read_partition(const MtdPartition *partition)
         return NULL;
     }
 
-    char mtddevname[32];
-    sprintf(mtddevname, "/dev/mtd/mtd%d", partition->device_index);
-    ctx->fd = open(mtddevname, O_RDONLY);
+    int blocks = partition->size / partition->erase_size;
+    ctx->bad_blocks = calloc((blocks + 7) / 8, 1);
+    if (ctx->bad_blocks == NULL) {
+        free(ctx->buffer);
+        free(ctx);
+        return NULL;
+    }
+
+    ctx->fd = g_backend->open(partition->device_index, O_RDONLY);
     if (ctx->fd < 0) {
+        free(ctx->bad_blocks);
+        free(ctx->buffer);
         free(ctx);
+        return NULL;
+    }
+
+    // Look up every block once rather than on each read
+    int i;
+    for (i = 0; i < blocks; ++i) {
+        loff_t pos = (loff_t) i * partition->erase_size;
+        int mgbb = g_backend->ioctl(ctx->fd, MEMGETBADBLOCK, &pos);
+        if (mgbb) {
+            fprintf(stderr,
+                    "mtd: MEMGETBADBLOCK returned %d at 0x%08llx (errno=%d)\n",
+                    mgbb, pos, errno);
+            ctx->bad_blocks[i / 8] |= 1 << (i % 8);
+        }
+    }
+
+    if (g_backend->ioctl(ctx->fd, ECCGETSTATS, &ctx->ecc_stats)) {
+        fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
+        g_backend->close(ctx->fd);
+        free(ctx->bad_blocks);
         free(ctx->buffer);
+        free(ctx);
         return NULL;
     }
 
@@ -279,43 +375,88 @@ MtdReadContext *mtd_read_partition(const MtdPartition *partition)
     return ctx;
 }
 
-static int read_block(const MtdPartition *partition, int fd, char *data)
+static int is_bad_block(const MtdReadContext *ctx, loff_t pos)
 {
-    struct mtd_ecc_stats before, after;
-    if (ioctl(fd, ECCGETSTATS, &before)) {
+    int i = pos / ctx->partition->erase_size;
+    return (ctx->bad_blocks[i / 8] >> (i % 8)) & 1;
+}
+
+static int is_zero_block(const char *data, size_t size)
+{
+    // Byte-wise up to word alignment, then a word at a time
+    while (size > 0 && ((uintptr_t) data % sizeof(unsigned long)) != 0) {
+        if (*data != 0) return 0;
+        ++data;
+        --size;
+    }
+
+    const unsigned long *words = (const unsigned long *) data;
+    size_t count = size / sizeof(unsigned long);
+    size_t i;
+    for (i = 0; i + 4 <= count; i += 4) {
+        if (words[i] | words[i + 1] | words[i + 2] | words[i + 3]) return 0;
+    }
+    for (; i < count; ++i) {
+        if (words[i] != 0) return 0;
+    }
+
+    data += count * sizeof(unsigned long);
+    size -= count * sizeof(unsigned long);
+    while (size > 0) {
+        if (*data != 0) return 0;
+        ++data;
+        --size;
+    }
+    return 1;
+}
+
+/* Updates the cached ECC counters and reports whether any reads since
+ * the last check hit an uncorrectable error.  Returns 1 if they did, 0
+ * if not, -1 if the counters could not be read.
+ */
+static int ecc_failed(MtdReadContext *ctx, loff_t pos)
+{
+    struct mtd_ecc_stats after;
+    if (g_backend->ioctl(ctx->fd, ECCGETSTATS, &after)) {
         fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
         return -1;
     }
 
+    int failed = after.failed != ctx->ecc_stats.failed;
+    if (failed) {
+        fprintf(stderr, "mtd: ECC errors (%d soft, %d hard) at 0x%08llx\n",
+                after.corrected - ctx->ecc_stats.corrected,
+                after.failed - ctx->ecc_stats.failed, pos);
+    }
+    ctx->ecc_stats = after;
+    return failed;
+}
+
+static int read_block(MtdReadContext *ctx, char *data)
+{
+    const MtdPartition *partition = ctx->partition;
+    int fd = ctx->fd;
     loff_t pos = lseek64(fd, 0, SEEK_CUR);
 
     ssize_t size = partition->erase_size;
-    int mgbb;
 
     while (pos + size <= (int) partition->size) {
-        if (lseek64(fd, pos, SEEK_SET) != pos || read(fd, data, size) != size) {
+        int failed;
+        if (is_bad_block(ctx, pos)) {
+            // Reported when the partition was opened
+        } else if (lseek64(fd, pos, SEEK_SET) != pos ||
+                   g_backend->read(fd, data, size) != size) {
             fprintf(stderr, "mtd: read error at 0x%08llx (%s)\n",
                     pos, strerror(errno));
-        } else if (ioctl(fd, ECCGETSTATS, &after)) {
-            fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
+        } else if ((failed = ecc_failed(ctx, pos)) < 0) {
             return -1;
-        } else if (after.failed != before.failed) {
-            fprintf(stderr, "mtd: ECC errors (%d soft, %d hard) at 0x%08llx\n",
-                    after.corrected - before.corrected,
-                    after.failed - before.failed, pos);
-        } else if ((mgbb = ioctl(fd, MEMGETBADBLOCK, &pos))) {
-            fprintf(stderr,
-                    "mtd: MEMGETBADBLOCK returned %d at 0x%08llx (errno=%d)\n",
-                    mgbb, pos, errno);
-        } else {
-            int i;
-            for (i = 0; i < size; ++i) {
-                if (data[i] != 0) {
-                    return 0;  // Success!
-                }
-            }
+        } else if (failed) {
+            // Reported by ecc_failed
+        } else if (is_zero_block(data, size)) {
             fprintf(stderr, "mtd: read all-zero block at 0x%08llx; skipping\n",
                     pos);
+        } else {
+            return 0;  // Success!
         }
 
         pos += partition->erase_size;
@@ -325,6 +466,71 @@ static int read_block(const MtdPartition *partition, int fd, char *data)
     return -1;
 }
 
+/* Reads count complete blocks into data, checking the ECC counters once
+ * for the whole range.  The bad block table is consulted up front so
+ * each run of good blocks between bad ones goes out as a single read.
+ * Anything unusual (a read error, an all-zero block, an ECC failure
+ * anywhere in the range) sends the range back through read_block one
+ * block at a time, which sorts out which block to skip.
+ */
+static int read_blocks(MtdReadContext *ctx, char *data, int count)
+{
+    const MtdPartition *partition = ctx->partition;
+    int fd = ctx->fd;
+    loff_t start = lseek64(fd, 0, SEEK_CUR);
+    loff_t pos = start;
+
+    ssize_t size = partition->erase_size;
+    int done = 0;
+
+    // Make sure there are enough good blocks left before reading any
+    loff_t end = start;
+    int good = 0;
+    while (good < count && end + size <= (int) partition->size) {
+        if (!is_bad_block(ctx, end)) ++good;
+        end += size;
+    }
+
+    while (good == count && done < count) {
+        while (is_bad_block(ctx, pos)) pos += size;
+
+        int run = 1;
+        while (done + run < count && !is_bad_block(ctx, pos + run * size)) {
+            ++run;
+        }
+
+        char *dest = data + done * size;
+        if (lseek64(fd, pos, SEEK_SET) != pos ||
+            g_backend->read(fd, dest, run * size) != run * size) {
+            break;
+        }
+
+        int i;
+        for (i = 0; i < run; ++i) {
+            if (is_zero_block(dest + i * size, size)) break;
+        }
+        if (i < run) break;
+
+        pos += run * size;
+        done += run;
+    }
+
+    if (done == count) {
+        int failed = ecc_failed(ctx, start);
+        if (failed < 0) return -1;
+        if (!failed) return 0;
+    }
+
+    // Start the counters afresh so read_block only sees its own errors
+    if (done < count && ecc_failed(ctx, start) < 0) return -1;
+
+    if (lseek64(fd, start, SEEK_SET) != start) return -1;
+    for (done = 0; done < count; ++done) {
+        if (read_block(ctx, data + done * size)) return -1;
+    }
+    return 0;
+}
+
 ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
 {
     ssize_t read = 0;
@@ -338,10 +544,11 @@ ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
         }
 
         // Read complete blocks directly into the user's buffer
-        while (ctx->consumed == ctx->partition->erase_size &&
-               len - read >= ctx->partition->erase_size) {
-            if (read_block(ctx->partition, ctx->fd, data + read)) return -1;
-            read += ctx->partition->erase_size;
+        if (ctx->consumed == ctx->partition->erase_size &&
+            len - read >= ctx->partition->erase_size) {
+            int blocks = (len - read) / ctx->partition->erase_size;
+            if (read_blocks(ctx, data + read, blocks)) return -1;
+            read += blocks * ctx->partition->erase_size;
         }
 
         if (read >= len) {
@@ -350,7 +557,7 @@ ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
 
         // Read the next block into the buffer
         if (ctx->consumed == ctx->partition->erase_size && read < (int) len) {
-            if (read_block(ctx->partition, ctx->fd, ctx->buffer)) return -1;
+            if (read_block(ctx, ctx->buffer)) return -1;
             ctx->consumed = 0;
         }
     }
@@ -360,11 +567,14 @@ ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
 
 void mtd_read_close(MtdReadContext *ctx)
 {
-    close(ctx->fd);
+    g_backend->close(ctx->fd);
+    free(ctx->bad_blocks);
     free(ctx->buffer);
     free(ctx);
 }
 
+static void *writer_thread(void *arg);
+
 MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
 {
     MtdWriteContext *ctx = (MtdWriteContext*) malloc(sizeof(MtdWriteContext));
@@ -374,23 +584,46 @@ MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
     ctx->bad_block_alloc = 0;
     ctx->bad_block_count = 0;
 
-    ctx->buffer = malloc(partition->erase_size);
-    if (ctx->buffer == NULL) {
+    ctx->buffer = malloc(partition->erase_size * MTD_WRITE_QUEUE_DEPTH);
+    ctx->verify = malloc(partition->erase_size);
+    if (ctx->buffer == NULL || ctx->verify == NULL) {
+        free(ctx->buffer);
+        free(ctx->verify);
         free(ctx);
         return NULL;
     }
 
-    char mtddevname[32];
-    sprintf(mtddevname, "/dev/mtd/mtd%d", partition->device_index);
-    ctx->fd = open(mtddevname, O_RDWR);
+    ctx->fd = g_backend->open(partition->device_index, O_RDWR);
     if (ctx->fd < 0) {
         free(ctx->buffer);
+        free(ctx->verify);
         free(ctx);
         return NULL;
     }
 
     ctx->partition = partition;
     ctx->stored = 0;
+
+    ctx->skip_unchanged = 0;
+    ctx->digests = NULL;
+    ctx->digest_count = 0;
+    ctx->unchanged = 0;
+
+    ctx->head = 0;
+    ctx->queued = 0;
+    ctx->error = 0;
+    ctx->stopping = 0;
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+    if (pthread_create(&ctx->writer, NULL, writer_thread, ctx) != 0) {
+        pthread_cond_destroy(&ctx->cond);
+        pthread_mutex_destroy(&ctx->lock);
+        g_backend->close(ctx->fd);
+        free(ctx->buffer);
+        free(ctx->verify);
+        free(ctx);
+        return NULL;
+    }
     return ctx;
 }
 
@@ -403,6 +636,56 @@ static void add_bad_block_offset(MtdWriteContext *ctx, off_t pos) {
     ctx->bad_block_offsets[ctx->bad_block_count++] = pos;
 }
 
+int mtd_write_skip_unchanged(MtdWriteContext *ctx,
+        const unsigned char *digests, int count)
+{
+    unsigned char *copy = NULL;
+    if (digests != NULL && count > 0) {
+        copy = malloc(count * SHA_DIGEST_SIZE);
+        if (copy == NULL) return -1;
+        memcpy(copy, digests, count * SHA_DIGEST_SIZE);
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    free(ctx->digests);
+    ctx->digests = copy;
+    ctx->digest_count = copy != NULL ? count : 0;
+    ctx->skip_unchanged = 1;
+    pthread_mutex_unlock(&ctx->lock);
+    return 0;
+}
+
+/* Whether the block at pos already holds the contents of data.  Blocks
+ * that read back with any ECC activity, even corrected, are rewritten to
+ * refresh them.
+ */
+static int block_unchanged(MtdWriteContext *ctx, off_t pos, const char *data)
+{
+    const MtdPartition *partition = ctx->partition;
+    int fd = ctx->fd;
+    ssize_t size = partition->erase_size;
+
+    int i = pos / size;
+    if (ctx->digests != NULL && i < ctx->digest_count) {
+        uint8_t digest[SHA_DIGEST_SIZE];
+        SHA(data, size, digest);
+        return !memcmp(digest, ctx->digests + i * SHA_DIGEST_SIZE,
+                       SHA_DIGEST_SIZE);
+    }
+
+    struct mtd_ecc_stats before, after;
+    if (g_backend->ioctl(fd, ECCGETSTATS, &before)) return 0;
+    if (lseek(fd, pos, SEEK_SET) != pos ||
+        g_backend->read(fd, ctx->verify, size) != size) {
+        return 0;
+    }
+    if (g_backend->ioctl(fd, ECCGETSTATS, &after)) return 0;
+    if (after.failed != before.failed || after.corrected != before.corrected) {
+        return 0;
+    }
+    return !memcmp(data, ctx->verify, size);
+}
+
 static int write_block(MtdWriteContext *ctx, const char *data)
 {
     const MtdPartition *partition = ctx->partition;
@@ -414,32 +697,38 @@ static int write_block(MtdWriteContext *ctx, const char *data)
     ssize_t size = partition->erase_size;
     while (pos + size <= (int) partition->size) {
         loff_t bpos = pos;
-        if (ioctl(fd, MEMGETBADBLOCK, &bpos) > 0) {
+        if (g_backend->ioctl(fd, MEMGETBADBLOCK, &bpos) > 0) {
             add_bad_block_offset(ctx, pos);
             fprintf(stderr, "mtd: not writing bad block at 0x%08lx\n", pos);
             pos += partition->erase_size;
             continue;  // Don't try to erase known factory-bad blocks.
         }
 
+        if (ctx->skip_unchanged && block_unchanged(ctx, pos, data)) {
+            if (lseek(fd, pos + size, SEEK_SET) != pos + size) return 1;
+            ++ctx->unchanged;
+            return 0;  // Already there, no erase or program needed
+        }
+
         struct erase_info_user erase_info;
         erase_info.start = pos;
         erase_info.length = size;
         int retry;
         for (retry = 0; retry < 2; ++retry) {
-            if (ioctl(fd, MEMERASE, &erase_info) < 0) {
+            if (g_backend->ioctl(fd, MEMERASE, &erase_info) < 0) {
                 fprintf(stderr, "mtd: erase failure at 0x%08lx (%s)\n",
                         pos, strerror(errno));
                 continue;
             }
             if (lseek(fd, pos, SEEK_SET) != pos ||
-                write(fd, data, size) != size) {
+                g_backend->write(fd, data, size) != size) {
                 fprintf(stderr, "mtd: write error at 0x%08lx (%s)\n",
                         pos, strerror(errno));
             }
 
-            char verify[size];
+            char *verify = ctx->verify;
             if (lseek(fd, pos, SEEK_SET) != pos ||
-                read(fd, verify, size) != size) {
+                g_backend->read(fd, verify, size) != size) {
                 fprintf(stderr, "mtd: re-read error at 0x%08lx (%s)\n",
                         pos, strerror(errno));
                 continue;
@@ -459,7 +748,7 @@ static int write_block(MtdWriteContext *ctx, const char *data)
         // Try to erase it once more as we give up on this block
         add_bad_block_offset(ctx, pos);
         fprintf(stderr, "mtd: skipping write block at 0x%08lx\n", pos);
-        ioctl(fd, MEMERASE, &erase_info);
+        g_backend->ioctl(fd, MEMERASE, &erase_info);
         pos += partition->erase_size;
     }
 
@@ -468,33 +757,175 @@ static int write_block(MtdWriteContext *ctx, const char *data)
     return -1;
 }
 
+/* Writes queued blocks in order until the context closes.  After a
+ * failed block the rest of the queue is dropped, since everything behind
+ * it would land at the wrong offset.
+ */
+static void *writer_thread(void *arg)
+{
+    MtdWriteContext *ctx = (MtdWriteContext *) arg;
+    const size_t size = ctx->partition->erase_size;
+
+    pthread_mutex_lock(&ctx->lock);
+    for (;;) {
+        while (ctx->queued == 0 && !ctx->stopping) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        if (ctx->queued == 0) break;
+
+        const char *data = ctx->buffer + ctx->head * size;
+        int failed = ctx->error;
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (!failed && write_block(ctx, data)) failed = errno ? errno : EIO;
+
+        pthread_mutex_lock(&ctx->lock);
+        if (failed && ctx->error == 0) ctx->error = failed;
+        ctx->head = (ctx->head + 1) % MTD_WRITE_QUEUE_DEPTH;
+        ctx->queued--;
+        pthread_cond_broadcast(&ctx->cond);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+/* Returns the block mtd_write_data should fill next, waiting for the
+ * writer thread to free one if the queue is full.  NULL (with errno set)
+ * if an earlier block failed.
+ */
+static char *next_fill_block(MtdWriteContext *ctx)
+{
+    char *block = NULL;
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->queued == MTD_WRITE_QUEUE_DEPTH && ctx->error == 0) {
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    }
+    if (ctx->error == 0) {
+        int fill = (ctx->head + ctx->queued) % MTD_WRITE_QUEUE_DEPTH;
+        block = ctx->buffer + fill * ctx->partition->erase_size;
+    } else {
+        errno = ctx->error;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return block;
+}
+
+/* Hands the filled block to the writer thread */
+static void queue_fill_block(MtdWriteContext *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    ctx->queued++;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/* Waits until every queued block is on flash.  Returns 0, or -1 with
+ * errno set if any of them failed.
+ */
+static int drain_write_queue(MtdWriteContext *ctx)
+{
+    int error;
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->queued > 0) {
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    }
+    error = ctx->error;
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
 ssize_t mtd_write_data(MtdWriteContext *ctx, const char *data, size_t len)
 {
+    const size_t size = ctx->partition->erase_size;
     size_t wrote = 0;
     while (wrote < len) {
-        // Coalesce partial writes into complete blocks
-        if (ctx->stored > 0 || len - wrote < ctx->partition->erase_size) {
-            size_t avail = ctx->partition->erase_size - ctx->stored;
-            size_t copy = len - wrote < avail ? len - wrote : avail;
-            memcpy(ctx->buffer + ctx->stored, data + wrote, copy);
-            ctx->stored += copy;
-            wrote += copy;
+        // Fill the next queue slot, partial writes coalesce there too
+        char *block = next_fill_block(ctx);
+        if (block == NULL) return -1;
+
+        size_t avail = size - ctx->stored;
+        size_t copy = len - wrote < avail ? len - wrote : avail;
+        memcpy(block + ctx->stored, data + wrote, copy);
+        ctx->stored += copy;
+        wrote += copy;
+
+        // If a complete block was accumulated, queue it
+        if (ctx->stored == size) {
+            queue_fill_block(ctx);
+            ctx->stored = 0;
         }
+    }
 
-        // If a complete block was accumulated, write it
-        if (ctx->stored == ctx->partition->erase_size) {
-            if (write_block(ctx, ctx->buffer)) return -1;
-            ctx->stored = 0;
+    return wrote;
+}
+
+/* Erases blocks erase blocks from pos on.  The bad block map for the
+ * range is read first, and each run of good blocks goes to the driver
+ * as one MEMERASE; if the driver refuses a run, or a block in it fails,
+ * the run is erased again a block at a time.  Like the per-block code
+ * this replaces, blocks that fail to erase are only reported.  Returns
+ * -1 only if the bad block map couldn't be allocated.
+ */
+static int erase_range(const MtdPartition *partition, int fd, off_t pos,
+        int blocks, int *p_erased, int *p_bad)
+{
+    const size_t size = partition->erase_size;
+    unsigned char *bad = malloc(blocks > 0 ? blocks : 1);
+    if (bad == NULL) return -1;
+
+    int i;
+    for (i = 0; i < blocks; ++i) {
+        loff_t bpos = pos + (off_t) i * size;
+        bad[i] = g_backend->ioctl(fd, MEMGETBADBLOCK, &bpos) > 0;
+        if (bad[i]) {
+            fprintf(stderr, "mtd: not erasing bad block at 0x%08lx\n",
+                    (long) bpos);
         }
+    }
 
-        // Write complete blocks directly from the user's buffer
-        while (ctx->stored == 0 && len - wrote >= ctx->partition->erase_size) {
-            if (write_block(ctx, data + wrote)) return -1;
-            wrote += ctx->partition->erase_size;
+    int erased = 0, bad_count = 0;
+    i = 0;
+    while (i < blocks) {
+        if (bad[i]) {
+            ++bad_count;
+            ++i;
+            continue;  // Don't try to erase known factory-bad blocks.
         }
+
+        int run = 1;
+        while (i + run < blocks && !bad[i + run]) ++run;
+
+        struct erase_info_user erase_info;
+        erase_info.start = pos + (off_t) i * size;
+        erase_info.length = run * size;
+        if (g_backend->ioctl(fd, MEMERASE, &erase_info) == 0) {
+            erased += run;
+        } else {
+            int j;
+            for (j = 0; j < run; ++j) {
+                erase_info.start = pos + (off_t) (i + j) * size;
+                erase_info.length = size;
+                if (run > 1 &&
+                    g_backend->ioctl(fd, MEMERASE, &erase_info) == 0) {
+                    ++erased;
+                } else {
+                    fprintf(stderr, "mtd: erase failure at 0x%08lx\n",
+                            (long) erase_info.start);
+                }
+            }
+        }
+        i += run;
     }
 
-    return wrote;
+    free(bad);
+    if (p_erased != NULL) *p_erased = erased;
+    if (p_bad != NULL) *p_bad = bad_count;
+    return 0;
 }
 
 off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
@@ -502,11 +933,16 @@ off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
     // Zero-pad and write any pending data to get us to a block boundary
     if (ctx->stored > 0) {
         size_t zero = ctx->partition->erase_size - ctx->stored;
-        memset(ctx->buffer + ctx->stored, 0, zero);
-        if (write_block(ctx, ctx->buffer)) return -1;
+        char *block = next_fill_block(ctx);
+        if (block == NULL) return -1;
+        memset(block + ctx->stored, 0, zero);
+        queue_fill_block(ctx);
         ctx->stored = 0;
     }
 
+    // The writer thread owns the file position until it is done
+    if (drain_write_queue(ctx)) return -1;
+
     off_t pos = lseek(ctx->fd, 0, SEEK_CUR);
     if ((off_t) pos == (off_t) -1) return pos;
 
@@ -518,24 +954,10 @@ off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
     }
 
     // Erase the specified number of blocks
-    while (blocks-- > 0) {
-        loff_t bpos = pos;
-        if (ioctl(ctx->fd, MEMGETBADBLOCK, &bpos) > 0) {
-            fprintf(stderr, "mtd: not erasing bad block at 0x%08lx\n", pos);
-            pos += ctx->partition->erase_size;
-            continue;  // Don't try to erase known factory-bad blocks.
-        }
-
-        struct erase_info_user erase_info;
-        erase_info.start = pos;
-        erase_info.length = ctx->partition->erase_size;
-        if (ioctl(ctx->fd, MEMERASE, &erase_info) < 0) {
-            fprintf(stderr, "mtd: erase failure at 0x%08lx\n", pos);
-        }
-        pos += ctx->partition->erase_size;
+    if (erase_range(ctx->partition, ctx->fd, pos, blocks, NULL, NULL)) {
+        return -1;
     }
-
-    return pos;
+    return pos + (off_t) blocks * ctx->partition->erase_size;
 }
 
 int mtd_write_close(MtdWriteContext *ctx)
@@ -543,9 +965,25 @@ int mtd_write_close(MtdWriteContext *ctx)
     int r = 0;
     // Make sure any pending data gets written
     if (mtd_erase_blocks(ctx, 0) == (off_t) -1) r = -1;
-    if (close(ctx->fd)) r = -1;
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->stopping = 1;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+    pthread_join(ctx->writer, NULL);
+    pthread_cond_destroy(&ctx->cond);
+    pthread_mutex_destroy(&ctx->lock);
+
+    if (ctx->skip_unchanged) {
+        fprintf(stderr, "mtd: %d unchanged blocks not rewritten\n",
+                ctx->unchanged);
+    }
+
+    if (g_backend->close(ctx->fd)) r = -1;
     free(ctx->bad_block_offsets);
     free(ctx->buffer);
+    free(ctx->verify);
+    free(ctx->digests);
     free(ctx);
     return r;
 }
@@ -555,6 +993,8 @@ int mtd_write_close(MtdWriteContext *ctx)
  */
 off_t mtd_find_write_start(MtdWriteContext *ctx, off_t pos) {
     int i;
+    // Blocks still queued may add to the bad block list
+    drain_write_queue(ctx);
     for (i = 0; i < ctx->bad_block_count; ++i) {
         if (ctx->bad_block_offsets[i] == pos) {
             pos += ctx->partition->erase_size;
@@ -564,3 +1004,86 @@ off_t mtd_find_write_start(MtdWriteContext *ctx, off_t pos) {
     }
     return pos;
 }
+
+typedef struct {
+    const MtdPartition *partition;
+    int result;
+} EraseJob;
+
+static long long now_msec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void *erase_partition_thread(void *arg)
+{
+    EraseJob *job = (EraseJob *) arg;
+    const MtdPartition *partition = job->partition;
+
+    job->result = -1;
+    int fd = g_backend->open(partition->device_index, O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr, "mtd: can't open %s for erasing (%s)\n",
+                partition->name, strerror(errno));
+        return NULL;
+    }
+
+    long long start = now_msec();
+    int erased, bad;
+    int blocks = partition->size / partition->erase_size;
+    if (erase_range(partition, fd, 0, blocks, &erased, &bad) == 0) {
+        long long msec = now_msec() - start;
+        long long kb = (long long) erased * partition->erase_size / 1024;
+        fprintf(stderr, "mtd: erased %s: %d blocks (%d bad) in %lld ms, "
+                "%lld KB/s\n", partition->name, erased, bad, msec,
+                kb * 1000 / (msec > 0 ? msec : 1));
+        job->result = 0;
+    }
+    if (g_backend->close(fd)) job->result = -1;
+    return NULL;
+}
+
+int mtd_erase_partitions(const MtdPartition **partitions, int count,
+                         int *results)
+{
+    EraseJob *jobs = malloc(count * sizeof(EraseJob));
+    pthread_t *threads = malloc(count * sizeof(pthread_t));
+    char *started = calloc(count, 1);
+    if (jobs == NULL || threads == NULL || started == NULL) {
+        free(jobs);
+        free(threads);
+        free(started);
+        if (results != NULL) {
+            int i;
+            for (i = 0; i < count; ++i) results[i] = -1;
+        }
+        return -1;
+    }
+
+    // The first partition is erased on the caller's thread
+    int i;
+    for (i = 0; i < count; ++i) {
+        jobs[i].partition = partitions[i];
+        jobs[i].result = -1;
+        if (i > 0 && pthread_create(&threads[i], NULL,
+                                    erase_partition_thread, &jobs[i]) == 0) {
+            started[i] = 1;
+        }
+    }
+    for (i = 0; i < count; ++i) {
+        if (!started[i]) erase_partition_thread(&jobs[i]);
+    }
+
+    int r = 0;
+    for (i = 0; i < count; ++i) {
+        if (started[i]) pthread_join(threads[i], NULL);
+        if (jobs[i].result) r = -1;
+        if (results != NULL) results[i] = jobs[i].result;
+    }
+    free(jobs);
+    free(threads);
+    free(started);
+    return r;
+}
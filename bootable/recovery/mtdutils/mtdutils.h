@@ -52,4 +52,43 @@ off_t mtd_erase_blocks(MtdWriteContext *, int blocks);  /* 0 ok, -1 for all */
 off_t mtd_find_write_start(MtdWriteContext *ctx, off_t pos);
 int mtd_write_close(MtdWriteContext *);
 
+/* Erase whole partitions, in parallel with each other.  Bad blocks are
+ * looked up once per partition, and good blocks next to each other are
+ * erased with a single request.  Returns 0, or -1 if any partition
+ * couldn't be erased.  If results isn't NULL, results[i] is set to 0 or
+ * -1 for partitions[i].
+ */
+int mtd_erase_partitions(const MtdPartition **partitions, int count,
+                         int *results);
+
+/* Don't erase and reprogram blocks that already hold the data being
+ * written.  Each block is read back for the comparison, or if digests is
+ * given (count SHA-1 digests, one per erase block of the partition as it
+ * is on flash now) compared by hash.  Call before writing any data.
+ * Returns 0, or -1 if the digests can't be stored.
+ */
+int mtd_write_skip_unchanged(MtdWriteContext *ctx,
+        const unsigned char *digests, int count);
+
+/* Where partitions and their data come from.  The default is the kernel
+ * MTD driver (/proc/mtd and /dev/mtd/mtdN); host tools can substitute a
+ * simulator, see mtdsim.h.  Descriptors returned by open must support
+ * lseek, since the read and write contexts seek on them directly.
+ */
+typedef struct {
+    /* contents in the format of /proc/mtd, or -1 */
+    ssize_t (*read_partitions)(char *buf, size_t len);
+    int (*open)(int device_index, int flags);
+    ssize_t (*read)(int fd, void *buf, size_t len);
+    ssize_t (*write)(int fd, const void *buf, size_t len);
+    /* MEMGETINFO, MEMERASE, MEMGETBADBLOCK and ECCGETSTATS */
+    int (*ioctl)(int fd, unsigned long request, void *arg);
+    int (*close)(int fd);
+} MtdBackend;
+
+/* NULL goes back to the kernel driver.  Call mtd_scan_partitions() again
+ * afterwards.
+ */
+void mtd_set_backend(const MtdBackend *backend);
+
 #endif  // MTDUTILS_H_
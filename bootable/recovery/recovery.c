@@ -76,8 +76,8 @@ static const char *TEMPORARY_LOG_FILE = "/tmp/recovery.log";
  * 3. main system reboots into recovery
  * 4. get_args() writes BCB with "boot-recovery" and "--wipe_data"
  *    -- after this, rebooting will restart the erase --
- * 5. erase_root() reformats /data
- * 6. erase_root() reformats /cache
+ * 5. erase_roots() reformats /data
+ * 6. erase_roots() reformats /cache, alongside /data
  * 7. finish_recovery() erases BCB
  *    -- after this, rebooting will restart the main system --
  * 8. main() calls reboot() to boot main system
@@ -105,7 +105,7 @@ static const char *TEMPORARY_LOG_FILE = "/tmp/recovery.log";
  *    8d. bootloader tries to flash firmware
  *    8e. bootloader writes BCB with "boot-recovery" (keeping "--wipe_cache")
  *        -- after this, rebooting will reformat cache & restart main system --
- *    8f. erase_root() reformats /cache
+ *    8f. erase_roots() reformats /cache
  *    8g. finish_recovery() erases BCB
  *        -- after this, rebooting will (try to) restart the main system --
  * 9. main() calls reboot() to boot main system
@@ -121,8 +121,8 @@ static const char *TEMPORARY_LOG_FILE = "/tmp/recovery.log";
  * 5. read_encrypted_fs_info() retrieves encrypted file systems settings from /data
  *    Settings include: property to specify the Encrypted FS istatus and
  *    FS encryption key if enabled (not yet implemented)
- * 6. erase_root() reformats /data
- * 7. erase_root() reformats /cache
+ * 6. erase_roots() reformats /data
+ * 7. erase_roots() reformats /cache, alongside /data
  * 8. restore_encrypted_fs_info() writes required encrypted file systems settings to /data
 	*    Settings include: property to specify the Encrypted FS status and
 *    FS encryption key if enabled (not yet implemented)
@@ -292,11 +292,19 @@ finish_recovery(const char *send_intent) {
 }
 
 static int
-erase_root(const char *root) {
+erase_roots(const char **roots, int count) {
+	int i;
 	ui_set_background(BACKGROUND_ICON_INSTALLING);
 	ui_show_indeterminate_progress();
-	ui_print("Formatting %s...\n", root);
-	return format_root_device(root);
+	for (i = 0; i < count; i++) {
+		ui_print("Formatting %s...\n", roots[i]);
+	}
+	return format_root_devices(roots, count);
+}
+
+static int
+erase_root(const char *root) {
+	return erase_roots(&root, 1);
 }
 
 static char**
@@ -397,8 +405,8 @@ wipe_data(int confirm) {
 
 	ui_print("\n-- Wiping data...\n");
 	device_wipe_data();
-	erase_root("DATA:");
-	erase_root("CACHE:");
+	const char *roots[] = { "DATA:", "CACHE:" };
+	erase_roots(roots, 2);
 	ui_print("Data wipe complete.\n");
 }
 
@@ -592,8 +600,8 @@ main(int argc, char **argv) {
 		if (status != INSTALL_SUCCESS) ui_print("Installation aborted.\n");
 	} else if (wipe_data) {
 		if (device_wipe_data()) status = INSTALL_ERROR;
-		if (erase_root("DATA:")) status = INSTALL_ERROR;
-		if (wipe_cache && erase_root("CACHE:")) status = INSTALL_ERROR;
+		const char *roots[] = { "DATA:", "CACHE:" };
+		if (erase_roots(roots, wipe_cache ? 2 : 1)) status = INSTALL_ERROR;
 		if (status != INSTALL_SUCCESS) ui_print("Data wipe failed.\n");
 	} else if (wipe_cache) {
 		if (wipe_cache && erase_root("CACHE:")) status = INSTALL_ERROR;
@@ -261,6 +261,7 @@ ensure_root_path_mounted(const char *root_path)
             return -1;
         }
     }
+    invalidate_mounted_volumes();
     return 0;
 }
 
@@ -308,8 +309,11 @@ get_root_mtd_partition(const char *root_path)
     return mtd_find_partition_by_name(info->partition_name);
 }
 
-int
-format_root_device(const char *root)
+/* Checks that "root" can be formatted and unmounts it, returning the
+ * partition to erase, or NULL.
+ */
+static const MtdPartition *
+prepare_root_device(const char *root)
 {
     /* Be a little safer here; require that "root" is just
      * a device with no relative path after it.
@@ -320,13 +324,13 @@ format_root_device(const char *root)
     }
     if (c[0] != ':' || c[1] != '\0') {
         LOGW("format_root_device: bad root name \"%s\"\n", root);
-        return -1;
+        return NULL;
     }
 
     const RootInfo *info = get_root_info_for_path(root);
     if (info == NULL || info->device == NULL) {
         LOGW("format_root_device: can't resolve \"%s\"\n", root);
-        return -1;
+        return NULL;
     }
     if (info->mount_point != NULL) {
         /* Don't try to format a mounted device.
@@ -334,12 +338,10 @@ format_root_device(const char *root)
         int ret = ensure_root_path_unmounted(root);
         if (ret < 0) {
             LOGW("format_root_device: can't unmount \"%s\"\n", root);
-            return ret;
+            return NULL;
         }
     }
 
-    /* Format the device.
-     */
     if (info->device == g_mtd_device) {
         mtd_scan_partitions();
         const MtdPartition *partition;
@@ -347,26 +349,55 @@ format_root_device(const char *root)
         if (partition == NULL) {
             LOGW("format_root_device: can't find mtd partition \"%s\"\n",
                     info->partition_name);
-            return -1;
+            return NULL;
         }
         if (info->filesystem == g_raw || !strcmp(info->filesystem, "yaffs2")) {
-            MtdWriteContext *write = mtd_write_partition(partition);
-            if (write == NULL) {
-                LOGW("format_root_device: can't open \"%s\"\n", root);
-                return -1;
-            } else if (mtd_erase_blocks(write, -1) == (off_t) -1) {
-                LOGW("format_root_device: can't erase \"%s\"\n", root);
-                mtd_write_close(write);
-                return -1;
-            } else if (mtd_write_close(write)) {
-                LOGW("format_root_device: can't close \"%s\"\n", root);
-                return -1;
-            } else {
-                return 0;
-            }
+            return partition;
         }
     }
 //TODO: handle other device types (sdcard, etc.)
     LOGW("format_root_device: can't handle non-mtd device \"%s\"\n", root);
-    return -1;
+    return NULL;
+}
+
+int
+format_root_devices(const char **roots, int count)
+{
+    const MtdPartition *partitions[NUM_ROOTS];
+    const char *names[NUM_ROOTS];
+    int results[NUM_ROOTS];
+    int n = 0;
+    int ret = 0;
+    int i;
+    if (count > (int) NUM_ROOTS) {
+        LOGW("format_root_device: too many roots (%d)\n", count);
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        const MtdPartition *partition = prepare_root_device(roots[i]);
+        if (partition == NULL) {
+            ret = -1;
+        } else {
+            names[n] = roots[i];
+            partitions[n++] = partition;
+        }
+    }
+
+    /* Format the devices.
+     */
+    if (n > 0 && mtd_erase_partitions(partitions, n, results)) {
+        for (i = 0; i < n; i++) {
+            if (results[i]) {
+                LOGW("format_root_device: can't erase \"%s\"\n", names[i]);
+            }
+        }
+        ret = -1;
+    }
+    return ret;
+}
+
+int
+format_root_device(const char *root)
+{
+    return format_root_devices(&root, 1);
 }
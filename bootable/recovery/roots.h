@@ -60,4 +60,9 @@ const MtdPartition *get_root_mtd_partition(const char *root_path);
  */
 int format_root_device(const char *root);
 
+/* Formats several roots at once; their partitions are erased in parallel.
+ * Returns -1 if any of them couldn't be formatted.
+ */
+int format_root_devices(const char **roots, int count);
+
 #endif  // RECOVERY_ROOTS_H_
@@ -16,6 +16,7 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -91,6 +92,7 @@ Value* MountFn(const char* name, State* state, int argc, Expr* argv[]) {
                     name, location, mount_point, strerror(errno));
             result = strdup("");
         } else {
+            invalidate_mounted_volumes();
             result = mount_point;
         }
     }
@@ -194,23 +196,11 @@ Value* FormatFn(const char* name, State* state, int argc, Expr* argv[]) {
             result = strdup("");
             goto done;
         }
-        MtdWriteContext* ctx = mtd_write_partition(mtd);
-        if (ctx == NULL) {
-            fprintf(stderr, "%s: can't write \"%s\"", name, location);
-            result = strdup("");
-            goto done;
-        }
-        if (mtd_erase_blocks(ctx, -1) == -1) {
-            mtd_write_close(ctx);
+        if (mtd_erase_partitions(&mtd, 1, NULL) != 0) {
             fprintf(stderr, "%s: failed to erase \"%s\"", name, location);
             result = strdup("");
             goto done;
         }
-        if (mtd_write_close(ctx) != 0) {
-            fprintf(stderr, "%s: failed to close \"%s\"", name, location);
-            result = strdup("");
-            goto done;
-        }
         result = location;
     } else {
         fprintf(stderr, "%s: unsupported type \"%s\"", name, type);
@@ -396,6 +386,115 @@ Value* PackageExtractFileFn(const char* name, State* state,
 }
 
 
+// Metadata operations on many paths are grouped by parent directory:
+// each directory is opened once and the operation is applied to the
+// paths' last components relative to it, instead of resolving every
+// path from the root.
+
+typedef struct {
+    char* path;
+    int index;         // position in the argument list
+    int dir_len;       // length of the parent directory prefix, or -1
+} BatchPath;
+
+// Applies an operation to name relative to dirfd; path is for messages.
+// Returns 0, or -1 after reporting the failure.
+typedef int (*BatchOp)(int dirfd, const char* name, const char* path,
+                       void* cookie);
+
+static int CompareParents(const BatchPath* pa, const BatchPath* pb) {
+    if (pa->dir_len != pb->dir_len) return pa->dir_len - pb->dir_len;
+    if (pa->dir_len <= 0) return 0;
+    return strncmp(pa->path, pb->path, pa->dir_len);
+}
+
+// By parent directory, then in argument order.
+static int CompareByParent(const void* a, const void* b) {
+    const BatchPath* pa = (const BatchPath*)a;
+    const BatchPath* pb = (const BatchPath*)b;
+    int c = CompareParents(pa, pb);
+    return c != 0 ? c : pa->index - pb->index;
+}
+
+// Runs op on each of paths[0..count-1] and returns the number of
+// paths it failed for.
+static int ApplyByParent(char** paths, int count, BatchOp op, void* cookie) {
+    BatchPath* batch = malloc(count * sizeof(BatchPath));
+    if (batch == NULL) {
+        // Do them one at a time instead
+        int failed = 0, i;
+        for (i = 0; i < count; ++i) {
+            if (op(AT_FDCWD, paths[i], paths[i], cookie) < 0) ++failed;
+        }
+        return failed;
+    }
+
+    int i;
+    for (i = 0; i < count; ++i) {
+        const char* slash = strrchr(paths[i], '/');
+        batch[i].path = paths[i];
+        batch[i].index = i;
+        // Paths with no directory part, or ending in '/', are used as is.
+        batch[i].dir_len = (slash == NULL || slash[1] == '\0') ?
+            -1 : slash - paths[i];
+    }
+    qsort(batch, count, sizeof(BatchPath), CompareByParent);
+
+    int failed = 0;
+    i = 0;
+    while (i < count) {
+        int dir_len = batch[i].dir_len;
+        int n = 1;
+        while (i + n < count && CompareParents(&batch[i], &batch[i+n]) == 0) {
+            ++n;
+        }
+
+        int dirfd = AT_FDCWD;
+        if (dir_len >= 0) {
+            char* dir = strndup(batch[i].path, dir_len > 0 ? dir_len : 1);
+            if (dir != NULL) {
+                dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+                free(dir);
+            }
+            if (dirfd < 0) dirfd = AT_FDCWD;
+        }
+
+        int j;
+        for (j = i; j < i + n; ++j) {
+            const char* name = (dirfd == AT_FDCWD) ?
+                batch[j].path : batch[j].path + dir_len + 1;
+            if (op(dirfd, name, batch[j].path, cookie) < 0) ++failed;
+        }
+        if (dirfd != AT_FDCWD) close(dirfd);
+        i += n;
+    }
+
+    free(batch);
+    return failed;
+}
+
+typedef struct {
+    const char* name;
+    const char* target;
+} SymlinkOp;
+
+static int SymlinkAt(int dirfd, const char* name, const char* path,
+                     void* cookie) {
+    const SymlinkOp* op = (const SymlinkOp*)cookie;
+    if (unlinkat(dirfd, name, 0) < 0) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "%s: failed to remove %s: %s\n",
+                    op->name, path, strerror(errno));
+        }
+    }
+    if (symlinkat(op->target, dirfd, name) < 0) {
+        fprintf(stderr, "%s: failed to symlink %s to %s: %s\n",
+                op->name, path, op->target, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
 // symlink target src1 src2 ...
 //    unlinks any previously existing src1, src2, etc before creating symlinks.
 Value* SymlinkFn(const char* name, State* state, int argc, Expr* argv[]) {
@@ -412,24 +511,45 @@ Value* SymlinkFn(const char* name, State* state, int argc, Expr* argv[]) {
         return NULL;
     }
 
+    SymlinkOp op = { name, target };
+    int failed = ApplyByParent(srcs, argc-1, SymlinkAt, &op);
+    if (failed > 0) {
+        fprintf(stderr, "%s: %d of %d symlinks to %s failed\n",
+                name, failed, argc-1, target);
+    }
+
     int i;
     for (i = 0; i < argc-1; ++i) {
-        if (unlink(srcs[i]) < 0) {
-            if (errno != ENOENT) {
-                fprintf(stderr, "%s: failed to remove %s: %s\n",
-                        name, srcs[i], strerror(errno));
-            }
-        }
-        if (symlink(target, srcs[i]) < 0) {
-            fprintf(stderr, "%s: failed to symlink %s to %s: %s\n",
-                    name, srcs[i], target, strerror(errno));
-        }
         free(srcs[i]);
     }
     free(srcs);
+    free(target);
     return StringValue(strdup(""));
 }
 
+typedef struct {
+    const char* name;
+    int uid;
+    int gid;
+    int mode;
+} SetPermOp;
+
+static int SetPermAt(int dirfd, const char* name, const char* path,
+                     void* cookie) {
+    const SetPermOp* op = (const SetPermOp*)cookie;
+    int r = 0;
+    if (fchownat(dirfd, name, op->uid, op->gid, 0) < 0) {
+        fprintf(stderr, "%s: chown of %s to %d %d failed: %s\n",
+                op->name, path, op->uid, op->gid, strerror(errno));
+        r = -1;
+    }
+    if (fchmodat(dirfd, name, op->mode, 0) < 0) {
+        fprintf(stderr, "%s: chmod of %s to %o failed: %s\n",
+                op->name, path, op->mode, strerror(errno));
+        r = -1;
+    }
+    return r;
+}
 
 Value* SetPermFn(const char* name, State* state, int argc, Expr* argv[]) {
     char* result = NULL;
@@ -482,15 +602,11 @@ Value* SetPermFn(const char* name, State* state, int argc, Expr* argv[]) {
             goto done;
         }
 
-        for (i = 3; i < argc; ++i) {
-            if (chown(args[i], uid, gid) < 0) {
-                fprintf(stderr, "%s: chown of %s to %d %d failed: %s\n",
-                        name, args[i], uid, gid, strerror(errno));
-            }
-            if (chmod(args[i], mode) < 0) {
-                fprintf(stderr, "%s: chmod of %s to %o failed: %s\n",
-                        name, args[i], mode, strerror(errno));
-            }
+        SetPermOp op = { name, uid, gid, mode };
+        int failed = ApplyByParent(args+3, argc-3, SetPermAt, &op);
+        if (failed > 0) {
+            fprintf(stderr, "%s: %d of %d paths failed\n",
+                    name, failed, argc-3);
         }
     }
     result = strdup("");
@@ -662,6 +778,8 @@ Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
         result = strdup("");
         goto done;
     }
+    // Incremental radio/boot updates leave most blocks as they were
+    mtd_write_skip_unchanged(ctx, NULL, 0);
 
     bool success;
 
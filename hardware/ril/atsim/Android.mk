@@ -0,0 +1,41 @@
+# Copyright 2006 The Android Open Source Project
+
+# Scriptable AT modem simulator and the libatchannel benchmark that runs
+# against it, see the comments at the top of atsim.c and atbench.c.
+#
+LOCAL_PATH:= $(call my-dir)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+    atsim.c
+
+LOCAL_SHARED_LIBRARIES := \
+    libcutils
+
+LOCAL_MODULE:= atsim
+LOCAL_MODULE_TAGS := debug
+
+include $(BUILD_EXECUTABLE)
+
+# For atbench binary
+# ==================
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+    atbench.c
+
+LOCAL_STATIC_LIBRARIES := \
+    libatchannel
+
+LOCAL_SHARED_LIBRARIES := \
+    libcutils \
+    libutils
+
+LOCAL_CFLAGS := -D_GNU_SOURCE
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../libatchannel
+
+LOCAL_MODULE:= atbench
+LOCAL_MODULE_TAGS := debug
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,488 @@
+/* //device/system/atsim/atbench.c
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * atbench: drives libatchannel against a modem (normally atsim) with the
+ * command mix reference-ril issues for call list, registration, signal,
+ * SIM status and operator requests, and reports per-command latency
+ * percentiles together with the CPU time spent on the AT reader and
+ * writer threads.
+ *
+ *   atsim -p 7000 -l 2 -u 50 -b 20 &
+ *   atbench -p 7000 -n 20000 -c 4
+ *
+ * With -x <channels> the modem is switched to 27.010 multiplexing and
+ * requests are spread round-robin over that many AT channels.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <cutils/sockets.h>
+
+#include "atchannel.h"
+#include "at_tok.h"
+#include "cmux.h"
+
+typedef struct {
+    const char *name;
+    const char *command;
+    ATCommandType type;
+    const char *prefix;
+} BenchCommand;
+
+static const BenchCommand s_benchCommands[] = {
+    { "clcc", "AT+CLCC",   MULTILINE,  "+CLCC:" },
+    { "creg", "AT+CREG?",  SINGLELINE, "+CREG:" },
+    { "csq",  "AT+CSQ",    SINGLELINE, "+CSQ:" },
+    { "cpin", "AT+CPIN?",  SINGLELINE, "+CPIN:" },
+    { "cops", "AT+COPS=3,0;+COPS?;+COPS=3,1;+COPS?;+COPS=3,2;+COPS?",
+                           MULTILINE,  "+COPS:" },
+};
+
+#define NUM_BENCH_COMMANDS \
+    (sizeof(s_benchCommands) / sizeof(s_benchCommands[0]))
+
+typedef struct {
+    const BenchCommand *p_cmd;
+    long long start;        /* usec */
+    long long latency;      /* usec */
+    int err;
+} BenchRequest;
+
+static pthread_mutex_t s_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_cond = PTHREAD_COND_INITIALIZER;
+
+static BenchRequest *s_requests;
+static int s_numRequests;
+static int s_nextRequest;
+static int s_completed;
+static int s_errors;
+static unsigned long s_unsolLines;
+static unsigned long s_parsedFields;
+
+static const BenchCommand *s_mix[NUM_BENCH_COMMANDS];
+static int s_mixCount;
+
+static int s_channelIds[CMUX_MAX_CHANNELS];
+static int s_numChannels = 1;
+
+static long long nowUsec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+        "usage: %s [-p <tcp port> | -s <socket path>] [-n <requests>]\n"
+        "          [-c <outstanding>] [-m clcc,creg,csq,cpin,cops]\n"
+        "          [-x <mux channels>]\n",
+        argv0);
+    exit(-1);
+}
+
+static void onUnsolicited(const char *s, const char *sms_pdu)
+{
+    pthread_mutex_lock(&s_mutex);
+    s_unsolLines++;
+    pthread_mutex_unlock(&s_mutex);
+}
+
+static void submitNext();
+
+static void onComplete(int err, ATResponse *p_response, void *param)
+{
+    BenchRequest *p_req = (BenchRequest *) param;
+    ATLine *p_cur;
+    unsigned long fields = 0;
+
+    p_req->latency = nowUsec() - p_req->start;
+    p_req->err = err;
+
+    /* parse like a request handler would */
+    if (p_response != NULL) {
+        for (p_cur = p_response->p_intermediates ; p_cur != NULL
+                ; p_cur = p_cur->p_next
+        ) {
+            ATTokLine tok;
+
+            if (at_tok_parse(p_cur->line, &tok) > 0) {
+                fields += tok.count;
+            }
+        }
+    }
+
+    at_response_free(p_response);
+
+    pthread_mutex_lock(&s_mutex);
+
+    s_parsedFields += fields;
+    if (err != 0) {
+        s_errors++;
+    }
+    s_completed++;
+
+    pthread_cond_signal(&s_cond);
+    pthread_mutex_unlock(&s_mutex);
+
+    submitNext();
+}
+
+/* keeps the configured number of commands outstanding */
+static void submitNext()
+{
+    BenchRequest *p_req;
+    int channel;
+    int prev;
+    int ret;
+
+    pthread_mutex_lock(&s_mutex);
+
+    if (s_nextRequest == s_numRequests) {
+        pthread_mutex_unlock(&s_mutex);
+        return;
+    }
+
+    p_req = &s_requests[s_nextRequest];
+    p_req->p_cmd = s_mix[s_nextRequest % s_mixCount];
+    channel = s_channelIds[s_nextRequest % s_numChannels];
+    s_nextRequest++;
+
+    pthread_mutex_unlock(&s_mutex);
+
+    p_req->start = nowUsec();
+
+    /* this may run on any channel's reader, keep its selection */
+    prev = at_channel_select(channel);
+
+    ret = at_send_command_async(p_req->p_cmd->command, p_req->p_cmd->type,
+                p_req->p_cmd->prefix, NULL, 0, onComplete, p_req);
+
+    at_channel_select(prev);
+
+    if (ret < 0) {
+        onComplete(ret, NULL, p_req);
+    }
+}
+
+/**
+ * returns the CPU time in msec used by all threads named "name",
+ * or -1 if there are none
+ */
+static long threadCpuMsec(const char *name)
+{
+    DIR *dir;
+    struct dirent *p_ent;
+    long ret = -1;
+    long ticks = sysconf(_SC_CLK_TCK);
+
+    dir = opendir("/proc/self/task");
+    if (dir == NULL) {
+        return -1;
+    }
+
+    while ((p_ent = readdir(dir)) != NULL) {
+        char path[300];
+        char buf[512];
+        char *p;
+        FILE *fp;
+        unsigned long utime;
+        unsigned long stime;
+
+        if (p_ent->d_name[0] == '.') {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "/proc/self/task/%s/stat",
+                    p_ent->d_name);
+
+        fp = fopen(path, "r");
+        if (fp == NULL) {
+            continue;
+        }
+
+        if (fgets(buf, sizeof(buf), fp) == NULL) {
+            fclose(fp);
+            continue;
+        }
+        fclose(fp);
+
+        /* pid (comm) state ... utime stime are fields 14 and 15 */
+        p = strchr(buf, '(');
+        if (p == NULL || strncmp(p + 1, name, strlen(name)) != 0
+            || p[1 + strlen(name)] != ')'
+        ) {
+            continue;
+        }
+
+        p = strrchr(buf, ')');
+        if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                    &utime, &stime) == 2
+        ) {
+            ret = (ret < 0 ? 0 : ret) + (utime + stime) * 1000 / ticks;
+        }
+    }
+
+    closedir(dir);
+
+    return ret;
+}
+
+static int compareLatency(const void *a, const void *b)
+{
+    long long la = *(const long long *) a;
+    long long lb = *(const long long *) b;
+
+    return la < lb ? -1 : la > lb;
+}
+
+static void printPercentiles(const char *name, long long *latencies, int count)
+{
+    if (count == 0) {
+        return;
+    }
+
+    qsort(latencies, count, sizeof(long long), compareLatency);
+
+    printf("  %-6s %7d   p50 %8.3f  p90 %8.3f  p99 %8.3f  max %8.3f ms\n",
+            name, count,
+            latencies[count * 50 / 100] / 1000.0,
+            latencies[count * 90 / 100] / 1000.0,
+            latencies[count * 99 / 100] / 1000.0,
+            latencies[count - 1] / 1000.0);
+}
+
+static int parseMix(const char *arg)
+{
+    char *copy = strdup(arg);
+    char *tok;
+    char *save = NULL;
+    size_t i;
+
+    s_mixCount = 0;
+
+    for (tok = strtok_r(copy, ",", &save) ; tok != NULL
+            ; tok = strtok_r(NULL, ",", &save)
+    ) {
+        for (i = 0 ; i < NUM_BENCH_COMMANDS ; i++) {
+            if (!strcmp(tok, s_benchCommands[i].name)) {
+                break;
+            }
+        }
+
+        if (i == NUM_BENCH_COMMANDS || s_mixCount == NUM_BENCH_COMMANDS) {
+            fprintf(stderr, "unknown command '%s'\n", tok);
+            free(copy);
+            return -1;
+        }
+
+        s_mix[s_mixCount++] = &s_benchCommands[i];
+    }
+
+    free(copy);
+
+    return s_mixCount > 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+    int port = -1;
+    const char *socketPath = NULL;
+    int outstanding = 1;
+    long long start;
+    long long elapsed;
+    long long *latencies;
+    long readerStart;
+    long writerStart;
+    long muxStart;
+    long readerCpu;
+    long writerCpu;
+    long muxCpu;
+    int fds[CMUX_MAX_CHANNELS];
+    size_t c;
+    int fd;
+    int opt;
+    int i;
+
+    s_numRequests = 10000;
+
+    for (c = 0 ; c < NUM_BENCH_COMMANDS ; c++) {
+        s_mix[c] = &s_benchCommands[c];
+    }
+    s_mixCount = NUM_BENCH_COMMANDS;
+
+    while ((opt = getopt(argc, argv, "p:s:n:c:m:x:")) != -1) {
+        switch (opt) {
+            case 'p': port = atoi(optarg); break;
+            case 's': socketPath = optarg; break;
+            case 'n': s_numRequests = atoi(optarg); break;
+            case 'c': outstanding = atoi(optarg); break;
+            case 'm':
+                if (parseMix(optarg) < 0) usage(argv[0]);
+                break;
+            case 'x': s_numChannels = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if ((port <= 0) == (socketPath == NULL)
+        || s_numRequests <= 0 || outstanding <= 0
+        || s_numChannels <= 0 || s_numChannels >= CMUX_MAX_CHANNELS
+    ) {
+        usage(argv[0]);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (port > 0) {
+        int one = 1;
+
+        fd = socket_loopback_client(port, SOCK_STREAM);
+
+        /* atchannel writes the command and its terminator separately */
+        if (fd >= 0) {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+    } else {
+        fd = socket_local_client(socketPath,
+                    ANDROID_SOCKET_NAMESPACE_FILESYSTEM, SOCK_STREAM);
+    }
+
+    if (fd < 0) {
+        perror("atbench: connect");
+        return 1;
+    }
+
+    if (s_numChannels > 1) {
+        if (cmux_open(fd, s_numChannels, fds) < 0) {
+            fprintf(stderr, "atbench: modem did not enter mux mode\n");
+            return 1;
+        }
+    } else {
+        fds[0] = fd;
+    }
+
+    if (at_open(fds[0], onUnsolicited) < 0) {
+        fprintf(stderr, "atbench: at_open failed\n");
+        return 1;
+    }
+    s_channelIds[0] = 0;
+
+    for (i = 1 ; i < s_numChannels ; i++) {
+        s_channelIds[i] = at_channel_open(fds[i], onUnsolicited);
+
+        if (s_channelIds[i] < 0) {
+            fprintf(stderr, "atbench: at_channel_open failed\n");
+            return 1;
+        }
+    }
+
+    for (i = 0 ; i < s_numChannels ; i++) {
+        at_channel_select(s_channelIds[i]);
+
+        if (at_handshake() < 0) {
+            fprintf(stderr, "atbench: modem did not answer the handshake\n");
+            return 1;
+        }
+
+        /* waits out the idle time the handshake leaves on the channel */
+        at_send_command("AT", NULL);
+    }
+
+    s_requests = (BenchRequest *) calloc(s_numRequests, sizeof(BenchRequest));
+
+    /* the handshake has gone through both threads, so they are named */
+    readerStart = threadCpuMsec("at_reader");
+    writerStart = threadCpuMsec("at_writer");
+    muxStart = threadCpuMsec("at_mux");
+
+    start = nowUsec();
+
+    for (i = 0 ; i < outstanding ; i++) {
+        submitNext();
+    }
+
+    pthread_mutex_lock(&s_mutex);
+    while (s_completed < s_numRequests) {
+        pthread_cond_wait(&s_cond, &s_mutex);
+    }
+    pthread_mutex_unlock(&s_mutex);
+
+    elapsed = nowUsec() - start;
+
+    readerCpu = threadCpuMsec("at_reader") - readerStart;
+    writerCpu = threadCpuMsec("at_writer") - writerStart;
+    muxCpu = threadCpuMsec("at_mux") - muxStart;
+
+    at_close();
+    cmux_close();
+
+    printf("%d commands, %d outstanding on %d channel(s), %d errors"
+           " in %.1f ms (%.0f commands/s)\n",
+            s_numRequests, outstanding, s_numChannels, s_errors,
+            elapsed / 1000.0,
+            s_numRequests * 1e6 / elapsed);
+    printf("%lu unsolicited lines, %lu fields parsed\n",
+            s_unsolLines, s_parsedFields);
+    printf("latency:\n");
+
+    latencies = (long long *) malloc(s_numRequests * sizeof(long long));
+
+    for (i = 0 ; i < s_numRequests ; i++) {
+        latencies[i] = s_requests[i].latency;
+    }
+    printPercentiles("all", latencies, s_numRequests);
+
+    for (c = 0 ; c < NUM_BENCH_COMMANDS ; c++) {
+        int count = 0;
+
+        for (i = 0 ; i < s_numRequests ; i++) {
+            if (s_requests[i].p_cmd == &s_benchCommands[c]) {
+                latencies[count++] = s_requests[i].latency;
+            }
+        }
+        printPercentiles(s_benchCommands[c].name, latencies, count);
+    }
+
+    printf("cpu: reader %ld ms, writer %ld ms (%.1f us reader per command)\n",
+            readerCpu, writerCpu,
+            readerCpu * 1000.0 / s_numRequests);
+
+    if (s_numChannels > 1) {
+        printf("cpu: mux %ld ms\n", muxCpu);
+    }
+
+    free(latencies);
+    free(s_requests);
+
+    return 0;
+}
@@ -0,0 +1,909 @@
+/* //device/system/atsim/atsim.c
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * atsim: a scriptable AT modem simulator
+ *
+ * Serves one client at a time on a loopback port (for reference-ril -p)
+ * or a local socket (for reference-ril -s). Commands are answered in
+ * order, each after its configured latency, and unsolicited lines can be
+ * injected periodically in bursts.
+ *
+ * Script format, one directive per block:
+ *
+ *   # comment
+ *   cmd <prefix> [latency_ms]      answer commands starting with <prefix>
+ *   <response line>                (longest prefix wins)
+ *   ...
+ *   end
+ *
+ *   unsol <period_ms> <burst>      every period_ms send <burst> copies
+ *   <line>                         of these lines
+ *   ...
+ *   end
+ *
+ * A response whose first line is ">" sends the "> " SMS prompt and waits
+ * for the ^Z terminated PDU before sending the remaining lines.
+ * Commands with no matching block are answered with OK.
+ *
+ * AT+CMUX=0 switches the client to TS 27.010 basic mode multiplexing:
+ * every DLCI then behaves like a modem of its own, answering commands in
+ * order with the same script, and unsolicited lines go out on DLCI 1.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <cutils/sockets.h>
+
+#define MAX_LINE 1024
+#define MAX_COMMANDS 64
+#define MAX_UNSOLS 16
+#define MAX_INPUT 4096
+#define MAX_DLCI 8
+
+/* 27.010 basic option, see libatchannel/cmux.c */
+#define MUX_FLAG    0xF9
+#define MUX_EA      0x01
+#define MUX_CR      0x02
+#define MUX_PF      0x10
+#define MUX_SABM    0x2F
+#define MUX_UA      0x63
+#define MUX_DISC    0x43
+#define MUX_UIH     0xEF
+#define MUX_MSG_CLD 0xC0
+#define MUX_MSG_MSC 0xE0
+#define MUX_N1      31
+
+typedef struct {
+    char *prefix;
+    int latency;            /* msec, -1 means the global default */
+    int prompt;             /* response starts with the SMS prompt */
+    char *response;         /* "\r\n" separated and terminated */
+} SimCommand;
+
+typedef struct {
+    int period;             /* msec */
+    int burst;
+    char *lines;
+    long long next;
+} SimUnsol;
+
+static SimCommand s_commands[MAX_COMMANDS];
+static int s_numCommands;
+static SimUnsol s_unsols[MAX_UNSOLS];
+static int s_numUnsols;
+
+static int s_latency = 0;
+static int s_jitter = 0;
+static int s_verbose = 0;
+
+/* one AT stream: the whole connection, or one DLCI in mux mode */
+typedef struct {
+    const SimCommand *pending;  /* the modem answers one at a time */
+    long long pendingDue;
+    int awaitingPdu;
+    char input[MAX_INPUT + 1];
+    size_t used;
+} SimChannel;
+
+/* channel 0 outside of mux mode, else indexed by DLCI */
+static SimChannel s_channels[MAX_DLCI + 1];
+static int s_muxMode;
+static unsigned char s_muxInput[MAX_INPUT];
+static size_t s_muxUsed;
+
+static unsigned long s_commandCount;
+static unsigned long s_unsolCount;
+
+static const char *s_defaultScript[] = {
+    "cmd AT+CLCC",
+    "+CLCC: 1,0,0,0,0,\"+18005551212\",145",
+    "+CLCC: 2,1,1,0,0,\"+18005550000\",145",
+    "OK",
+    "end",
+    "cmd AT+CREG?",
+    "+CREG: 2,1,\"1A2B\",\"00C3D4E5\"",
+    "OK",
+    "end",
+    "cmd AT+CGREG?",
+    "+CGREG: 2,1,\"1A2B\",\"00C3D4E5\",2",
+    "OK",
+    "end",
+    "cmd AT+CSQ",
+    "+CSQ: 17,99",
+    "OK",
+    "end",
+    "cmd AT+CPIN?",
+    "+CPIN: READY",
+    "OK",
+    "end",
+    "cmd AT+CFUN?",
+    "+CFUN: 1",
+    "OK",
+    "end",
+    "cmd AT+COPS?",
+    "+COPS: 0",
+    "OK",
+    "end",
+    "cmd AT+COPS=3,0;+COPS?",
+    "+COPS: 0,0,\"Android\"",
+    "+COPS: 0,1,\"Android\"",
+    "+COPS: 0,2,\"310260\"",
+    "OK",
+    "end",
+    "cmd AT+CMGS",
+    ">",
+    "+CMGS: 1",
+    "OK",
+    "end",
+    "cmd AT+CGSN",
+    "123456789012345",
+    "OK",
+    "end",
+    "cmd AT+CIMI",
+    "310260000000000",
+    "OK",
+    "end",
+    NULL
+};
+
+static long long nowMsec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+        "usage: %s [-p <tcp port> | -s <socket path>] [-f <script>]\n"
+        "          [-l <latency ms>] [-j <jitter ms>]\n"
+        "          [-u <unsol period ms> -b <burst>] [-v]\n"
+        "  -u/-b add a +CREG/+CSQ burst on top of the script\n",
+        argv0);
+    exit(-1);
+}
+
+static char *appendLine(char *buf, const char *line)
+{
+    size_t len = buf ? strlen(buf) : 0;
+
+    buf = (char *) realloc(buf, len + strlen(line) + 3);
+    strcpy(buf + len, line);
+    strcat(buf + len, "\r\n");
+
+    return buf;
+}
+
+/* parses one script line; returns -1 on error */
+static int scriptLine(const char *raw, int lineno)
+{
+    static SimCommand *p_cmd;
+    static SimUnsol *p_unsol;
+    char line[MAX_LINE];
+    size_t len;
+
+    strncpy(line, raw, sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\0';
+
+    len = strlen(line);
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+        line[--len] = '\0';
+    }
+
+    if (p_cmd == NULL && p_unsol == NULL) {
+        char word[16];
+        char arg[MAX_LINE];
+        int n1 = -1;
+        int n2 = 1;
+
+        if (len == 0 || line[0] == '#') {
+            return 0;
+        }
+
+        if (sscanf(line, "%15s %1023s %d", word, arg, &n1) >= 2
+            && !strcmp(word, "cmd")
+        ) {
+            if (s_numCommands == MAX_COMMANDS) {
+                fprintf(stderr, "line %d: too many cmd blocks\n", lineno);
+                return -1;
+            }
+            p_cmd = &s_commands[s_numCommands++];
+            memset(p_cmd, 0, sizeof(*p_cmd));
+            p_cmd->prefix = strdup(arg);
+            p_cmd->latency = n1;
+            return 0;
+        }
+
+        if (sscanf(line, "%15s %d %d", word, &n1, &n2) >= 2
+            && !strcmp(word, "unsol")
+        ) {
+            if (s_numUnsols == MAX_UNSOLS || n1 <= 0) {
+                fprintf(stderr, "line %d: bad unsol block\n", lineno);
+                return -1;
+            }
+            p_unsol = &s_unsols[s_numUnsols++];
+            memset(p_unsol, 0, sizeof(*p_unsol));
+            p_unsol->period = n1;
+            p_unsol->burst = n2 > 0 ? n2 : 1;
+            return 0;
+        }
+
+        fprintf(stderr, "line %d: expected cmd or unsol\n", lineno);
+        return -1;
+    }
+
+    if (!strcmp(line, "end")) {
+        p_cmd = NULL;
+        p_unsol = NULL;
+    } else if (p_unsol != NULL) {
+        p_unsol->lines = appendLine(p_unsol->lines, line);
+    } else if (p_cmd->response == NULL && !p_cmd->prompt
+               && !strcmp(line, ">")
+    ) {
+        p_cmd->prompt = 1;
+    } else {
+        p_cmd->response = appendLine(p_cmd->response, line);
+    }
+
+    return 0;
+}
+
+static int loadScript(const char *path)
+{
+    FILE *fp;
+    char line[MAX_LINE];
+    int lineno = 0;
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (scriptLine(line, ++lineno) < 0) {
+            fclose(fp);
+            return -1;
+        }
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+static const SimCommand *findCommand(const char *line)
+{
+    const SimCommand *p_best = NULL;
+    size_t bestLen = 0;
+    int i;
+
+    for (i = 0 ; i < s_numCommands ; i++) {
+        size_t len = strlen(s_commands[i].prefix);
+
+        if (len > bestLen && !strncmp(line, s_commands[i].prefix, len)) {
+            p_best = &s_commands[i];
+            bestLen = len;
+        }
+    }
+
+    return p_best;
+}
+
+static int writeAll(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t written = write(fd, buf, len);
+
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        buf += written;
+        len -= written;
+    }
+
+    return 0;
+}
+
+/** reflected CRC-8 of 27.010 annex B */
+static unsigned char muxFcs(const unsigned char *p, size_t len)
+{
+    unsigned char fcs = 0xFF;
+    int i;
+
+    while (len-- > 0) {
+        fcs ^= *p++;
+        for (i = 0 ; i < 8 ; i++) {
+            fcs = (fcs & 1) ? (fcs >> 1) ^ 0xE0 : fcs >> 1;
+        }
+    }
+
+    return fcs;
+}
+
+static int writeFrame(int fd, int dlci, int cr, int control,
+                        const unsigned char *info, size_t len)
+{
+    unsigned char frame[MUX_N1 + 6];
+    size_t n = 0;
+
+    frame[n++] = MUX_FLAG;
+    frame[n++] = MUX_EA | (cr ? MUX_CR : 0) | (dlci << 2);
+    frame[n++] = control;
+    frame[n++] = MUX_EA | (len << 1);
+
+    if (len > 0) {
+        memcpy(frame + n, info, len);
+        n += len;
+    }
+    frame[n++] = 0xFF - muxFcs(frame + 1, 3);
+    frame[n++] = MUX_FLAG;
+
+    return writeAll(fd, (const char *) frame, n);
+}
+
+/* writes to a channel: as is, or in UIH frames in mux mode */
+static int channelWrite(int fd, int dlci, const char *buf, size_t len)
+{
+    if (!s_muxMode) {
+        return writeAll(fd, buf, len);
+    }
+
+    while (len > 0) {
+        size_t chunk = len < MUX_N1 ? len : MUX_N1;
+
+        if (writeFrame(fd, dlci, 0, MUX_UIH,
+                        (const unsigned char *) buf, chunk) < 0) {
+            return -1;
+        }
+
+        buf += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+static int writeControl(int fd, int type, int command,
+                        const unsigned char *value, size_t len)
+{
+    unsigned char msg[MUX_N1];
+
+    msg[0] = type | MUX_EA | (command ? MUX_CR : 0);
+    msg[1] = MUX_EA | (len << 1);
+
+    if (len > 0) {
+        memcpy(msg + 2, value, len);
+    }
+
+    return writeFrame(fd, 0, 0, MUX_UIH, msg, len + 2);
+}
+
+/**
+ * writes "\r\n" + line for each line, the way a modem frames every
+ * response line; the block goes out in one write so that a socket client
+ * sees it the way a tty would deliver it
+ */
+static int sendLines(int fd, int dlci, const char *lines)
+{
+    static char *s_frame;
+    static size_t s_frameSize;
+    const char *p = lines;
+    size_t used = 0;
+    size_t need = 2 * strlen(lines) + 1;
+
+    if (need > s_frameSize) {
+        free(s_frame);
+        s_frame = (char *) malloc(need);
+        s_frameSize = need;
+    }
+
+    while (*p != '\0') {
+        const char *eol = strstr(p, "\r\n");
+        size_t len = eol - p;
+
+        memcpy(s_frame + used, "\r\n", 2);
+        memcpy(s_frame + used + 2, p, len + 2);
+        used += len + 4;
+
+        if (s_verbose) {
+            printf("<<%d %.*s\n", dlci, (int) len, p);
+        }
+
+        p = eol + 2;
+    }
+
+    return channelWrite(fd, dlci, s_frame, used);
+}
+
+static int commandLatency(const SimCommand *p_cmd)
+{
+    int latency = (p_cmd != NULL && p_cmd->latency >= 0)
+                    ? p_cmd->latency : s_latency;
+
+    if (s_jitter > 0) {
+        latency += rand() % (s_jitter + 1);
+    }
+
+    return latency;
+}
+
+/* the response for a command with no cmd block */
+static const SimCommand s_okCommand = { NULL, -1, 0, (char *) "OK\r\n" };
+
+static void resetChannels()
+{
+    memset(s_channels, 0, sizeof(s_channels));
+}
+
+static void onCommand(int fd, int dlci, const char *line)
+{
+    SimChannel *p_chan = &s_channels[dlci];
+    const SimCommand *p_cmd;
+
+    if (s_verbose) {
+        printf(">>%d %s\n", dlci, line);
+    }
+
+    s_commandCount++;
+
+    if (!s_muxMode && !strncmp(line, "AT+CMUX=0", 9)) {
+        /* whatever follows in the input is already framed */
+        sendLines(fd, dlci, "OK\r\n");
+        s_muxMode = 1;
+        s_muxUsed = 0;
+        return;
+    }
+
+    p_cmd = findCommand(line);
+
+    if (p_cmd == NULL) {
+        p_cmd = &s_okCommand;
+    }
+
+    if (p_cmd->prompt) {
+        channelWrite(fd, dlci, "> ", 2);
+        p_chan->awaitingPdu = 1;
+    }
+
+    p_chan->pending = p_cmd;
+    p_chan->pendingDue = nowMsec() + commandLatency(p_cmd);
+}
+
+static void sendPending(int fd, int dlci)
+{
+    SimChannel *p_chan = &s_channels[dlci];
+
+    if (p_chan->pending->response != NULL) {
+        sendLines(fd, dlci, p_chan->pending->response);
+    }
+
+    p_chan->pending = NULL;
+}
+
+static void sendUnsols(int fd, long long now)
+{
+    int i;
+    int j;
+
+    for (i = 0 ; i < s_numUnsols ; i++) {
+        SimUnsol *p_unsol = &s_unsols[i];
+
+        if (p_unsol->lines == NULL || now < p_unsol->next) {
+            continue;
+        }
+
+        for (j = 0 ; j < p_unsol->burst ; j++) {
+            sendLines(fd, s_muxMode ? 1 : 0, p_unsol->lines);
+            s_unsolCount++;
+        }
+
+        p_unsol->next = now + p_unsol->period;
+    }
+}
+
+/**
+ * handles every complete command buffered on a channel; stops at the
+ * first that has to wait for its response
+ */
+static void processInput(int fd, int dlci)
+{
+    SimChannel *p_chan = &s_channels[dlci];
+    char *p = p_chan->input;
+    char *eol;
+
+    while ((p_chan->pending == NULL || p_chan->awaitingPdu)
+           && !(dlci == 0 && s_muxMode)
+           && (eol = strpbrk(p, p_chan->awaitingPdu ? "\032" : "\r")) != NULL
+    ) {
+        *eol = '\0';
+
+        /* tolerate "\r\n" terminated commands */
+        while (*p == '\n') {
+            p++;
+        }
+
+        if (p_chan->awaitingPdu) {
+            p_chan->awaitingPdu = 0;
+            p_chan->pendingDue = nowMsec() + commandLatency(p_chan->pending);
+        } else if (*p != '\0') {
+            onCommand(fd, dlci, p);
+        }
+
+        p = eol + 1;
+    }
+
+    p_chan->used -= p - p_chan->input;
+    memmove(p_chan->input, p, p_chan->used + 1);
+
+    if (dlci == 0 && s_muxMode && p_chan->used > 0) {
+        /* switched to mux mode in the middle of this input */
+        memcpy(s_muxInput, p_chan->input, p_chan->used);
+        s_muxUsed = p_chan->used;
+        p_chan->used = 0;
+        p_chan->input[0] = '\0';
+    }
+}
+
+static void feedChannel(int fd, int dlci, const char *data, size_t len)
+{
+    SimChannel *p_chan = &s_channels[dlci];
+
+    if (p_chan->used + len > MAX_INPUT) {
+        fprintf(stderr, "input overflow on %d, dropping buffer\n", dlci);
+        p_chan->used = 0;
+        len = len > MAX_INPUT ? MAX_INPUT : len;
+    }
+
+    memcpy(p_chan->input + p_chan->used, data, len);
+    p_chan->used += len;
+    p_chan->input[p_chan->used] = '\0';
+
+    processInput(fd, dlci);
+}
+
+/* answers a control channel message; returns 1 on CLD */
+static int onMuxControl(int fd, const unsigned char *info, size_t len)
+{
+    size_t valueLen;
+
+    if (len < 2 || (info[0] & MUX_CR) == 0) {
+        return 0;
+    }
+
+    valueLen = info[1] >> 1;
+    if (valueLen + 2 > len || valueLen + 2 > MUX_N1) {
+        return 0;
+    }
+
+    switch (info[0] & ~(MUX_EA | MUX_CR)) {
+        case MUX_MSG_MSC:
+            writeControl(fd, MUX_MSG_MSC, 0, info + 2, valueLen);
+            return 0;
+        case MUX_MSG_CLD:
+            writeControl(fd, MUX_MSG_CLD, 0, NULL, 0);
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/* handles every complete frame in s_muxInput */
+static void processFrames(int fd)
+{
+    size_t pos = 0;
+
+    for (;;) {
+        size_t len;
+        int dlci;
+        int control;
+
+        while (pos < s_muxUsed && s_muxInput[pos] != MUX_FLAG) {
+            pos++;
+        }
+        while (pos + 1 < s_muxUsed && s_muxInput[pos + 1] == MUX_FLAG) {
+            pos++;
+        }
+
+        /* the client never sends more than N1, so one length byte */
+        if (pos + 4 > s_muxUsed) {
+            break;
+        }
+
+        len = s_muxInput[pos + 3] >> 1;
+
+        if (pos + 4 + len + 1 > s_muxUsed) {
+            break;
+        }
+
+        if (0xFF - muxFcs(s_muxInput + pos + 1, 3)
+                != s_muxInput[pos + 4 + len]) {
+            fprintf(stderr, "bad FCS, resynchronizing\n");
+            pos++;
+            continue;
+        }
+
+        dlci = s_muxInput[pos + 1] >> 2;
+        control = s_muxInput[pos + 2] & ~MUX_PF;
+
+        if (dlci > MAX_DLCI) {
+            /* not supported */
+        } else if (control == MUX_SABM) {
+            memset(&s_channels[dlci], 0, sizeof(SimChannel));
+            writeFrame(fd, dlci, 1, MUX_UA | MUX_PF, NULL, 0);
+        } else if (control == MUX_DISC) {
+            writeFrame(fd, dlci, 1, MUX_UA | MUX_PF, NULL, 0);
+            if (dlci == 0) {
+                s_muxMode = 0;
+            }
+        } else if (control == (MUX_UIH & ~MUX_PF) && dlci == 0) {
+            if (onMuxControl(fd, s_muxInput + pos + 4, len)) {
+                s_muxMode = 0;
+            }
+        } else if (control == (MUX_UIH & ~MUX_PF)) {
+            feedChannel(fd, dlci, (const char *) s_muxInput + pos + 4, len);
+        }
+
+        pos += 4 + len + 1;
+
+        if (!s_muxMode) {
+            /* back to AT commands on the whole stream */
+            resetChannels();
+            feedChannel(fd, 0, (const char *) s_muxInput + pos,
+                        s_muxUsed - pos);
+            s_muxUsed = 0;
+            return;
+        }
+    }
+
+    s_muxUsed -= pos;
+    memmove(s_muxInput, s_muxInput + pos, s_muxUsed);
+}
+
+/* serves one client until it disconnects */
+static void serve(int fd)
+{
+    char input[MAX_INPUT];
+    long long now = nowMsec();
+    int i;
+
+    resetChannels();
+    s_muxMode = 0;
+    s_muxUsed = 0;
+
+    for (i = 0 ; i < s_numUnsols ; i++) {
+        s_unsols[i].next = now + s_unsols[i].period;
+    }
+
+    for (;;) {
+        struct pollfd pfd;
+        long long wakeup = 0;
+        int timeout = -1;
+        ssize_t count;
+        SimChannel *p_chan = &s_channels[0];
+
+        now = nowMsec();
+
+        for (i = 0 ; i <= MAX_DLCI ; i++) {
+            SimChannel *p_cur = &s_channels[i];
+
+            if (p_cur->pending != NULL && !p_cur->awaitingPdu) {
+                if (now >= p_cur->pendingDue) {
+                    sendPending(fd, i);
+                    processInput(fd, i);
+                }
+            }
+
+            /* processInput may have queued the next one */
+            if (p_cur->pending != NULL && !p_cur->awaitingPdu
+                && (wakeup == 0 || p_cur->pendingDue < wakeup)
+            ) {
+                wakeup = p_cur->pendingDue;
+            }
+        }
+
+        sendUnsols(fd, now);
+
+        for (i = 0 ; i < s_numUnsols ; i++) {
+            if (s_unsols[i].lines != NULL
+                && (wakeup == 0 || s_unsols[i].next < wakeup)
+            ) {
+                wakeup = s_unsols[i].next;
+            }
+        }
+
+        if (wakeup != 0) {
+            timeout = wakeup > now ? (int)(wakeup - now) : 0;
+        }
+
+        /* a real modem does not read ahead while it is busy; with a mux
+           every DLCI is buffered separately so reading never stops */
+        pfd.fd = fd;
+        pfd.events = (s_muxMode || p_chan->pending == NULL
+                        || p_chan->awaitingPdu) ? POLLIN : 0;
+        pfd.revents = 0;
+
+        if (poll(&pfd, 1, timeout) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return;
+        }
+
+        if ((pfd.revents & (POLLIN | POLLHUP | POLLERR)) == 0) {
+            continue;
+        }
+
+        if (s_muxMode) {
+            do {
+                count = read(fd, s_muxInput + s_muxUsed,
+                                sizeof(s_muxInput) - s_muxUsed);
+            } while (count < 0 && errno == EINTR);
+
+            if (count <= 0) {
+                return;
+            }
+
+            s_muxUsed += count;
+            processFrames(fd);
+
+            if (s_muxUsed == sizeof(s_muxInput)) {
+                fprintf(stderr, "mux input overflow, dropping buffer\n");
+                s_muxUsed = 0;
+            }
+        } else {
+            do {
+                count = read(fd, input, sizeof(input));
+            } while (count < 0 && errno == EINTR);
+
+            if (count <= 0) {
+                return;
+            }
+
+            feedChannel(fd, 0, input, count);
+
+            if (s_muxMode && s_muxUsed > 0) {
+                processFrames(fd);
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int port = -1;
+    const char *socketPath = NULL;
+    const char *script = NULL;
+    int unsolPeriod = 0;
+    int unsolBurst = 1;
+    int listenFd;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "p:s:f:l:j:u:b:v")) != -1) {
+        switch (opt) {
+            case 'p': port = atoi(optarg); break;
+            case 's': socketPath = optarg; break;
+            case 'f': script = optarg; break;
+            case 'l': s_latency = atoi(optarg); break;
+            case 'j': s_jitter = atoi(optarg); break;
+            case 'u': unsolPeriod = atoi(optarg); break;
+            case 'b': unsolBurst = atoi(optarg); break;
+            case 'v': s_verbose = 1; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if ((port <= 0) == (socketPath == NULL)) {
+        usage(argv[0]);
+    }
+
+    for (i = 0 ; s_defaultScript[i] != NULL ; i++) {
+        scriptLine(s_defaultScript[i], 0);
+    }
+
+    /* script blocks go in front of the defaults so that they win over a
+       default block with the same prefix */
+    if (script != NULL) {
+        int numDefaults = s_numCommands;
+        SimCommand defaults[MAX_COMMANDS];
+
+        memcpy(defaults, s_commands, sizeof(SimCommand) * numDefaults);
+        s_numCommands = 0;
+
+        if (loadScript(script) < 0) {
+            return 1;
+        }
+
+        for (i = 0 ; i < numDefaults && s_numCommands < MAX_COMMANDS ; i++) {
+            s_commands[s_numCommands++] = defaults[i];
+        }
+    }
+
+    if (unsolPeriod > 0) {
+        char directive[64];
+
+        snprintf(directive, sizeof(directive), "unsol %d %d",
+                    unsolPeriod, unsolBurst);
+
+        if (scriptLine(directive, 0) < 0) {
+            return 1;
+        }
+        scriptLine("+CREG: 1,\"1A2B\",\"00C3D4E5\"", 0);
+        scriptLine("+CSQ: 17,99", 0);
+        scriptLine("end", 0);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (port > 0) {
+        listenFd = socket_loopback_server(port, SOCK_STREAM);
+    } else {
+        unlink(socketPath);
+        listenFd = socket_local_server(socketPath,
+                        ANDROID_SOCKET_NAMESPACE_FILESYSTEM, SOCK_STREAM);
+    }
+
+    if (listenFd < 0) {
+        perror("atsim: listen");
+        return 1;
+    }
+
+    printf("atsim: %d cmd blocks, %d unsol blocks, waiting for a client\n",
+            s_numCommands, s_numUnsols);
+
+    for (;;) {
+        int fd = accept(listenFd, NULL, NULL);
+
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            return 1;
+        }
+
+        if (port > 0) {
+            /* answer right away rather than waiting on the client's ack */
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+
+        s_commandCount = 0;
+        s_unsolCount = 0;
+
+        serve(fd);
+        close(fd);
+
+        printf("atsim: client gone after %lu commands, %lu unsol bursts\n",
+                s_commandCount, s_unsolCount);
+    }
+
+    return 0;
+}
@@ -0,0 +1,35 @@
+# Copyright 2006 The Android Open Source Project
+
+# AT command channel shared by reference-ril and ril-reader
+#
+LOCAL_PATH:= $(call my-dir)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+    atchannel.c \
+    cmux.c \
+    at_tok.c \
+    at_prefix.c \
+    misc.c
+
+LOCAL_CFLAGS := -D_GNU_SOURCE
+
+LOCAL_C_INCLUDES := $(KERNEL_HEADERS)
+
+ifeq ($(TARGET_DEVICE),sooner)
+  LOCAL_CFLAGS += -DOMAP_CSMI_POWER_CONTROL
+endif
+
+# AT traffic logging, see AT_LOG_LEVEL in atchannel.h.
+# Override with ATCHANNEL_LOG_LEVEL=<0..3> on the make command line.
+ifeq ($(ATCHANNEL_LOG_LEVEL),)
+  ifeq ($(TARGET_BUILD_VARIANT),eng)
+    ATCHANNEL_LOG_LEVEL := 3
+  else
+    ATCHANNEL_LOG_LEVEL := 0
+  endif
+endif
+LOCAL_CFLAGS += -DAT_LOG_LEVEL=$(ATCHANNEL_LOG_LEVEL)
+
+LOCAL_MODULE:= libatchannel
+include $(BUILD_STATIC_LIBRARY)
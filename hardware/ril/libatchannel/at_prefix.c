@@ -0,0 +1,93 @@
+/* //device/system/libatchannel/at_prefix.c
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#include "at_prefix.h"
+
+/**
+ * Links the entries of table into its trie
+ * An entry listed twice keeps the value of its first occurrence
+ */
+void at_prefix_build(ATPrefixTable *table)
+{
+    ATPrefixNode *nodes = table->nodes;
+    size_t i;
+
+    nodes[0].c = '\0';
+    nodes[0].child = -1;
+    nodes[0].sibling = -1;
+    nodes[0].value = -1;
+    table->numNodes = 1;
+
+    for (i = 0 ; i < table->numEntries ; i++) {
+        const unsigned char *p = (const unsigned char *) table->entries[i].prefix;
+        int parent = 0;
+
+        for ( ; *p != '\0' ; p++) {
+            int node = nodes[parent].child;
+
+            while (node >= 0 && nodes[node].c != *p) {
+                node = nodes[node].sibling;
+            }
+
+            if (node < 0) {
+                /* the pool is sized from the list, so this cannot run out */
+                node = table->numNodes++;
+                nodes[node].c = *p;
+                nodes[node].child = -1;
+                nodes[node].value = -1;
+                nodes[node].sibling = nodes[parent].child;
+                nodes[parent].child = node;
+            }
+
+            parent = node;
+        }
+
+        if (nodes[parent].value < 0) {
+            nodes[parent].value = table->entries[i].value;
+        }
+    }
+}
+
+/**
+ * returns the value of the longest prefix of line in table,
+ * or -1 if there is none
+ */
+int at_prefix_match(const ATPrefixTable *table, const char *line)
+{
+    const ATPrefixNode *nodes = table->nodes;
+    const unsigned char *p = (const unsigned char *) line;
+    int node = nodes[0].child;
+    int value = -1;
+
+    for ( ; *p != '\0' && node >= 0 ; p++) {
+        while (node >= 0 && nodes[node].c != *p) {
+            node = nodes[node].sibling;
+        }
+
+        if (node < 0) {
+            break;
+        }
+
+        if (nodes[node].value >= 0) {
+            value = nodes[node].value;
+        }
+
+        node = nodes[node].child;
+    }
+
+    return value;
+}
@@ -0,0 +1,88 @@
+/* //device/system/libatchannel/at_prefix.h
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef AT_PREFIX_H
+#define AT_PREFIX_H 1
+
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * Prefix classifier for modem lines
+ *
+ * A table is declared from a single X-macro list of (prefix, value)
+ * pairs, value >= 0:
+ *
+ *   #define FINAL_RESPONSES(X) \
+ *       X("OK",          LINE_SUCCESS) \
+ *       X("+CME ERROR:", LINE_ERROR)
+ *
+ *   AT_PREFIX_TABLE(s_finalResponses, FINAL_RESPONSES)
+ *
+ *   cls = AT_PREFIX_MATCH(s_finalResponses, line);
+ *
+ * AT_PREFIX_MATCH returns the value of the longest listed prefix of line,
+ * or -1 if none matches. The entries are stored as a trie whose node
+ * pool is sized at compile time from the list; it is linked once on first
+ * use, after which a lookup visits each character of the line at most
+ * once instead of comparing against every prefix.
+ */
+
+typedef struct {
+    const char *prefix;
+    int value;
+} ATPrefixEntry;
+
+typedef struct {
+    unsigned char c;
+    short child;        /* first child node, -1 if none */
+    short sibling;      /* next node with the same parent, -1 if none */
+    short value;        /* -1 unless a listed prefix ends here */
+} ATPrefixNode;
+
+typedef struct {
+    const ATPrefixEntry *entries;
+    size_t numEntries;
+    ATPrefixNode *nodes;        /* nodes[0] is the root */
+    size_t maxNodes;
+    size_t numNodes;
+    pthread_once_t once;
+} ATPrefixTable;
+
+void at_prefix_build(ATPrefixTable *table);
+int at_prefix_match(const ATPrefixTable *table, const char *line);
+
+#define AT_PREFIX_ENTRY(prefix, value) { prefix, value },
+#define AT_PREFIX_LENGTH(prefix, value) + sizeof(prefix)
+
+#define AT_PREFIX_TABLE(name, LIST)                                     \
+    static const ATPrefixEntry name##_entries[] = { LIST(AT_PREFIX_ENTRY) }; \
+    static ATPrefixNode name##_nodes[1 LIST(AT_PREFIX_LENGTH)];         \
+    static ATPrefixTable name = {                                       \
+        name##_entries,                                                 \
+        sizeof(name##_entries) / sizeof(name##_entries[0]),             \
+        name##_nodes,                                                   \
+        sizeof(name##_nodes) / sizeof(name##_nodes[0]),                 \
+        0,                                                              \
+        PTHREAD_ONCE_INIT                                               \
+    };                                                                  \
+    static void name##_build(void) { at_prefix_build(&name); }
+
+#define AT_PREFIX_MATCH(name, line) \
+    (pthread_once(&(name).once, name##_build), at_prefix_match(&(name), (line)))
+
+#endif /*AT_PREFIX_H */
@@ -0,0 +1,409 @@
+/* //device/system/libatchannel/at_tok.c
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#include "at_tok.h"
+#include <string.h>
+#include <ctype.h>
+#include <stdlib.h>
+
+/**
+ * Starts tokenizing an AT response string
+ * returns -1 if this is not a valid response string, 0 on success.
+ * updates *p_cur with current position
+ */
+int at_tok_start(char **p_cur)
+{
+    if (*p_cur == NULL) {
+        return -1;
+    }
+
+    // skip prefix
+    // consume "^[^:]:"
+
+    *p_cur = strchr(*p_cur, ':');
+
+    if (*p_cur == NULL) {
+        return -1;
+    }
+
+    (*p_cur)++;
+
+    return 0;
+}
+
+static void skipWhiteSpace(char **p_cur)
+{
+    if (*p_cur == NULL) return;
+
+    while (**p_cur != '\0' && isspace(**p_cur)) {
+        (*p_cur)++;
+    }
+}
+
+static void skipNextComma(char **p_cur)
+{
+    if (*p_cur == NULL) return;
+
+    while (**p_cur != '\0' && **p_cur != ',') {
+        (*p_cur)++;
+    }
+
+    if (**p_cur == ',') {
+        (*p_cur)++;
+    }
+}
+
+static char * nextTok(char **p_cur)
+{
+    char *ret = NULL;
+
+    skipWhiteSpace(p_cur);
+
+    if (*p_cur == NULL) {
+        ret = NULL;
+    } else if (**p_cur == '"') {
+        (*p_cur)++;
+        ret = strsep(p_cur, "\"");
+        skipNextComma(p_cur);
+    } else {
+        ret = strsep(p_cur, ",");
+    }
+
+    return ret;
+}
+
+
+/**
+ * Parses the next integer in the AT response line and places it in *p_out
+ * returns 0 on success and -1 on fail
+ * updates *p_cur
+ * "base" is the same as the base param in strtol
+ */
+
+static int at_tok_nextint_base(char **p_cur, int *p_out, int base, int  uns)
+{
+    char *ret;
+
+    if (*p_cur == NULL) {
+        return -1;
+    }
+
+    ret = nextTok(p_cur);
+
+    if (ret == NULL) {
+        return -1;
+    } else {
+        long l;
+        char *end;
+
+        if (uns)
+            l = strtoul(ret, &end, base);
+        else
+            l = strtol(ret, &end, base);
+
+        *p_out = (int)l;
+
+        if (end == ret) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Parses the next base 10 integer in the AT response line
+ * and places it in *p_out
+ * returns 0 on success and -1 on fail
+ * updates *p_cur
+ */
+int at_tok_nextint(char **p_cur, int *p_out)
+{
+    return at_tok_nextint_base(p_cur, p_out, 10, 0);
+}
+
+/**
+ * Parses the next base 16 integer in the AT response line
+ * and places it in *p_out
+ * returns 0 on success and -1 on fail
+ * updates *p_cur
+ */
+int at_tok_nexthexint(char **p_cur, int *p_out)
+{
+    return at_tok_nextint_base(p_cur, p_out, 16, 1);
+}
+
+int at_tok_nextbool(char **p_cur, char *p_out)
+{
+    int ret;
+    int result;
+
+    ret = at_tok_nextint(p_cur, &result);
+
+    if (ret < 0) {
+        return -1;
+    }
+
+    // booleans should be 0 or 1
+    if (!(result == 0 || result == 1)) {
+        return -1;
+    }
+
+    if (p_out != NULL) {
+        *p_out = (char)result;
+    }
+
+    return ret;
+}
+
+int at_tok_nextstr(char **p_cur, char **p_out)
+{
+    if (*p_cur == NULL) {
+        return -1;
+    }
+
+    *p_out = nextTok(p_cur);
+
+    return 0;
+}
+
+/** returns 1 on "has more tokens" and 0 if no */
+int at_tok_hasmore(char **p_cur)
+{
+    return ! (*p_cur == NULL || **p_cur == '\0');
+}
+
+
+/**
+ * Decodes the leading integer of a field view in base 10 and base 16,
+ * with the same leniency as strtol: leading white space and a sign are
+ * allowed and anything after the digits is ignored.
+ */
+static void parseFieldInts(ATTokField *p_field)
+{
+    const char *p = p_field->str;
+    const char *end = p + p_field->len;
+    int negative = 0;
+    unsigned int dec = 0;
+    unsigned int hex = 0;
+    int decDigits = 0;
+    int hexDigits = 0;
+    int decDone = 0;
+
+    while (p < end && isspace((unsigned char)*p)) {
+        p++;
+    }
+
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = (*p == '-');
+        p++;
+    }
+
+    if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')
+        && isxdigit((unsigned char)p[2])
+    ) {
+        /* strtoul(..., 16) accepts a 0x prefix; base 10 reads just "0" */
+        decDigits = 1;
+        decDone = 1;
+        p += 2;
+    }
+
+    for ( ; p < end ; p++) {
+        int c = (unsigned char)*p;
+
+        if (!decDone && c >= '0' && c <= '9') {
+            dec = dec * 10 + (c - '0');
+            decDigits++;
+        } else {
+            decDone = 1;
+        }
+
+        if (c >= '0' && c <= '9') {
+            hex = (hex << 4) | (c - '0');
+        } else if (c >= 'a' && c <= 'f') {
+            hex = (hex << 4) | (c - 'a' + 10);
+        } else if (c >= 'A' && c <= 'F') {
+            hex = (hex << 4) | (c - 'A' + 10);
+        } else {
+            break;
+        }
+        hexDigits++;
+    }
+
+    p_field->isInt = decDigits > 0;
+    p_field->intValue = negative ? -(int)dec : (int)dec;
+    p_field->isHex = hexDigits > 0;
+    p_field->hexValue = negative ? -(int)hex : (int)hex;
+}
+
+/**
+ * Splits the AT response line "line" into *p_out
+ * returns the number of fields, or -1 if this is not a valid response
+ * string or has more than AT_TOK_MAX_FIELDS fields
+ */
+int at_tok_parse(const char *line, ATTokLine *p_out)
+{
+    const char *p;
+
+    p_out->count = 0;
+
+    if (line == NULL) {
+        return -1;
+    }
+
+    // skip prefix
+    // consume "^[^:]:"
+
+    p = strchr(line, ':');
+
+    if (p == NULL) {
+        return -1;
+    }
+
+    p++;
+
+    for (;;) {
+        ATTokField *p_field;
+
+        if (p_out->count == AT_TOK_MAX_FIELDS) {
+            return -1;
+        }
+
+        p_field = &p_out->fields[p_out->count++];
+
+        while (*p != '\0' && isspace((unsigned char)*p)) {
+            p++;
+        }
+
+        if (*p == '"') {
+            const char *close = strchr(++p, '"');
+
+            if (close == NULL) {
+                close = p + strlen(p);
+            }
+
+            p_field->str = p;
+            p_field->len = close - p;
+            p_field->quoted = 1;
+
+            p = (*close != '\0') ? close + 1 : close;
+
+            while (*p != '\0' && *p != ',') {
+                p++;
+            }
+        } else {
+            p_field->str = p;
+
+            while (*p != '\0' && *p != ',') {
+                p++;
+            }
+
+            p_field->len = p - p_field->str;
+            p_field->quoted = 0;
+        }
+
+        parseFieldInts(p_field);
+
+        if (*p != ',') {
+            break;
+        }
+
+        p++;
+    }
+
+    return p_out->count;
+}
+
+/**
+ * Fetches field "index" of a parsed line as a base 10 integer
+ * returns 0 on success and -1 on fail
+ */
+int at_tok_getint(const ATTokLine *p_line, int index, int *p_out)
+{
+    if (index < 0 || index >= p_line->count
+        || !p_line->fields[index].isInt
+    ) {
+        return -1;
+    }
+
+    *p_out = p_line->fields[index].intValue;
+
+    return 0;
+}
+
+/**
+ * Fetches field "index" of a parsed line as a base 16 integer
+ * returns 0 on success and -1 on fail
+ */
+int at_tok_gethexint(const ATTokLine *p_line, int index, int *p_out)
+{
+    if (index < 0 || index >= p_line->count
+        || !p_line->fields[index].isHex
+    ) {
+        return -1;
+    }
+
+    *p_out = p_line->fields[index].hexValue;
+
+    return 0;
+}
+
+int at_tok_getbool(const ATTokLine *p_line, int index, char *p_out)
+{
+    int result;
+
+    if (at_tok_getint(p_line, index, &result) < 0) {
+        return -1;
+    }
+
+    // booleans should be 0 or 1
+    if (!(result == 0 || result == 1)) {
+        return -1;
+    }
+
+    if (p_out != NULL) {
+        *p_out = (char)result;
+    }
+
+    return 0;
+}
+
+/**
+ * Copies field "index" of a parsed line, '\0' terminated, into p_out
+ * returns 0 on success and -1 if there is no such field or it does not
+ * fit in size bytes
+ */
+int at_tok_getstr(const ATTokLine *p_line, int index,
+                  char *p_out, size_t size)
+{
+    const ATTokField *p_field;
+
+    if (index < 0 || index >= p_line->count) {
+        return -1;
+    }
+
+    p_field = &p_line->fields[index];
+
+    if ((size_t)p_field->len >= size) {
+        return -1;
+    }
+
+    memcpy(p_out, p_field->str, p_field->len);
+    p_out[p_field->len] = '\0';
+
+    return 0;
+}
@@ -0,0 +1,68 @@
+/* //device/system/libatchannel/at_tok.h
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef AT_TOK_H
+#define AT_TOK_H 1
+
+#include <stddef.h>
+
+int at_tok_start(char **p_cur);
+int at_tok_nextint(char **p_cur, int *p_out);
+int at_tok_nexthexint(char **p_cur, int *p_out);
+
+int at_tok_nextbool(char **p_cur, char *p_out);
+int at_tok_nextstr(char **p_cur, char **out);
+
+int at_tok_hasmore(char **p_cur);
+
+/*
+ * Non-destructive tokenizer
+ *
+ * at_tok_parse() splits everything after the "prefix:" of a response line
+ * into comma separated fields in a single pass, without modifying or
+ * copying the line. Each field is a view into the line with quotes
+ * stripped, and its leading decimal and hex integer values (as
+ * at_tok_nextint/at_tok_nexthexint would have read them) are decoded on
+ * the way. The views are valid as long as the line is.
+ */
+
+#define AT_TOK_MAX_FIELDS 16
+
+typedef struct {
+    const char *str;        /* not '\0' terminated */
+    int len;
+    char quoted;
+    char isInt;             /* intValue is valid */
+    char isHex;             /* hexValue is valid */
+    int intValue;
+    int hexValue;
+} ATTokField;
+
+typedef struct {
+    int count;
+    ATTokField fields[AT_TOK_MAX_FIELDS];
+} ATTokLine;
+
+int at_tok_parse(const char *line, ATTokLine *p_out);
+
+int at_tok_getint(const ATTokLine *p_line, int index, int *p_out);
+int at_tok_gethexint(const ATTokLine *p_line, int index, int *p_out);
+int at_tok_getbool(const ATTokLine *p_line, int index, char *p_out);
+int at_tok_getstr(const ATTokLine *p_line, int index,
+                  char *p_out, size_t size);
+
+#endif /*AT_TOK_H */
@@ -0,0 +1,1698 @@
+/* //device/system/libatchannel/atchannel.c
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#include "atchannel.h"
+#include "at_tok.h"
+#include "at_prefix.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_NDEBUG 0
+#define LOG_TAG "AT"
+#include <utils/Log.h>
+
+#if AT_LOG_LEVEL >= AT_LOG_INFO
+#define AT_LOGI(...) LOGI(__VA_ARGS__)
+#else
+#define AT_LOGI(...) do{}while(0)
+#endif
+
+#if AT_LOG_LEVEL >= AT_LOG_TRAFFIC
+#define AT_LOGD(...) LOGD(__VA_ARGS__)
+#else
+#define AT_LOGD(...) do{}while(0)
+#endif
+
+#ifdef HAVE_ANDROID_OS
+/* for IOCTL's */
+#include <linux/omap_csmi.h>
+#endif /*HAVE_ANDROID_OS*/
+
+#include "misc.h"
+
+#ifdef HAVE_ANDROID_OS
+#define USE_NP 1
+#endif /* HAVE_ANDROID_OS */
+
+
+#define NUM_ELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+#define MAX_AT_RESPONSE (8 * 1024)
+#define HANDSHAKE_RETRY_COUNT 8
+#define HANDSHAKE_TIMEOUT_MSEC 250
+
+/*
+ * Channels
+ *
+ * Each channel is one AT stream (a tty, a socket or a CMUX DLCI) with its
+ * own input buffer, command queue, reader thread and writer thread.
+ * Channel 0 is the one at_open() starts; at_channel_open() adds more.
+ * Callers name channels by id rather than by pointer so that an id kept
+ * across a close fails with AT_ERROR_CHANNEL_CLOSED instead of touching
+ * freed memory.
+ *
+ * Commands may be submitted from any thread and are sent strictly in
+ * order by the channel's writer thread, one at a time: the modem only
+ * ever sees a single outstanding command per channel, but the next one is
+ * already queued and goes out the moment the reader matches the final
+ * response of inflight.
+ *
+ * Completions are delivered outside s_commandmutex: on the reader thread
+ * for anything the modem answered, on the writer thread for timeouts,
+ * write errors and channel close, and on the caller's thread for
+ * at_cancel_command() of a command that was still queued.
+ *
+ * Writes to the stream are made outside s_commandmutex too, under the
+ * channel's own writeMutex, so a stream that stops draining (a stalled
+ * CMUX DLCI, say) only holds up its own channel.
+ */
+
+typedef struct ATCommand {
+    struct ATCommand *p_next;
+    int id;
+    char *command;
+    ATCommandType type;
+    char *responsePrefix;
+    char *smsPDU;               /* NULL once the PDU has been written */
+    long long deadline;         /* monotonic msec, 0 means no timeout */
+    long long holdMsec;         /* keep the channel idle after success */
+    int notifyTimeout;          /* call s_onTimeout if this times out */
+    int cancelled;
+    ATResponse *p_response;     /* allocated when the command is sent */
+    ATCommandCallback callback;
+    void *param;
+} ATCommand;
+
+typedef struct ATChannel {
+    int id;
+    int refCount;               /* the table, the reader and the writer */
+    int fd;
+    ATUnsolHandler unsolHandler;
+    int closed;                 /* set by close or reader EOF */
+
+    pthread_t tid_reader;
+    pthread_t tid_writer;
+    pthread_cond_t cond;
+
+    /* held across each write to fd, and by closeChannel around close */
+    pthread_mutex_t writeMutex;
+    int fdClosed;               /* protected by writeMutex */
+
+    /* protected by s_commandmutex */
+    ATCommand *queueHead;
+    ATCommand *queueTail;
+    ATCommand *inflight;
+    long long holdUntil;
+    long long queueDeadline;    /* earliest queued deadline, or 0 */
+
+    /*
+     * for input buffering, only touched by the reader thread
+     *
+     * reads append at readEnd and lines are handed out in place starting
+     * at lineStart. The unconsumed tail is only moved back to the front
+     * once the buffer end is reached, so a long multiline response costs
+     * at most one copy per buffer fill rather than one per read.
+     */
+    size_t lineStart;           /* first byte of the next line */
+    size_t scanPos;             /* bytes before this hold no EOL */
+    size_t readEnd;             /* end of buffered input, always '\0' */
+
+    int ackPowerIoctl;          /* true if TTY has android byte-count
+                                   handshake for low power*/
+    int readCount;
+
+    char ATBuffer[MAX_AT_RESPONSE+1];
+} ATChannel;
+
+static pthread_mutex_t s_commandmutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* protected by s_commandmutex */
+static ATChannel *s_channels[AT_MAX_CHANNELS];
+static int s_nextCommandId = 1;
+
+/* the channel at_send_command* uses on this thread, as id + 1 */
+static pthread_key_t s_channelKey;
+static pthread_once_t s_channelKeyOnce = PTHREAD_ONCE_INIT;
+
+static void (*s_onTimeout)(void) = NULL;
+static void (*s_onReaderClosed)(void) = NULL;
+
+static int writeCtrlZ (ATChannel *p_channel, const char *s);
+static int writeline (ATChannel *p_channel, const char *s);
+static ATResponse * at_response_new();
+
+#if AT_LOG_LEVEL >= AT_LOG_DUMP
+void  AT_DUMP(const char*  prefix, const char*  buff, int  len)
+{
+    if (len < 0)
+        len = strlen(buff);
+    LOGD("%.*s", len, buff);
+}
+#endif
+
+#ifndef USE_NP
+static void setTimespecRelative(struct timespec *p_ts, long long msec)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, (struct timezone *) NULL);
+
+    /* what's really funny about this is that I know
+       pthread_cond_timedwait just turns around and makes this
+       a relative time again */
+    p_ts->tv_sec = tv.tv_sec + (msec / 1000);
+    p_ts->tv_nsec = (tv.tv_usec + (msec % 1000) * 1000L ) * 1000L;
+}
+#endif /*USE_NP*/
+
+/** returns CLOCK_MONOTONIC in msec */
+static long long nowMsec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Waits on p_channel->cond for at most msec (0 means forever)
+ * assumes s_commandmutex is held
+ */
+static void waitCommandCond(ATChannel *p_channel, long long msec)
+{
+#ifndef USE_NP
+    struct timespec ts;
+#endif /*USE_NP*/
+
+    if (msec <= 0) {
+        pthread_cond_wait(&p_channel->cond, &s_commandmutex);
+        return;
+    }
+
+#ifdef USE_NP
+    pthread_cond_timeout_np(&p_channel->cond, &s_commandmutex, msec);
+#else
+    setTimespecRelative(&ts, msec);
+    pthread_cond_timedwait(&p_channel->cond, &s_commandmutex, &ts);
+#endif /*USE_NP*/
+}
+
+static void createChannelKey()
+{
+    pthread_key_create(&s_channelKey, NULL);
+}
+
+/** returns the channel id at_send_command* uses on this thread */
+static int selectedChannel()
+{
+    pthread_once(&s_channelKeyOnce, createChannelKey);
+
+    return (int)(long) pthread_getspecific(s_channelKey) - 1;
+}
+
+/**
+ * returns the channel at_send_command* uses on this thread, or NULL if
+ * it is closed
+ * assumes s_commandmutex is held
+ */
+static ATChannel *currentChannel()
+{
+    int id = selectedChannel();
+
+    if (id < 0) {
+        id = 0;
+    }
+
+    return s_channels[id];
+}
+
+/**
+ * drops one reference, freeing p_channel with the last one
+ * assumes s_commandmutex is held
+ */
+static void releaseChannel(ATChannel *p_channel)
+{
+    if (--p_channel->refCount == 0) {
+        pthread_cond_destroy(&p_channel->cond);
+        pthread_mutex_destroy(&p_channel->writeMutex);
+        free(p_channel);
+    }
+}
+
+
+
+
+/*
+ * Response storage
+ *
+ * The ATResponse handed to callers is the head of an ATResponseArena.
+ * Intermediate lines and the final response are bump-allocated from its
+ * chunks, the first of which is part of the same allocation, and
+ * at_response_free() releases everything at once.
+ */
+
+#define AT_ARENA_INLINE 256
+
+typedef struct ATArenaChunk {
+    struct ATArenaChunk *p_next;
+    char *data;
+    size_t size;
+    size_t used;
+} ATArenaChunk;
+
+typedef struct {
+    ATResponse response;        /* must be first */
+    ATLine *p_lastLine;
+    ATArenaChunk *p_chunks;     /* most recent chunk first */
+    ATArenaChunk first;
+    char firstData[AT_ARENA_INLINE];
+} ATResponseArena;
+
+static void *arenaAlloc(ATResponseArena *p_arena, size_t len)
+{
+    ATArenaChunk *p_chunk = p_arena->p_chunks;
+    void *ret;
+
+    len = (len + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    if (p_chunk->size - p_chunk->used < len) {
+        /* grow geometrically so huge responses take few mallocs */
+        size_t size = p_chunk->size * 2;
+
+        if (size < len) {
+            size = len;
+        }
+
+        p_chunk = (ATArenaChunk *) malloc(sizeof(ATArenaChunk) + size);
+        p_chunk->data = (char *)(p_chunk + 1);
+        p_chunk->size = size;
+        p_chunk->used = 0;
+        p_chunk->p_next = p_arena->p_chunks;
+        p_arena->p_chunks = p_chunk;
+    }
+
+    ret = p_chunk->data + p_chunk->used;
+    p_chunk->used += len;
+
+    return ret;
+}
+
+static char *arenaStrdup(ATResponseArena *p_arena, const char *s)
+{
+    size_t len = strlen(s) + 1;
+
+    return (char *) memcpy(arenaAlloc(p_arena, len), s, len);
+}
+
+/** add an intermediate response to the in-flight command */
+static void addIntermediate(ATChannel *p_channel, const char *line)
+{
+    ATResponseArena *p_arena =
+            (ATResponseArena *) p_channel->inflight->p_response;
+    size_t len = strlen(line) + 1;
+    ATLine *p_new;
+
+    p_new = (ATLine *) arenaAlloc(p_arena, sizeof(ATLine) + len);
+
+    p_new->line = (char *)(p_new + 1);
+    memcpy(p_new->line, line, len);
+    p_new->p_next = NULL;
+
+    /* lines are appended in the order received */
+    if (p_arena->p_lastLine == NULL) {
+        p_arena->response.p_intermediates = p_new;
+    } else {
+        p_arena->p_lastLine->p_next = p_new;
+    }
+    p_arena->p_lastLine = p_new;
+}
+
+
+/**
+ * Line classes recognized by prefix
+ * See 27.007 annex B for the final responses
+ * WARNING: NO CARRIER and others are sometimes unsolicited
+ */
+enum {
+    LINE_FINAL_SUCCESS,
+    LINE_FINAL_ERROR,
+    LINE_SMS_UNSOLICITED    /* first line of a two-line SMS unsolicited */
+};
+
+#define AT_LINE_PREFIXES(X) \
+    X("OK",             LINE_FINAL_SUCCESS) \
+    X("CONNECT",        LINE_FINAL_SUCCESS) /* some stacks start up data on another channel */ \
+    X("ERROR",          LINE_FINAL_ERROR) \
+    X("+CMS ERROR:",    LINE_FINAL_ERROR) \
+    X("+CME ERROR:",    LINE_FINAL_ERROR) \
+    X("NO CARRIER",     LINE_FINAL_ERROR) /* sometimes! */ \
+    X("NO ANSWER",      LINE_FINAL_ERROR) \
+    X("NO DIALTONE",    LINE_FINAL_ERROR) \
+    X("+CMT:",          LINE_SMS_UNSOLICITED) \
+    X("+CDS:",          LINE_SMS_UNSOLICITED) \
+    X("+CBM:",          LINE_SMS_UNSOLICITED)
+
+AT_PREFIX_TABLE(s_linePrefixes, AT_LINE_PREFIXES)
+
+/** returns the LINE_* class of line, or -1 */
+static int classifyLine(const char *line)
+{
+    return AT_PREFIX_MATCH(s_linePrefixes, line);
+}
+
+/**
+ * returns 1 if line is the first line in (what will be) a two-line
+ * SMS unsolicited response
+ */
+static int isSMSUnsolicited(const char *line)
+{
+    return classifyLine(line) == LINE_SMS_UNSOLICITED;
+}
+
+
+static void freeCommand(ATCommand *p_cmd)
+{
+    at_response_free(p_cmd->p_response);
+    free(p_cmd->command);
+    free(p_cmd->responsePrefix);
+    free(p_cmd->smsPDU);
+    free(p_cmd);
+}
+
+/**
+ * Hands the result of p_cmd to its callback, which takes ownership of
+ * the response, and frees p_cmd
+ *
+ * must be called without s_commandmutex held
+ */
+static void completeCommand(ATCommand *p_cmd, int err)
+{
+    ATResponse *p_response = p_cmd->p_response;
+
+    p_cmd->p_response = NULL;
+
+    if (err == 0 && p_cmd->cancelled) {
+        err = AT_ERROR_CANCELLED;
+    }
+
+    if (err == 0
+        && (p_cmd->type == SINGLELINE || p_cmd->type == NUMERIC)
+        && p_response->success > 0
+        && p_response->p_intermediates == NULL
+    ) {
+        /* successful command must have an intermediate response */
+        err = AT_ERROR_INVALID_RESPONSE;
+    }
+
+    if (err < 0) {
+        at_response_free(p_response);
+        p_response = NULL;
+    }
+
+    if (p_cmd->callback != NULL) {
+        p_cmd->callback(err, p_response, p_cmd->param);
+    } else {
+        at_response_free(p_response);
+    }
+
+    freeCommand(p_cmd);
+}
+
+/** completes every command on the p_next chain starting at p_cmd */
+static void completeCommandList(ATCommand *p_cmd, int err)
+{
+    while (p_cmd != NULL) {
+        ATCommand *p_next = p_cmd->p_next;
+
+        completeCommand(p_cmd, err);
+        p_cmd = p_next;
+    }
+}
+
+/**
+ * Retires the in-flight command and wakes the writer so the next queued
+ * command goes out immediately
+ *
+ * assumes s_commandmutex is held; the caller completes the result
+ */
+static ATCommand *handleFinalResponse(ATChannel *p_channel, const char *line)
+{
+    ATCommand *p_cmd = p_channel->inflight;
+
+    p_cmd->p_response->finalResponse =
+            arenaStrdup((ATResponseArena *) p_cmd->p_response, line);
+
+    if (p_cmd->holdMsec > 0 && p_cmd->p_response->success) {
+        p_channel->holdUntil = nowMsec() + p_cmd->holdMsec;
+    }
+
+    p_channel->inflight = NULL;
+
+    pthread_cond_broadcast(&p_channel->cond);
+
+    return p_cmd;
+}
+
+static void handleUnsolicited(ATChannel *p_channel, const char *line)
+{
+    if (p_channel->unsolHandler != NULL) {
+        p_channel->unsolHandler(line, NULL);
+    }
+}
+
+static void processLine(ATChannel *p_channel, const char *line)
+{
+    ATCommand *p_done = NULL;
+    ATCommand *p_inflight;
+    char *smsPDU = NULL;
+    int lineClass = classifyLine(line);
+
+    pthread_mutex_lock(&s_commandmutex);
+
+    p_inflight = p_channel->inflight;
+
+    if (p_inflight == NULL) {
+        /* no command pending */
+        handleUnsolicited(p_channel, line);
+    } else if (lineClass == LINE_FINAL_SUCCESS) {
+        p_inflight->p_response->success = 1;
+        p_done = handleFinalResponse(p_channel, line);
+    } else if (lineClass == LINE_FINAL_ERROR) {
+        p_inflight->p_response->success = 0;
+        p_done = handleFinalResponse(p_channel, line);
+    } else if (p_inflight->smsPDU != NULL && 0 == strcmp(line, "> ")) {
+        // See eg. TS 27.005 4.3
+        // Commands like AT+CMGS have a "> " prompt
+        // written below, once s_commandmutex is released
+        smsPDU = p_inflight->smsPDU;
+        p_inflight->smsPDU = NULL;
+    } else switch (p_inflight->type) {
+        case NO_RESULT:
+            handleUnsolicited(p_channel, line);
+            break;
+        case NUMERIC:
+            if (p_inflight->p_response->p_intermediates == NULL
+                && isdigit(line[0])
+            ) {
+                addIntermediate(p_channel, line);
+            } else {
+                /* either we already have an intermediate response or
+                   the line doesn't begin with a digit */
+                handleUnsolicited(p_channel, line);
+            }
+            break;
+        case SINGLELINE:
+            if (p_inflight->p_response->p_intermediates == NULL
+                && strStartsWith (line, p_inflight->responsePrefix)
+            ) {
+                addIntermediate(p_channel, line);
+            } else {
+                /* we already have an intermediate response */
+                handleUnsolicited(p_channel, line);
+            }
+            break;
+        case MULTILINE:
+            if (strStartsWith (line, p_inflight->responsePrefix)) {
+                addIntermediate(p_channel, line);
+            } else {
+                handleUnsolicited(p_channel, line);
+            }
+        break;
+
+        default: /* this should never be reached */
+            LOGE("Unsupported AT command type %d\n", p_inflight->type);
+            handleUnsolicited(p_channel, line);
+        break;
+    }
+
+    pthread_mutex_unlock(&s_commandmutex);
+
+    if (smsPDU != NULL) {
+        writeCtrlZ(p_channel, smsPDU);
+        free(smsPDU);
+    }
+
+    if (p_done != NULL) {
+        completeCommand(p_done, 0);
+    }
+}
+
+
+/**
+ * Returns a pointer to the end of the line starting at lineStart,
+ * searching only input that has not been searched before
+ * special-cases the "> " SMS prompt
+ *
+ * returns NULL if there is no complete line
+ */
+static char * findNextEOL(ATChannel *p_channel)
+{
+    char *cur = p_channel->ATBuffer + p_channel->lineStart;
+    char *scan = p_channel->ATBuffer + p_channel->scanPos;
+    char *end = p_channel->ATBuffer + p_channel->readEnd;
+    char *p_cr;
+    char *p_lf;
+
+    if (end - cur == 2 && cur[0] == '>' && cur[1] == ' ') {
+        /* SMS prompt character...not \r terminated */
+        return end;
+    }
+
+    // Find next newline
+    p_cr = (char *) memchr(scan, '\r', end - scan);
+    p_lf = (char *) memchr(scan, '\n', (p_cr != NULL ? p_cr : end) - scan);
+
+    if (p_lf != NULL) {
+        return p_lf;
+    }
+
+    if (p_cr == NULL) {
+        p_channel->scanPos = p_channel->readEnd;
+    }
+
+    return p_cr;
+}
+
+
+/**
+ * Reads a line from the AT channel, returns NULL on timeout.
+ * Assumes it has exclusive read access to the FD
+ *
+ * This line is valid only until the next call to readline
+ *
+ * This function exists because as of writing, android libc does not
+ * have buffered stdio.
+ */
+
+static const char *readline(ATChannel *p_channel)
+{
+    char *buf = p_channel->ATBuffer;
+    ssize_t count;
+
+    char *p_eol = NULL;
+    char *ret;
+
+    for (;;) {
+        // skip over leading newlines
+        while (p_channel->lineStart < p_channel->readEnd
+               && (buf[p_channel->lineStart] == '\r'
+                   || buf[p_channel->lineStart] == '\n')
+        ) {
+            p_channel->lineStart++;
+        }
+
+        if (p_channel->scanPos < p_channel->lineStart) {
+            p_channel->scanPos = p_channel->lineStart;
+        }
+
+        p_eol = findNextEOL(p_channel);
+
+        if (p_eol != NULL) {
+            break;
+        }
+
+        if (p_channel->lineStart == p_channel->readEnd) {
+            /* everything consumed, start over at the front for free */
+            p_channel->lineStart = p_channel->scanPos = p_channel->readEnd = 0;
+        } else if (p_channel->readEnd == MAX_AT_RESPONSE) {
+            if (p_channel->lineStart == 0) {
+                LOGE("ERROR: Input line exceeded buffer\n");
+                /* ditch buffer and start over again */
+                p_channel->lineStart = p_channel->scanPos
+                        = p_channel->readEnd = 0;
+            } else {
+                /* a partial line at the end. move it up */
+                memmove(buf, buf + p_channel->lineStart,
+                        p_channel->readEnd - p_channel->lineStart);
+                p_channel->readEnd -= p_channel->lineStart;
+                p_channel->scanPos -= p_channel->lineStart;
+                p_channel->lineStart = 0;
+            }
+        }
+
+        do {
+            count = read(p_channel->fd, buf + p_channel->readEnd,
+                            MAX_AT_RESPONSE - p_channel->readEnd);
+        } while (count < 0 && errno == EINTR);
+
+        if (count > 0) {
+            AT_DUMP( "<< ", buf + p_channel->readEnd, count );
+            p_channel->readCount += count;
+
+            p_channel->readEnd += count;
+            buf[p_channel->readEnd] = '\0';
+        } else if (count <= 0) {
+            /* read error encountered or EOF reached */
+            if(count == 0) {
+                AT_LOGI("atchannel: EOF reached");
+            } else {
+                AT_LOGI("atchannel: read error %s", strerror(errno));
+            }
+            return NULL;
+        }
+    }
+
+    /* a full line in the buffer. Place a \0 over the \r and return */
+
+    ret = buf + p_channel->lineStart;
+    *p_eol = '\0';
+
+    /* the "> " prompt has no terminator to step over */
+    p_channel->lineStart = p_eol - buf;
+    if (p_channel->lineStart < p_channel->readEnd) {
+        p_channel->lineStart++;
+    }
+    p_channel->scanPos = p_channel->lineStart;
+
+    AT_LOGD("AT%d< %s\n", p_channel->id, ret);
+    return ret;
+}
+
+
+static void onReaderClosed(ATChannel *p_channel)
+{
+    int notify;
+
+    pthread_mutex_lock(&s_commandmutex);
+
+    /* nothing to report if at_close got there first */
+    notify = !p_channel->closed;
+    p_channel->closed = 1;
+
+    pthread_cond_broadcast(&p_channel->cond);
+
+    pthread_mutex_unlock(&s_commandmutex);
+
+    if (notify && s_onReaderClosed != NULL) {
+        s_onReaderClosed();
+    }
+}
+
+
+static void *readerLoop(void *arg)
+{
+    ATChannel *p_channel = (ATChannel *) arg;
+
+    AT_LOGI("entering readerLoop() for channel %d", p_channel->id);
+
+    /* named so tools can find the reader in /proc/<pid>/task */
+    prctl(PR_SET_NAME, (unsigned long) "at_reader", 0, 0, 0);
+
+    /* commands queued from completions stay on this channel */
+    at_channel_select(p_channel->id);
+
+    for (;;) {
+        const char * line;
+
+        line = readline(p_channel);
+
+        if (line == NULL) {
+            break;
+        }
+
+		AT_DUMP("Dump",line,strlen(line));
+
+        if(isSMSUnsolicited(line)) {
+            char *line1;
+            const char *line2;
+
+            // The scope of string returned by 'readline()' is valid only
+            // till next call to 'readline()' hence making a copy of line
+            // before calling readline again.
+            line1 = strdup(line);
+            line2 = readline(p_channel);
+
+            if (line2 == NULL) {
+                free(line1);
+                break;
+            }
+
+            if (p_channel->unsolHandler != NULL) {
+                p_channel->unsolHandler (line1, line2);
+            }
+            free(line1);
+        } else {
+            processLine(p_channel, line);
+        }
+
+#ifdef HAVE_ANDROID_OS
+        if (p_channel->ackPowerIoctl > 0) {
+            /* acknowledge that bytes have been read and processed */
+            ioctl(p_channel->fd, OMAP_CSMI_TTY_ACK, &p_channel->readCount);
+            p_channel->readCount = 0;
+        }
+#endif /*HAVE_ANDROID_OS*/
+    }
+
+    onReaderClosed(p_channel);
+
+    pthread_mutex_lock(&s_commandmutex);
+    releaseChannel(p_channel);
+    pthread_mutex_unlock(&s_commandmutex);
+
+    return NULL;
+}
+
+/**
+ * Writes len bytes of s followed by the single byte "end" to the radio
+ * Returns AT_ERROR_* on error, 0 on success
+ *
+ * must be called without s_commandmutex held
+ */
+static int writeTerminated (ATChannel *p_channel, const char *s, size_t len,
+                            const char *end)
+{
+    size_t cur = 0;
+    ssize_t written;
+    int err = 0;
+
+    pthread_mutex_lock(&p_channel->writeMutex);
+
+    if (p_channel->fd < 0 || p_channel->fdClosed) {
+        pthread_mutex_unlock(&p_channel->writeMutex);
+        return AT_ERROR_CHANNEL_CLOSED;
+    }
+
+    /* the main string */
+    while (cur < len) {
+        do {
+            written = write (p_channel->fd, s + cur, len - cur);
+        } while (written < 0 && errno == EINTR);
+
+        if (written < 0) {
+            err = AT_ERROR_GENERIC;
+            goto out;
+        }
+
+        cur += written;
+    }
+
+    /* the terminator */
+
+    do {
+        written = write (p_channel->fd, end, 1);
+    } while ((written < 0 && errno == EINTR) || (written == 0));
+
+    if (written < 0) {
+        err = AT_ERROR_GENERIC;
+    }
+
+out:
+    pthread_mutex_unlock(&p_channel->writeMutex);
+    return err;
+}
+
+/**
+ * Sends string s to the radio with a \r appended.
+ * Returns AT_ERROR_* on error, 0 on success
+ *
+ * This function exists because as of writing, android libc does not
+ * have buffered stdio.
+ *
+ * must be called without s_commandmutex held
+ */
+static int writeline (ATChannel *p_channel, const char *s)
+{
+    AT_LOGD("AT%d> %s\n", p_channel->id, s);
+
+    AT_DUMP( ">> ", s, strlen(s) );
+
+    return writeTerminated(p_channel, s, strlen(s), "\r");
+}
+
+/* must be called without s_commandmutex held */
+static int writeCtrlZ (ATChannel *p_channel, const char *s)
+{
+    AT_LOGD("AT%d> %s^Z\n", p_channel->id, s);
+
+    AT_DUMP( ">* ", s, strlen(s) );
+
+    return writeTerminated(p_channel, s, strlen(s), "\032");
+}
+
+/**
+ * Unlinks every queued command whose deadline has passed and returns
+ * them as a list. *p_wakeup is lowered to the earliest remaining deadline.
+ *
+ * queueDeadline may be stale (too early) once commands have been sent,
+ * which only costs an extra walk of the queue
+ *
+ * assumes s_commandmutex is held
+ */
+static ATCommand *takeExpiredCommands(ATChannel *p_channel, long long now,
+                                        long long *p_wakeup)
+{
+    ATCommand *p_expired = NULL;
+    ATCommand **pp_cur = &p_channel->queueHead;
+
+    if (p_channel->queueDeadline == 0 || now < p_channel->queueDeadline) {
+        *p_wakeup = p_channel->queueDeadline;
+        return NULL;
+    }
+
+    p_channel->queueTail = NULL;
+
+    while (*pp_cur != NULL) {
+        ATCommand *p_cmd = *pp_cur;
+
+        if (p_cmd->deadline != 0 && now >= p_cmd->deadline) {
+            *pp_cur = p_cmd->p_next;
+            p_cmd->p_next = p_expired;
+            p_expired = p_cmd;
+            continue;
+        }
+
+        if (p_cmd->deadline != 0
+            && (*p_wakeup == 0 || p_cmd->deadline < *p_wakeup)
+        ) {
+            *p_wakeup = p_cmd->deadline;
+        }
+
+        p_channel->queueTail = p_cmd;
+        pp_cur = &p_cmd->p_next;
+    }
+
+    p_channel->queueDeadline = *p_wakeup;
+
+    return p_expired;
+}
+
+/**
+ * Unlinks the whole queue, plus the in-flight command, and returns them
+ * as a list
+ *
+ * assumes s_commandmutex is held
+ */
+static ATCommand *takeAllCommands(ATChannel *p_channel)
+{
+    ATCommand *p_all = p_channel->queueHead;
+
+    if (p_channel->inflight != NULL) {
+        p_channel->inflight->p_next = p_all;
+        p_all = p_channel->inflight;
+    }
+
+    p_channel->queueHead = p_channel->queueTail = NULL;
+    p_channel->inflight = NULL;
+    p_channel->queueDeadline = 0;
+
+    return p_all;
+}
+
+/**
+ * The writer thread: sends queued commands one at a time and enforces
+ * per-command timeouts. Exits when the channel closes.
+ */
+static void *writerLoop(void *arg)
+{
+    ATChannel *p_channel = (ATChannel *) arg;
+    ATCommand *p_all;
+
+    prctl(PR_SET_NAME, (unsigned long) "at_writer", 0, 0, 0);
+
+    at_channel_select(p_channel->id);
+
+    pthread_mutex_lock(&s_commandmutex);
+
+    while (!p_channel->closed) {
+        long long now = nowMsec();
+        long long wakeup = 0;
+        ATCommand *p_cmd;
+        char *command;
+        int err;
+
+        p_cmd = takeExpiredCommands(p_channel, now, &wakeup);
+
+        if (p_cmd != NULL) {
+            /* timed out before ever reaching the modem */
+            pthread_mutex_unlock(&s_commandmutex);
+            completeCommandList(p_cmd, AT_ERROR_TIMEOUT);
+            pthread_mutex_lock(&s_commandmutex);
+            continue;
+        }
+
+        if (p_channel->inflight != NULL) {
+            p_cmd = p_channel->inflight;
+
+            if (p_cmd->deadline != 0 && now >= p_cmd->deadline) {
+                int notify;
+
+                /* any late response is treated as unsolicited */
+                p_channel->inflight = NULL;
+                notify = p_cmd->notifyTimeout;
+
+                pthread_mutex_unlock(&s_commandmutex);
+
+                completeCommand(p_cmd, AT_ERROR_TIMEOUT);
+
+                if (notify && s_onTimeout != NULL) {
+                    s_onTimeout();
+                }
+
+                pthread_mutex_lock(&s_commandmutex);
+                continue;
+            }
+
+            if (p_cmd->deadline != 0
+                && (wakeup == 0 || p_cmd->deadline < wakeup)
+            ) {
+                wakeup = p_cmd->deadline;
+            }
+        } else if (p_channel->queueHead != NULL
+                   && now < p_channel->holdUntil
+        ) {
+            if (wakeup == 0 || p_channel->holdUntil < wakeup) {
+                wakeup = p_channel->holdUntil;
+            }
+        } else if (p_channel->queueHead != NULL) {
+            p_cmd = p_channel->queueHead;
+            p_channel->queueHead = p_cmd->p_next;
+            if (p_channel->queueHead == NULL) {
+                p_channel->queueTail = NULL;
+            }
+            p_cmd->p_next = NULL;
+            p_cmd->p_response = at_response_new();
+
+            p_channel->inflight = p_cmd;
+
+            /*
+             * The reader may retire p_cmd as soon as the lock is dropped,
+             * so the writer takes the command string for itself
+             */
+            command = p_cmd->command;
+            p_cmd->command = NULL;
+
+            pthread_mutex_unlock(&s_commandmutex);
+            err = writeline (p_channel, command);
+            free(command);
+            pthread_mutex_lock(&s_commandmutex);
+
+            /* only this thread makes a command inflight, so p_cmd is
+               still there unless the reader already retired it */
+            if (err < 0 && p_channel->inflight == p_cmd) {
+                p_channel->inflight = NULL;
+
+                pthread_mutex_unlock(&s_commandmutex);
+                completeCommand(p_cmd, err);
+                pthread_mutex_lock(&s_commandmutex);
+            }
+            continue;
+        }
+
+        waitCommandCond(p_channel, wakeup == 0 ? 0 : wakeup - now);
+    }
+
+    p_all = takeAllCommands(p_channel);
+    releaseChannel(p_channel);
+
+    pthread_mutex_unlock(&s_commandmutex);
+
+    completeCommandList(p_all, AT_ERROR_CHANNEL_CLOSED);
+
+    return NULL;
+}
+
+
+/**
+ * Unhooks p_channel from the table and tells its threads to exit; the
+ * writer fails whatever is still queued with AT_ERROR_CHANNEL_CLOSED
+ * assumes s_commandmutex is held
+ */
+static void detachChannel(ATChannel *p_channel)
+{
+    s_channels[p_channel->id] = NULL;
+    p_channel->closed = 1;
+
+    pthread_cond_broadcast(&p_channel->cond);
+
+    releaseChannel(p_channel);
+}
+
+/**
+ * Closes the stream under p_channel and detaches it
+ * assumes s_commandmutex is held
+ */
+static void closeChannel(ATChannel *p_channel)
+{
+    if (p_channel->fd >= 0) {
+        /* a reader or writer blocked on a socket only wakes up for a
+           shutdown */
+        shutdown(p_channel->fd, SHUT_RDWR);
+
+        pthread_mutex_lock(&p_channel->writeMutex);
+        close(p_channel->fd);
+        p_channel->fdClosed = 1;
+        pthread_mutex_unlock(&p_channel->writeMutex);
+    }
+
+    detachChannel(p_channel);
+}
+
+/**
+ * Starts the reader and writer for a channel on fd in slot id, or in the
+ * first free slot above 0 if id is -1. A channel already in slot id is
+ * detached first.
+ *
+ * returns the channel id, or -1 on error
+ */
+static int startChannel(int id, int fd, ATUnsolHandler h)
+{
+    int ret;
+    ATChannel *p_channel;
+    pthread_attr_t attr;
+
+    p_channel = (ATChannel *) calloc(1, sizeof(ATChannel));
+
+    if (p_channel == NULL) {
+        return -1;
+    }
+
+    p_channel->fd = fd;
+    p_channel->unsolHandler = h;
+    p_channel->refCount = 3;
+    pthread_cond_init(&p_channel->cond, NULL);
+    pthread_mutex_init(&p_channel->writeMutex, NULL);
+
+    /* Android power control ioctl */
+#ifdef HAVE_ANDROID_OS
+#ifdef OMAP_CSMI_POWER_CONTROL
+    ret = ioctl(fd, OMAP_CSMI_TTY_ENABLE_ACK);
+    if(ret == 0) {
+        int ack_count;
+		int read_count;
+        int old_flags;
+        char sync_buf[256];
+        old_flags = fcntl(fd, F_GETFL, 0);
+        fcntl(fd, F_SETFL, old_flags | O_NONBLOCK);
+        do {
+            ioctl(fd, OMAP_CSMI_TTY_READ_UNACKED, &ack_count);
+			read_count = 0;
+            do {
+                ret = read(fd, sync_buf, sizeof(sync_buf));
+				if(ret > 0)
+					read_count += ret;
+            } while(ret > 0 || (ret < 0 && errno == EINTR));
+            ioctl(fd, OMAP_CSMI_TTY_ACK, &ack_count);
+         } while(ack_count > 0 || read_count > 0);
+        fcntl(fd, F_SETFL, old_flags);
+        p_channel->readCount = 0;
+        p_channel->ackPowerIoctl = 1;
+    }
+    else
+        p_channel->ackPowerIoctl = 0;
+
+#else // OMAP_CSMI_POWER_CONTROL
+    p_channel->ackPowerIoctl = 0;
+
+#endif // OMAP_CSMI_POWER_CONTROL
+#endif /*HAVE_ANDROID_OS*/
+
+    pthread_mutex_lock(&s_commandmutex);
+
+    if (id < 0) {
+        for (id = 1 ; id < AT_MAX_CHANNELS ; id++) {
+            if (s_channels[id] == NULL) {
+                break;
+            }
+        }
+
+        if (id == AT_MAX_CHANNELS) {
+            LOGE("no free AT channel for fd %d", fd);
+            goto error;
+        }
+    } else if (s_channels[id] != NULL) {
+        /* anything left on the previous channel can never complete */
+        detachChannel(s_channels[id]);
+    }
+
+    p_channel->id = id;
+    s_channels[id] = p_channel;
+
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    /* created under the lock so sendCommandSync always sees the tids */
+    ret = pthread_create(&p_channel->tid_reader, &attr, readerLoop,
+                            p_channel);
+
+    if (ret != 0) {
+        LOGE("pthread_create for the AT reader failed");
+        s_channels[id] = NULL;
+        goto error;
+    }
+
+    ret = pthread_create(&p_channel->tid_writer, &attr, writerLoop,
+                            p_channel);
+
+    if (ret != 0) {
+        LOGE("pthread_create for the AT writer failed");
+        /* the reader lets go once the caller closes fd */
+        p_channel->refCount--;
+        detachChannel(p_channel);
+        pthread_mutex_unlock(&s_commandmutex);
+        return -1;
+    }
+
+    pthread_mutex_unlock(&s_commandmutex);
+
+    return id;
+
+error:
+    pthread_mutex_unlock(&s_commandmutex);
+    pthread_cond_destroy(&p_channel->cond);
+    pthread_mutex_destroy(&p_channel->writeMutex);
+    free(p_channel);
+    return -1;
+}
+
+/**
+ * Starts AT handler on stream "fd'
+ * returns 0 on success, -1 on error
+ */
+int at_open(int fd, ATUnsolHandler h)
+{
+    AT_LOGI("entering at_open()");
+
+    return startChannel(0, fd, h) < 0 ? -1 : 0;
+}
+
+/* FIXME is it ok to call this from the reader and the command thread? */
+void at_close()
+{
+    int i;
+
+    pthread_mutex_lock(&s_commandmutex);
+
+    for (i = 0 ; i < AT_MAX_CHANNELS ; i++) {
+        if (s_channels[i] != NULL) {
+            closeChannel(s_channels[i]);
+        }
+    }
+
+    pthread_mutex_unlock(&s_commandmutex);
+
+    /* the reader threads should eventually die; the writers fail
+       everything still queued with AT_ERROR_CHANNEL_CLOSED */
+}
+
+/**
+ * Starts an additional AT channel on stream fd, see atchannel.h
+ * returns the channel id (> 0), or -1 on error
+ */
+int at_channel_open(int fd, ATUnsolHandler h)
+{
+    AT_LOGI("entering at_channel_open()");
+
+    return startChannel(-1, fd, h);
+}
+
+void at_channel_close(int channel)
+{
+    if (channel < 0 || channel >= AT_MAX_CHANNELS) {
+        return;
+    }
+
+    pthread_mutex_lock(&s_commandmutex);
+
+    if (s_channels[channel] != NULL) {
+        closeChannel(s_channels[channel]);
+    }
+
+    pthread_mutex_unlock(&s_commandmutex);
+}
+
+int at_channel_select(int channel)
+{
+    int prev = selectedChannel();
+
+    pthread_setspecific(s_channelKey, (void *)(long)(channel + 1));
+
+    return prev;
+}
+
+static ATResponse * at_response_new()
+{
+    ATResponseArena *p_arena;
+
+    p_arena = (ATResponseArena *) calloc(1, sizeof(ATResponseArena));
+
+    p_arena->first.data = p_arena->firstData;
+    p_arena->first.size = AT_ARENA_INLINE;
+    p_arena->p_chunks = &p_arena->first;
+
+    return &p_arena->response;
+}
+
+void at_response_free(ATResponse *p_response)
+{
+    ATResponseArena *p_arena = (ATResponseArena *) p_response;
+    ATArenaChunk *p_chunk;
+
+    if (p_response == NULL) return;
+
+    p_chunk = p_arena->p_chunks;
+
+    while (p_chunk != &p_arena->first) {
+        ATArenaChunk *p_toFree;
+
+        p_toFree = p_chunk;
+        p_chunk = p_chunk->p_next;
+
+        free(p_toFree);
+    }
+
+    free (p_arena);
+}
+
+/**
+ * Queues a command for p_channel's writer thread
+ * assumes s_commandmutex is held
+ *
+ * returns the command id (> 0) or AT_ERROR_*
+ */
+static int queueCommand (ATChannel *p_channel,
+                    const char *command, ATCommandType type,
+                    const char *responsePrefix, const char *smspdu,
+                    long long timeoutMsec, int notifyTimeout,
+                    long long holdMsec,
+                    ATCommandCallback callback, void *param)
+{
+    ATCommand *p_cmd;
+
+    if (p_channel == NULL || p_channel->fd < 0 || p_channel->closed) {
+        return AT_ERROR_CHANNEL_CLOSED;
+    }
+
+    p_cmd = (ATCommand *) calloc(1, sizeof(ATCommand));
+
+    if (p_cmd == NULL) {
+        return AT_ERROR_GENERIC;
+    }
+
+    p_cmd->command = strdup(command);
+    p_cmd->type = type;
+    p_cmd->responsePrefix = responsePrefix ? strdup(responsePrefix) : NULL;
+    p_cmd->smsPDU = smspdu ? strdup(smspdu) : NULL;
+    p_cmd->deadline = timeoutMsec != 0 ? nowMsec() + timeoutMsec : 0;
+
+    if (p_cmd->deadline != 0
+        && (p_channel->queueDeadline == 0
+            || p_cmd->deadline < p_channel->queueDeadline)
+    ) {
+        p_channel->queueDeadline = p_cmd->deadline;
+    }
+    p_cmd->holdMsec = holdMsec;
+    p_cmd->notifyTimeout = notifyTimeout;
+    p_cmd->callback = callback;
+    p_cmd->param = param;
+
+    p_cmd->id = s_nextCommandId++;
+    if (s_nextCommandId <= 0) {
+        s_nextCommandId = 1;
+    }
+
+    if (p_channel->queueTail == NULL) {
+        p_channel->queueHead = p_cmd;
+    } else {
+        p_channel->queueTail->p_next = p_cmd;
+    }
+    p_channel->queueTail = p_cmd;
+
+    pthread_cond_broadcast(&p_channel->cond);
+
+    return p_cmd->id;
+}
+
+/**
+ * Queues a command on the selected channel, see atchannel.h
+ *
+ * timeoutMsec == 0 means infinite timeout
+ */
+int at_send_command_async (const char *command, ATCommandType type,
+                    const char *responsePrefix, const char *smspdu,
+                    long long timeoutMsec,
+                    ATCommandCallback callback, void *param)
+{
+    int ret;
+
+    pthread_mutex_lock(&s_commandmutex);
+
+    ret = queueCommand(currentChannel(), command, type, responsePrefix,
+                    smspdu, timeoutMsec, 1, 0, callback, param);
+
+    pthread_mutex_unlock(&s_commandmutex);
+
+    return ret;
+}
+
+/**
+ * Unlinks command id from p_channel's queue
+ * assumes s_commandmutex is held
+ *
+ * returns the command, or NULL if it is not queued there
+ */
+static ATCommand *unqueueCommand(ATChannel *p_channel, int id)
+{
+    ATCommand *p_cmd;
+    ATCommand *p_prev = NULL;
+
+    for (p_cmd = p_channel->queueHead ; p_cmd != NULL
+            ; p_cmd = p_cmd->p_next) {
+        if (p_cmd->id == id) {
+            break;
+        }
+        p_prev = p_cmd;
+    }
+
+    if (p_cmd != NULL) {
+        if (p_prev == NULL) {
+            p_channel->queueHead = p_cmd->p_next;
+        } else {
+            p_prev->p_next = p_cmd->p_next;
+        }
+
+        if (p_channel->queueTail == p_cmd) {
+            p_channel->queueTail = p_prev;
+        }
+    }
+
+    return p_cmd;
+}
+
+/**
+ * Cancels a command returned by at_send_command_async
+ *
+ * A queued command is removed and completed with AT_ERROR_CANCELLED
+ * right away. A command already sent to the modem still occupies the
+ * channel until its final response arrives; it then completes with
+ * AT_ERROR_CANCELLED instead of its response.
+ *
+ * returns 0 on success, AT_ERROR_GENERIC if id is not outstanding
+ */
+int at_cancel_command (int id)
+{
+    ATCommand *p_cmd = NULL;
+    int i;
+
+    pthread_mutex_lock(&s_commandmutex);
+
+    /* ids are unique across channels */
+    for (i = 0 ; i < AT_MAX_CHANNELS && p_cmd == NULL ; i++) {
+        ATChannel *p_channel = s_channels[i];
+
+        if (p_channel == NULL) {
+            continue;
+        }
+
+        if (p_channel->inflight != NULL && p_channel->inflight->id == id) {
+            p_channel->inflight->cancelled = 1;
+            pthread_mutex_unlock(&s_commandmutex);
+            return 0;
+        }
+
+        p_cmd = unqueueCommand(p_channel, id);
+    }
+
+    pthread_mutex_unlock(&s_commandmutex);
+
+    if (p_cmd == NULL) {
+        return AT_ERROR_GENERIC;
+    }
+
+    completeCommand(p_cmd, AT_ERROR_CANCELLED);
+
+    return 0;
+}
+
+/** rendezvous between a blocking caller and its completion */
+typedef struct {
+    pthread_cond_t cond;
+    int done;
+    int err;
+    ATResponse *p_response;
+} ATSyncWait;
+
+static void onSyncComplete(int err, ATResponse *p_response, void *param)
+{
+    ATSyncWait *p_wait = (ATSyncWait *) param;
+
+    pthread_mutex_lock(&s_commandmutex);
+
+    p_wait->err = err;
+    p_wait->p_response = p_response;
+    p_wait->done = 1;
+
+    pthread_cond_signal(&p_wait->cond);
+
+    pthread_mutex_unlock(&s_commandmutex);
+}
+
+/**
+ * Queues a command on the selected channel and blocks until it completes
+ * May not be called from the reader or writer thread
+ */
+static int sendCommandSync (const char *command, ATCommandType type,
+                    const char *responsePrefix, const char *smspdu,
+                    long long timeoutMsec, int notifyTimeout,
+                    long long holdMsec, ATResponse **pp_outResponse)
+{
+    ATSyncWait wait;
+    int err;
+    int i;
+
+    memset(&wait, 0, sizeof(wait));
+
+    pthread_mutex_lock(&s_commandmutex);
+
+    for (i = 0 ; i < AT_MAX_CHANNELS ; i++) {
+        ATChannel *p_channel = s_channels[i];
+
+        if (p_channel != NULL
+            && (0 != pthread_equal(p_channel->tid_reader, pthread_self())
+                || 0 != pthread_equal(p_channel->tid_writer, pthread_self()))
+        ) {
+            /* cannot be called from any reader or writer thread */
+            pthread_mutex_unlock(&s_commandmutex);
+            return AT_ERROR_INVALID_THREAD;
+        }
+    }
+
+    pthread_cond_init(&wait.cond, NULL);
+
+    err = queueCommand(currentChannel(), command, type, responsePrefix,
+                    smspdu, timeoutMsec, notifyTimeout, holdMsec,
+                    onSyncComplete, &wait);
+
+    if (err > 0) {
+        while (!wait.done) {
+            pthread_cond_wait(&wait.cond, &s_commandmutex);
+        }
+        err = wait.err;
+    }
+
+    pthread_mutex_unlock(&s_commandmutex);
+
+    pthread_cond_destroy(&wait.cond);
+
+    if (pp_outResponse != NULL) {
+        *pp_outResponse = wait.p_response;
+    } else {
+        at_response_free(wait.p_response);
+    }
+
+    return err;
+}
+
+/**
+ * Internal send_command implementation
+ *
+ * timeoutMsec == 0 means infinite timeout
+ */
+static int at_send_command_full (const char *command, ATCommandType type,
+                    const char *responsePrefix, const char *smspdu,
+                    long long timeoutMsec, ATResponse **pp_outResponse)
+{
+    return sendCommandSync(command, type, responsePrefix, smspdu,
+                    timeoutMsec, 1, 0, pp_outResponse);
+}
+
+
+/**
+ * Issue a single normal AT command with no intermediate response expected
+ *
+ * "command" should not include \r
+ * pp_outResponse can be NULL
+ *
+ * if non-NULL, the resulting ATResponse * must be eventually freed with
+ * at_response_free
+ */
+int at_send_command (const char *command, ATResponse **pp_outResponse)
+{
+    int err;
+
+    err = at_send_command_full (command, NO_RESULT, NULL,
+                                    NULL, 0, pp_outResponse);
+
+    return err;
+}
+
+
+int at_send_command_singleline (const char *command,
+                                const char *responsePrefix,
+                                 ATResponse **pp_outResponse)
+{
+    int err;
+
+    err = at_send_command_full (command, SINGLELINE, responsePrefix,
+                                    NULL, 0, pp_outResponse);
+
+    return err;
+}
+
+
+int at_send_command_numeric (const char *command,
+                                 ATResponse **pp_outResponse)
+{
+    int err;
+
+    err = at_send_command_full (command, NUMERIC, NULL,
+                                    NULL, 0, pp_outResponse);
+
+    return err;
+}
+
+
+int at_send_command_sms (const char *command,
+                                const char *pdu,
+                                const char *responsePrefix,
+                                 ATResponse **pp_outResponse)
+{
+    int err;
+
+    err = at_send_command_full (command, SINGLELINE, responsePrefix,
+                                    pdu, 0, pp_outResponse);
+
+    return err;
+}
+
+
+int at_send_command_multiline (const char *command,
+                                const char *responsePrefix,
+                                 ATResponse **pp_outResponse)
+{
+    int err;
+
+    err = at_send_command_full (command, MULTILINE, responsePrefix,
+                                    NULL, 0, pp_outResponse);
+
+    return err;
+}
+
+
+/** This callback is invoked on the writer thread */
+void at_set_on_timeout(void (*onTimeout)(void))
+{
+    s_onTimeout = onTimeout;
+}
+
+/**
+ *  This callback is invoked on the reader thread (like ATUnsolHandler)
+ *  when the input stream closes before you call at_close
+ *  (not when you call at_close())
+ *  You should still call at_close()
+ */
+
+void at_set_on_reader_closed(void (*onClose)(void))
+{
+    s_onReaderClosed = onClose;
+}
+
+
+/**
+ * Periodically issue an AT command and wait for a response.
+ * Used to ensure channel has start up and is active
+ */
+
+int at_handshake()
+{
+    int i;
+    int err = 0;
+
+    for (i = 0 ; i < HANDSHAKE_RETRY_COUNT ; i++) {
+        /* some stacks start with verbose off. on success the writer
+           holds the channel idle for a bit to let the input buffer drain
+           any unmatched OK's (they will appear as extraneous unsolicited
+           responses) */
+        err = sendCommandSync ("ATE0Q0V1", NO_RESULT, NULL, NULL,
+                    HANDSHAKE_TIMEOUT_MSEC, 0, HANDSHAKE_TIMEOUT_MSEC, NULL);
+
+        if (err == 0 || err == AT_ERROR_INVALID_THREAD) {
+            break;
+        }
+    }
+
+    return err;
+}
+
+/**
+ * Returns error code from response
+ * Assumes AT+CMEE=1 (numeric) mode
+ */
+AT_CME_Error at_get_cme_error(const ATResponse *p_response)
+{
+    int ret;
+    int err;
+    char *p_cur;
+
+    if (p_response->success > 0) {
+        return CME_SUCCESS;
+    }
+
+    if (p_response->finalResponse == NULL
+        || !strStartsWith(p_response->finalResponse, "+CME ERROR:")
+    ) {
+        return CME_ERROR_NON_CME;
+    }
+
+    p_cur = p_response->finalResponse;
+    err = at_tok_start(&p_cur);
+
+    if (err < 0) {
+        return CME_ERROR_NON_CME;
+    }
+
+    err = at_tok_nextint(&p_cur, &ret);
+
+    if (err < 0) {
+        return CME_ERROR_NON_CME;
+    }
+
+    return (AT_CME_Error) ret;
+}
+
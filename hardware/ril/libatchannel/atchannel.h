@@ -1,4 +1,4 @@
-/* //device/system/reference-ril/atchannel.h
+/* //device/system/libatchannel/atchannel.h
 **
 ** Copyright 2006, The Android Open Source Project
 **
@@ -22,16 +22,29 @@
 extern "C" {
 #endif
 
-#define AT_DEBUG 1
-/* define AT_DEBUG to send AT traffic to /tmp/radio-at.log" */
-#define AT_DEBUG  0
+/*
+ * AT_LOG_LEVEL decides at compile time how much AT traffic is logged;
+ * anything above it compiles out entirely. LOGE is always kept.
+ * libatchannel's Android.mk picks the level from TARGET_BUILD_VARIANT.
+ */
+#define AT_LOG_ERROR    0   /* errors only */
+#define AT_LOG_INFO     1   /* + channel open/close and thread events */
+#define AT_LOG_TRAFFIC  2   /* + every line sent and received */
+#define AT_LOG_DUMP     3   /* + raw reads and writes via AT_DUMP */
+
+#ifndef AT_LOG_LEVEL
+#define AT_LOG_LEVEL AT_LOG_TRAFFIC
+#endif
 
-#if AT_DEBUG
+#if AT_LOG_LEVEL >= AT_LOG_DUMP
 extern void  AT_DUMP(const char* prefix, const char*  buff, int  len);
 #else
 #define  AT_DUMP(prefix,buff,len)  do{}while(0)
 #endif
 
+/* channel ids run from 0 (the at_open channel) to AT_MAX_CHANNELS - 1 */
+#define AT_MAX_CHANNELS 8
+
 #define AT_ERROR_GENERIC -1
 #define AT_ERROR_COMMAND_PENDING -2
 #define AT_ERROR_CHANNEL_CLOSED -3
@@ -42,6 +55,7 @@ extern void  AT_DUMP(const char* prefix, const char*  buff, int  len);
 #define AT_ERROR_INVALID_RESPONSE -6 /* eg an at_send_command_singleline that
                                         did not get back an intermediate
                                         response */
+#define AT_ERROR_CANCELLED -7 /* at_cancel_command() was called */
 
 
 typedef enum {
@@ -58,7 +72,7 @@ typedef struct ATLine  {
     char *line;
 } ATLine;
 
-/** Free this with at_response_free() */
+/** Free this with at_response_free(), which also releases every line */
 typedef struct {
     int success;              /* true if final response indicates
                                     success (eg "OK") */
@@ -75,9 +89,32 @@ typedef struct {
 typedef void (*ATUnsolHandler)(const char *s, const char *sms_pdu);
 
 int at_open(int fd, ATUnsolHandler h);
+/* closes every channel, including those from at_channel_open() */
 void at_close();
 
-/* This callback is invoked on the command thread.
+/**
+ * Starts an additional AT channel on stream fd (eg. a CMUX DLCI) with
+ * its own reader and writer thread, so a slow command on one channel
+ * does not hold up the others. at_open() must be called first; a
+ * reader closing on any channel reports through at_set_on_reader_closed.
+ *
+ * Returns the channel id (> 0), or -1 on error
+ */
+int at_channel_open(int fd, ATUnsolHandler h);
+void at_channel_close(int channel);
+
+/**
+ * Routes this thread's at_send_command* calls to channel, until the
+ * next call. Threads that never select use channel 0; the reader and
+ * writer of a channel select their own, so completions that queue
+ * follow-up commands stay on it. Commands to a closed channel fail with
+ * AT_ERROR_CHANNEL_CLOSED.
+ *
+ * Returns the previous selection, or -1 if there was none
+ */
+int at_channel_select(int channel);
+
+/* This callback is invoked on the writer thread.
    You should reset or handshake here to avoid getting out of sync */
 void at_set_on_timeout(void (*onTimeout)(void));
 /* This callback is invoked on the reader thread (like ATUnsolHandler)
@@ -108,6 +145,37 @@ int at_send_command_sms (const char *command, const char *pdu,
                             const char *responsePrefix,
                             ATResponse **pp_outResponse);
 
+/**
+ * Completion for at_send_command_async(). Invoked exactly once per
+ * queued command, without any atchannel lock held, so it may queue
+ * further commands (but may not use the blocking at_send_command*).
+ *
+ * On success err is 0 and p_response must be freed with
+ * at_response_free(); otherwise err is AT_ERROR_* and p_response is NULL.
+ * Runs on the reader thread for commands the modem answered, on the
+ * writer thread for timeouts and channel close, and in the caller of
+ * at_cancel_command() for commands cancelled while still queued.
+ */
+typedef void (*ATCommandCallback)(int err, ATResponse *p_response,
+                                  void *param);
+
+/**
+ * Queues a command without blocking. Commands are sent in order, each as
+ * soon as the previous one's final response arrives. smspdu may be NULL.
+ * timeoutMsec counts from submission; 0 means no timeout.
+ *
+ * callback may be NULL if the result is not needed.
+ *
+ * Returns a command id (> 0) for at_cancel_command(), or AT_ERROR_*
+ * in which case the callback is never invoked.
+ */
+int at_send_command_async (const char *command, ATCommandType type,
+                            const char *responsePrefix, const char *smspdu,
+                            long long timeoutMsec,
+                            ATCommandCallback callback, void *param);
+
+int at_cancel_command (int id);
+
 void at_response_free(ATResponse *p_response);
 
 typedef enum {
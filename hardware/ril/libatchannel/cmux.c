@@ -0,0 +1,799 @@
+/* //device/system/libatchannel/cmux.c
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#include "cmux.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define LOG_NDEBUG 0
+#define LOG_TAG "CMUX"
+#include <utils/Log.h>
+
+/*
+ * TS 27.010 basic option framing
+ *
+ *   F9 | address | control | length (1 or 2 bytes) | info | FCS | F9
+ *
+ * address is EA | C/R << 1 | DLCI << 2 and the length bytes carry their
+ * own EA bit. The FCS covers address, control and length only.
+ */
+
+#define CMUX_FLAG   0xF9
+#define CMUX_EA     0x01
+#define CMUX_CR     0x02
+#define CMUX_PF     0x10
+
+#define CMUX_SABM   (0x2F | CMUX_PF)
+#define CMUX_UA     (0x63 | CMUX_PF)
+#define CMUX_DM     (0x0F | CMUX_PF)
+#define CMUX_DISC   (0x43 | CMUX_PF)
+#define CMUX_UIH    0xEF
+
+/* control channel message types, without EA and C/R */
+#define CMUX_MSG_CLD    0xC0    /* multiplexer close down */
+#define CMUX_MSG_MSC    0xE0    /* modem status command */
+
+/* V.24 signals for MSC: RTC, RTR and DV, and FC to stop the sender */
+#define CMUX_V24_READY  0x8D
+#define CMUX_V24_FC     0x02
+
+/* default N1 for basic option, the largest info field either side sends */
+#define CMUX_N1 31
+
+/* frames with a larger info field are dropped */
+#define CMUX_MAX_INFO 1024
+
+#define CMUX_SETUP_TIMEOUT_MSEC 1000
+#define CMUX_SETUP_RETRY_COUNT 3
+
+/* backlog at which the modem is asked to stop sending on a DLCI */
+#define CMUX_BACKLOG_HIGH 4096
+
+typedef struct {
+    int dlci;
+    int control;
+    size_t len;
+    unsigned char info[CMUX_MAX_INFO];
+} CmuxFrame;
+
+/* modem output a DLCI's owner has not read yet */
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t size;
+    int throttled;              /* FC sent to the modem */
+} CmuxBacklog;
+
+static int s_fd = -1;                   /* the modem */
+static int s_socks[CMUX_MAX_CHANNELS];  /* mux side of each DLCI, or -1 */
+static int s_active[CMUX_MAX_CHANNELS]; /* owner still reading, mux thread only */
+static CmuxBacklog s_backlog[CMUX_MAX_CHANNELS];    /* mux thread only */
+static int s_numChannels;
+static int s_wakePipe[2] = { -1, -1 };
+static pthread_t s_tid_mux;
+static pthread_mutex_t s_writeMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* raw input from the modem, only touched by one thread at a time;
+   one spare byte so enterMuxMode can search it as a string */
+static unsigned char s_in[2 * (CMUX_MAX_INFO + 8) + 1];
+static size_t s_inLen;
+
+/** reflected CRC-8, polynomial x^8 + x^2 + x + 1, see 27.010 annex B */
+static unsigned char fcsUpdate(unsigned char fcs, const unsigned char *p,
+                                size_t len)
+{
+    int i;
+
+    while (len-- > 0) {
+        fcs ^= *p++;
+        for (i = 0 ; i < 8 ; i++) {
+            fcs = (fcs & 1) ? (fcs >> 1) ^ 0xE0 : fcs >> 1;
+        }
+    }
+
+    return fcs;
+}
+
+static int writeAll(int fd, const void *p_data, size_t len)
+{
+    const char *p = (const char *) p_data;
+    ssize_t written;
+
+    while (len > 0) {
+        do {
+            written = write(fd, p, len);
+        } while (written < 0 && errno == EINTR);
+
+        if (written <= 0) {
+            return -1;
+        }
+
+        p += written;
+        len -= written;
+    }
+
+    return 0;
+}
+
+/** frames and sends one info field, len <= CMUX_N1 */
+static int writeFrame(int dlci, int control, const unsigned char *info,
+                        size_t len)
+{
+    unsigned char frame[CMUX_N1 + 6];
+    size_t n = 0;
+    unsigned char fcs;
+    int ret;
+
+    frame[n++] = CMUX_FLAG;
+    frame[n++] = CMUX_EA | CMUX_CR | (dlci << 2);
+    frame[n++] = control;
+    frame[n++] = CMUX_EA | (len << 1);
+    fcs = 0xFF - fcsUpdate(0xFF, frame + 1, n - 1);
+
+    if (len > 0) {
+        memcpy(frame + n, info, len);
+        n += len;
+    }
+
+    frame[n++] = fcs;
+    frame[n++] = CMUX_FLAG;
+
+    pthread_mutex_lock(&s_writeMutex);
+    ret = writeAll(s_fd, frame, n);
+    pthread_mutex_unlock(&s_writeMutex);
+
+    return ret;
+}
+
+/** sends a control channel message */
+static int writeControl(int type, int command, const unsigned char *value,
+                        size_t len)
+{
+    unsigned char msg[CMUX_N1];
+
+    msg[0] = type | CMUX_EA | (command ? CMUX_CR : 0);
+    msg[1] = CMUX_EA | (len << 1);
+
+    if (len > 0) {
+        memcpy(msg + 2, value, len);
+    }
+
+    return writeFrame(0, CMUX_UIH, msg, len + 2);
+}
+
+/** asks the modem to stop or resume sending on dlci, see 27.010 5.4.6.3.7 */
+static void setFlowControl(int dlci, int stop)
+{
+    unsigned char msc[2];
+
+    msc[0] = CMUX_EA | CMUX_CR | (dlci << 2);
+    msc[1] = CMUX_V24_READY | (stop ? CMUX_V24_FC : 0);
+    writeControl(CMUX_MSG_MSC, 1, msc, sizeof(msc));
+
+    s_backlog[dlci].throttled = stop;
+}
+
+/**
+ * Called once the owner of dlci has closed its end: the DLCI's traffic
+ * is discarded from now on
+ */
+static void deactivate(int dlci)
+{
+    s_active[dlci] = 0;
+
+    free(s_backlog[dlci].data);
+    s_backlog[dlci].data = NULL;
+    s_backlog[dlci].len = s_backlog[dlci].size = 0;
+
+    /* let the modem drain whatever it holds for the DLCI */
+    if (s_backlog[dlci].throttled) {
+        setFlowControl(dlci, 0);
+    }
+}
+
+/**
+ * Writes as much of p as the owner's socket takes without blocking
+ * returns the byte count, or -1 if the owner has closed its end
+ */
+static ssize_t sendSome(int dlci, const unsigned char *p, size_t len)
+{
+    size_t sent = 0;
+    ssize_t written;
+
+    while (sent < len) {
+        do {
+            written = send(s_socks[dlci], p + sent, len - sent,
+                            MSG_NOSIGNAL | MSG_DONTWAIT);
+        } while (written < 0 && errno == EINTR);
+
+        if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if (written < 0) {
+            LOGE("DLCI %d: channel closed (%s)", dlci, strerror(errno));
+            deactivate(dlci);
+            return -1;
+        }
+
+        sent += written;
+    }
+
+    return sent;
+}
+
+/**
+ * Passes a frame's info to the owner of a DLCI
+ *
+ * Never blocks, so a channel whose reader has stalled cannot hold up
+ * the others: what does not fit is kept in the DLCI's backlog, which
+ * muxLoop flushes as the owner reads, and the modem is told to stop
+ * sending on the DLCI once the backlog grows past CMUX_BACKLOG_HIGH.
+ * Once the owner has closed its end later frames are dropped.
+ */
+static void deliver(int dlci, const unsigned char *p, size_t len)
+{
+    CmuxBacklog *p_backlog = &s_backlog[dlci];
+    ssize_t sent = 0;
+
+    if (!s_active[dlci]) {
+        return;
+    }
+
+    /* anything already waiting has to go first */
+    if (p_backlog->len == 0) {
+        sent = sendSome(dlci, p, len);
+        if (sent < 0) {
+            return;
+        }
+    }
+
+    p += sent;
+    len -= sent;
+
+    if (len == 0) {
+        return;
+    }
+
+    if (p_backlog->len + len > p_backlog->size) {
+        size_t size = p_backlog->size == 0 ? CMUX_MAX_INFO : p_backlog->size;
+        unsigned char *data;
+
+        while (size < p_backlog->len + len) {
+            size *= 2;
+        }
+
+        data = (unsigned char *) realloc(p_backlog->data, size);
+        if (data == NULL) {
+            LOGE("DLCI %d: out of memory, dropping modem output", dlci);
+            return;
+        }
+        p_backlog->data = data;
+        p_backlog->size = size;
+    }
+
+    memcpy(p_backlog->data + p_backlog->len, p, len);
+    p_backlog->len += len;
+
+    if (p_backlog->len >= CMUX_BACKLOG_HIGH && !p_backlog->throttled) {
+        LOGI("DLCI %d: channel not reading, stopping the modem", dlci);
+        setFlowControl(dlci, 1);
+    }
+}
+
+/** passes on as much of dlci's backlog as its owner now takes */
+static void flushBacklog(int dlci)
+{
+    CmuxBacklog *p_backlog = &s_backlog[dlci];
+    ssize_t sent;
+
+    sent = sendSome(dlci, p_backlog->data, p_backlog->len);
+    if (sent <= 0) {
+        return;
+    }
+
+    memmove(p_backlog->data, p_backlog->data + sent, p_backlog->len - sent);
+    p_backlog->len -= sent;
+
+    if (p_backlog->len == 0 && p_backlog->throttled) {
+        LOGI("DLCI %d: channel drained, resuming the modem", dlci);
+        setFlowControl(dlci, 0);
+    }
+}
+
+/**
+ * Takes the next complete frame out of s_in, resynchronizing on the flag
+ * after garbage or a bad FCS
+ *
+ * returns 1 if p_frame was filled in, 0 if more input is needed
+ */
+static int nextFrame(CmuxFrame *p_frame)
+{
+    size_t pos = 0;
+    int found = 0;
+
+    while (!found) {
+        size_t hdr;
+        size_t len;
+        unsigned char fcs;
+
+        /* skip to an opening flag and past any repeats of it */
+        while (pos < s_inLen && s_in[pos] != CMUX_FLAG) {
+            pos++;
+        }
+        while (pos + 1 < s_inLen && s_in[pos + 1] == CMUX_FLAG) {
+            pos++;
+        }
+
+        if (pos + 4 > s_inLen) {
+            break;
+        }
+
+        len = s_in[pos + 3] >> 1;
+        hdr = 3;
+        if ((s_in[pos + 3] & CMUX_EA) == 0) {
+            if (pos + 5 > s_inLen) {
+                break;
+            }
+            len |= (size_t) s_in[pos + 4] << 7;
+            hdr = 4;
+        }
+
+        if (pos + 1 + hdr + len + 1 > s_inLen) {
+            if (len > CMUX_MAX_INFO) {
+                /* can never fit, resynchronize */
+                pos++;
+                continue;
+            }
+            break;
+        }
+
+        fcs = fcsUpdate(0xFF, s_in + pos + 1, hdr);
+        fcs = fcsUpdate(fcs, s_in + pos + 1 + hdr + len, 1);
+
+        if (fcs != 0xCF || len > CMUX_MAX_INFO) {
+            LOGE("dropping bad frame");
+            pos++;
+            continue;
+        }
+
+        p_frame->dlci = s_in[pos + 1] >> 2;
+        p_frame->control = s_in[pos + 2];
+        p_frame->len = len;
+        memcpy(p_frame->info, s_in + pos + 1 + hdr, len);
+
+        /* leave the closing flag, it may open the next frame */
+        pos += 1 + hdr + len + 1;
+        found = 1;
+    }
+
+    memmove(s_in, s_in + pos, s_inLen - pos);
+    s_inLen -= pos;
+
+    return found;
+}
+
+/**
+ * Reads whatever the modem has into s_in, waiting at most msec
+ * (-1 means forever)
+ *
+ * returns the byte count, 0 on timeout, -1 on EOF or error
+ */
+static int readInput(int msec)
+{
+    struct pollfd pfd;
+    ssize_t count;
+    int ret;
+
+    if (s_inLen == sizeof(s_in) - 1) {
+        /* only garbage can fill the buffer */
+        s_inLen = 0;
+    }
+
+    pfd.fd = s_fd;
+    pfd.events = POLLIN;
+
+    do {
+        ret = poll(&pfd, 1, msec);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret <= 0) {
+        return ret;
+    }
+
+    do {
+        count = read(s_fd, s_in + s_inLen, sizeof(s_in) - 1 - s_inLen);
+    } while (count < 0 && errno == EINTR);
+
+    if (count <= 0) {
+        return -1;
+    }
+
+    s_inLen += count;
+
+    return count;
+}
+
+/**
+ * Sends AT+CMUX=0 and waits for its final response
+ * returns 0 on OK
+ */
+static int enterMuxMode()
+{
+    static const char cmd[] = "AT+CMUX=0\r";
+    int i;
+
+    for (i = 0 ; i < CMUX_SETUP_RETRY_COUNT ; i++) {
+        s_inLen = 0;
+
+        if (writeAll(s_fd, cmd, sizeof(cmd) - 1) < 0) {
+            return -1;
+        }
+
+        while (readInput(CMUX_SETUP_TIMEOUT_MSEC) > 0) {
+            char *p_ok;
+
+            s_in[s_inLen] = '\0';
+
+            if (strstr((char *) s_in, "ERROR") != NULL) {
+                return -1;
+            }
+
+            p_ok = strstr((char *) s_in, "OK\r");
+
+            if (p_ok != NULL) {
+                /* anything after the OK line is already framed */
+                size_t used = (unsigned char *) p_ok + 3 - s_in;
+
+                if (used < s_inLen && s_in[used] == '\n') {
+                    used++;
+                }
+                memmove(s_in, s_in + used, s_inLen - used);
+                s_inLen -= used;
+                return 0;
+            }
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Sends SABM or DISC on dlci and waits for the modem's UA
+ * returns 0 on UA, -1 on DM or timeout
+ */
+static int sendControlFrame(int dlci, int control)
+{
+    CmuxFrame frame;
+    int i;
+
+    for (i = 0 ; i < CMUX_SETUP_RETRY_COUNT ; i++) {
+        if (writeFrame(dlci, control, NULL, 0) < 0) {
+            return -1;
+        }
+
+        for (;;) {
+            while (nextFrame(&frame)) {
+                if (frame.dlci != dlci) {
+                    continue;
+                }
+                if (frame.control == CMUX_UA) {
+                    return 0;
+                }
+                if (frame.control == CMUX_DM) {
+                    return -1;
+                }
+            }
+
+            if (readInput(CMUX_SETUP_TIMEOUT_MSEC) <= 0) {
+                break;
+            }
+        }
+    }
+
+    return -1;
+}
+
+/** ends every channel as if its stream had closed */
+static void shutdownChannels()
+{
+    int i;
+
+    for (i = 1 ; i <= s_numChannels ; i++) {
+        if (s_socks[i] >= 0) {
+            shutdown(s_socks[i], SHUT_RDWR);
+        }
+    }
+}
+
+/**
+ * Handles a message on the control channel
+ * returns -1 if the modem closed the multiplexer
+ */
+static int handleControl(const CmuxFrame *p_frame)
+{
+    unsigned char msg[CMUX_N1];
+    int type;
+    size_t len;
+
+    if (p_frame->len < 2) {
+        return 0;
+    }
+
+    type = p_frame->info[0] & ~(CMUX_EA | CMUX_CR);
+    len = p_frame->info[1] >> 1;
+
+    if ((p_frame->info[0] & CMUX_CR) == 0 || len + 2 > p_frame->len
+        || len + 2 > sizeof(msg)
+    ) {
+        /* responses to our own commands need no action */
+        return 0;
+    }
+
+    switch (type) {
+        case CMUX_MSG_MSC:
+            writeControl(type, 0, p_frame->info + 2, len);
+            return 0;
+
+        case CMUX_MSG_CLD:
+            writeControl(type, 0, NULL, 0);
+            return -1;
+
+        default:
+            /* not supported, see 27.010 5.4.6.3.8 */
+            msg[0] = p_frame->info[0];
+            writeControl(0x10, 0, msg, 1);
+            return 0;
+    }
+}
+
+/**
+ * Delivers a frame from the modem
+ * returns -1 if the multiplexer was closed
+ */
+static int handleFrame(const CmuxFrame *p_frame)
+{
+    int dlci = p_frame->dlci;
+    int control = p_frame->control & ~CMUX_PF;
+
+    if (dlci > s_numChannels) {
+        if (p_frame->control == CMUX_SABM) {
+            writeFrame(dlci, CMUX_DM, NULL, 0);
+        }
+        return 0;
+    }
+
+    /* UI frames are not used; their FCS would also cover the info */
+    if (control == CMUX_UIH) {
+        if (dlci == 0) {
+            return handleControl(p_frame);
+        }
+
+        if (s_socks[dlci] >= 0) {
+            deliver(dlci, p_frame->info, p_frame->len);
+        }
+    } else if (p_frame->control == CMUX_DISC) {
+        writeFrame(dlci, CMUX_UA, NULL, 0);
+
+        if (dlci == 0) {
+            return -1;
+        }
+
+        if (s_socks[dlci] >= 0) {
+            shutdown(s_socks[dlci], SHUT_RDWR);
+        }
+    } else if (p_frame->control == CMUX_SABM) {
+        writeFrame(dlci, CMUX_UA, NULL, 0);
+    }
+
+    return 0;
+}
+
+static void *muxLoop(void *arg)
+{
+    struct pollfd pfds[CMUX_MAX_CHANNELS + 2];
+    int i;
+
+    prctl(PR_SET_NAME, (unsigned long) "at_mux", 0, 0, 0);
+
+    for (i = 1 ; i <= s_numChannels ; i++) {
+        s_active[i] = 1;
+    }
+
+    for (;;) {
+        unsigned char buf[CMUX_N1];
+        CmuxFrame frame;
+        int ret;
+
+        pfds[0].fd = s_fd;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = s_wakePipe[0];
+        pfds[1].events = POLLIN;
+
+        for (i = 1 ; i <= s_numChannels ; i++) {
+            /* a negative fd is skipped by poll */
+            pfds[i + 1].fd = s_active[i] ? s_socks[i] : -1;
+            pfds[i + 1].events = POLLIN;
+            if (s_backlog[i].len > 0) {
+                pfds[i + 1].events |= POLLOUT;
+            }
+            pfds[i + 1].revents = 0;
+        }
+
+        do {
+            ret = poll(pfds, s_numChannels + 2, -1);
+        } while (ret < 0 && errno == EINTR);
+
+        if (ret < 0 || pfds[1].revents != 0) {
+            break;
+        }
+
+        if (pfds[0].revents != 0) {
+            if (readInput(0) < 0) {
+                LOGI("modem closed");
+                break;
+            }
+
+            while (nextFrame(&frame)) {
+                if (handleFrame(&frame) < 0) {
+                    LOGI("modem closed the multiplexer");
+                    goto done;
+                }
+            }
+        }
+
+        for (i = 1 ; i <= s_numChannels ; i++) {
+            ssize_t count;
+
+            if ((pfds[i + 1].revents & POLLOUT) && s_active[i]) {
+                flushBacklog(i);
+            }
+
+            if ((pfds[i + 1].revents & ~POLLOUT) == 0 || !s_active[i]) {
+                continue;
+            }
+
+            do {
+                count = read(s_socks[i], buf, sizeof(buf));
+            } while (count < 0 && errno == EINTR);
+
+            if (count <= 0) {
+                /* the channel owner is done with this DLCI */
+                deactivate(i);
+            } else if (writeFrame(i, CMUX_UIH, buf, count) < 0) {
+                LOGE("DLCI %d: modem write failed", i);
+            }
+        }
+    }
+
+done:
+    shutdownChannels();
+
+    return NULL;
+}
+
+int cmux_open(int fd, int numChannels, int *p_fds)
+{
+    unsigned char msc[2];
+    int sv[2];
+    int i;
+
+    if (s_fd >= 0 || numChannels < 1 || numChannels >= CMUX_MAX_CHANNELS) {
+        return -1;
+    }
+
+    s_fd = fd;
+    s_numChannels = numChannels;
+
+    for (i = 0 ; i < CMUX_MAX_CHANNELS ; i++) {
+        s_socks[i] = -1;
+    }
+
+    if (enterMuxMode() < 0) {
+        LOGE("AT+CMUX=0 failed");
+        s_fd = -1;
+        return -1;
+    }
+
+    /* DLCI 0 first, it carries the control channel */
+    for (i = 0 ; i <= numChannels ; i++) {
+        if (sendControlFrame(i, CMUX_SABM) < 0) {
+            LOGE("DLCI %d: no UA for SABM", i);
+            goto error;
+        }
+    }
+
+    for (i = 1 ; i <= numChannels ; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+            LOGE("socketpair failed: %s", strerror(errno));
+            goto error;
+        }
+
+        p_fds[i - 1] = sv[0];
+        s_socks[i] = sv[1];
+
+        /* some modems hold a DLCI until they see the terminal ready */
+        msc[0] = CMUX_EA | CMUX_CR | (i << 2);
+        msc[1] = CMUX_V24_READY;
+        writeControl(CMUX_MSG_MSC, 1, msc, sizeof(msc));
+    }
+
+    if (pipe(s_wakePipe) < 0
+        || pthread_create(&s_tid_mux, NULL, muxLoop, NULL) != 0
+    ) {
+        LOGE("failed to start the mux thread");
+        goto error;
+    }
+
+    LOGI("CMUX running with %d channels", numChannels);
+
+    return 0;
+
+error:
+    for (i = 1 ; i <= numChannels ; i++) {
+        if (s_socks[i] >= 0) {
+            close(s_socks[i]);
+            close(p_fds[i - 1]);
+            s_socks[i] = -1;
+        }
+    }
+    if (s_wakePipe[0] >= 0) {
+        close(s_wakePipe[0]);
+        close(s_wakePipe[1]);
+        s_wakePipe[0] = s_wakePipe[1] = -1;
+    }
+
+    /* leave the modem in AT command mode */
+    writeControl(CMUX_MSG_CLD, 1, NULL, 0);
+    s_fd = -1;
+
+    return -1;
+}
+
+void cmux_close()
+{
+    int i;
+
+    if (s_fd < 0) {
+        return;
+    }
+
+    writeControl(CMUX_MSG_CLD, 1, NULL, 0);
+
+    write(s_wakePipe[1], "", 1);
+    pthread_join(s_tid_mux, NULL);
+
+    for (i = 1 ; i <= s_numChannels ; i++) {
+        close(s_socks[i]);
+        s_socks[i] = -1;
+
+        free(s_backlog[i].data);
+        memset(&s_backlog[i], 0, sizeof(s_backlog[i]));
+    }
+
+    close(s_wakePipe[0]);
+    close(s_wakePipe[1]);
+    s_wakePipe[0] = s_wakePipe[1] = -1;
+
+    s_fd = -1;
+}
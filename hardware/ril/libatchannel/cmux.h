@@ -0,0 +1,57 @@
+/* //device/system/libatchannel/cmux.h
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef CMUX_H
+#define CMUX_H 1
+
+#include "atchannel.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* one DLCI per AT channel; DLCI 0 is the mux control channel */
+#define CMUX_MAX_CHANNELS AT_MAX_CHANNELS
+
+/**
+ * Switches the modem on stream fd into TS 27.010 basic mode multiplexing
+ * (AT+CMUX=0) and opens DLCIs 1..numChannels. On success p_fds[i] is a
+ * local stream carrying the AT traffic of DLCI i + 1, ready for at_open()
+ * or at_channel_open(), and a mux thread moves frames between them and fd
+ * until cmux_close(). If fd closes, every channel sees end of file.
+ * Modem output for a channel that is not being read is buffered, with
+ * the modem asked to pause that DLCI, rather than stalling the others;
+ * once its owner closes p_fds[i] the DLCI's traffic is discarded.
+ *
+ * Only one multiplexer runs at a time. fd is not closed by this module.
+ *
+ * returns 0 on success, -1 if the modem did not enter mux mode; fd is
+ * then still usable as a plain AT channel.
+ */
+int cmux_open(int fd, int numChannels, int *p_fds);
+
+/**
+ * Sends the modem back to AT command mode and stops the mux thread.
+ * The channel fds handed out by cmux_open() stay open for their owner.
+ */
+void cmux_close();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*CMUX_H*/
@@ -1,4 +1,4 @@
-/* //device/system/reference-ril/misc.c
+/* //device/system/libatchannel/misc.c
 **
 ** Copyright 2006, The Android Open Source Project
 **
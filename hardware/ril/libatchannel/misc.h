@@ -1,4 +1,4 @@
-/* //device/system/reference-ril/misc.h
+/* //device/system/libatchannel/misc.h
 **
 ** Copyright 2006, The Android Open Source Project
 **
@@ -17,7 +17,9 @@
 
 #define LOG_TAG "RILC"
 
+#ifdef HAVE_ANDROID_OS
 #include <hardware_legacy/power.h>
+#endif /* HAVE_ANDROID_OS */
 
 #include <telephony/ril.h>
 #include <telephony/ril_cdma_sms.h>
@@ -36,6 +38,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -45,11 +48,13 @@
 #include <ctype.h>
 #include <alloca.h>
 #include <sys/un.h>
+#include <sys/poll.h>
 #include <assert.h>
 #include <netinet/in.h>
 #include <cutils/properties.h>
 
 #include <ril_event.h>
+#include <ril_capture.h>
 
 namespace android {
 
@@ -66,6 +71,9 @@ namespace android {
 // match with constant in RIL.java
 #define MAX_COMMAND_BYTES (8 * 1024)
 
+// how long a response write waits for a stalled command socket reader
+#define RESPONSE_WRITE_TIMEOUT_MS 5000
+
 // Basically: memset buffers that the client library
 // shouldn't be using anymore in an attempt to find
 // memory usage issues sooner.
@@ -133,6 +141,7 @@ typedef struct RequestInfo {
     struct RequestInfo *p_next;
     char cancelled;
     char local;         // responses to local commands do not go back to command process
+    int64_t dispatchTime;   // elapsedRealtime() when handed to onRequest
 } RequestInfo;
 
 typedef struct UserCallbackInfo {
@@ -181,8 +190,6 @@ static RequestInfo *s_pendingRequests = NULL;
 static RequestInfo *s_toDispatchHead = NULL;
 static RequestInfo *s_toDispatchTail = NULL;
 
-static UserCallbackInfo *s_last_wake_timeout_info = NULL;
-
 static void *s_lastNITZTimeData = NULL;
 static size_t s_lastNITZTimeDataSize;
 
@@ -243,6 +250,8 @@ static UserCallbackInfo * internalRequestTimedCallback
     (RIL_TimedCallback callback, void *param,
         const struct timeval *relativeTime);
 
+static void dumpStats(int fd);
+
 /** Index == requestNumber */
 static CommandInfo s_commands[] = {
 #include "ril_commands.h"
@@ -252,6 +261,105 @@ static UnsolResponseInfo s_unsolResponses[] = {
 #include "ril_unsol_commands.h"
 };
 
+/*
+ * Request and unsol statistics, dumped through the debug socket.
+ *
+ * For each request: dispatch-to-complete latency as a histogram where
+ * bucket 0 counts latencies under 1ms and bucket i counts latencies in
+ * [2^(i-1), 2^i) ms, plus error and cancellation counts.
+ */
+
+#define STATS_LATENCY_BUCKETS 16
+
+// RIL_Errno values plus one slot for anything out of range
+#define STATS_NUM_ERRNOS (RIL_E_ILLEGAL_SIM_OR_ME + 2)
+
+typedef struct {
+    unsigned int count;
+    unsigned int errors;
+    unsigned int cancelled;
+    int64_t totalLatency;
+    int64_t maxLatency;
+    unsigned int latency[STATS_LATENCY_BUCKETS];
+} RequestStats;
+
+static pthread_mutex_t s_statsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static RequestStats s_requestStats[NUM_ELEMS(s_commands)];
+static unsigned int s_unsolStats[NUM_ELEMS(s_unsolResponses)];
+static unsigned int s_errnoStats[STATS_NUM_ERRNOS];
+
+static int s_inFlight = 0;
+static int s_maxInFlight = 0;
+static int64_t s_statsStartTime = 0;
+
+static void
+statsRequestDispatched(RequestInfo *pRI) {
+    pRI->dispatchTime = elapsedRealtime();
+
+    pthread_mutex_lock(&s_statsMutex);
+
+    if (s_statsStartTime == 0) {
+        s_statsStartTime = pRI->dispatchTime;
+    }
+
+    s_inFlight++;
+    if (s_inFlight > s_maxInFlight) {
+        s_maxInFlight = s_inFlight;
+    }
+
+    pthread_mutex_unlock(&s_statsMutex);
+}
+
+static void
+statsRequestCompleted(RequestInfo *pRI, RIL_Errno e) {
+    int64_t latency;
+    RequestStats *p_stats;
+    int bucket;
+
+    latency = elapsedRealtime() - pRI->dispatchTime;
+
+    for (bucket = 0
+            ; (latency >> bucket) > 0 && bucket < STATS_LATENCY_BUCKETS - 1
+            ; bucket++
+    );
+
+    pthread_mutex_lock(&s_statsMutex);
+
+    p_stats = &s_requestStats[pRI->pCI->requestNumber];
+
+    p_stats->count++;
+    p_stats->totalLatency += latency;
+    if (latency > p_stats->maxLatency) {
+        p_stats->maxLatency = latency;
+    }
+    p_stats->latency[bucket]++;
+
+    if (e != RIL_E_SUCCESS) {
+        p_stats->errors++;
+    }
+    if (pRI->cancelled) {
+        p_stats->cancelled++;
+    }
+
+    if (e < 0 || e >= STATS_NUM_ERRNOS - 1) {
+        s_errnoStats[STATS_NUM_ERRNOS - 1]++;
+    } else {
+        s_errnoStats[e]++;
+    }
+
+    s_inFlight--;
+
+    pthread_mutex_unlock(&s_statsMutex);
+}
+
+static void
+statsUnsolReceived(int unsolResponseIndex) {
+    pthread_mutex_lock(&s_statsMutex);
+    s_unsolStats[unsolResponseIndex]++;
+    pthread_mutex_unlock(&s_statsMutex);
+}
+
 
 static char *
 strdupReadString(Parcel &p) {
@@ -263,14 +371,167 @@ strdupReadString(Parcel &p) {
     return strndup16to8(s16, stringlen);
 }
 
+/**
+ * Writes s as a String16, transcoding straight into the parcel buffer
+ * NULL is written as a null string
+ */
 static void writeStringToParcel(Parcel &p, const char *s) {
     char16_t *s16;
     size_t s16_len;
-    s16 = strdup8to16(s, &s16_len);
-    p.writeString16(s16, s16_len);
-    free(s16);
+
+    if (s == NULL) {
+        p.writeInt32(-1);
+        return;
+    }
+
+    s16_len = strlen8to16(s);
+    p.writeInt32(s16_len);
+
+    s16 = (char16_t *) p.writeInplace((s16_len + 1) * sizeof(char16_t));
+    if (s16 != NULL) {
+        strcpy8to16(s16, s, &s16_len);
+        s16[s16_len] = 0;
+    }
+}
+
+/** As writeStringToParcel, for a buffer of len chars with no terminator */
+static void writeCountedStringToParcel(Parcel &p, const char *buf, int len) {
+    char string8[256];
+
+    len = MIN(len, (int)sizeof(string8) - 1);
+    memcpy(string8, buf, len);
+    string8[len] = '\0';
+
+    writeStringToParcel(p, string8);
+}
+
+
+/*
+ * Command socket capture, enabled by RIL_CAPTURE_PROPERTY
+ * See ril_capture.h for the file format.
+ */
+
+static int s_fdCapture = -1;
+static pthread_mutex_t s_captureMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+openCapture() {
+    char path[PROPERTY_VALUE_MAX];
+    char debuggable[PROPERTY_VALUE_MAX];
+    RIL_CaptureHeader header;
+
+    if (property_get(RIL_CAPTURE_PROPERTY, path, "") <= 0) {
+        return;
+    }
+
+    property_get("ro.debuggable", debuggable, "0");
+    if (strcmp(debuggable, "1") != 0) {
+        LOGW("%s ignored: capture needs a debuggable build",
+                RIL_CAPTURE_PROPERTY);
+        return;
+    }
+
+    s_fdCapture = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (s_fdCapture < 0) {
+        LOGE("Unable to open capture file %s errno:%d", path, errno);
+        return;
+    }
+
+    header.magic = RIL_CAPTURE_MAGIC;
+    header.version = RIL_CAPTURE_VERSION;
+
+    if (write(s_fdCapture, &header, sizeof(header)) != sizeof(header)) {
+        LOGE("Unable to write capture file %s errno:%d", path, errno);
+        close(s_fdCapture);
+        s_fdCapture = -1;
+        return;
+    }
+
+    LOGI("Capturing command socket to %s", path);
+}
+
+/*
+ * Requests whose arguments carry PINs, passwords, dialled numbers,
+ * message bodies or other user data.  Their COMMAND records are cut
+ * down to the request and token.
+ */
+static bool
+captureIsSensitive(int32_t request) {
+    switch (request) {
+        case RIL_REQUEST_ENTER_SIM_PIN:
+        case RIL_REQUEST_ENTER_SIM_PUK:
+        case RIL_REQUEST_ENTER_SIM_PIN2:
+        case RIL_REQUEST_ENTER_SIM_PUK2:
+        case RIL_REQUEST_CHANGE_SIM_PIN:
+        case RIL_REQUEST_CHANGE_SIM_PIN2:
+        case RIL_REQUEST_ENTER_NETWORK_DEPERSONALIZATION:
+        case RIL_REQUEST_QUERY_FACILITY_LOCK:
+        case RIL_REQUEST_SET_FACILITY_LOCK:
+        case RIL_REQUEST_CHANGE_BARRING_PASSWORD:
+        case RIL_REQUEST_SIM_IO:
+        case RIL_REQUEST_DIAL:
+        case RIL_REQUEST_DTMF:
+        case RIL_REQUEST_DTMF_START:
+        case RIL_REQUEST_SEND_SMS:
+        case RIL_REQUEST_SEND_SMS_EXPECT_MORE:
+        case RIL_REQUEST_WRITE_SMS_TO_SIM:
+        case RIL_REQUEST_SEND_USSD:
+        case RIL_REQUEST_SET_CALL_FORWARD:
+        case RIL_REQUEST_SETUP_DATA_CALL:
+        case RIL_REQUEST_STK_SEND_ENVELOPE_COMMAND:
+        case RIL_REQUEST_STK_SEND_TERMINAL_RESPONSE:
+        case RIL_REQUEST_CDMA_FLASH:
+        case RIL_REQUEST_CDMA_BURST_DTMF:
+        case RIL_REQUEST_CDMA_SEND_SMS:
+        case RIL_REQUEST_CDMA_WRITE_SMS_TO_RUIM:
+            return true;
+        default:
+            return false;
+    }
 }
 
+static void
+captureRecord(uint32_t type, int32_t request, int32_t token, int32_t error,
+                const void *data, size_t datalen) {
+    RIL_CaptureRecord record;
+
+    if (s_fdCapture < 0) {
+        return;
+    }
+
+    memset(&record, 0, sizeof(record));
+
+    if (type == RIL_CAPTURE_COMMAND && captureIsSensitive(request)) {
+        // keep only the request and token at the front of the record
+        datalen = MIN(datalen, 2 * sizeof(int32_t));
+        record.flags |= RIL_CAPTURE_REDACTED;
+    }
+
+    record.type = type;
+    record.length = datalen;
+    record.timestamp = elapsedRealtime();
+    record.request = request;
+    record.token = token;
+    record.error = error;
+
+    pthread_mutex_lock(&s_captureMutex);
+
+    /* an earlier write error may have closed it since the check above */
+    if (s_fdCapture < 0) {
+        pthread_mutex_unlock(&s_captureMutex);
+        return;
+    }
+
+    if (write(s_fdCapture, &record, sizeof(record)) != sizeof(record)
+        || (datalen > 0
+            && write(s_fdCapture, data, datalen) != (ssize_t)datalen)) {
+        LOGE("Error writing capture file errno:%d, capture stopped", errno);
+        close(s_fdCapture);
+        s_fdCapture = -1;
+    }
+
+    pthread_mutex_unlock(&s_captureMutex);
+}
 
 static void
 memsetString (char *s) {
@@ -310,6 +571,8 @@ issueLocalRequest(int request, void *data, int len) {
     ret = pthread_mutex_unlock(&s_pendingRequestsMutex);
     assert (ret == 0);
 
+    statsRequestDispatched(pRI);
+
     LOGD("C[locl]> %s", requestToString(request));
 
     s_callbacks.onRequest(request, data, len, pRI);
@@ -337,6 +600,8 @@ processCommandBuffer(void *buffer, size_t buflen) {
         return 0;
     }
 
+    captureRecord(RIL_CAPTURE_COMMAND, request, token, 0, buffer, buflen);
+
     if (request < 1 || request >= (int32_t)NUM_ELEMS(s_commands)) {
         LOGE("unsupported request code %d token %d", request, token);
         // FIXME this should perhaps return a response
@@ -358,6 +623,8 @@ processCommandBuffer(void *buffer, size_t buflen) {
     ret = pthread_mutex_unlock(&s_pendingRequestsMutex);
     assert (ret == 0);
 
+    statsRequestDispatched(pRI);
+
 /*    sLastDispatchedToken = token; */
 
     pRI->pCI->dispatchFunction(p, pRI);
@@ -1195,6 +1462,24 @@ blockingWrite(int fd, const void *buffer, size_t len) {
 
         if (written >= 0) {
             writeOffset += written;
+        } else if (errno == EAGAIN) {
+            // the command socket is non-blocking; wait for the reader,
+            // but don't let a reader that stopped reading wedge us
+            struct pollfd pfd;
+            int ret;
+
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            do {
+                ret = poll(&pfd, 1, RESPONSE_WRITE_TIMEOUT_MS);
+            } while (ret < 0 && errno == EINTR);
+
+            if (ret <= 0) {
+                LOGE ("RIL Response: command socket not draining, %s",
+                        ret == 0 ? "timed out" : "poll failed");
+                close(fd);
+                return -1;
+            }
         } else {   // written < 0
             LOGE ("RIL Response: unexpected error on write errno:%d", errno);
             close(fd);
@@ -1251,6 +1536,361 @@ sendResponse (Parcel &p) {
     return sendResponseRaw(p.data(), p.dataSize());
 }
 
+/*
+ * Table driven marshalling
+ *
+ * The parcel layout of each fixed RIL_* response struct is described once
+ * by a ParcelLayout<T> specialization: an ordered list of fields, each with
+ * its type and offset in T.  marshallStruct<T>() walks that table, so every
+ * response function that sends a struct shares the same marshalling code.
+ */
+
+typedef enum {
+    FIELD_INT,          // int or enum, written as int32
+    FIELD_CHAR,         // char, widened to int32
+    FIELD_UCHAR,        // unsigned char, zero extended to int32
+    FIELD_STRING,       // NUL terminated char *, written as String16
+    FIELD_COUNTED       // char count at offset, char buffer at aux
+} ParcelFieldType;
+
+typedef struct {
+    ParcelFieldType type;
+    size_t offset;
+    size_t aux;         // FIELD_COUNTED only: offset of the buffer
+    size_t limit;       // FIELD_COUNTED only: size of the buffer
+} ParcelField;
+
+template <typename T>
+struct ParcelLayout {
+    static const ParcelField fields[];
+    static const size_t numFields;
+};
+
+#define INT_FIELD(T, m)     { FIELD_INT, offsetof(T, m), 0, 0 }
+#define CHAR_FIELD(T, m)    { FIELD_CHAR, offsetof(T, m), 0, 0 }
+#define UCHAR_FIELD(T, m)   { FIELD_UCHAR, offsetof(T, m), 0, 0 }
+#define STRING_FIELD(T, m)  { FIELD_STRING, offsetof(T, m), 0, 0 }
+#define COUNTED_FIELD(T, count, buf) \
+    { FIELD_COUNTED, offsetof(T, count), offsetof(T, buf), \
+      sizeof(((T *)0)->buf) }
+
+#define PARCEL_LAYOUT(T) \
+    template <> const ParcelField ParcelLayout<T>::fields[]
+#define PARCEL_LAYOUT_END(T) \
+    template <> const size_t ParcelLayout<T>::numFields \
+        = NUM_ELEMS(ParcelLayout<T>::fields)
+
+PARCEL_LAYOUT(RIL_Call) = {
+    INT_FIELD(RIL_Call, state),
+    INT_FIELD(RIL_Call, index),
+    INT_FIELD(RIL_Call, toa),
+    CHAR_FIELD(RIL_Call, isMpty),
+    CHAR_FIELD(RIL_Call, isMT),
+    CHAR_FIELD(RIL_Call, als),
+    CHAR_FIELD(RIL_Call, isVoice),
+    CHAR_FIELD(RIL_Call, isVoicePrivacy),
+    STRING_FIELD(RIL_Call, number),
+    INT_FIELD(RIL_Call, numberPresentation),
+    STRING_FIELD(RIL_Call, name),
+    INT_FIELD(RIL_Call, namePresentation),
+};
+PARCEL_LAYOUT_END(RIL_Call);
+
+PARCEL_LAYOUT(RIL_SMS_Response) = {
+    INT_FIELD(RIL_SMS_Response, messageRef),
+    STRING_FIELD(RIL_SMS_Response, ackPDU),
+    INT_FIELD(RIL_SMS_Response, errorCode),
+};
+PARCEL_LAYOUT_END(RIL_SMS_Response);
+
+PARCEL_LAYOUT(RIL_Data_Call_Response) = {
+    INT_FIELD(RIL_Data_Call_Response, cid),
+    INT_FIELD(RIL_Data_Call_Response, active),
+    STRING_FIELD(RIL_Data_Call_Response, type),
+    STRING_FIELD(RIL_Data_Call_Response, apn),
+    STRING_FIELD(RIL_Data_Call_Response, address),
+};
+PARCEL_LAYOUT_END(RIL_Data_Call_Response);
+
+PARCEL_LAYOUT(RIL_SIM_IO_Response) = {
+    INT_FIELD(RIL_SIM_IO_Response, sw1),
+    INT_FIELD(RIL_SIM_IO_Response, sw2),
+    STRING_FIELD(RIL_SIM_IO_Response, simResponse),
+};
+PARCEL_LAYOUT_END(RIL_SIM_IO_Response);
+
+PARCEL_LAYOUT(RIL_CallForwardInfo) = {
+    INT_FIELD(RIL_CallForwardInfo, status),
+    INT_FIELD(RIL_CallForwardInfo, reason),
+    INT_FIELD(RIL_CallForwardInfo, serviceClass),
+    INT_FIELD(RIL_CallForwardInfo, toa),
+    STRING_FIELD(RIL_CallForwardInfo, number),
+    INT_FIELD(RIL_CallForwardInfo, timeSeconds),
+};
+PARCEL_LAYOUT_END(RIL_CallForwardInfo);
+
+PARCEL_LAYOUT(RIL_SuppSvcNotification) = {
+    INT_FIELD(RIL_SuppSvcNotification, notificationType),
+    INT_FIELD(RIL_SuppSvcNotification, code),
+    INT_FIELD(RIL_SuppSvcNotification, index),
+    INT_FIELD(RIL_SuppSvcNotification, type),
+    STRING_FIELD(RIL_SuppSvcNotification, number),
+};
+PARCEL_LAYOUT_END(RIL_SuppSvcNotification);
+
+PARCEL_LAYOUT(RIL_NeighboringCell) = {
+    INT_FIELD(RIL_NeighboringCell, rssi),
+    STRING_FIELD(RIL_NeighboringCell, cid),
+};
+PARCEL_LAYOUT_END(RIL_NeighboringCell);
+
+PARCEL_LAYOUT(RIL_CDMA_SignalInfoRecord) = {
+    CHAR_FIELD(RIL_CDMA_SignalInfoRecord, isPresent),
+    CHAR_FIELD(RIL_CDMA_SignalInfoRecord, signalType),
+    CHAR_FIELD(RIL_CDMA_SignalInfoRecord, alertPitch),
+    CHAR_FIELD(RIL_CDMA_SignalInfoRecord, signal),
+};
+PARCEL_LAYOUT_END(RIL_CDMA_SignalInfoRecord);
+
+PARCEL_LAYOUT(RIL_CDMA_DisplayInfoRecord) = {
+    COUNTED_FIELD(RIL_CDMA_DisplayInfoRecord, alpha_len, alpha_buf),
+};
+PARCEL_LAYOUT_END(RIL_CDMA_DisplayInfoRecord);
+
+PARCEL_LAYOUT(RIL_CDMA_NumberInfoRecord) = {
+    COUNTED_FIELD(RIL_CDMA_NumberInfoRecord, len, buf),
+    CHAR_FIELD(RIL_CDMA_NumberInfoRecord, number_type),
+    CHAR_FIELD(RIL_CDMA_NumberInfoRecord, number_plan),
+    CHAR_FIELD(RIL_CDMA_NumberInfoRecord, pi),
+    CHAR_FIELD(RIL_CDMA_NumberInfoRecord, si),
+};
+PARCEL_LAYOUT_END(RIL_CDMA_NumberInfoRecord);
+
+PARCEL_LAYOUT(RIL_CDMA_RedirectingNumberInfoRecord) = {
+    COUNTED_FIELD(RIL_CDMA_RedirectingNumberInfoRecord,
+            redirectingNumber.len, redirectingNumber.buf),
+    CHAR_FIELD(RIL_CDMA_RedirectingNumberInfoRecord,
+            redirectingNumber.number_type),
+    CHAR_FIELD(RIL_CDMA_RedirectingNumberInfoRecord,
+            redirectingNumber.number_plan),
+    CHAR_FIELD(RIL_CDMA_RedirectingNumberInfoRecord, redirectingNumber.pi),
+    CHAR_FIELD(RIL_CDMA_RedirectingNumberInfoRecord, redirectingNumber.si),
+    INT_FIELD(RIL_CDMA_RedirectingNumberInfoRecord, redirectingReason),
+};
+PARCEL_LAYOUT_END(RIL_CDMA_RedirectingNumberInfoRecord);
+
+PARCEL_LAYOUT(RIL_CDMA_LineControlInfoRecord) = {
+    CHAR_FIELD(RIL_CDMA_LineControlInfoRecord, lineCtrlPolarityIncluded),
+    CHAR_FIELD(RIL_CDMA_LineControlInfoRecord, lineCtrlToggle),
+    CHAR_FIELD(RIL_CDMA_LineControlInfoRecord, lineCtrlReverse),
+    CHAR_FIELD(RIL_CDMA_LineControlInfoRecord, lineCtrlPowerDenial),
+};
+PARCEL_LAYOUT_END(RIL_CDMA_LineControlInfoRecord);
+
+PARCEL_LAYOUT(RIL_CDMA_T53_CLIRInfoRecord) = {
+    CHAR_FIELD(RIL_CDMA_T53_CLIRInfoRecord, cause),
+};
+PARCEL_LAYOUT_END(RIL_CDMA_T53_CLIRInfoRecord);
+
+PARCEL_LAYOUT(RIL_CDMA_T53_AudioControlInfoRecord) = {
+    CHAR_FIELD(RIL_CDMA_T53_AudioControlInfoRecord, upLink),
+    CHAR_FIELD(RIL_CDMA_T53_AudioControlInfoRecord, downLink),
+};
+PARCEL_LAYOUT_END(RIL_CDMA_T53_AudioControlInfoRecord);
+
+PARCEL_LAYOUT(RIL_SignalStrength) = {
+    INT_FIELD(RIL_SignalStrength, GW_SignalStrength.signalStrength),
+    INT_FIELD(RIL_SignalStrength, GW_SignalStrength.bitErrorRate),
+    INT_FIELD(RIL_SignalStrength, CDMA_SignalStrength.dbm),
+    INT_FIELD(RIL_SignalStrength, CDMA_SignalStrength.ecio),
+    INT_FIELD(RIL_SignalStrength, EVDO_SignalStrength.dbm),
+    INT_FIELD(RIL_SignalStrength, EVDO_SignalStrength.ecio),
+    INT_FIELD(RIL_SignalStrength, EVDO_SignalStrength.signalNoiseRatio),
+};
+PARCEL_LAYOUT_END(RIL_SignalStrength);
+
+PARCEL_LAYOUT(RIL_CDMA_CallWaiting) = {
+    STRING_FIELD(RIL_CDMA_CallWaiting, number),
+    INT_FIELD(RIL_CDMA_CallWaiting, numberPresentation),
+    STRING_FIELD(RIL_CDMA_CallWaiting, name),
+    CHAR_FIELD(RIL_CDMA_CallWaiting, signalInfoRecord.isPresent),
+    CHAR_FIELD(RIL_CDMA_CallWaiting, signalInfoRecord.signalType),
+    CHAR_FIELD(RIL_CDMA_CallWaiting, signalInfoRecord.alertPitch),
+    CHAR_FIELD(RIL_CDMA_CallWaiting, signalInfoRecord.signal),
+};
+PARCEL_LAYOUT_END(RIL_CDMA_CallWaiting);
+
+PARCEL_LAYOUT(RIL_CardStatus) = {
+    INT_FIELD(RIL_CardStatus, card_state),
+    INT_FIELD(RIL_CardStatus, universal_pin_state),
+    INT_FIELD(RIL_CardStatus, gsm_umts_subscription_app_index),
+    INT_FIELD(RIL_CardStatus, cdma_subscription_app_index),
+    INT_FIELD(RIL_CardStatus, num_applications),
+};
+PARCEL_LAYOUT_END(RIL_CardStatus);
+
+PARCEL_LAYOUT(RIL_AppStatus) = {
+    INT_FIELD(RIL_AppStatus, app_type),
+    INT_FIELD(RIL_AppStatus, app_state),
+    INT_FIELD(RIL_AppStatus, perso_substate),
+    STRING_FIELD(RIL_AppStatus, aid_ptr),
+    STRING_FIELD(RIL_AppStatus, app_label_ptr),
+    INT_FIELD(RIL_AppStatus, pin1_replaced),
+    INT_FIELD(RIL_AppStatus, pin1),
+    INT_FIELD(RIL_AppStatus, pin2),
+};
+PARCEL_LAYOUT_END(RIL_AppStatus);
+
+PARCEL_LAYOUT(RIL_GSM_BroadcastSmsConfigInfo) = {
+    INT_FIELD(RIL_GSM_BroadcastSmsConfigInfo, fromServiceId),
+    INT_FIELD(RIL_GSM_BroadcastSmsConfigInfo, toServiceId),
+    INT_FIELD(RIL_GSM_BroadcastSmsConfigInfo, fromCodeScheme),
+    INT_FIELD(RIL_GSM_BroadcastSmsConfigInfo, toCodeScheme),
+    UCHAR_FIELD(RIL_GSM_BroadcastSmsConfigInfo, selected),
+};
+PARCEL_LAYOUT_END(RIL_GSM_BroadcastSmsConfigInfo);
+
+PARCEL_LAYOUT(RIL_CDMA_BroadcastSmsConfigInfo) = {
+    INT_FIELD(RIL_CDMA_BroadcastSmsConfigInfo, service_category),
+    INT_FIELD(RIL_CDMA_BroadcastSmsConfigInfo, language),
+    UCHAR_FIELD(RIL_CDMA_BroadcastSmsConfigInfo, selected),
+};
+PARCEL_LAYOUT_END(RIL_CDMA_BroadcastSmsConfigInfo);
+
+/**
+ * Marshall one T into the parcel as described by ParcelLayout<T>
+ * Returns 0 or RIL_ERRNO_INVALID_RESPONSE if a counted string overflows
+ */
+template <typename T>
+static int marshallStruct(Parcel &p, const T *p_cur) {
+    const uint8_t *base = (const uint8_t *) p_cur;
+
+    for (size_t i = 0 ; i < ParcelLayout<T>::numFields ; i++) {
+        const ParcelField *f = &ParcelLayout<T>::fields[i];
+
+        switch (f->type) {
+            case FIELD_INT:
+                p.writeInt32(*(const int *)(base + f->offset));
+                appendPrintBuf("%s%d,", printBuf,
+                    *(const int *)(base + f->offset));
+                break;
+            case FIELD_CHAR:
+                p.writeInt32(*(const char *)(base + f->offset));
+                appendPrintBuf("%s%d,", printBuf,
+                    *(const char *)(base + f->offset));
+                break;
+            case FIELD_UCHAR:
+                p.writeInt32(*(const unsigned char *)(base + f->offset));
+                appendPrintBuf("%s%d,", printBuf,
+                    *(const unsigned char *)(base + f->offset));
+                break;
+            case FIELD_STRING:
+                writeStringToParcel(p,
+                    *(const char * const *)(base + f->offset));
+                appendPrintBuf("%s%s,", printBuf,
+                    *(const char * const *)(base + f->offset));
+                break;
+            case FIELD_COUNTED: {
+                int len = *(const char *)(base + f->offset);
+
+                if (len < 0 || (size_t)len > f->limit) {
+                    LOGE("invalid counted string length %d "
+                         "expected not more than %d", len, (int)f->limit);
+                    return RIL_ERRNO_INVALID_RESPONSE;
+                }
+                writeCountedStringToParcel(p,
+                    (const char *)(base + f->aux), len);
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/** response is a single T */
+template <typename T>
+static int responseStruct(Parcel &p, void *response, size_t responselen) {
+    if (response == NULL) {
+        LOGE("invalid response: NULL");
+        return RIL_ERRNO_INVALID_RESPONSE;
+    }
+
+    if (responselen != sizeof(T)) {
+        LOGE("invalid response length was %d expected %d",
+                (int)responselen, (int)sizeof(T));
+        return RIL_ERRNO_INVALID_RESPONSE;
+    }
+
+    startResponse;
+    int ret = marshallStruct(p, (const T *) response);
+    removeLastChar;
+    closeResponse;
+
+    return ret;
+}
+
+/** response is a T *, pointing to an array of T's */
+template <typename T>
+static int responseStructArray(Parcel &p, void *response, size_t responselen) {
+    if (response == NULL && responselen != 0) {
+        LOGE("invalid response: NULL");
+        return RIL_ERRNO_INVALID_RESPONSE;
+    }
+
+    if (responselen % sizeof(T) != 0) {
+        LOGE("invalid response length %d expected multiple of %d",
+                (int)responselen, (int)sizeof(T));
+        return RIL_ERRNO_INVALID_RESPONSE;
+    }
+
+    int num = responselen / sizeof(T);
+    p.writeInt32(num);
+
+    startResponse;
+    for (int i = 0 ; i < num ; i++) {
+        int ret = marshallStruct(p, &((const T *) response)[i]);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    removeLastChar;
+    closeResponse;
+
+    return 0;
+}
+
+/** response is a T **, pointing to an array of T *'s */
+template <typename T>
+static int responseStructPointers(Parcel &p, void *response,
+            size_t responselen) {
+    if (response == NULL && responselen != 0) {
+        LOGE("invalid response: NULL");
+        return RIL_ERRNO_INVALID_RESPONSE;
+    }
+
+    if (responselen % sizeof(T *) != 0) {
+        LOGE("invalid response length %d expected multiple of %d",
+                (int)responselen, (int)sizeof(T *));
+        return RIL_ERRNO_INVALID_RESPONSE;
+    }
+
+    int num = responselen / sizeof(T *);
+    p.writeInt32(num);
+
+    startResponse;
+    for (int i = 0 ; i < num ; i++) {
+        int ret = marshallStruct(p, ((T **) response)[i]);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    removeLastChar;
+    closeResponse;
+
+    return 0;
+}
+
 /** response is an int* pointing to an array of ints*/
 
 static int
@@ -1362,18 +2002,8 @@ static int responseCallList(Parcel &p, void *response, size_t responselen) {
     for (int i = 0 ; i < num ; i++) {
         RIL_Call *p_cur = ((RIL_Call **) response)[i];
         /* each call info */
-        p.writeInt32(p_cur->state);
-        p.writeInt32(p_cur->index);
-        p.writeInt32(p_cur->toa);
-        p.writeInt32(p_cur->isMpty);
-        p.writeInt32(p_cur->isMT);
-        p.writeInt32(p_cur->als);
-        p.writeInt32(p_cur->isVoice);
-        p.writeInt32(p_cur->isVoicePrivacy);
-        writeStringToParcel(p, p_cur->number);
-        p.writeInt32(p_cur->numberPresentation);
-        writeStringToParcel(p, p_cur->name);
-        p.writeInt32(p_cur->namePresentation);
+        appendPrintBuf("%s[", printBuf);
+        marshallStruct(p, p_cur);
         // Remove when partners upgrade to version 3
         if ((s_callbacks.version < 3) || (p_cur->uusInfo == NULL || p_cur->uusInfo->uusData == NULL)) {
             p.writeInt32(0); /* UUS Information is absent */
@@ -1385,24 +2015,8 @@ static int responseCallList(Parcel &p, void *response, size_t responselen) {
             p.writeInt32(uusInfo->uusLength);
             p.write(uusInfo->uusData, uusInfo->uusLength);
         }
-        appendPrintBuf("%s[id=%d,%s,toa=%d,",
-            printBuf,
-            p_cur->index,
-            callStateToString(p_cur->state),
-            p_cur->toa);
-        appendPrintBuf("%s%s,%s,als=%d,%s,%s,",
-            printBuf,
-            (p_cur->isMpty)?"conf":"norm",
-            (p_cur->isMT)?"mt":"mo",
-            p_cur->als,
-            (p_cur->isVoice)?"voc":"nonvoc",
-            (p_cur->isVoicePrivacy)?"evp":"noevp");
-        appendPrintBuf("%s%s,cli=%d,name='%s',%d]",
-            printBuf,
-            p_cur->number,
-            p_cur->numberPresentation,
-            p_cur->name,
-            p_cur->namePresentation);
+        removeLastChar;
+        appendPrintBuf("%s],", printBuf);
     }
     removeLastChar;
     closeResponse;
@@ -1411,67 +2025,13 @@ static int responseCallList(Parcel &p, void *response, size_t responselen) {
 }
 
 static int responseSMS(Parcel &p, void *response, size_t responselen) {
-    if (response == NULL) {
-        LOGE("invalid response: NULL");
-        return RIL_ERRNO_INVALID_RESPONSE;
-    }
-
-    if (responselen != sizeof (RIL_SMS_Response) ) {
-        LOGE("invalid response length %d expected %d",
-                (int)responselen, (int)sizeof (RIL_SMS_Response));
-        return RIL_ERRNO_INVALID_RESPONSE;
-    }
-
-    RIL_SMS_Response *p_cur = (RIL_SMS_Response *) response;
-
-    p.writeInt32(p_cur->messageRef);
-    writeStringToParcel(p, p_cur->ackPDU);
-    p.writeInt32(p_cur->errorCode);
-
-    startResponse;
-    appendPrintBuf("%s%d,%s,%d", printBuf, p_cur->messageRef,
-        (char*)p_cur->ackPDU, p_cur->errorCode);
-    closeResponse;
-
-    return 0;
+    return responseStruct<RIL_SMS_Response>(p, response, responselen);
 }
 
 static int responseDataCallList(Parcel &p, void *response, size_t responselen)
 {
-    if (response == NULL && responselen != 0) {
-        LOGE("invalid response: NULL");
-        return RIL_ERRNO_INVALID_RESPONSE;
-    }
-
-    if (responselen % sizeof(RIL_Data_Call_Response) != 0) {
-        LOGE("invalid response length %d expected multiple of %d",
-                (int)responselen, (int)sizeof(RIL_Data_Call_Response));
-        return RIL_ERRNO_INVALID_RESPONSE;
-    }
-
-    int num = responselen / sizeof(RIL_Data_Call_Response);
-    p.writeInt32(num);
-
-    RIL_Data_Call_Response *p_cur = (RIL_Data_Call_Response *) response;
-    startResponse;
-    int i;
-    for (i = 0; i < num; i++) {
-        p.writeInt32(p_cur[i].cid);
-        p.writeInt32(p_cur[i].active);
-        writeStringToParcel(p, p_cur[i].type);
-        writeStringToParcel(p, p_cur[i].apn);
-        writeStringToParcel(p, p_cur[i].address);
-        appendPrintBuf("%s[cid=%d,%s,%s,%s,%s],", printBuf,
-            p_cur[i].cid,
-            (p_cur[i].active==0)?"down":"up",
-            (char*)p_cur[i].type,
-            (char*)p_cur[i].apn,
-            (char*)p_cur[i].address);
-    }
-    removeLastChar;
-    closeResponse;
-
-    return 0;
+    return responseStructArray<RIL_Data_Call_Response>(p, response,
+                responselen);
 }
 
 static int responseRaw(Parcel &p, void *response, size_t responselen) {
@@ -1493,150 +2053,27 @@ static int responseRaw(Parcel &p, void *response, size_t responselen) {
 
 
 static int responseSIM_IO(Parcel &p, void *response, size_t responselen) {
-    if (response == NULL) {
-        LOGE("invalid response: NULL");
-        return RIL_ERRNO_INVALID_RESPONSE;
-    }
-
-    if (responselen != sizeof (RIL_SIM_IO_Response) ) {
-        LOGE("invalid response length was %d expected %d",
-                (int)responselen, (int)sizeof (RIL_SIM_IO_Response));
-        return RIL_ERRNO_INVALID_RESPONSE;
-    }
-
-    RIL_SIM_IO_Response *p_cur = (RIL_SIM_IO_Response *) response;
-    p.writeInt32(p_cur->sw1);
-    p.writeInt32(p_cur->sw2);
-    writeStringToParcel(p, p_cur->simResponse);
-
-    startResponse;
-    appendPrintBuf("%ssw1=0x%X,sw2=0x%X,%s", printBuf, p_cur->sw1, p_cur->sw2,
-        (char*)p_cur->simResponse);
-    closeResponse;
-
-
-    return 0;
+    return responseStruct<RIL_SIM_IO_Response>(p, response, responselen);
 }
 
 static int responseCallForwards(Parcel &p, void *response, size_t responselen) {
-    int num;
-
-    if (response == NULL && responselen != 0) {
-        LOGE("invalid response: NULL");
-        return RIL_ERRNO_INVALID_RESPONSE;
-    }
-
-    if (responselen % sizeof(RIL_CallForwardInfo *) != 0) {
-        LOGE("invalid response length %d expected multiple of %d",
-                (int)responselen, (int)sizeof(RIL_CallForwardInfo *));
-        return RIL_ERRNO_INVALID_RESPONSE;
-    }
-
-    /* number of call info's */
-    num = responselen / sizeof(RIL_CallForwardInfo *);
-    p.writeInt32(num);
-
-    startResponse;
-    for (int i = 0 ; i < num ; i++) {
-        RIL_CallForwardInfo *p_cur = ((RIL_CallForwardInfo **) response)[i];
-
-        p.writeInt32(p_cur->status);
-        p.writeInt32(p_cur->reason);
-        p.writeInt32(p_cur->serviceClass);
-        p.writeInt32(p_cur->toa);
-        writeStringToParcel(p, p_cur->number);
-        p.writeInt32(p_cur->timeSeconds);
-        appendPrintBuf("%s[%s,reason=%d,cls=%d,toa=%d,%s,tout=%d],", printBuf,
-            (p_cur->status==1)?"enable":"disable",
-            p_cur->reason, p_cur->serviceClass, p_cur->toa,
-            (char*)p_cur->number,
-            p_cur->timeSeconds);
-    }
-    removeLastChar;
-    closeResponse;
-
-    return 0;
+    return responseStructPointers<RIL_CallForwardInfo>(p, response,
+                responselen);
 }
 
 static int responseSsn(Parcel &p, void *response, size_t responselen) {
-    if (response == NULL) {
-        LOGE("invalid response: NULL");
-        return RIL_ERRNO_INVALID_RESPONSE;
-    }
-
-    if (responselen != sizeof(RIL_SuppSvcNotification)) {
-        LOGE("invalid response length was %d expected %d",
-                (int)responselen, (int)sizeof (RIL_SuppSvcNotification));
-        return RIL_ERRNO_INVALID_RESPONSE;
-    }
-
-    RIL_SuppSvcNotification *p_cur = (RIL_SuppSvcNotification *) response;
-    p.writeInt32(p_cur->notificationType);
-    p.writeInt32(p_cur->code);
-    p.writeInt32(p_cur->index);
-    p.writeInt32(p_cur->type);
-    writeStringToParcel(p, p_cur->number);
-
-    startResponse;
-    appendPrintBuf("%s%s,code=%d,id=%d,type=%d,%s", printBuf,
-        (p_cur->notificationType==0)?"mo":"mt",
-         p_cur->code, p_cur->index, p_cur->type,
-        (char*)p_cur->number);
-    closeResponse;
-
-    return 0;
+    return responseStruct<RIL_SuppSvcNotification>(p, response, responselen);
 }
 
 static int responseCellList(Parcel &p, void *response, size_t responselen) {
-    int num;
-
-    if (response == NULL && responselen != 0) {
-        LOGE("invalid response: NULL");
-        return RIL_ERRNO_INVALID_RESPONSE;
-    }
-
-    if (responselen % sizeof (RIL_NeighboringCell *) != 0) {
-        LOGE("invalid response length %d expected multiple of %d\n",
-            (int)responselen, (int)sizeof (RIL_NeighboringCell *));
-        return RIL_ERRNO_INVALID_RESPONSE;
-    }
-
-    startResponse;
-    /* number of records */
-    num = responselen / sizeof(RIL_NeighboringCell *);
-    p.writeInt32(num);
-
-    for (int i = 0 ; i < num ; i++) {
-        RIL_NeighboringCell *p_cur = ((RIL_NeighboringCell **) response)[i];
-
-        p.writeInt32(p_cur->rssi);
-        writeStringToParcel (p, p_cur->cid);
-
-        appendPrintBuf("%s[cid=%s,rssi=%d],", printBuf,
-            p_cur->cid, p_cur->rssi);
-    }
-    removeLastChar;
-    closeResponse;
-
-    return 0;
-}
-
-/**
- * Marshall the signalInfoRecord into the parcel if it exists.
- */
-static void marshallSignalInfoRecord(Parcel &p,
-            RIL_CDMA_SignalInfoRecord &p_signalInfoRecord) {
-    p.writeInt32(p_signalInfoRecord.isPresent);
-    p.writeInt32(p_signalInfoRecord.signalType);
-    p.writeInt32(p_signalInfoRecord.alertPitch);
-    p.writeInt32(p_signalInfoRecord.signal);
+    return responseStructPointers<RIL_NeighboringCell>(p, response,
+                responselen);
 }
 
 static int responseCdmaInformationRecords(Parcel &p,
             void *response, size_t responselen) {
     int num;
-    char* string8 = NULL;
-    int buffer_lenght;
+    int ret;
     RIL_CDMA_InformationRecord *infoRec;
 
     if (response == NULL && responselen != 0) {
@@ -1663,117 +2100,27 @@ static int responseCdmaInformationRecords(Parcel &p,
         switch (infoRec->name) {
             case RIL_CDMA_DISPLAY_INFO_REC:
             case RIL_CDMA_EXTENDED_DISPLAY_INFO_REC:
-                if (infoRec->rec.display.alpha_len >
-                                         CDMA_ALPHA_INFO_BUFFER_LENGTH) {
-                    LOGE("invalid display info response length %d \
-                          expected not more than %d\n",
-                         (int)infoRec->rec.display.alpha_len,
-                         CDMA_ALPHA_INFO_BUFFER_LENGTH);
-                    return RIL_ERRNO_INVALID_RESPONSE;
-                }
-                string8 = (char*) malloc((infoRec->rec.display.alpha_len + 1)
-                                                             * sizeof(char) );
-                for (int i = 0 ; i < infoRec->rec.display.alpha_len ; i++) {
-                    string8[i] = infoRec->rec.display.alpha_buf[i];
-                }
-                string8[infoRec->rec.display.alpha_len] = '\0';
-                writeStringToParcel(p, (const char*)string8);
-                free(string8);
-                string8 = NULL;
+                ret = marshallStruct(p, &infoRec->rec.display);
                 break;
             case RIL_CDMA_CALLED_PARTY_NUMBER_INFO_REC:
             case RIL_CDMA_CALLING_PARTY_NUMBER_INFO_REC:
             case RIL_CDMA_CONNECTED_NUMBER_INFO_REC:
-                if (infoRec->rec.number.len > CDMA_NUMBER_INFO_BUFFER_LENGTH) {
-                    LOGE("invalid display info response length %d \
-                          expected not more than %d\n",
-                         (int)infoRec->rec.number.len,
-                         CDMA_NUMBER_INFO_BUFFER_LENGTH);
-                    return RIL_ERRNO_INVALID_RESPONSE;
-                }
-                string8 = (char*) malloc((infoRec->rec.number.len + 1)
-                                                             * sizeof(char) );
-                for (int i = 0 ; i < infoRec->rec.number.len; i++) {
-                    string8[i] = infoRec->rec.number.buf[i];
-                }
-                string8[infoRec->rec.number.len] = '\0';
-                writeStringToParcel(p, (const char*)string8);
-                free(string8);
-                string8 = NULL;
-                p.writeInt32(infoRec->rec.number.number_type);
-                p.writeInt32(infoRec->rec.number.number_plan);
-                p.writeInt32(infoRec->rec.number.pi);
-                p.writeInt32(infoRec->rec.number.si);
+                ret = marshallStruct(p, &infoRec->rec.number);
                 break;
             case RIL_CDMA_SIGNAL_INFO_REC:
-                p.writeInt32(infoRec->rec.signal.isPresent);
-                p.writeInt32(infoRec->rec.signal.signalType);
-                p.writeInt32(infoRec->rec.signal.alertPitch);
-                p.writeInt32(infoRec->rec.signal.signal);
-
-                appendPrintBuf("%sisPresent=%X, signalType=%X, \
-                                alertPitch=%X, signal=%X, ",
-                   printBuf, (int)infoRec->rec.signal.isPresent,
-                   (int)infoRec->rec.signal.signalType,
-                   (int)infoRec->rec.signal.alertPitch,
-                   (int)infoRec->rec.signal.signal);
-                removeLastChar;
+                ret = marshallStruct(p, &infoRec->rec.signal);
                 break;
             case RIL_CDMA_REDIRECTING_NUMBER_INFO_REC:
-                if (infoRec->rec.redir.redirectingNumber.len >
-                                              CDMA_NUMBER_INFO_BUFFER_LENGTH) {
-                    LOGE("invalid display info response length %d \
-                          expected not more than %d\n",
-                         (int)infoRec->rec.redir.redirectingNumber.len,
-                         CDMA_NUMBER_INFO_BUFFER_LENGTH);
-                    return RIL_ERRNO_INVALID_RESPONSE;
-                }
-                string8 = (char*) malloc((infoRec->rec.redir.redirectingNumber
-                                          .len + 1) * sizeof(char) );
-                for (int i = 0;
-                         i < infoRec->rec.redir.redirectingNumber.len;
-                         i++) {
-                    string8[i] = infoRec->rec.redir.redirectingNumber.buf[i];
-                }
-                string8[infoRec->rec.redir.redirectingNumber.len] = '\0';
-                writeStringToParcel(p, (const char*)string8);
-                free(string8);
-                string8 = NULL;
-                p.writeInt32(infoRec->rec.redir.redirectingNumber.number_type);
-                p.writeInt32(infoRec->rec.redir.redirectingNumber.number_plan);
-                p.writeInt32(infoRec->rec.redir.redirectingNumber.pi);
-                p.writeInt32(infoRec->rec.redir.redirectingNumber.si);
-                p.writeInt32(infoRec->rec.redir.redirectingReason);
+                ret = marshallStruct(p, &infoRec->rec.redir);
                 break;
             case RIL_CDMA_LINE_CONTROL_INFO_REC:
-                p.writeInt32(infoRec->rec.lineCtrl.lineCtrlPolarityIncluded);
-                p.writeInt32(infoRec->rec.lineCtrl.lineCtrlToggle);
-                p.writeInt32(infoRec->rec.lineCtrl.lineCtrlReverse);
-                p.writeInt32(infoRec->rec.lineCtrl.lineCtrlPowerDenial);
-
-                appendPrintBuf("%slineCtrlPolarityIncluded=%d, \
-                                lineCtrlToggle=%d, lineCtrlReverse=%d, \
-                                lineCtrlPowerDenial=%d, ", printBuf,
-                       (int)infoRec->rec.lineCtrl.lineCtrlPolarityIncluded,
-                       (int)infoRec->rec.lineCtrl.lineCtrlToggle,
-                       (int)infoRec->rec.lineCtrl.lineCtrlReverse,
-                       (int)infoRec->rec.lineCtrl.lineCtrlPowerDenial);
-                removeLastChar;
+                ret = marshallStruct(p, &infoRec->rec.lineCtrl);
                 break;
             case RIL_CDMA_T53_CLIR_INFO_REC:
-                p.writeInt32((int)(infoRec->rec.clir.cause));
-
-                appendPrintBuf("%scause%d", printBuf, infoRec->rec.clir.cause);
-                removeLastChar;
+                ret = marshallStruct(p, &infoRec->rec.clir);
                 break;
             case RIL_CDMA_T53_AUDIO_CONTROL_INFO_REC:
-                p.writeInt32(infoRec->rec.audioCtrl.upLink);
-                p.writeInt32(infoRec->rec.audioCtrl.downLink);
-
-                appendPrintBuf("%supLink=%d, downLink=%d, ", printBuf,
-                        infoRec->rec.audioCtrl.upLink,
-                        infoRec->rec.audioCtrl.downLink);
-                removeLastChar;
+                ret = marshallStruct(p, &infoRec->rec.audioCtrl);
                 break;
             case RIL_CDMA_T53_RELEASE_INFO_REC:
                 // TODO(Moto): See David Krause, he has the answer:)
@@ -1783,6 +2130,9 @@ static int responseCdmaInformationRecords(Parcel &p,
                 LOGE("Incorrect name value");
                 return RIL_ERRNO_INVALID_RESPONSE;
         }
+        if (ret != 0) {
+            return ret;
+        }
     }
     closeResponse;
 
@@ -1798,32 +2148,7 @@ static int responseRilSignalStrength(Parcel &p,
 
     if (responselen == sizeof (RIL_SignalStrength)) {
         // New RIL
-        RIL_SignalStrength *p_cur = ((RIL_SignalStrength *) response);
-
-        p.writeInt32(p_cur->GW_SignalStrength.signalStrength);
-        p.writeInt32(p_cur->GW_SignalStrength.bitErrorRate);
-        p.writeInt32(p_cur->CDMA_SignalStrength.dbm);
-        p.writeInt32(p_cur->CDMA_SignalStrength.ecio);
-        p.writeInt32(p_cur->EVDO_SignalStrength.dbm);
-        p.writeInt32(p_cur->EVDO_SignalStrength.ecio);
-        p.writeInt32(p_cur->EVDO_SignalStrength.signalNoiseRatio);
-
-        startResponse;
-        appendPrintBuf("%s[signalStrength=%d,bitErrorRate=%d,\
-                CDMA_SignalStrength.dbm=%d,CDMA_SignalStrength.ecio=%d,\
-                EVDO_SignalStrength.dbm =%d,EVDO_SignalStrength.ecio=%d,\
-                EVDO_SignalStrength.signalNoiseRatio=%d]",
-                printBuf,
-                p_cur->GW_SignalStrength.signalStrength,
-                p_cur->GW_SignalStrength.bitErrorRate,
-                p_cur->CDMA_SignalStrength.dbm,
-                p_cur->CDMA_SignalStrength.ecio,
-                p_cur->EVDO_SignalStrength.dbm,
-                p_cur->EVDO_SignalStrength.ecio,
-                p_cur->EVDO_SignalStrength.signalNoiseRatio);
-
-        closeResponse;
-
+        return responseStruct<RIL_SignalStrength>(p, response, responselen);
     } else if (responselen % sizeof (int) == 0) {
         // Old RIL deprecated
         int *p_cur = (int *) response;
@@ -1865,70 +2190,13 @@ static int responseCallRing(Parcel &p, void *response, size_t responselen) {
 }
 
 static int responseCdmaSignalInfoRecord(Parcel &p, void *response, size_t responselen) {
-    if (response == NULL || responselen == 0) {
-        LOGE("invalid response: NULL");
-        return RIL_ERRNO_INVALID_RESPONSE;
-    }
-
-    if (responselen != sizeof (RIL_CDMA_SignalInfoRecord)) {
-        LOGE("invalid response length %d expected sizeof (RIL_CDMA_SignalInfoRecord) of %d\n",
-            (int)responselen, (int)sizeof (RIL_CDMA_SignalInfoRecord));
-        return RIL_ERRNO_INVALID_RESPONSE;
-    }
-
-    startResponse;
-
-    RIL_CDMA_SignalInfoRecord *p_cur = ((RIL_CDMA_SignalInfoRecord *) response);
-    marshallSignalInfoRecord(p, *p_cur);
-
-    appendPrintBuf("%s[isPresent=%d,signalType=%d,alertPitch=%d\
-              signal=%d]",
-              printBuf,
-              p_cur->isPresent,
-              p_cur->signalType,
-              p_cur->alertPitch,
-              p_cur->signal);
-
-    closeResponse;
-    return 0;
+    return responseStruct<RIL_CDMA_SignalInfoRecord>(p, response,
+                responselen);
 }
 
 static int responseCdmaCallWaiting(Parcel &p, void *response,
             size_t responselen) {
-    if (response == NULL && responselen != 0) {
-        LOGE("invalid response: NULL");
-        return RIL_ERRNO_INVALID_RESPONSE;
-    }
-
-    if (responselen != sizeof(RIL_CDMA_CallWaiting)) {
-        LOGE("invalid response length %d expected %d\n",
-            (int)responselen, (int)sizeof(RIL_CDMA_CallWaiting));
-        return RIL_ERRNO_INVALID_RESPONSE;
-    }
-
-    startResponse;
-    RIL_CDMA_CallWaiting *p_cur = ((RIL_CDMA_CallWaiting *) response);
-
-    writeStringToParcel (p, p_cur->number);
-    p.writeInt32(p_cur->numberPresentation);
-    writeStringToParcel (p, p_cur->name);
-    marshallSignalInfoRecord(p, p_cur->signalInfoRecord);
-
-    appendPrintBuf("%snumber=%s,numberPresentation=%d, name=%s,\
-            signalInfoRecord[isPresent=%d,signalType=%d,alertPitch=%d\
-            signal=%d]",
-            printBuf,
-            p_cur->number,
-            p_cur->numberPresentation,
-            p_cur->name,
-            p_cur->signalInfoRecord.isPresent,
-            p_cur->signalInfoRecord.signalType,
-            p_cur->signalInfoRecord.alertPitch,
-            p_cur->signalInfoRecord.signal);
-
-    closeResponse;
-
-    return 0;
+    return responseStruct<RIL_CDMA_CallWaiting>(p, response, responselen);
 }
 
 static void triggerEvLoop() {
@@ -1963,86 +2231,26 @@ static int responseSimStatus(Parcel &p, void *response, size_t responselen) {
 
     RIL_CardStatus *p_cur = ((RIL_CardStatus *) response);
 
-    p.writeInt32(p_cur->card_state);
-    p.writeInt32(p_cur->universal_pin_state);
-    p.writeInt32(p_cur->gsm_umts_subscription_app_index);
-    p.writeInt32(p_cur->cdma_subscription_app_index);
-    p.writeInt32(p_cur->num_applications);
-
     startResponse;
+    marshallStruct(p, p_cur);
+
     for (i = 0; i < p_cur->num_applications; i++) {
-        p.writeInt32(p_cur->applications[i].app_type);
-        p.writeInt32(p_cur->applications[i].app_state);
-        p.writeInt32(p_cur->applications[i].perso_substate);
-        writeStringToParcel(p, (const char*)(p_cur->applications[i].aid_ptr));
-        writeStringToParcel(p, (const char*)
-                                      (p_cur->applications[i].app_label_ptr));
-        p.writeInt32(p_cur->applications[i].pin1_replaced);
-        p.writeInt32(p_cur->applications[i].pin1);
-        p.writeInt32(p_cur->applications[i].pin2);
-        appendPrintBuf("%s[app_type=%d,app_state=%d,perso_substate=%d,\
-                aid_ptr=%s,app_label_ptr=%s,pin1_replaced=%d,pin1=%d,pin2=%d],",
-                printBuf,
-                p_cur->applications[i].app_type,
-                p_cur->applications[i].app_state,
-                p_cur->applications[i].perso_substate,
-                p_cur->applications[i].aid_ptr,
-                p_cur->applications[i].app_label_ptr,
-                p_cur->applications[i].pin1_replaced,
-                p_cur->applications[i].pin1,
-                p_cur->applications[i].pin2);
+        marshallStruct(p, &p_cur->applications[i]);
     }
+    removeLastChar;
     closeResponse;
 
     return 0;
 }
 
 static int responseGsmBrSmsCnf(Parcel &p, void *response, size_t responselen) {
-    int num = responselen / sizeof(RIL_GSM_BroadcastSmsConfigInfo *);
-    p.writeInt32(num);
-
-    startResponse;
-    RIL_GSM_BroadcastSmsConfigInfo **p_cur =
-                (RIL_GSM_BroadcastSmsConfigInfo **) response;
-    for (int i = 0; i < num; i++) {
-        p.writeInt32(p_cur[i]->fromServiceId);
-        p.writeInt32(p_cur[i]->toServiceId);
-        p.writeInt32(p_cur[i]->fromCodeScheme);
-        p.writeInt32(p_cur[i]->toCodeScheme);
-        p.writeInt32(p_cur[i]->selected);
-
-        appendPrintBuf("%s [%d: fromServiceId=%d, toServiceId=%d, \
-                fromCodeScheme=%d, toCodeScheme=%d, selected =%d]",
-                printBuf, i, p_cur[i]->fromServiceId, p_cur[i]->toServiceId,
-                p_cur[i]->fromCodeScheme, p_cur[i]->toCodeScheme,
-                p_cur[i]->selected);
-    }
-    closeResponse;
-
-    return 0;
+    return responseStructPointers<RIL_GSM_BroadcastSmsConfigInfo>(p,
+                response, responselen);
 }
 
 static int responseCdmaBrSmsCnf(Parcel &p, void *response, size_t responselen) {
-    RIL_CDMA_BroadcastSmsConfigInfo **p_cur =
-               (RIL_CDMA_BroadcastSmsConfigInfo **) response;
-
-    int num = responselen / sizeof (RIL_CDMA_BroadcastSmsConfigInfo *);
-    p.writeInt32(num);
-
-    startResponse;
-    for (int i = 0 ; i < num ; i++ ) {
-        p.writeInt32(p_cur[i]->service_category);
-        p.writeInt32(p_cur[i]->language);
-        p.writeInt32(p_cur[i]->selected);
-
-        appendPrintBuf("%s [%d: srvice_category=%d, language =%d, \
-              selected =%d], ",
-              printBuf, i, p_cur[i]->service_category, p_cur[i]->language,
-              p_cur[i]->selected);
-    }
-    closeResponse;
-
-    return 0;
+    return responseStructPointers<RIL_CDMA_BroadcastSmsConfigInfo>(p,
+                response, responselen);
 }
 
 static int responseCdmaSms(Parcel &p, void *response, size_t responselen) {
@@ -2182,7 +2390,9 @@ static void processCommandsCallback(int fd, short flags, void *param) {
         record_stream_free(p_rs);
 
         /* start listening for new connections again */
-        rilEventAddWakeup(&s_listen_event);
+        if (s_fdListen >= 0) {
+            rilEventAddWakeup(&s_listen_event);
+        }
 
         onCommandsSocketClosed();
     }
@@ -2435,6 +2645,10 @@ static void debugCallback (int fd, short flags, void *param) {
 			LOGI("Receive data %s",smsData[1]);
 			issueLocalRequest(RIL_REQUEST_SEND_SMS, &smsData,  2*sizeof(int));
 			break;
+        case 12:
+            LOGI("Debug port: Dump stats");
+            dumpStats(acceptFD);
+            break;
         default:
             LOGE ("Invalid request");
             break;
@@ -2451,12 +2665,6 @@ static void userTimerCallback (int fd, short flags, void *param) {
 
     p_info->p_callback(p_info->userParam);
 
-
-    // FIXME generalize this...there should be a cancel mechanism
-    if (s_last_wake_timeout_info != NULL && s_last_wake_timeout_info == p_info) {
-        s_last_wake_timeout_info = NULL;
-    }
-
     free(p_info);
 }
 
@@ -2529,6 +2737,27 @@ extern "C" void RIL_setcallbacks (const RIL_RadioFunctions *callbacks) {
     memcpy(&s_callbacks, callbacks, sizeof (RIL_RadioFunctions));
 }
 
+// Used for testing purpose only.
+// Serve commands from an already connected socket, in place of the
+// "rild" control socket and its peer credential check.
+extern "C" void RIL_setCommandSocket (int fd) {
+    RecordStream *p_rs;
+
+    s_registerCalled = 1;
+    s_fdCommand = fd;
+
+    fcntl(s_fdCommand, F_SETFL, O_NONBLOCK);
+
+    p_rs = record_stream_new(s_fdCommand, MAX_COMMAND_BYTES);
+
+    ril_event_set (&s_commands_event, s_fdCommand, 1,
+        processCommandsCallback, p_rs);
+
+    rilEventAddWakeup (&s_commands_event);
+
+    onNewCommandConnect();
+}
+
 extern "C" void
 RIL_register (const RIL_RadioFunctions *callbacks) {
     int ret;
@@ -2631,6 +2860,8 @@ RIL_register (const RIL_RadioFunctions *callbacks) {
     rilEventAddWakeup (&s_debug_event);
 #endif
 
+    openCapture();
+
 }
 
 static int
@@ -2674,6 +2905,13 @@ RIL_onRequestComplete(RIL_Token t, RIL_Errno e, void *response, size_t responsel
         return;
     }
 
+    statsRequestCompleted(pRI, e);
+
+    if (pRI->local == 0) {
+        captureRecord(RIL_CAPTURE_COMPLETE, pRI->pCI->requestNumber,
+                        pRI->token, e, NULL, 0);
+    }
+
     if (pRI->local > 0) {
         // Locally issued command...void only!
         // response does not go back up the command socket
@@ -2720,29 +2958,420 @@ done:
 }
 
 
+// the host build (rilreplay) has no wake locks
 static void
 grabPartialWakeLock() {
+#ifdef HAVE_ANDROID_OS
     acquire_wake_lock(PARTIAL_WAKE_LOCK, ANDROID_WAKE_LOCK_NAME);
+#endif /* HAVE_ANDROID_OS */
 }
 
 static void
 releaseWakeLock() {
+#ifdef HAVE_ANDROID_OS
     release_wake_lock(ANDROID_WAKE_LOCK_NAME);
+#endif /* HAVE_ANDROID_OS */
+}
+
+/*
+ * Wake lock coalescing
+ *
+ * Every WAKE_PARTIAL unsol takes a reference on the wake lock while it is
+ * processed and then pushes the release deadline out to
+ * TIMEVAL_WAKE_TIMEOUT from now.  The lock itself is only acquired on the
+ * first reference, and a single static timer event is re-armed for what
+ * is left of the deadline when it fires, so a burst of unsols costs one
+ * acquire and one timer with no allocations.
+ */
+
+static pthread_mutex_t s_wakeLockMutex = PTHREAD_MUTEX_INITIALIZER;
+static int s_wakeLockRefs = 0;          // unsols currently being processed
+static bool s_wakeLockHeld = false;
+static bool s_wakeTimerArmed = false;
+static int64_t s_wakeLockDeadline = 0;  // elapsedRealtime(), in ms
+
+static void wakeTimeoutCallback (int fd, short flags, void *param);
+
+/** Call with s_wakeLockMutex held */
+static void
+armWakeTimeout(int64_t ms) {
+    struct timeval tv;
+
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+
+    ril_event_set(&s_wake_timeout_event, -1, false, wakeTimeoutCallback, NULL);
+    ril_timer_add(&s_wake_timeout_event, &tv);
+    s_wakeTimerArmed = true;
+
+    triggerEvLoop();
+}
+
+static void
+acquireWakeLockRef() {
+    pthread_mutex_lock(&s_wakeLockMutex);
+
+    if (!s_wakeLockHeld) {
+        grabPartialWakeLock();
+        s_wakeLockHeld = true;
+    }
+    s_wakeLockRefs++;
+
+    pthread_mutex_unlock(&s_wakeLockMutex);
+}
+
+/**
+ * Drop a reference taken by acquireWakeLockRef()
+ * If keepAwake, the lock is held until TIMEVAL_WAKE_TIMEOUT from now;
+ * otherwise it is released at once unless something else still needs it.
+ */
+static void
+releaseWakeLockRef(bool keepAwake) {
+    int64_t timeout = TIMEVAL_WAKE_TIMEOUT.tv_sec * 1000
+                        + TIMEVAL_WAKE_TIMEOUT.tv_usec / 1000;
+
+    pthread_mutex_lock(&s_wakeLockMutex);
+
+    s_wakeLockRefs--;
+
+    if (keepAwake) {
+        s_wakeLockDeadline = elapsedRealtime() + timeout;
+
+        if (!s_wakeTimerArmed) {
+            armWakeTimeout(timeout);
+        }
+    } else if (s_wakeLockRefs == 0 && !s_wakeTimerArmed && s_wakeLockHeld) {
+        releaseWakeLock();
+        s_wakeLockHeld = false;
+    }
+
+    pthread_mutex_unlock(&s_wakeLockMutex);
 }
 
 /**
  * Timer callback to put us back to sleep before the default timeout
  */
 static void
-wakeTimeoutCallback (void *param) {
-    // We're using "param != NULL" as a cancellation mechanism
-    if (param == NULL) {
-        //LOGD("wakeTimeout: releasing wake lock");
+wakeTimeoutCallback (int fd, short flags, void *param) {
+    int64_t remaining;
+
+    pthread_mutex_lock(&s_wakeLockMutex);
 
+    s_wakeTimerArmed = false;
+    remaining = s_wakeLockDeadline - elapsedRealtime();
+
+    if (remaining > 0) {
+        // the deadline moved while we slept
+        armWakeTimeout(remaining);
+    } else if (s_wakeLockRefs == 0 && s_wakeLockHeld) {
         releaseWakeLock();
+        s_wakeLockHeld = false;
+    }
+    // else an unsol in progress re-arms or releases when it is done
+
+    pthread_mutex_unlock(&s_wakeLockMutex);
+}
+
+/*
+ * Status report channel
+ *
+ * SMS status reports are forwarded to the "status-report" service over a
+ * persistent local socket.  The unsol path only copies the PDU into a
+ * bounded queue; a dedicated thread owns the socket, (re)connects to the
+ * consumer and drains the queue.  When the queue is full the PDU is
+ * dropped and counted rather than blocking the caller.
+ */
+
+#define SOCKET_NAME_STATUS_REPORT  "status-report"
+
+// max number of status reports waiting for the consumer
+#define STATUS_REPORT_QUEUE_SIZE 32
+
+// a hex encoded SMS-STATUS-REPORT TPDU plus SMSC address fits easily
+#define STATUS_REPORT_MAX_PDU 512
+
+// reconnect backoff, in seconds
+#define STATUS_REPORT_RETRY_MIN 1
+#define STATUS_REPORT_RETRY_MAX 30
+
+typedef struct {
+    int len;
+    char pdu[STATUS_REPORT_MAX_PDU];
+} StatusReportEntry;
+
+static pthread_once_t s_statusReportOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t s_statusReportMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_statusReportCond = PTHREAD_COND_INITIALIZER;
+
+static StatusReportEntry s_statusReportQueue[STATUS_REPORT_QUEUE_SIZE];
+static int s_statusReportHead = 0;
+static int s_statusReportCount = 0;
+
+static int s_fdStatusReport = -1;
+
+static unsigned int s_statusReportSent = 0;
+static unsigned int s_statusReportDropped = 0;
+
+static int
+statusReportSend(int fd, const StatusReportEntry *p_entry) {
+    const char *toWrite;
+    size_t len;
+    ssize_t written;
+    char buf[sizeof(int) + STATUS_REPORT_MAX_PDU];
+
+    /* length prefix and payload go out in a single send() */
+    memcpy(buf, &p_entry->len, sizeof(int));
+    memcpy(buf + sizeof(int), p_entry->pdu, p_entry->len);
+
+    toWrite = buf;
+    len = sizeof(int) + p_entry->len;
+
+    while (len > 0) {
+        written = send(fd, toWrite, len, MSG_NOSIGNAL);
+
+        if (written < 0 && errno == EINTR) {
+            continue;
+        } else if (written < 0) {
+            return -1;
+        }
+
+        toWrite += written;
+        len -= written;
+    }
+
+    return 0;
+}
+
+/**
+ * Sleeps for *p_retry seconds and doubles it, up to the maximum.
+ * Called without s_statusReportMutex; returns holding it.  New PDUs
+ * signal the same cond, so those wakeups don't end the wait early.
+ */
+static void
+statusReportBackoff(int *p_retry) {
+    struct timespec ts;
+    int ret;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += *p_retry;
+    *p_retry = MIN(*p_retry * 2, STATUS_REPORT_RETRY_MAX);
+
+    pthread_mutex_lock(&s_statusReportMutex);
+    do {
+        ret = pthread_cond_timedwait(&s_statusReportCond,
+                &s_statusReportMutex, &ts);
+    } while (ret == 0 || ret == EINTR);
+
+    if (ret != ETIMEDOUT) {
+        LOGE("status report backoff wait failed:%d", ret);
+    }
+}
+
+static void *
+statusReportLoop(void *param) {
+    StatusReportEntry entry;
+    int retry = STATUS_REPORT_RETRY_MIN;
+
+    pthread_mutex_lock(&s_statusReportMutex);
+
+    for (;;) {
+        while (s_statusReportCount == 0) {
+            pthread_cond_wait(&s_statusReportCond, &s_statusReportMutex);
+        }
+
+        /* peek only; the entry is dequeued once it has been delivered */
+        memcpy(&entry, &s_statusReportQueue[s_statusReportHead],
+                sizeof(int) + s_statusReportQueue[s_statusReportHead].len);
+
+        pthread_mutex_unlock(&s_statusReportMutex);
+
+        if (s_fdStatusReport < 0) {
+            s_fdStatusReport = socket_local_client(SOCKET_NAME_STATUS_REPORT,
+                                    ANDROID_SOCKET_NAMESPACE_ABSTRACT,
+                                    SOCK_STREAM);
+            if (s_fdStatusReport < 0) {
+                LOGE("open %s socket failed errno:%d, retry in %ds",
+                        SOCKET_NAME_STATUS_REPORT, errno, retry);
+                statusReportBackoff(&retry);
+                continue;
+            }
+        }
+
+        if (statusReportSend(s_fdStatusReport, &entry) < 0) {
+            LOGE("failed to send status report errno:%d, retry in %ds",
+                    errno, retry);
+            close(s_fdStatusReport);
+            s_fdStatusReport = -1;
+
+            // leave the entry queued; it is retried on the next connection
+            statusReportBackoff(&retry);
+            continue;
+        }
+
+        /* only a delivered PDU shows the consumer is healthy again */
+        retry = STATUS_REPORT_RETRY_MIN;
+
+        pthread_mutex_lock(&s_statusReportMutex);
+
+        s_statusReportHead = (s_statusReportHead + 1)
+                                % STATUS_REPORT_QUEUE_SIZE;
+        s_statusReportCount--;
+        s_statusReportSent++;
+    }
+
+    return NULL;
+}
+
+static void
+statusReportStartThread() {
+    pthread_t tid;
+    pthread_attr_t attr;
+    int ret;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    ret = pthread_create(&tid, &attr, statusReportLoop, NULL);
+
+    if (ret != 0) {
+        LOGE("Failed to create status report thread errno:%d", ret);
+    }
+}
+
+/**
+ * Queue a status report PDU for the status report service.
+ * Never blocks on the consumer; returns -1 if the PDU was dropped.
+ */
+static int
+queueStatusReport(const void *data, size_t datalen) {
+    StatusReportEntry *p_entry;
+    unsigned int dropped;
+    int ret = 0;
+
+    pthread_once(&s_statusReportOnce, statusReportStartThread);
+
+    pthread_mutex_lock(&s_statusReportMutex);
+
+    if (data == NULL) {
+        LOGE("status report with no pdu");
+        s_statusReportDropped++;
+        ret = -1;
+    } else if (datalen > STATUS_REPORT_MAX_PDU) {
+        LOGE("status report pdu too large (%d)", (int)datalen);
+        s_statusReportDropped++;
+        ret = -1;
+    } else if (s_statusReportCount == STATUS_REPORT_QUEUE_SIZE) {
+        s_statusReportDropped++;
+        ret = -1;
     } else {
-        //LOGD("wakeTimeout: releasing wake lock CANCELLED");
+        p_entry = &s_statusReportQueue[(s_statusReportHead
+                        + s_statusReportCount) % STATUS_REPORT_QUEUE_SIZE];
+        p_entry->len = (int)datalen;
+        memcpy(p_entry->pdu, data, datalen);
+        s_statusReportCount++;
+
+        pthread_cond_signal(&s_statusReportCond);
     }
+
+    dropped = s_statusReportDropped;
+
+    pthread_mutex_unlock(&s_statusReportMutex);
+
+    if (ret < 0) {
+        LOGW("status report dropped (%u dropped so far)", dropped);
+    }
+
+    return ret;
+}
+
+static void
+statsPrintf(int fd, const char *fmt, ...) {
+    char buf[256];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    if (len <= 0) {
+        return;
+    }
+
+    len = MIN(len, (int)sizeof(buf) - 1);
+    write(fd, buf, len);
+}
+
+/**
+ * Writes the request/unsol statistics as text to fd
+ * Histogram bucket i counts latencies in [2^(i-1), 2^i) ms; see above
+ */
+static void
+dumpStats(int fd) {
+    int64_t uptime;
+    unsigned int sent, dropped, queued;
+
+    pthread_mutex_lock(&s_statsMutex);
+
+    uptime = (s_statsStartTime == 0) ? 0
+                : elapsedRealtime() - s_statsStartTime;
+
+    statsPrintf(fd, "uptime %lldms in-flight %d max-in-flight %d\n",
+            (long long)uptime, s_inFlight, s_maxInFlight);
+
+    statsPrintf(fd, "requests: count errors cancelled avg(ms) max(ms) "
+            "[latency histogram]\n");
+
+    for (int i = 1; i < (int)NUM_ELEMS(s_requestStats); i++) {
+        RequestStats *p_stats = &s_requestStats[i];
+
+        if (p_stats->count == 0) {
+            continue;
+        }
+
+        statsPrintf(fd, "  %s %u %u %u %lld %lld [", requestToString(i),
+                p_stats->count, p_stats->errors, p_stats->cancelled,
+                (long long)(p_stats->totalLatency / p_stats->count),
+                (long long)p_stats->maxLatency);
+
+        for (int j = 0; j < STATS_LATENCY_BUCKETS; j++) {
+            statsPrintf(fd, j == 0 ? "%u" : " %u", p_stats->latency[j]);
+        }
+        statsPrintf(fd, "]\n");
+    }
+
+    statsPrintf(fd, "errors:\n");
+    for (int i = 0; i < STATS_NUM_ERRNOS - 1; i++) {
+        if (s_errnoStats[i] != 0) {
+            statsPrintf(fd, "  %s %u\n",
+                failCauseToString((RIL_Errno)i), s_errnoStats[i]);
+        }
+    }
+    if (s_errnoStats[STATS_NUM_ERRNOS - 1] != 0) {
+        statsPrintf(fd, "  <other> %u\n", s_errnoStats[STATS_NUM_ERRNOS - 1]);
+    }
+
+    statsPrintf(fd, "unsols: count per-minute\n");
+    for (int i = 0; i < (int)NUM_ELEMS(s_unsolStats); i++) {
+        if (s_unsolStats[i] == 0) {
+            continue;
+        }
+
+        statsPrintf(fd, "  %s %u %lld\n",
+                requestToString(i + RIL_UNSOL_RESPONSE_BASE), s_unsolStats[i],
+                (long long)(uptime > 0 ? s_unsolStats[i] * 60000LL / uptime
+                                       : 0));
+    }
+
+    pthread_mutex_unlock(&s_statsMutex);
+
+    pthread_mutex_lock(&s_statusReportMutex);
+    sent = s_statusReportSent;
+    dropped = s_statusReportDropped;
+    queued = s_statusReportCount;
+    pthread_mutex_unlock(&s_statusReportMutex);
+
+    statsPrintf(fd, "status reports: sent %u dropped %u queued %u\n",
+            sent, dropped, queued);
 }
 
 extern "C"
@@ -2753,39 +3382,10 @@ void RIL_onUnsolicitedResponse(int unsolResponse, void *data,
     int ret;
     int64_t timeReceived = 0;
     bool shouldScheduleTimeout = false;
-	
-#define SOCKET_NAME_STATUS_REPORT  "status-report"
-	if(unsolResponse == RIL_UNSOL_RESPONSE_NEW_SMS_STATUS_REPORT) {
-		LOGE("received message status report %s",(char*)data);
-
-		int fd, ret;
-
-		fd = socket_local_client(SOCKET_NAME_STATUS_REPORT,
-		           ANDROID_SOCKET_NAMESPACE_ABSTRACT,
-				            SOCK_STREAM);
-		if(fd < 0) {
-			LOGE("open %s socket failed",SOCKET_NAME_STATUS_REPORT);
-			goto final;
-		}
-
-		ret = send(fd, (const void *)&datalen, sizeof(int), 0);
-		if(ret != sizeof(int)) {
-			LOGE("failed to send status report len");
-			goto error;
-		}
-		
-		ret =  send(fd, data, datalen * sizeof(char), 0);
-		if(ret != datalen * sizeof(char)) {
-			LOGE("failed to send status report pdu");
-			goto error;
-		}
-
-		LOGE("send pdu to service succeed!");
-error:
-		close(fd);
-	}
-
-final:
+
+    if (unsolResponse == RIL_UNSOL_RESPONSE_NEW_SMS_STATUS_REPORT) {
+        queueStatusReport(data, datalen);
+    }
 
     if (s_registerCalled == 0) {
         // Ignore RIL_onUnsolicitedResponse before RIL_register
@@ -2801,12 +3401,16 @@ final:
         return;
     }
 
+    statsUnsolReceived(unsolResponseIndex);
+
+    captureRecord(RIL_CAPTURE_UNSOL, unsolResponse, 0, 0, NULL, 0);
+
     // Grab a wake lock if needed for this reponse,
     // as we exit we'll either release it immediately
     // or set a timer to release it later.
     switch (s_unsolResponses[unsolResponseIndex].wakeType) {
         case WAKE_PARTIAL:
-            grabPartialWakeLock();
+            acquireWakeLockRef();
             shouldScheduleTimeout = true;
         break;
 
@@ -2880,14 +3484,7 @@ final:
     // FIXME The java code should handshake here to release wake lock
 
     if (shouldScheduleTimeout) {
-        // Cancel the previous request
-        if (s_last_wake_timeout_info != NULL) {
-            s_last_wake_timeout_info->userParam = (void *)1;
-        }
-
-        s_last_wake_timeout_info
-            = internalRequestTimedCallback(wakeTimeoutCallback, NULL,
-                                            &TIMEVAL_WAKE_TIMEOUT);
+        releaseWakeLockRef(true);
     }
 
     // Normal exit
@@ -2895,7 +3492,7 @@ final:
 
 error_exit:
     if (shouldScheduleTimeout) {
-        releaseWakeLock();
+        releaseWakeLockRef(false);
     }
 }
 
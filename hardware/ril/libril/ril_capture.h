@@ -0,0 +1,70 @@
+/* //device/libs/telephony/ril_capture.h
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * Command socket capture format
+ *
+ * When the "rild.capture" property names a file and the build is
+ * debuggable, libril truncates it at startup and then writes to it every
+ * record read from the command socket, and a marker for every request
+ * completion and unsolicited response.  rilreplay plays such a capture
+ * back against libril.
+ *
+ * Commands that carry PINs, passwords, numbers or message bodies are
+ * captured with only their request and token, and RIL_CAPTURE_REDACTED
+ * set; rilreplay skips them.
+ *
+ * The file is a RIL_CaptureHeader followed by RIL_CaptureRecord's, each
+ * followed by "length" bytes of payload.  All fields are host endian.
+ */
+
+#ifndef RIL_CAPTURE_H
+#define RIL_CAPTURE_H 1
+
+#include <stdint.h>
+
+#define RIL_CAPTURE_PROPERTY "rild.capture"
+
+#define RIL_CAPTURE_MAGIC   0x43504352  /* "RCPC" */
+#define RIL_CAPTURE_VERSION 1
+
+/* raw record read from the command socket; payload is the record */
+#define RIL_CAPTURE_COMMAND   1
+/* RIL_onRequestComplete for a command; no payload */
+#define RIL_CAPTURE_COMPLETE  2
+/* RIL_onUnsolicitedResponse; no payload */
+#define RIL_CAPTURE_UNSOL     3
+
+/* RIL_CaptureRecord flags */
+#define RIL_CAPTURE_REDACTED  0x1   /* COMMAND payload cut after the token */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+} RIL_CaptureHeader;
+
+typedef struct {
+    uint32_t type;          /* RIL_CAPTURE_* */
+    uint32_t length;        /* bytes of payload following this record */
+    int64_t timestamp;      /* elapsedRealtime(), in ms */
+    int32_t request;        /* request or unsol number */
+    int32_t token;          /* COMMAND and COMPLETE only */
+    int32_t error;          /* COMPLETE only: RIL_Errno */
+    uint32_t flags;         /* RIL_CAPTURE_REDACTED */
+} RIL_CaptureRecord;
+
+#endif /*RIL_CAPTURE_H*/
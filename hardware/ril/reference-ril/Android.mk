@@ -6,10 +6,9 @@ LOCAL_PATH:= $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES:= \
-    reference-ril.c \
-    atchannel.c \
-    misc.c \
-    at_tok.c
+    reference-ril.c
+
+LOCAL_STATIC_LIBRARIES := libatchannel
 
 LOCAL_SHARED_LIBRARIES := \
     libcutils libutils libril
@@ -17,10 +16,11 @@ LOCAL_SHARED_LIBRARIES := \
 # for asprinf
 LOCAL_CFLAGS := -D_GNU_SOURCE
 
-LOCAL_C_INCLUDES := $(KERNEL_HEADERS)
+LOCAL_C_INCLUDES := $(KERNEL_HEADERS) \
+    $(LOCAL_PATH)/../libatchannel
 
 ifeq ($(TARGET_DEVICE),sooner)
-  LOCAL_CFLAGS += -DOMAP_CSMI_POWER_CONTROL -DUSE_TI_COMMANDS
+  LOCAL_CFLAGS += -DUSE_TI_COMMANDS
 endif
 
 ifeq ($(TARGET_DEVICE),surf)
@@ -25,9 +25,12 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <time.h>
 #include <alloca.h>
 #include "atchannel.h"
+#include "cmux.h"
 #include "at_tok.h"
+#include "at_prefix.h"
 #include "misc.h"
 #include <getopt.h>
 #include <sys/socket.h>
@@ -39,6 +42,9 @@
 
 #define MAX_AT_RESPONSE 0x1000
 
+/* longest dial string kept from a +CLCC line, including the '\0' */
+#define MAX_CALL_NUMBER 64
+
 /* pathname returned from RIL_REQUEST_SETUP_DATA_CALL / RIL_REQUEST_SETUP_DEFAULT_PDP */
 #define PPP_TTY_PATH "/dev/omap_csmi_tty1"
 
@@ -105,6 +111,25 @@ static int s_port = -1;
 static const char * s_device_path = NULL;
 static int          s_device_socket = 0;
 
+/*
+ * With -x <n> the modem is multiplexed (27.010) into n AT channels and
+ * each request goes to the channel of its class, so that eg. a slow SMS
+ * send or PDP activation does not hold up call control. Call control
+ * keeps channel 0, which also carries init and polling, to itself; the
+ * other classes share the rest. Without a mux everything uses channel 0.
+ */
+typedef enum {
+    CHANNEL_CALL,       /* call control and anything not listed */
+    CHANNEL_SMS,
+    CHANNEL_DATA,
+    CHANNEL_SIM,
+    CHANNEL_CLASS_COUNT
+} ChannelClass;
+
+static int s_muxChannels = 1;
+static int s_muxed = 0;     /* the current AT interface runs a CMUX */
+static int s_classChannel[CHANNEL_CLASS_COUNT];
+
 /* trigger change to this with s_state_cond */
 static int s_closed = 0;
 
@@ -114,7 +139,9 @@ static char *sATBufferCur = NULL;
 
 static const struct timeval TIMEVAL_SIMPOLL = {1,0};
 static const struct timeval TIMEVAL_CALLSTATEPOLL = {0,500000};
+static const struct timeval TIMEVAL_CALLSTATE_DEBOUNCE = {0,50000};
 static const struct timeval TIMEVAL_0 = {0,0};
+static const struct timeval TIMEVAL_QMIPOLL = {1,0};
 
 #ifdef WORKAROUND_ERRONEOUS_ANSWER
 // Max number of times we'll try to repoll when we think
@@ -130,8 +157,87 @@ static int s_expectAnswer = 0;
 #endif /* WORKAROUND_ERRONEOUS_ANSWER */
 
 static void pollSIMState (void *param);
+static void sendCallStateChanged(void *param);
 static void setRadioState(RIL_RadioState newState);
 
+/*
+ * Coalesced polls
+ *
+ * Call, SIM and data call state are refreshed from timed callbacks that
+ * any number of unsolicited lines and repoll timers can ask for. A
+ * CoalescedPoll has at most one callback outstanding: a request that
+ * arrives while one is scheduled to run no later than it needs is folded
+ * into it instead of costing another round of AT commands.
+ */
+
+typedef struct {
+    RIL_TimedCallback callback;
+    int scheduled;
+    long long due;          /* monotonic msec */
+} CoalescedPoll;
+
+static pthread_mutex_t s_pollMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static CoalescedPoll s_callStatePoll = { sendCallStateChanged, 0, 0 };
+static CoalescedPoll s_simPoll = { pollSIMState, 0, 0 };
+static CoalescedPoll s_dataCallListPoll = { onDataCallListChanged, 0, 0 };
+
+static long long nowMsec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void runCoalescedPoll(void *param)
+{
+    CoalescedPoll *p_poll = (CoalescedPoll *) param;
+    int run;
+
+    pthread_mutex_lock(&s_pollMutex);
+    run = p_poll->scheduled;
+    p_poll->scheduled = 0;
+    pthread_mutex_unlock(&s_pollMutex);
+
+    /* an earlier callback may already have done this one's work */
+    if (run) {
+        p_poll->callback(NULL);
+    }
+}
+
+/**
+ * Arranges for p_poll->callback to run after p_relativeTime (NULL means
+ * as soon as possible), unless it is already due by then
+ *
+ * May be called from any thread
+ */
+static void schedulePoll(CoalescedPoll *p_poll,
+                            const struct timeval *p_relativeTime)
+{
+    long long due = nowMsec();
+
+    if (p_relativeTime != NULL) {
+        due += p_relativeTime->tv_sec * 1000LL
+                + p_relativeTime->tv_usec / 1000;
+    }
+
+    pthread_mutex_lock(&s_pollMutex);
+
+    if (p_poll->scheduled && p_poll->due <= due) {
+        pthread_mutex_unlock(&s_pollMutex);
+        return;
+    }
+
+    p_poll->scheduled = 1;
+    p_poll->due = due;
+
+    pthread_mutex_unlock(&s_pollMutex);
+
+    RIL_requestTimedCallback (runCoalescedPoll, p_poll, p_relativeTime);
+}
+
 static int clccStateToRILState(int state, RIL_CallState *p_state)
 
 {
@@ -147,56 +253,57 @@ static int clccStateToRILState(int state, RIL_CallState *p_state)
 }
 
 /**
- * Note: directly modified line and has *p_call point directly into
- * modified line
+ * Fills *p_call from a +CLCC line without modifying it. The number, if
+ * any, is copied into "number", which must hold MAX_CALL_NUMBER bytes
  */
-static int callFromCLCCLine(char *line, RIL_Call *p_call)
+static int callFromCLCCLine(const char *line, RIL_Call *p_call, char *number)
 {
         //+CLCC: 1,0,2,0,0,\"+18005551212\",145
         //     index,isMT,state,mode,isMpty(,number,TOA)?
 
+    ATTokLine tok;
     int err;
     int state;
     int mode;
 
-    err = at_tok_start(&line);
+    err = at_tok_parse(line, &tok);
     if (err < 0) goto error;
 
-    err = at_tok_nextint(&line, &(p_call->index));
+    err = at_tok_getint(&tok, 0, &(p_call->index));
     if (err < 0) goto error;
 
-    err = at_tok_nextbool(&line, &(p_call->isMT));
+    err = at_tok_getbool(&tok, 1, &(p_call->isMT));
     if (err < 0) goto error;
 
-    err = at_tok_nextint(&line, &state);
+    err = at_tok_getint(&tok, 2, &state);
     if (err < 0) goto error;
 
     err = clccStateToRILState(state, &(p_call->state));
     if (err < 0) goto error;
 
-    err = at_tok_nextint(&line, &mode);
+    err = at_tok_getint(&tok, 3, &mode);
     if (err < 0) goto error;
 
     p_call->isVoice = (mode == 0);
 
-    err = at_tok_nextbool(&line, &(p_call->isMpty));
+    err = at_tok_getbool(&tok, 4, &(p_call->isMpty));
     if (err < 0) goto error;
 
-    if (at_tok_hasmore(&line)) {
-        err = at_tok_nextstr(&line, &(p_call->number));
+    if (tok.count > 5) {
+        err = at_tok_getstr(&tok, 5, number, MAX_CALL_NUMBER);
 
         /* tolerate null here */
         if (err < 0) return 0;
 
+        p_call->number = number;
+
         // Some lame implementations return strings
         // like "NOT AVAILABLE" in the CLCC line
-        if (p_call->number != NULL
-            && 0 == strspn(p_call->number, "+0123456789")
-        ) {
+        if (0 == strspn(p_call->number, "+0123456789")) {
             p_call->number = NULL;
         }
 
-        err = at_tok_nextint(&line, &p_call->toa);
+        err = at_tok_getint(&tok, 6, &p_call->toa);
         if (err < 0) goto error;
     }
 
@@ -209,7 +316,6 @@ error:
     return -1;
 }
 
-
 /** do post-AT+CFUN=1 initialization */
 static void onRadioPowerOn()
 {
@@ -430,6 +536,264 @@ error:
     at_response_free(p_response);
 }
 
+/*
+ * Response cache
+ *
+ * Identity and operator queries are answered from here when possible.
+ * Each entry has a TTL (0 for none) and a reset class saying what makes
+ * it stale: a radio reset for modem identity, a SIM (re)initialization
+ * for SIM identity and any registration change for network state.
+ * Values are refcounted so that a request can be completed from one
+ * outside s_cacheMutex while the entry is being replaced.
+ */
+
+#define CACHE_RESET_RADIO   0x1     /* channel lost, modem reset */
+#define CACHE_RESET_SIM     0x2     /* SIM may have changed */
+#define CACHE_RESET_NETWORK 0x4     /* registration or operator changed */
+
+typedef enum {
+    CACHE_INT,              /* response is an int */
+    CACHE_STRING,           /* response is a char * */
+    CACHE_STRINGS           /* response is a char *[] */
+} CacheKind;
+
+/*      id                    kind           ttl msec  reset class */
+#define RESPONSE_CACHES(X) \
+    X(CACHE_IMSI,             CACHE_STRING,  0,        CACHE_RESET_SIM) \
+    X(CACHE_IMEI,             CACHE_STRING,  0,        CACHE_RESET_RADIO) \
+    X(CACHE_BASEBAND_VERSION, CACHE_STRING,  0,        CACHE_RESET_RADIO) \
+    X(CACHE_OPERATOR,         CACHE_STRINGS, 10000,    CACHE_RESET_NETWORK) \
+    X(CACHE_SELECTION_MODE,   CACHE_INT,     60000,    CACHE_RESET_NETWORK)
+
+enum {
+#define CACHE_ENUM(id, kind, ttl, reset) id,
+    RESPONSE_CACHES(CACHE_ENUM)
+#undef CACHE_ENUM
+    NUM_RESPONSE_CACHES
+};
+
+typedef struct {
+    int refCount;
+    int intValue;
+    int count;
+    char *strings[1];       /* count entries, then their text */
+} CacheValue;
+
+typedef struct {
+    CacheKind kind;
+    long long ttlMsec;
+    int resetClass;
+    CacheValue *p_value;    /* NULL when stale */
+    long long expires;      /* monotonic msec, 0 means never */
+    int gen;                /* bumped on every invalidation */
+} CacheEntry;
+
+static pthread_mutex_t s_cacheMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static CacheEntry s_cache[NUM_RESPONSE_CACHES] = {
+#define CACHE_INIT(id, kind, ttl, reset) { kind, ttl, reset, NULL, 0, 0 },
+    RESPONSE_CACHES(CACHE_INIT)
+#undef CACHE_INIT
+};
+
+/** count may be 0; NULL strings are kept as NULL */
+static CacheValue *newCacheValue(int intValue, char **strings, int count)
+{
+    CacheValue *p_value;
+    size_t size;
+    char *p_text;
+    int i;
+
+    size = sizeof(CacheValue) + count * sizeof(char *);
+
+    for (i = 0 ; i < count ; i++) {
+        if (strings[i] != NULL) {
+            size += strlen(strings[i]) + 1;
+        }
+    }
+
+    p_value = (CacheValue *) malloc(size);
+
+    p_value->refCount = 1;
+    p_value->intValue = intValue;
+    p_value->count = count;
+
+    p_text = (char *)(p_value->strings + count);
+
+    for (i = 0 ; i < count ; i++) {
+        if (strings[i] == NULL) {
+            p_value->strings[i] = NULL;
+        } else {
+            p_value->strings[i] = strcpy(p_text, strings[i]);
+            p_text += strlen(p_text) + 1;
+        }
+    }
+
+    return p_value;
+}
+
+static void releaseCacheValue(CacheValue *p_value)
+{
+    int refCount;
+
+    if (p_value == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&s_cacheMutex);
+    refCount = --p_value->refCount;
+    pthread_mutex_unlock(&s_cacheMutex);
+
+    if (refCount == 0) {
+        free(p_value);
+    }
+}
+
+/**
+ * Completes t from the cache entry "id" if it holds a fresh value
+ *
+ * Returns 1 if t was completed. Otherwise *p_gen is set to a value to
+ * hand to cacheStore() once the modem has answered.
+ */
+static int completeFromCache(int id, RIL_Token t, int *p_gen)
+{
+    CacheEntry *p_entry = &s_cache[id];
+    CacheValue *p_value;
+
+    pthread_mutex_lock(&s_cacheMutex);
+
+    p_value = p_entry->p_value;
+
+    if (p_value != NULL && p_entry->expires != 0
+        && nowMsec() >= p_entry->expires
+    ) {
+        p_entry->p_value = NULL;
+        p_entry->gen++;
+
+        if (--p_value->refCount == 0) {
+            free(p_value);
+        }
+        p_value = NULL;
+    }
+
+    if (p_value == NULL) {
+        *p_gen = p_entry->gen;
+        pthread_mutex_unlock(&s_cacheMutex);
+        return 0;
+    }
+
+    p_value->refCount++;
+
+    pthread_mutex_unlock(&s_cacheMutex);
+
+    switch (p_entry->kind) {
+        case CACHE_INT:
+            RIL_onRequestComplete(t, RIL_E_SUCCESS,
+                    &p_value->intValue, sizeof(int));
+            break;
+        case CACHE_STRING:
+            RIL_onRequestComplete(t, RIL_E_SUCCESS,
+                    p_value->strings[0], sizeof(char *));
+            break;
+        case CACHE_STRINGS:
+            RIL_onRequestComplete(t, RIL_E_SUCCESS,
+                    p_value->strings, p_value->count * sizeof(char *));
+            break;
+    }
+
+    releaseCacheValue(p_value);
+
+    return 1;
+}
+
+/**
+ * Caches p_value (taking ownership) for entry "id", unless the entry was
+ * invalidated since completeFromCache() handed out gen
+ */
+static void cacheStore(int id, int gen, CacheValue *p_value)
+{
+    CacheEntry *p_entry = &s_cache[id];
+    CacheValue *p_old = NULL;
+
+    pthread_mutex_lock(&s_cacheMutex);
+
+    if (p_entry->gen == gen) {
+        p_old = p_entry->p_value;
+        p_entry->p_value = p_value;
+        p_entry->expires = p_entry->ttlMsec > 0
+                            ? nowMsec() + p_entry->ttlMsec : 0;
+        p_value = NULL;
+    }
+
+    pthread_mutex_unlock(&s_cacheMutex);
+
+    releaseCacheValue(p_old);
+    releaseCacheValue(p_value);
+}
+
+/**
+ * Drops every entry whose reset class is in resetMask
+ * May be called from any thread
+ */
+static void invalidateCaches(int resetMask)
+{
+    CacheValue *p_stale[NUM_RESPONSE_CACHES];
+    int i;
+
+    pthread_mutex_lock(&s_cacheMutex);
+
+    for (i = 0 ; i < NUM_RESPONSE_CACHES ; i++) {
+        p_stale[i] = NULL;
+
+        if (s_cache[i].resetClass & resetMask) {
+            p_stale[i] = s_cache[i].p_value;
+            s_cache[i].p_value = NULL;
+            s_cache[i].gen++;
+        }
+    }
+
+    pthread_mutex_unlock(&s_cacheMutex);
+
+    for (i = 0 ; i < NUM_RESPONSE_CACHES ; i++) {
+        releaseCacheValue(p_stale[i]);
+    }
+}
+
+/**
+ * Answers a request whose response is the single line a modem sends
+ * for "cmd", such as the IMSI for AT+CIMI
+ *
+ * responsePrefix NULL means a numeric response
+ */
+static void requestIdentity(int id, const char *cmd,
+                    const char *responsePrefix, RIL_Token t)
+{
+    ATResponse *p_response = NULL;
+    int err;
+    int gen;
+
+    if (completeFromCache(id, t, &gen)) {
+        return;
+    }
+
+    if (responsePrefix == NULL) {
+        err = at_send_command_numeric(cmd, &p_response);
+    } else {
+        err = at_send_command_singleline(cmd, responsePrefix, &p_response);
+    }
+
+    if (err < 0 || p_response->success == 0) {
+        RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+    } else {
+        RIL_onRequestComplete(t, RIL_E_SUCCESS,
+            p_response->p_intermediates->line, sizeof(char *));
+
+        cacheStore(id, gen,
+            newCacheValue(0, &p_response->p_intermediates->line, 1));
+    }
+    at_response_free(p_response);
+}
+
 static void requestQueryNetworkSelectionMode(
                 void *data, size_t datalen, RIL_Token t)
 {
@@ -437,6 +801,11 @@ static void requestQueryNetworkSelectionMode(
     ATResponse *p_response = NULL;
     int response = 0;
     char *line;
+    int gen;
+
+    if (completeFromCache(CACHE_SELECTION_MODE, t, &gen)) {
+        return;
+    }
 
     err = at_send_command_singleline("AT+COPS?", "+COPS:", &p_response);
 
@@ -459,6 +828,7 @@ static void requestQueryNetworkSelectionMode(
     }
 
     RIL_onRequestComplete(t, RIL_E_SUCCESS, &response, sizeof(int));
+    cacheStore(CACHE_SELECTION_MODE, gen, newCacheValue(response, NULL, 0));
     at_response_free(p_response);
     return;
 error:
@@ -467,38 +837,138 @@ error:
     RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
 }
 
+/*
+ * Current calls
+ *
+ * The last +CLCC result is kept as a CallList until something that may
+ * change it happens: a call state unsolicited line, a call control
+ * request or a radio state change. RIL_REQUEST_GET_CURRENT_CALLS is
+ * answered from it when there is one; otherwise the request waits for
+ * the AT+CLCC in flight, or starts one, so a burst of requests costs a
+ * single query.
+ *
+ * these are protected by s_callListMutex
+ */
+
+typedef struct {
+    int refCount;
+    int count;
+    RIL_Call **pp_calls;
+    RIL_Call *p_calls;
+    char *p_numbers;        /* MAX_CALL_NUMBER bytes per call */
+} CallList;
+
+typedef struct CallListWaiter {
+    struct CallListWaiter *p_next;
+    RIL_Token t;
+    int gen;                /* s_callListGen when the request arrived */
+} CallListWaiter;
+
+static pthread_mutex_t s_callListMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static CallList *s_callList = NULL;     /* NULL when stale */
+static int s_callListGen = 0;           /* bumped when s_callList goes stale */
+static int s_callListQueryGen = 0;      /* s_callListGen at AT+CLCC time */
+static int s_callListQueryInFlight = 0;
+static CallListWaiter *s_callListWaiters = NULL;
+
+static void onCallListComplete(int err, ATResponse *p_response, void *param);
+
+static CallList *newCallList(int count)
+{
+    CallList *p_list;
+    int i;
+
+    /* one allocation: the list, an array of pointers, an array of
+       structures and then the numbers */
+    p_list = (CallList *) malloc(sizeof(CallList)
+                + count * (sizeof(RIL_Call *) + sizeof(RIL_Call)
+                           + MAX_CALL_NUMBER));
+
+    p_list->refCount = 1;
+    p_list->count = 0;
+    p_list->pp_calls = (RIL_Call **)(p_list + 1);
+    p_list->p_calls = (RIL_Call *)(p_list->pp_calls + count);
+    p_list->p_numbers = (char *)(p_list->p_calls + count);
+
+    memset (p_list->p_calls, 0, count * sizeof(RIL_Call));
+
+    for (i = 0; i < count ; i++) {
+        p_list->pp_calls[i] = &(p_list->p_calls[i]);
+    }
+
+    return p_list;
+}
+
+static void releaseCallList(CallList *p_list)
+{
+    int refCount;
+
+    if (p_list == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&s_callListMutex);
+    refCount = --p_list->refCount;
+    pthread_mutex_unlock(&s_callListMutex);
+
+    if (refCount == 0) {
+        free(p_list);
+    }
+}
+
+/** drops the cached call list; may be called from any thread */
+static void invalidateCallList()
+{
+    CallList *p_list;
+
+    pthread_mutex_lock(&s_callListMutex);
+
+    s_callListGen++;
+    p_list = s_callList;
+    s_callList = NULL;
+
+    pthread_mutex_unlock(&s_callListMutex);
+
+    releaseCallList(p_list);
+}
+
 static void sendCallStateChanged(void *param)
 {
+    /* the framework answers this with GET_CURRENT_CALLS */
+    invalidateCallList();
+
     RIL_onUnsolicitedResponse (
         RIL_UNSOL_RESPONSE_CALL_STATE_CHANGED,
         NULL, 0);
 }
 
-static void requestGetCurrentCalls(void *data, size_t datalen, RIL_Token t)
+/**
+ * Builds a CallList from an AT+CLCC response
+ *
+ * Returns NULL if the response should be treated as an error.
+ * *p_needRepoll is set if the call state should be polled again
+ * because it is expected to change without an unsolicited line.
+ */
+static CallList *callListFromResponse(ATResponse *p_response,
+                                        int *p_needRepoll)
 {
-    int err;
-    ATResponse *p_response;
     ATLine *p_cur;
     int countCalls;
     int countValidCalls;
+    CallList *p_list;
     RIL_Call *p_calls;
-    RIL_Call **pp_calls;
-    int i;
     int needRepoll = 0;
 
 #ifdef WORKAROUND_ERRONEOUS_ANSWER
     int prevIncomingOrWaitingLine;
+    int i;
 
     prevIncomingOrWaitingLine = s_incomingOrWaitingLine;
     s_incomingOrWaitingLine = -1;
 #endif /*WORKAROUND_ERRONEOUS_ANSWER*/
 
-    err = at_send_command_multiline ("AT+CLCC", "+CLCC:", &p_response);
-
-    if (err != 0 || p_response->success == 0) {
-        RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-        return;
-    }
+    *p_needRepoll = 0;
 
     /* count the calls */
     for (countCalls = 0, p_cur = p_response->p_intermediates
@@ -508,22 +978,17 @@ static void requestGetCurrentCalls(void *data, size_t datalen, RIL_Token t)
         countCalls++;
     }
 
-    /* yes, there's an array of pointers and then an array of structures */
-
-    pp_calls = (RIL_Call **)alloca(countCalls * sizeof(RIL_Call *));
-    p_calls = (RIL_Call *)alloca(countCalls * sizeof(RIL_Call));
-    memset (p_calls, 0, countCalls * sizeof(RIL_Call));
-
-    /* init the pointer array */
-    for(i = 0; i < countCalls ; i++) {
-        pp_calls[i] = &(p_calls[i]);
-    }
+    p_list = newCallList(countCalls);
+    p_calls = p_list->p_calls;
 
     for (countValidCalls = 0, p_cur = p_response->p_intermediates
             ; p_cur != NULL
             ; p_cur = p_cur->p_next
     ) {
-        err = callFromCLCCLine(p_cur->line, p_calls + countValidCalls);
+        int err;
+
+        err = callFromCLCCLine(p_cur->line, p_calls + countValidCalls,
+                p_list->p_numbers + countValidCalls * MAX_CALL_NUMBER);
 
         if (err != 0) {
             continue;
@@ -546,6 +1011,8 @@ static void requestGetCurrentCalls(void *data, size_t datalen, RIL_Token t)
         countValidCalls++;
     }
 
+    p_list->count = countValidCalls;
+
 #ifdef WORKAROUND_ERRONEOUS_ANSWER
     // Basically:
     // A call was incoming or waiting
@@ -568,7 +1035,8 @@ static void requestGetCurrentCalls(void *data, size_t datalen, RIL_Token t)
                     "Hit WORKAROUND_ERRONOUS_ANSWER case."
                     " Repoll count: %d\n", s_repollCallsCount);
                 s_repollCallsCount++;
-                goto error;
+                free(p_list);
+                return NULL;
             }
         }
     }
@@ -577,24 +1045,177 @@ static void requestGetCurrentCalls(void *data, size_t datalen, RIL_Token t)
     s_repollCallsCount = 0;
 #endif /*WORKAROUND_ERRONEOUS_ANSWER*/
 
-    RIL_onRequestComplete(t, RIL_E_SUCCESS, pp_calls,
-            countValidCalls * sizeof (RIL_Call *));
+#ifdef POLL_CALL_STATE
+    // We don't seem to get a "NO CARRIER" message from
+    // smd, so we're forced to poll until the call ends.
+    *p_needRepoll = (countValidCalls > 0);
+#else
+    *p_needRepoll = needRepoll;
+#endif
+
+    return p_list;
+}
+
+static void completeGetCurrentCalls(RIL_Token t, CallList *p_list)
+{
+    if (p_list == NULL) {
+        RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+        return;
+    }
+
+    RIL_onRequestComplete(t, RIL_E_SUCCESS, p_list->pp_calls,
+            p_list->count * sizeof (RIL_Call *));
+}
+
+/**
+ * Marks an AT+CLCC in flight for the waiters queued so far; the caller
+ * sends it with sendCallListQuery() once s_callListMutex is released
+ * assumes s_callListMutex is held and no query is in flight
+ */
+static void startCallListQuery()
+{
+    s_callListQueryInFlight = 1;
+    s_callListQueryGen = s_callListGen;
+}
+
+static void sendCallListQuery()
+{
+    int ret;
+
+    ret = at_send_command_async("AT+CLCC", MULTILINE, "+CLCC:", NULL, 0,
+                                onCallListComplete, NULL);
+
+    if (ret < 0) {
+        onCallListComplete(ret, NULL, NULL);
+    }
+}
+
+static void onCallListComplete(int err, ATResponse *p_response, void *param)
+{
+    CallList *p_list = NULL;
+    CallListWaiter *p_done = NULL;
+    CallListWaiter **pp_done = &p_done;
+    CallListWaiter **pp_cur;
+    int needRepoll = 0;
+    int again;
+
+    if (err == 0 && p_response->success) {
+        p_list = callListFromResponse(p_response, &needRepoll);
+    }
 
     at_response_free(p_response);
 
-#ifdef POLL_CALL_STATE
-    if (countValidCalls) {  // We don't seem to get a "NO CARRIER" message from
-                            // smd, so we're forced to poll until the call ends.
-#else
+    pthread_mutex_lock(&s_callListMutex);
+
+    s_callListQueryInFlight = 0;
+
+    /* requests that arrived after the list went stale need a new query */
+    for (pp_cur = &s_callListWaiters ; *pp_cur != NULL ; ) {
+        CallListWaiter *p_waiter = *pp_cur;
+
+        if (p_waiter->gen == s_callListQueryGen) {
+            *pp_cur = p_waiter->p_next;
+            p_waiter->p_next = NULL;
+            *pp_done = p_waiter;
+            pp_done = &p_waiter->p_next;
+        } else {
+            pp_cur = &p_waiter->p_next;
+        }
+    }
+
+    if (p_list != NULL && s_callListQueryGen == s_callListGen) {
+        s_callList = p_list;
+        p_list->refCount++;
+    }
+
+    again = (s_callListWaiters != NULL);
+
+    if (again) {
+        startCallListQuery();
+    }
+
+    pthread_mutex_unlock(&s_callListMutex);
+
+    while (p_done != NULL) {
+        CallListWaiter *p_next = p_done->p_next;
+
+        completeGetCurrentCalls(p_done->t, p_list);
+        free(p_done);
+
+        p_done = p_next;
+    }
+
+    releaseCallList(p_list);
+
     if (needRepoll) {
-#endif
-        RIL_requestTimedCallback (sendCallStateChanged, NULL, &TIMEVAL_CALLSTATEPOLL);
+        schedulePoll(&s_callStatePoll, &TIMEVAL_CALLSTATEPOLL);
     }
 
-    return;
-error:
-    RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+    if (again) {
+        sendCallListQuery();
+    }
+}
+
+static void requestGetCurrentCalls(void *data, size_t datalen, RIL_Token t)
+{
+    CallList *p_list;
+    CallListWaiter *p_waiter;
+    CallListWaiter **pp_tail;
+    int start;
+
+    pthread_mutex_lock(&s_callListMutex);
+
+    p_list = s_callList;
+
+    if (p_list != NULL) {
+        p_list->refCount++;
+        pthread_mutex_unlock(&s_callListMutex);
+
+        completeGetCurrentCalls(t, p_list);
+        releaseCallList(p_list);
+        return;
+    }
+
+    p_waiter = (CallListWaiter *) malloc(sizeof(CallListWaiter));
+    p_waiter->p_next = NULL;
+    p_waiter->t = t;
+    p_waiter->gen = s_callListGen;
+
+    for (pp_tail = &s_callListWaiters ; *pp_tail != NULL
+            ; pp_tail = &(*pp_tail)->p_next
+    );
+    *pp_tail = p_waiter;
+
+    start = !s_callListQueryInFlight;
+
+    if (start) {
+        startCallListQuery();
+    }
+
+    pthread_mutex_unlock(&s_callListMutex);
+
+    if (start) {
+        sendCallListQuery();
+    }
+}
+
+/*
+ * The handlers below do not wait for the modem. They queue their AT
+ * commands with at_send_command_async() and finish the request from the
+ * completion, which runs on the AT reader thread, so the event loop is
+ * free as soon as the command is queued. Anything the completion needs
+ * from "data" must be copied first; it is only valid inside onRequest.
+ */
+
+static void onDialComplete(int err, ATResponse *p_response, void *param)
+{
+    RIL_Token t = (RIL_Token) param;
+
     at_response_free(p_response);
+
+    /* success or failure is ignored by the upper layer here.
+       it will call GET_CURRENT_CALLS and determine success that way */
+    RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
 }
 
 static void requestDial(void *data, size_t datalen, RIL_Token t)
@@ -615,13 +1236,14 @@ static void requestDial(void *data, size_t datalen, RIL_Token t)
 
     asprintf(&cmd, "ATD%s%s;", p_dial->address, clir);
 
-    ret = at_send_command(cmd, NULL);
+    ret = at_send_command_async(cmd, NO_RESULT, NULL, NULL, 0,
+                                onDialComplete, t);
 
     free(cmd);
 
-    /* success or failure is ignored by the upper layer here.
-       it will call GET_CURRENT_CALLS and determine success that way */
-    RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
+    if (ret < 0) {
+        onDialComplete(ret, NULL, t);
+    }
 }
 
 static void requestWriteSmsToSim(void *data, size_t datalen, RIL_Token t)
@@ -675,9 +1297,9 @@ static void requestHangup(void *data, size_t datalen, RIL_Token t)
 static void requestSignalStrength(void *data, size_t datalen, RIL_Token t)
 {
     ATResponse *p_response = NULL;
+    ATTokLine tok;
     int err;
     int response[2];
-    char *line;
 
     err = at_send_command_singleline("AT+CSQ", "+CSQ:", &p_response);
 
@@ -686,15 +1308,13 @@ static void requestSignalStrength(void *data, size_t datalen, RIL_Token t)
         goto error;
     }
 
-    line = p_response->p_intermediates->line;
-
-    err = at_tok_start(&line);
+    err = at_tok_parse(p_response->p_intermediates->line, &tok);
     if (err < 0) goto error;
 
-    err = at_tok_nextint(&line, &(response[0]));
+    err = at_tok_getint(&tok, 0, &(response[0]));
     if (err < 0) goto error;
 
-    err = at_tok_nextint(&line, &(response[1]));
+    err = at_tok_getint(&tok, 1, &(response[1]));
     if (err < 0) goto error;
 
     RIL_onRequestComplete(t, RIL_E_SUCCESS, response, sizeof(response));
@@ -713,13 +1333,14 @@ static void requestRegistrationState(int request, void *data,
 {
     int err;
     int response[4];
+    char responseBuf[4][12];
     char * responseStr[4];
     ATResponse *p_response = NULL;
+    ATTokLine tok;
     const char *cmd;
     const char *prefix;
-    char *line, *p;
-    int commas;
-    int skip;
+    int first;
+    int i;
     int count = 3;
 
 
@@ -738,9 +1359,7 @@ static void requestRegistrationState(int request, void *data,
 
     if (err != 0) goto error;
 
-    line = p_response->p_intermediates->line;
-
-    err = at_tok_start(&line);
+    err = at_tok_parse(p_response->p_intermediates->line, &tok);
     if (err < 0) goto error;
 
     /* Ok you have to be careful here
@@ -764,61 +1383,26 @@ static void requestRegistrationState(int request, void *data,
      *   +CGREG: n, stat [,lac, cid [,networkType]]
      */
 
-    /* count number of commas */
-    commas = 0;
-    for (p = line ; *p != '\0' ;p++) {
-        if (*p == ',') commas++;
-    }
-
-    switch (commas) {
-        case 0: /* +CREG: <stat> */
-            err = at_tok_nextint(&line, &response[0]);
-            if (err < 0) goto error;
-            response[1] = -1;
-            response[2] = -1;
-        break;
-
-        case 1: /* +CREG: <n>, <stat> */
-            err = at_tok_nextint(&line, &skip);
-            if (err < 0) goto error;
-            err = at_tok_nextint(&line, &response[0]);
-            if (err < 0) goto error;
+    switch (tok.count) {
+        case 1: /* +CREG: <stat> */
+        case 2: /* +CREG: <n>, <stat> */
+            first = tok.count - 1;
             response[1] = -1;
             response[2] = -1;
-            if (err < 0) goto error;
         break;
 
-        case 2: /* +CREG: <stat>, <lac>, <cid> */
-            err = at_tok_nextint(&line, &response[0]);
-            if (err < 0) goto error;
-            err = at_tok_nexthexint(&line, &response[1]);
-            if (err < 0) goto error;
-            err = at_tok_nexthexint(&line, &response[2]);
-            if (err < 0) goto error;
+        case 3: /* +CREG: <stat>, <lac>, <cid> */
+            first = 0;
         break;
-        case 3: /* +CREG: <n>, <stat>, <lac>, <cid> */
-            err = at_tok_nextint(&line, &skip);
-            if (err < 0) goto error;
-            err = at_tok_nextint(&line, &response[0]);
-            if (err < 0) goto error;
-            err = at_tok_nexthexint(&line, &response[1]);
-            if (err < 0) goto error;
-            err = at_tok_nexthexint(&line, &response[2]);
-            if (err < 0) goto error;
+        case 4: /* +CREG: <n>, <stat>, <lac>, <cid> */
+            first = 1;
         break;
         /* special case for CGREG, there is a fourth parameter
          * that is the network type (unknown/gprs/edge/umts)
          */
-        case 4: /* +CGREG: <n>, <stat>, <lac>, <cid>, <networkType> */
-            err = at_tok_nextint(&line, &skip);
-            if (err < 0) goto error;
-            err = at_tok_nextint(&line, &response[0]);
-            if (err < 0) goto error;
-            err = at_tok_nexthexint(&line, &response[1]);
-            if (err < 0) goto error;
-            err = at_tok_nexthexint(&line, &response[2]);
-            if (err < 0) goto error;
-            err = at_tok_nexthexint(&line, &response[3]);
+        case 5: /* +CGREG: <n>, <stat>, <lac>, <cid>, <networkType> */
+            first = 1;
+            err = at_tok_gethexint(&tok, 4, &response[3]);
             if (err < 0) goto error;
             count = 4;
         break;
@@ -826,12 +1410,32 @@ static void requestRegistrationState(int request, void *data,
             goto error;
     }
 
-    asprintf(&responseStr[0], "%d", response[0]);
-    asprintf(&responseStr[1], "%x", response[1]);
-    asprintf(&responseStr[2], "%x", response[2]);
+    if (first == 1) {
+        /* <n> must still be a number */
+        err = at_tok_getint(&tok, 0, &i);
+        if (err < 0) goto error;
+    }
+
+    err = at_tok_getint(&tok, first, &response[0]);
+    if (err < 0) goto error;
+
+    if (tok.count >= 3) {
+        err = at_tok_gethexint(&tok, first + 1, &response[1]);
+        if (err < 0) goto error;
+        err = at_tok_gethexint(&tok, first + 2, &response[2]);
+        if (err < 0) goto error;
+    }
+
+    for (i = 0 ; i < 4 ; i++) {
+        responseStr[i] = responseBuf[i];
+    }
+
+    snprintf(responseBuf[0], sizeof(responseBuf[0]), "%d", response[0]);
+    snprintf(responseBuf[1], sizeof(responseBuf[1]), "%x", response[1]);
+    snprintf(responseBuf[2], sizeof(responseBuf[2]), "%x", response[2]);
 
     if (count > 3)
-        asprintf(&responseStr[3], "%d", response[3]);
+        snprintf(responseBuf[3], sizeof(responseBuf[3]), "%d", response[3]);
 
     RIL_onRequestComplete(t, RIL_E_SUCCESS, responseStr, count*sizeof(char*));
     at_response_free(p_response);
@@ -850,11 +1454,16 @@ static void requestOperator(void *data, size_t datalen, RIL_Token t)
     int skip;
     ATLine *p_cur;
     char *response[3];
+    int gen;
 
     memset(response, 0, sizeof(response));
 
     ATResponse *p_response = NULL;
 
+    if (completeFromCache(CACHE_OPERATOR, t, &gen)) {
+        return;
+    }
+
     err = at_send_command_multiline(
         "AT+COPS=3,0;+COPS?;+COPS=3,1;+COPS?;+COPS=3,2;+COPS?",
         "+COPS:", &p_response);
@@ -905,11 +1514,32 @@ static void requestOperator(void *data, size_t datalen, RIL_Token t)
     }
 
     RIL_onRequestComplete(t, RIL_E_SUCCESS, response, sizeof(response));
+    cacheStore(CACHE_OPERATOR, gen, newCacheValue(0, response, 3));
+    at_response_free(p_response);
+
+    return;
+error:
+    LOGE("requestOperator must not return error when radio is on");
+    RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+    at_response_free(p_response);
+}
+
+static void onSendSMSComplete(int err, ATResponse *p_response, void *param)
+{
+    RIL_Token t = (RIL_Token) param;
+    RIL_SMS_Response response;
+
+    if (err != 0 || p_response->success == 0) goto error;
+
+    memset(&response, 0, sizeof(response));
+
+    /* FIXME fill in messageRef and ackPDU */
+
+    RIL_onRequestComplete(t, RIL_E_SUCCESS, &response, sizeof(response));
     at_response_free(p_response);
 
     return;
 error:
-    LOGE("requestOperator must not return error when radio is on");
     RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
     at_response_free(p_response);
 }
@@ -921,8 +1551,6 @@ static void requestSendSMS(void *data, size_t datalen, RIL_Token t)
     const char *pdu;
     int tpLayerLength;
     char *cmd1, *cmd2;
-    RIL_SMS_Response response;
-    ATResponse *p_response = NULL;
 
     smsc = ((const char **)data)[0];
     pdu = ((const char **)data)[1];
@@ -937,64 +1565,125 @@ static void requestSendSMS(void *data, size_t datalen, RIL_Token t)
     asprintf(&cmd1, "AT+CMGS=%d", tpLayerLength);
     asprintf(&cmd2, "%s%s", smsc, pdu);
 
-    err = at_send_command_sms(cmd1, cmd2, "+CMGS:", &p_response);
+    err = at_send_command_async(cmd1, SINGLELINE, "+CMGS:", cmd2, 0,
+                                onSendSMSComplete, t);
 
-    if (err != 0 || p_response->success == 0) goto error;
+    free(cmd1);
+    free(cmd2);
 
-    memset(&response, 0, sizeof(response));
+    if (err < 0) {
+        onSendSMSComplete(err, NULL, t);
+    }
+}
 
-    /* FIXME fill in messageRef and ackPDU */
+static void completeSetupDataCall(RIL_Token t, int success)
+{
+    const char *response[2] = { "1", PPP_TTY_PATH };
 
-    RIL_onRequestComplete(t, RIL_E_SUCCESS, &response, sizeof(response));
-    at_response_free(p_response);
+    if (success) {
+        RIL_onRequestComplete(t, RIL_E_SUCCESS, response, sizeof(response));
+    } else {
+        RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+    }
+}
 
-    return;
-error:
-    RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+static void onSetupDataCallComplete(int err, ATResponse *p_response,
+                                    void *param)
+{
+    completeSetupDataCall((RIL_Token) param,
+                          err >= 0 && p_response->success != 0);
     at_response_free(p_response);
 }
 
+/* state for waiting on /dev/qmi with timed callbacks instead of sleep() */
+typedef struct {
+    RIL_Token t;
+    int fd;
+    int retry;
+} QmiSetupState;
+
+static void pollQmiDataCall(void *param)
+{
+    QmiSetupState *p_state = (QmiSetupState *) param;
+    char status[32] = {0};
+    ssize_t rlen;
+    int qmistatus;
+    int success = 0;
+
+    do {
+        rlen = read(p_state->fd, status, 31);
+    } while (rlen < 0 && errno == EINTR);
+
+    if (rlen < 0) {
+        LOGE("### ERROR reading from /dev/qmi");
+        goto done;
+    }
+
+    status[rlen] = '\0';
+    LOGD("### status: %s", status);
+
+    if (strncmp(status, "STATE=up", 8) && strcmp(status, "online")) {
+        if (--p_state->retry > 0) {
+            RIL_requestTimedCallback (pollQmiDataCall, p_state,
+                                      &TIMEVAL_QMIPOLL);
+            return;
+        }
+
+        LOGE("### Failed to get data connection up\n");
+        goto done;
+    }
+
+    qmistatus = system("netcfg rmnet0 dhcp");
+
+    LOGD("netcfg rmnet0 dhcp: status %d\n", qmistatus);
+
+    success = (qmistatus >= 0);
+
+done:
+    close(p_state->fd);
+    completeSetupDataCall(p_state->t, success);
+    free(p_state);
+}
+
 static void requestSetupDataCall(void *data, size_t datalen, RIL_Token t)
 {
     const char *apn;
     char *cmd;
     int err;
-    ATResponse *p_response = NULL;
-    char *response[2] = { "1", PPP_TTY_PATH };
+    int fd;
+    size_t cur = 0;
+    size_t len;
+    ssize_t written;
 
     apn = ((const char **)data)[2];
 
 #ifdef USE_TI_COMMANDS
     // Config for multislot class 10 (probably default anyway eh?)
-    err = at_send_command("AT%CPRIM=\"GMM\",\"CONFIG MULTISLOT_CLASS=<10>\"",
-                        NULL);
+    at_send_command_async("AT%CPRIM=\"GMM\",\"CONFIG MULTISLOT_CLASS=<10>\"",
+                        NO_RESULT, NULL, NULL, 0, NULL, NULL);
 
-    err = at_send_command("AT%DATA=2,\"UART\",1,,\"SER\",\"UART\",0", NULL);
+    at_send_command_async("AT%DATA=2,\"UART\",1,,\"SER\",\"UART\",0",
+                        NO_RESULT, NULL, NULL, 0, NULL, NULL);
 #endif /* USE_TI_COMMANDS */
 
-    int fd, qmistatus;
-    size_t cur = 0;
-    size_t len;
-    ssize_t written, rlen;
-    char status[32] = {0};
-    int retry = 10;
-
     LOGD("requesting data connection to APN '%s'", apn);
 
     fd = open ("/dev/qmi", O_RDWR);
     if (fd >= 0) { /* the device doesn't exist on the emulator */
+        QmiSetupState *p_state;
 
-	    LOGD("opened the qmi device\n");
-	    asprintf(&cmd, "up:%s", apn);
-	    len = strlen(cmd);
+        LOGD("opened the qmi device\n");
+        asprintf(&cmd, "up:%s", apn);
+        len = strlen(cmd);
 
-	    while (cur < len) {
-		    do {
-	            written = write (fd, cmd + cur, len - cur);
-	        } while (written < 0 && errno == EINTR);
+        while (cur < len) {
+            do {
+                written = write (fd, cmd + cur, len - cur);
+            } while (written < 0 && errno == EINTR);
 
-	        if (written < 0) {
+            if (written < 0) {
                 LOGE("### ERROR writing to /dev/qmi");
+                free(cmd);
                 close(fd);
                 goto error;
             }
@@ -1002,72 +1691,51 @@ static void requestSetupDataCall(void *data, size_t datalen, RIL_Token t)
             cur += written;
         }
 
-        // wait for interface to come online
-
-        do {
-            sleep(1);
-            do {
-                rlen = read(fd, status, 31);
-            } while (rlen < 0 && errno == EINTR);
-
-            if (rlen < 0) {
-                LOGE("### ERROR reading from /dev/qmi");
-                close(fd);
-                goto error;
-            } else {
-                status[rlen] = '\0';
-                LOGD("### status: %s", status);
-            }
-        } while (strncmp(status, "STATE=up", 8) && strcmp(status, "online") && --retry);
-
-        close(fd);
+        free(cmd);
 
-        if (retry == 0) {
-            LOGE("### Failed to get data connection up\n");
-	        goto error;
-		}
-
-        qmistatus = system("netcfg rmnet0 dhcp");
-
-        LOGD("netcfg rmnet0 dhcp: status %d\n", qmistatus);
+        // wait for interface to come online
+        p_state = (QmiSetupState *) malloc(sizeof(QmiSetupState));
+        p_state->t = t;
+        p_state->fd = fd;
+        p_state->retry = 10;
 
-	    if (qmistatus < 0) goto error;
+        RIL_requestTimedCallback (pollQmiDataCall, p_state, &TIMEVAL_QMIPOLL);
+        return;
+    }
 
-	} else {
+    /* the commands go out back to back in queue order; as before only
+       the result of the final ATD matters */
 
-        asprintf(&cmd, "AT+CGDCONT=1,\"IP\",\"%s\",,0,0", apn);
-	    //FIXME check for error here
-	    err = at_send_command(cmd, NULL);
-	    free(cmd);
+    asprintf(&cmd, "AT+CGDCONT=1,\"IP\",\"%s\",,0,0", apn);
+    //FIXME check for error here
+    at_send_command_async(cmd, NO_RESULT, NULL, NULL, 0, NULL, NULL);
+    free(cmd);
 
-	    // Set required QoS params to default
-	    err = at_send_command("AT+CGQREQ=1", NULL);
+    // Set required QoS params to default
+    at_send_command_async("AT+CGQREQ=1", NO_RESULT, NULL, NULL, 0, NULL, NULL);
 
-	    // Set minimum QoS params to default
-	    err = at_send_command("AT+CGQMIN=1", NULL);
+    // Set minimum QoS params to default
+    at_send_command_async("AT+CGQMIN=1", NO_RESULT, NULL, NULL, 0, NULL, NULL);
 
-	    // packet-domain event reporting
-	    err = at_send_command("AT+CGEREP=1,0", NULL);
+    // packet-domain event reporting
+    at_send_command_async("AT+CGEREP=1,0", NO_RESULT, NULL, NULL, 0,
+                          NULL, NULL);
 
-	    // Hangup anything that's happening there now
-	    err = at_send_command("AT+CGACT=1,0", NULL);
+    // Hangup anything that's happening there now
+    at_send_command_async("AT+CGACT=1,0", NO_RESULT, NULL, NULL, 0,
+                          NULL, NULL);
 
-	    // Start data on PDP context 1
-	    err = at_send_command("ATD*99***1#", &p_response);
+    // Start data on PDP context 1
+    err = at_send_command_async("ATD*99***1#", NO_RESULT, NULL, NULL, 0,
+                                onSetupDataCallComplete, t);
 
-	    if (err < 0 || p_response->success == 0) {
-	        goto error;
-	    }
+    if (err < 0) {
+        goto error;
     }
 
-    RIL_onRequestComplete(t, RIL_E_SUCCESS, response, sizeof(response));
-    at_response_free(p_response);
-
     return;
 error:
-    RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-    at_response_free(p_response);
-
+    completeSetupDataCall(t, 0);
 }
 
 static void requestSMSAcknowledge(void *data, size_t datalen, RIL_Token t)
@@ -1092,33 +1760,14 @@ error:
 
 }
 
-static void  requestSIM_IO(void *data, size_t datalen, RIL_Token t)
+static void onSIM_IOComplete(int err, ATResponse *p_response, void *param)
 {
-    ATResponse *p_response = NULL;
+    RIL_Token t = (RIL_Token) param;
     RIL_SIM_IO_Response sr;
-    int err;
-    char *cmd = NULL;
-    RIL_SIM_IO *p_args;
     char *line;
 
     memset(&sr, 0, sizeof(sr));
 
-    p_args = (RIL_SIM_IO *)data;
-
-    /* FIXME handle pin2 */
-
-    if (p_args->data == NULL) {
-        asprintf(&cmd, "AT+CRSM=%d,%d,%d,%d,%d",
-                    p_args->command, p_args->fileid,
-                    p_args->p1, p_args->p2, p_args->p3);
-    } else {
-        asprintf(&cmd, "AT+CRSM=%d,%d,%d,%d,%d,%s",
-                    p_args->command, p_args->fileid,
-                    p_args->p1, p_args->p2, p_args->p3, p_args->data);
-    }
-
-    err = at_send_command_singleline(cmd, "+CRSM:", &p_response);
-
     if (err < 0 || p_response->success == 0) {
         goto error;
     }
@@ -1141,14 +1790,41 @@ static void  requestSIM_IO(void *data, size_t datalen, RIL_Token t)
 
     RIL_onRequestComplete(t, RIL_E_SUCCESS, &sr, sizeof(sr));
     at_response_free(p_response);
-    free(cmd);
 
     return;
 error:
     RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
     at_response_free(p_response);
+}
+
+static void  requestSIM_IO(void *data, size_t datalen, RIL_Token t)
+{
+    int err;
+    char *cmd = NULL;
+    RIL_SIM_IO *p_args;
+
+    p_args = (RIL_SIM_IO *)data;
+
+    /* FIXME handle pin2 */
+
+    if (p_args->data == NULL) {
+        asprintf(&cmd, "AT+CRSM=%d,%d,%d,%d,%d",
+                    p_args->command, p_args->fileid,
+                    p_args->p1, p_args->p2, p_args->p3);
+    } else {
+        asprintf(&cmd, "AT+CRSM=%d,%d,%d,%d,%d,%s",
+                    p_args->command, p_args->fileid,
+                    p_args->p1, p_args->p2, p_args->p3, p_args->data);
+    }
+
+    err = at_send_command_async(cmd, SINGLELINE, "+CRSM:", NULL, 0,
+                                onSIM_IOComplete, t);
+
     free(cmd);
 
+    if (err < 0) {
+        onSIM_IOComplete(err, NULL, t);
+    }
 }
 
 static void  requestEnterSimPin(void*  data, size_t  datalen, RIL_Token  t)
@@ -1192,6 +1868,37 @@ static void  requestSendUSSD(void *data, size_t datalen, RIL_Token t)
 }
 
 
+/** returns the AT channel class for request */
+static ChannelClass requestChannelClass(int request)
+{
+    switch (request) {
+        case RIL_REQUEST_SEND_SMS:
+        case RIL_REQUEST_SMS_ACKNOWLEDGE:
+        case RIL_REQUEST_WRITE_SMS_TO_SIM:
+        case RIL_REQUEST_DELETE_SMS_ON_SIM:
+            return CHANNEL_SMS;
+
+        case RIL_REQUEST_SETUP_DATA_CALL:
+        case RIL_REQUEST_DATA_CALL_LIST:
+            return CHANNEL_DATA;
+
+        case RIL_REQUEST_GET_SIM_STATUS:
+        case RIL_REQUEST_SIM_IO:
+        case RIL_REQUEST_GET_IMSI:
+        case RIL_REQUEST_ENTER_SIM_PIN:
+        case RIL_REQUEST_ENTER_SIM_PUK:
+        case RIL_REQUEST_ENTER_SIM_PIN2:
+        case RIL_REQUEST_ENTER_SIM_PUK2:
+        case RIL_REQUEST_CHANGE_SIM_PIN:
+        case RIL_REQUEST_CHANGE_SIM_PIN2:
+            return CHANNEL_SIM;
+
+        default:
+            return CHANNEL_CALL;
+    }
+}
+
+
 /*** Callback methods from the RIL library to us ***/
 
 /**
@@ -1211,6 +1918,7 @@ onRequest (int request, void *data, size_t datalen, RIL_Token t)
 {
     ATResponse *p_response;
     int err;
+    int prevChannel;
 
     LOGD("onRequest: %s", requestToString(request));
 
@@ -1235,6 +1943,26 @@ onRequest (int request, void *data, size_t datalen, RIL_Token t)
         return;
     }
 
+    /* anything that can change the call list makes the cached one stale */
+    switch (request) {
+        case RIL_REQUEST_DIAL:
+        case RIL_REQUEST_HANGUP:
+        case RIL_REQUEST_HANGUP_WAITING_OR_BACKGROUND:
+        case RIL_REQUEST_HANGUP_FOREGROUND_RESUME_BACKGROUND:
+        case RIL_REQUEST_SWITCH_WAITING_OR_HOLDING_AND_ACTIVE:
+        case RIL_REQUEST_ANSWER:
+        case RIL_REQUEST_CONFERENCE:
+        case RIL_REQUEST_UDUB:
+        case RIL_REQUEST_SEPARATE_CONNECTION:
+            invalidateCallList();
+            break;
+        default:
+            break;
+    }
+
+    prevChannel = at_channel_select(
+                    s_classChannel[requestChannelClass(request)]);
+
     switch (request) {
         case RIL_REQUEST_GET_SIM_STATUS: {
             RIL_CardStatus *p_card_status;
@@ -1377,29 +2105,16 @@ onRequest (int request, void *data, size_t datalen, RIL_Token t)
             break;
 
         case RIL_REQUEST_GET_IMSI:
-            p_response = NULL;
-            err = at_send_command_numeric("AT+CIMI", &p_response);
-
-            if (err < 0 || p_response->success == 0) {
-                RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-            } else {
-                RIL_onRequestComplete(t, RIL_E_SUCCESS,
-                    p_response->p_intermediates->line, sizeof(char *));
-            }
-            at_response_free(p_response);
+            requestIdentity(CACHE_IMSI, "AT+CIMI", NULL, t);
             break;
 
         case RIL_REQUEST_GET_IMEI:
-            p_response = NULL;
-            err = at_send_command_numeric("AT+CGSN", &p_response);
+            requestIdentity(CACHE_IMEI, "AT+CGSN", NULL, t);
+            break;
 
-            if (err < 0 || p_response->success == 0) {
-                RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-            } else {
-                RIL_onRequestComplete(t, RIL_E_SUCCESS,
-                    p_response->p_intermediates->line, sizeof(char *));
-            }
-            at_response_free(p_response);
+        case RIL_REQUEST_BASEBAND_VERSION:
+            /* free-form, so take whatever line comes back */
+            requestIdentity(CACHE_BASEBAND_VERSION, "AT+CGMR", "", t);
             break;
 
         case RIL_REQUEST_SIM_IO:
@@ -1424,6 +2139,7 @@ onRequest (int request, void *data, size_t datalen, RIL_Token t)
             break;
 
         case RIL_REQUEST_SET_NETWORK_SELECTION_AUTOMATIC:
+            invalidateCaches(CACHE_RESET_NETWORK);
             at_send_command("AT+COPS=0", NULL);
             break;
 
@@ -1490,6 +2206,8 @@ onRequest (int request, void *data, size_t datalen, RIL_Token t)
             RIL_onRequestComplete(t, RIL_E_REQUEST_NOT_SUPPORTED, NULL, 0);
             break;
     }
+
+    at_channel_select(prevChannel);
 }
 
 /**
@@ -1556,6 +2274,15 @@ setRadioState(RIL_RadioState newState)
 
     /* do these outside of the mutex */
     if (sState != oldState) {
+        invalidateCallList();
+
+        /* registration is lost with the radio; a SIM that is becoming
+           ready again may not be the one we read the IMSI from, and
+           losing the channel means the modem itself may have changed */
+        invalidateCaches(CACHE_RESET_NETWORK
+            | (sState == RADIO_STATE_SIM_READY ? 0 : CACHE_RESET_SIM)
+            | (sState == RADIO_STATE_UNAVAILABLE ? CACHE_RESET_RADIO : 0));
+
         RIL_onUnsolicitedResponse (RIL_UNSOL_RESPONSE_RADIO_STATE_CHANGED,
                                     NULL, 0);
 
@@ -1751,7 +2478,7 @@ static void pollSIMState (void *param)
         return;
 
         case SIM_NOT_READY:
-            RIL_requestTimedCallback (pollSIMState, NULL, &TIMEVAL_SIMPOLL);
+            schedulePoll(&s_simPoll, &TIMEVAL_SIMPOLL);
         return;
 
         case SIM_READY:
@@ -1886,6 +2613,37 @@ static void waitForClose()
     pthread_mutex_unlock(&s_state_mutex);
 }
 
+enum {
+    UNSOL_NITZ,
+    UNSOL_CALL_STATE,
+    UNSOL_NETWORK_STATE,
+    UNSOL_NEW_SMS,
+    UNSOL_SMS_STATUS_REPORT,
+    UNSOL_DATA_CALL
+};
+
+#ifdef WORKAROUND_FAKE_CGEV
+#define FAKE_CGEV_PREFIXES(X) \
+    X("+CME ERROR: 150", UNSOL_DATA_CALL)
+#else
+#define FAKE_CGEV_PREFIXES(X)
+#endif /* WORKAROUND_FAKE_CGEV */
+
+#define UNSOL_PREFIXES(X) \
+    X("%CTZV:",     UNSOL_NITZ) /* TI specific -- NITZ time */ \
+    X("+CRING:",    UNSOL_CALL_STATE) \
+    X("RING",       UNSOL_CALL_STATE) \
+    X("NO CARRIER", UNSOL_CALL_STATE) \
+    X("+CCWA",      UNSOL_CALL_STATE) \
+    X("+CREG:",     UNSOL_NETWORK_STATE) \
+    X("+CGREG:",    UNSOL_NETWORK_STATE) \
+    X("+CMT:",      UNSOL_NEW_SMS) \
+    X("+CDS:",      UNSOL_SMS_STATUS_REPORT) \
+    X("+CGEV:",     UNSOL_DATA_CALL) \
+    FAKE_CGEV_PREFIXES(X)
+
+AT_PREFIX_TABLE(s_unsolPrefixes, UNSOL_PREFIXES)
+
 /**
  * Called by atchannel when an unsolicited line appears
  * This is called on atchannel's reader thread. AT commands may
@@ -1903,61 +2661,70 @@ static void onUnsolicited (const char *s, const char *sms_pdu)
         return;
     }
 
-    if (strStartsWith(s, "%CTZV:")) {
-        /* TI specific -- NITZ time */
-        char *response;
+    switch (AT_PREFIX_MATCH(s_unsolPrefixes, s)) {
+        case UNSOL_NITZ: {
+            /* TI specific -- NITZ time */
+            char *response;
 
-        line = strdup(s);
-        at_tok_start(&line);
+            line = strdup(s);
+            at_tok_start(&line);
 
-        err = at_tok_nextstr(&line, &response);
+            err = at_tok_nextstr(&line, &response);
 
-        if (err != 0) {
-            LOGE("invalid NITZ line %s\n", s);
-        } else {
-            RIL_onUnsolicitedResponse (
-                RIL_UNSOL_NITZ_TIME_RECEIVED,
-                response, strlen(response));
+            if (err != 0) {
+                LOGE("invalid NITZ line %s\n", s);
+            } else {
+                RIL_onUnsolicitedResponse (
+                    RIL_UNSOL_NITZ_TIME_RECEIVED,
+                    response, strlen(response));
+            }
+            break;
         }
-    } else if (strStartsWith(s,"+CRING:")
-                || strStartsWith(s,"RING")
-                || strStartsWith(s,"NO CARRIER")
-                || strStartsWith(s,"+CCWA")
-    ) {
-        RIL_onUnsolicitedResponse (
-            RIL_UNSOL_RESPONSE_CALL_STATE_CHANGED,
-            NULL, 0);
-#ifdef WORKAROUND_FAKE_CGEV
-        RIL_requestTimedCallback (onDataCallListChanged, NULL, NULL); //TODO use new function
-#endif /* WORKAROUND_FAKE_CGEV */
-    } else if (strStartsWith(s,"+CREG:")
-                || strStartsWith(s,"+CGREG:")
-    ) {
-        RIL_onUnsolicitedResponse (
-            RIL_UNSOL_RESPONSE_NETWORK_STATE_CHANGED,
-            NULL, 0);
+
+        case UNSOL_CALL_STATE:
+            /* a call setup burst (RING, +CCWA, NO CARRIER...) is reported
+               once, and the framework's GET_CURRENT_CALLS then costs a
+               single AT+CLCC */
+            invalidateCallList();
+            schedulePoll(&s_callStatePoll, &TIMEVAL_CALLSTATE_DEBOUNCE);
 #ifdef WORKAROUND_FAKE_CGEV
-        RIL_requestTimedCallback (onDataCallListChanged, NULL, NULL);
+            schedulePoll(&s_dataCallListPoll, NULL); //TODO use new function
 #endif /* WORKAROUND_FAKE_CGEV */
-    } else if (strStartsWith(s, "+CMT:")) {
-        RIL_onUnsolicitedResponse (
-            RIL_UNSOL_RESPONSE_NEW_SMS,
-            sms_pdu, strlen(sms_pdu));
-    } else if (strStartsWith(s, "+CDS:")) {
-        RIL_onUnsolicitedResponse (
-            RIL_UNSOL_RESPONSE_NEW_SMS_STATUS_REPORT,
-            sms_pdu, strlen(sms_pdu));
-    } else if (strStartsWith(s, "+CGEV:")) {
-        /* Really, we can ignore NW CLASS and ME CLASS events here,
-         * but right now we don't since extranous
-         * RIL_UNSOL_DATA_CALL_LIST_CHANGED calls are tolerated
-         */
-        /* can't issue AT commands here -- call on main thread */
-        RIL_requestTimedCallback (onDataCallListChanged, NULL, NULL);
+            break;
+
+        case UNSOL_NETWORK_STATE:
+            invalidateCaches(CACHE_RESET_NETWORK);
+            RIL_onUnsolicitedResponse (
+                RIL_UNSOL_RESPONSE_NETWORK_STATE_CHANGED,
+                NULL, 0);
 #ifdef WORKAROUND_FAKE_CGEV
-    } else if (strStartsWith(s, "+CME ERROR: 150")) {
-        RIL_requestTimedCallback (onDataCallListChanged, NULL, NULL);
+            schedulePoll(&s_dataCallListPoll, NULL);
 #endif /* WORKAROUND_FAKE_CGEV */
+            break;
+
+        case UNSOL_NEW_SMS:
+            RIL_onUnsolicitedResponse (
+                RIL_UNSOL_RESPONSE_NEW_SMS,
+                sms_pdu, strlen(sms_pdu));
+            break;
+
+        case UNSOL_SMS_STATUS_REPORT:
+            RIL_onUnsolicitedResponse (
+                RIL_UNSOL_RESPONSE_NEW_SMS_STATUS_REPORT,
+                sms_pdu, strlen(sms_pdu));
+            break;
+
+        case UNSOL_DATA_CALL:
+            /* Really, we can ignore NW CLASS and ME CLASS events here,
+             * but right now we don't since extranous
+             * RIL_UNSOL_DATA_CALL_LIST_CHANGED calls are tolerated
+             */
+            /* can't issue AT commands here -- call on main thread */
+            schedulePoll(&s_dataCallListPoll, NULL);
+            break;
+
+        default:
+            break;
     }
 }
 
@@ -1987,13 +2754,82 @@ static void onATTimeout()
 static void usage(char *s)
 {
 #ifdef RIL_SHLIB
-    fprintf(stderr, "reference-ril requires: -p <tcp port> or -d /dev/tty_device\n");
+    fprintf(stderr, "reference-ril requires: -p <tcp port> or -d /dev/tty_device\n"
+                    "    and takes -x <channels> to multiplex the modem\n");
 #else
-    fprintf(stderr, "usage: %s [-p <tcp port>] [-d /dev/tty_device]\n", s);
+    fprintf(stderr, "usage: %s [-p <tcp port>] [-d /dev/tty_device]"
+                    " [-x <channels>]\n", s);
     exit(-1);
 #endif
 }
 
+/**
+ * Starts the AT channels on fd: s_muxChannels of them over a CMUX, or
+ * just fd if no mux was asked for or the modem refuses it
+ *
+ * returns 0 on success, else the at_open error
+ */
+static int openChannels(int fd)
+{
+    int fds[CMUX_MAX_CHANNELS];
+    int ids[CMUX_MAX_CHANNELS];
+    int ret;
+    int i;
+
+    memset(s_classChannel, 0, sizeof(s_classChannel));
+    s_muxed = 0;
+
+    if (s_muxChannels <= 1) {
+        return at_open(fd, onUnsolicited);
+    }
+
+    if (cmux_open(fd, s_muxChannels, fds) < 0) {
+        LOGE("CMUX setup failed, using a single AT channel");
+        return at_open(fd, onUnsolicited);
+    }
+
+    s_muxed = 1;
+
+    ret = at_open(fds[0], onUnsolicited);
+
+    if (ret < 0) {
+        for (i = 0 ; i < s_muxChannels ; i++) {
+            close(fds[i]);
+        }
+        cmux_close();
+        s_muxed = 0;
+        return ret;
+    }
+
+    ids[0] = 0;
+
+    for (i = 1 ; i < s_muxChannels ; i++) {
+        ids[i] = at_channel_open(fds[i], onUnsolicited);
+
+        if (ids[i] < 0) {
+            /* its classes fall back to channel 0 */
+            close(fds[i]);
+            ids[i] = 0;
+            continue;
+        }
+
+        /* each DLCI has its own command settings */
+        at_channel_select(ids[i]);
+        at_handshake();
+        at_send_command("AT+CMEE=1", NULL);
+    }
+
+    at_channel_select(-1);
+
+    for (i = CHANNEL_SMS ; i < CHANNEL_CLASS_COUNT ; i++) {
+        s_classChannel[i] = ids[1 + (i - 1) % (s_muxChannels - 1)];
+    }
+
+    LOGI("%d AT channels over CMUX", s_muxChannels);
+
+    return 0;
+}
+
 static void *
 mainLoop(void *param)
 {
@@ -2050,7 +2886,7 @@ mainLoop(void *param)
         }
 
         s_closed = 0;
-        ret = at_open(fd, onUnsolicited);
+        ret = openChannels(fd);
 
         if (ret < 0) {
             LOGE ("AT error %d on at_open\n", ret);
@@ -2064,6 +2900,14 @@ mainLoop(void *param)
         sleep(1);
 
         waitForClose();
+
+        /* at_close only closed the mux side of the channels */
+        if (s_muxed) {
+            cmux_close();
+            close(fd);
+            s_muxed = 0;
+        }
+
         LOGI("Re-opening after close");
     }
 }
@@ -2081,7 +2925,7 @@ const RIL_RadioFunctions *RIL_Init(const struct RIL_Env *env, int argc, char **a
 
     s_rilenv = env;
 
-    while ( -1 != (opt = getopt(argc, argv, "p:d:s:"))) {
+    while ( -1 != (opt = getopt(argc, argv, "p:d:s:x:"))) {
         switch (opt) {
             case 'p':
                 s_port = atoi(optarg);
@@ -2103,6 +2947,15 @@ const RIL_RadioFunctions *RIL_Init(const struct RIL_Env *env, int argc, char **a
                 LOGI("Opening socket %s\n", s_device_path);
             break;
 
+            case 'x':
+                s_muxChannels = atoi(optarg);
+                if (s_muxChannels < 1 || s_muxChannels >= CMUX_MAX_CHANNELS) {
+                    usage(argv[0]);
+                    return NULL;
+                }
+                LOGI("Multiplexing %d AT channels\n", s_muxChannels);
+            break;
+
             default:
                 usage(argv[0]);
                 return NULL;
@@ -2127,7 +2980,7 @@ int main (int argc, char **argv)
     int fd = -1;
     int opt;
 
-    while ( -1 != (opt = getopt(argc, argv, "p:d:"))) {
+    while ( -1 != (opt = getopt(argc, argv, "p:d:x:"))) {
         switch (opt) {
             case 'p':
                 s_port = atoi(optarg);
@@ -2148,6 +3001,14 @@ int main (int argc, char **argv)
                 LOGI("Opening socket %s\n", s_device_path);
             break;
 
+            case 'x':
+                s_muxChannels = atoi(optarg);
+                if (s_muxChannels < 1 || s_muxChannels >= CMUX_MAX_CHANNELS) {
+                    usage(argv[0]);
+                }
+                LOGI("Multiplexing %d AT channels\n", s_muxChannels);
+            break;
+
             default:
                 usage(argv[0]);
         }
@@ -72,3 +72,28 @@ LOCAL_MODULE_TAGS := debug
 
 include $(BUILD_EXECUTABLE)
 
+# For rilreplay host binary
+# =========================
+ifeq ($(HOST_OS),linux)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+    rilreplay.c \
+    ../libril/ril.cpp \
+    ../libril/ril_event.cpp
+
+LOCAL_STATIC_LIBRARIES := \
+    libbinder \
+    libutils \
+    libcutils \
+    liblog
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../libril
+
+LOCAL_LDLIBS += -lpthread -lrt
+
+LOCAL_MODULE:= rilreplay
+LOCAL_MODULE_TAGS := debug
+
+include $(BUILD_HOST_EXECUTABLE)
+endif # HOST_OS == linux
@@ -35,6 +35,7 @@ enum options {
     DIAL_CALL,
     ANSWER_CALL,
     END_CALL,
+    DUMP_STATS = 12,    /* 11 is rild's send SMS debug command */
 };
 
 
@@ -50,7 +51,8 @@ static void print_usage() {
            7 - DEACTIVE_PDP, \n\
            8 number - DIAL_CALL number, \n\
            9 - ANSWER_CALL, \n\
-           10 - END_CALL \n");
+           10 - END_CALL, \n\
+           12 - DUMP_STATS \n");
 }
 
 static int error_check(int argc, char * argv[]) {
@@ -58,7 +60,7 @@ static int error_check(int argc, char * argv[]) {
         return -1;
     }
     const int option = atoi(argv[1]);
-    if (option < 0 || option > 10) {
+    if (option < 0 || option > DUMP_STATS) {
         return 0;
     } else if ((option == DIAL_CALL || option == SETUP_PDP) && argc == 8) {
         return 0;
@@ -122,6 +124,14 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (atoi(argv[1]) == DUMP_STATS) {
+        // rild writes the stats as text, then closes the socket
+        char buf[512];
+        while ((ret = read(fd, buf, sizeof(buf))) > 0) {
+            fwrite(buf, 1, ret, stdout);
+        }
+    }
+
     close(fd);
     return 0;
 }
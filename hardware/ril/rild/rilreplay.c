@@ -0,0 +1,566 @@
+/* //device/system/rild/rilreplay.c
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * Replays a command socket capture (see ril_capture.h) against libril
+ * with a fake RIL_RadioFunctions, so the libril dispatch and marshalling
+ * paths can be load tested without a modem.
+ *
+ * Commands are written to libril's command socket at their captured
+ * times (or back to back with -f).  The fake radio completes each request
+ * with the captured error after the captured modem latency (immediately
+ * with -f), and unsolicited responses are re-raised at their captured
+ * times.  Requests that carry a response payload get a canned one so the
+ * marshallers run.  Redacted commands (see ril_capture.h) are skipped,
+ * along with their completions.
+ *
+ * rilreplay is built for the host, linking libril's sources directly.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <telephony/ril.h>
+#include <ril_capture.h>
+
+#define MAX_REQUEST 256
+
+extern void RIL_startEventLoop(void);
+extern void RIL_setcallbacks(const RIL_RadioFunctions *callbacks);
+extern void RIL_setCommandSocket(int fd);
+extern void RIL_onRequestComplete(RIL_Token t, RIL_Errno e,
+                           void *response, size_t responselen);
+extern void RIL_onUnsolicitedResponse(int unsolResponse, const void *data,
+                                size_t datalen);
+extern void RIL_requestTimedCallback(RIL_TimedCallback callback,
+                               void *param, const struct timeval *relativeTime);
+
+typedef struct Record {
+    RIL_CaptureRecord r;
+    void *payload;
+    int64_t latency;            /* COMPLETE only: ms since its COMMAND */
+    int64_t sentAt;             /* COMMAND only: replay time it was sent */
+    int answered;               /* COMMAND only */
+    struct Record *p_next;      /* COMPLETE only: per request queue */
+} Record;
+
+typedef struct {
+    RIL_Token t;
+    int request;
+    RIL_Errno e;
+} PendingCompletion;
+
+static Record *s_records;
+static int s_numRecords;
+
+/* captured completions not yet used by the fake radio, per request */
+static Record *s_completeHead[MAX_REQUEST];
+static Record *s_completeTail[MAX_REQUEST];
+static pthread_mutex_t s_completeMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int s_fast = 0;
+static int s_fdClient = -1;
+
+static pthread_mutex_t s_statsMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_statsCond = PTHREAD_COND_INITIALIZER;
+static int s_responses = 0;
+static int s_unsols = 0;
+static int64_t *s_latencies;
+static int s_firstUnanswered = 0;
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [-f] <capture file>\n"
+                    "  -f  replay at maximum speed instead of captured timing\n",
+                    argv0);
+    exit(-1);
+}
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_until(int64_t when)
+{
+    int64_t delta = when - now_us();
+
+    if (delta > 0) {
+        usleep(delta);
+    }
+}
+
+static int load_capture(const char *path)
+{
+    RIL_CaptureHeader header;
+    RIL_CaptureRecord r;
+    int capacity = 0;
+    FILE *fp;
+    int i, j;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    if (fread(&header, sizeof(header), 1, fp) != 1
+        || header.magic != RIL_CAPTURE_MAGIC
+        || header.version != RIL_CAPTURE_VERSION) {
+        fprintf(stderr, "%s: not a RIL capture file\n", path);
+        fclose(fp);
+        return -1;
+    }
+
+    while (fread(&r, sizeof(r), 1, fp) == 1) {
+        if (s_numRecords == capacity) {
+            capacity = capacity == 0 ? 256 : capacity * 2;
+            s_records = realloc(s_records, capacity * sizeof(Record));
+        }
+
+        memset(&s_records[s_numRecords], 0, sizeof(Record));
+        s_records[s_numRecords].r = r;
+
+        if (r.length > 0) {
+            s_records[s_numRecords].payload = malloc(r.length);
+            if (fread(s_records[s_numRecords].payload, r.length, 1, fp) != 1) {
+                fprintf(stderr, "%s: truncated record\n", path);
+                break;
+            }
+        }
+        s_numRecords++;
+    }
+    fclose(fp);
+
+    /* queue each completion on its request, with its captured latency */
+    for (i = 0; i < s_numRecords; i++) {
+        Record *p_rec = &s_records[i];
+        int redacted = 0;
+
+        if (p_rec->r.type != RIL_CAPTURE_COMPLETE
+            || p_rec->r.request < 0 || p_rec->r.request >= MAX_REQUEST) {
+            continue;
+        }
+
+        for (j = i - 1; j >= 0; j--) {
+            if (s_records[j].r.type == RIL_CAPTURE_COMMAND
+                && s_records[j].r.token == p_rec->r.token) {
+                p_rec->latency = p_rec->r.timestamp - s_records[j].r.timestamp;
+                redacted = s_records[j].r.flags & RIL_CAPTURE_REDACTED;
+                break;
+            }
+        }
+
+        /* its command is never replayed, so neither is it */
+        if (redacted) {
+            continue;
+        }
+
+        if (s_completeTail[p_rec->r.request] == NULL) {
+            s_completeHead[p_rec->r.request] = p_rec;
+        } else {
+            s_completeTail[p_rec->r.request]->p_next = p_rec;
+        }
+        s_completeTail[p_rec->r.request] = p_rec;
+    }
+
+    return 0;
+}
+
+/*
+ * Canned responses, so the fake radio exercises the same marshallers a
+ * real one would.  Requests not listed here complete with no payload.
+ */
+
+static RIL_UUS_Info s_uus = { RIL_UUS_TYPE1_IMPLICIT, RIL_UUS_DCS_IA5c, 0, NULL };
+static RIL_Call s_calls[2] = {
+    { RIL_CALL_ACTIVE, 1, 129, 0, 0, 0, 1, 0, "5551234", 0, "Alice", 0, &s_uus },
+    { RIL_CALL_HOLDING, 2, 145, 0, 1, 0, 1, 0, "+15555678", 0, "Bob", 0, NULL },
+};
+static RIL_Call *s_callList[2] = { &s_calls[0], &s_calls[1] };
+
+static char *s_regState[4] = { "1", "1f2e", "0000a1b2", "3" };
+static char *s_operator[3] = { "Android", "Android", "310260" };
+static char *s_imei = "000000000000000";
+static int s_selectionMode[1] = { 0 };
+static RIL_SignalStrength s_signal = { { 21, 99 }, { -1, -1 }, { -1, -1, -1 } };
+static RIL_SIM_IO_Response s_simIo = { 0x90, 0x00, "0000000a2fe2040000000000" };
+static RIL_SMS_Response s_sms = { 1, NULL, -1 };
+static RIL_Data_Call_Response s_dataCall = { 1, 1, "IP", "internet", "10.0.2.15" };
+
+static void complete_request(RIL_Token t, int request, RIL_Errno e)
+{
+    void *response = NULL;
+    size_t responselen = 0;
+
+    if (e == RIL_E_SUCCESS) {
+        switch (request) {
+            case RIL_REQUEST_GET_CURRENT_CALLS:
+                response = s_callList;
+                responselen = sizeof(s_callList);
+                break;
+            case RIL_REQUEST_REGISTRATION_STATE:
+            case RIL_REQUEST_GPRS_REGISTRATION_STATE:
+                response = s_regState;
+                responselen = sizeof(s_regState);
+                break;
+            case RIL_REQUEST_OPERATOR:
+                response = s_operator;
+                responselen = sizeof(s_operator);
+                break;
+            case RIL_REQUEST_GET_IMEI:
+            case RIL_REQUEST_GET_IMEISV:
+            case RIL_REQUEST_GET_IMSI:
+            case RIL_REQUEST_BASEBAND_VERSION:
+                response = s_imei;
+                responselen = sizeof(char *);
+                break;
+            case RIL_REQUEST_QUERY_NETWORK_SELECTION_MODE:
+                response = s_selectionMode;
+                responselen = sizeof(s_selectionMode);
+                break;
+            case RIL_REQUEST_SIGNAL_STRENGTH:
+                response = &s_signal;
+                responselen = sizeof(s_signal);
+                break;
+            case RIL_REQUEST_SIM_IO:
+                response = &s_simIo;
+                responselen = sizeof(s_simIo);
+                break;
+            case RIL_REQUEST_SEND_SMS:
+            case RIL_REQUEST_SEND_SMS_EXPECT_MORE:
+                response = &s_sms;
+                responselen = sizeof(s_sms);
+                break;
+            case RIL_REQUEST_DATA_CALL_LIST:
+                response = &s_dataCall;
+                responselen = sizeof(s_dataCall);
+                break;
+        }
+    }
+
+    RIL_onRequestComplete(t, e, response, responselen);
+}
+
+static void onCompletionTimer(void *param)
+{
+    PendingCompletion *p_pending = (PendingCompletion *)param;
+
+    complete_request(p_pending->t, p_pending->request, p_pending->e);
+    free(p_pending);
+}
+
+static void fake_onRequest(int request, void *data, size_t datalen, RIL_Token t)
+{
+    RIL_Errno e = RIL_E_SUCCESS;
+    int64_t latency = 0;
+    Record *p_rec = NULL;
+
+    pthread_mutex_lock(&s_completeMutex);
+    if (request >= 0 && request < MAX_REQUEST) {
+        p_rec = s_completeHead[request];
+        if (p_rec != NULL) {
+            s_completeHead[request] = p_rec->p_next;
+            if (s_completeHead[request] == NULL) {
+                s_completeTail[request] = NULL;
+            }
+        }
+    }
+    pthread_mutex_unlock(&s_completeMutex);
+
+    if (p_rec != NULL) {
+        e = (RIL_Errno)p_rec->r.error;
+        latency = p_rec->latency;
+    }
+
+    if (s_fast || latency <= 0) {
+        complete_request(t, request, e);
+    } else {
+        PendingCompletion *p_pending = malloc(sizeof(PendingCompletion));
+        struct timeval tv;
+
+        p_pending->t = t;
+        p_pending->request = request;
+        p_pending->e = e;
+
+        tv.tv_sec = latency / 1000;
+        tv.tv_usec = (latency % 1000) * 1000;
+        RIL_requestTimedCallback(onCompletionTimer, p_pending, &tv);
+    }
+}
+
+static RIL_RadioState fake_onStateRequest(void)
+{
+    return RADIO_STATE_SIM_READY;
+}
+
+static int fake_supports(int requestCode)
+{
+    return 1;
+}
+
+static void fake_onCancel(RIL_Token t)
+{
+}
+
+static const char *fake_getVersion(void)
+{
+    return "rilreplay";
+}
+
+static const RIL_RadioFunctions s_fakeCallbacks = {
+    RIL_VERSION,
+    fake_onRequest,
+    fake_onStateRequest,
+    fake_supports,
+    fake_onCancel,
+    fake_getVersion
+};
+
+static void raise_unsol(int unsolResponse)
+{
+    switch (unsolResponse) {
+        case RIL_UNSOL_SIGNAL_STRENGTH:
+            RIL_onUnsolicitedResponse(unsolResponse, &s_signal,
+                                        sizeof(s_signal));
+            break;
+        case RIL_UNSOL_RESPONSE_NEW_SMS:
+        case RIL_UNSOL_RESPONSE_NEW_SMS_STATUS_REPORT:
+            RIL_onUnsolicitedResponse(unsolResponse,
+                "07914151551512f2040B916105551511f100006060605130308A04D4F29C0E",
+                62);
+            break;
+        case RIL_UNSOL_NITZ_TIME_RECEIVED:
+            RIL_onUnsolicitedResponse(unsolResponse, "10/10/19,12:00:00+00", 20);
+            break;
+        default:
+            RIL_onUnsolicitedResponse(unsolResponse, NULL, 0);
+            break;
+    }
+}
+
+static int read_fully(int fd, void *buf, size_t len)
+{
+    size_t offset = 0;
+    ssize_t ret;
+
+    while (offset < len) {
+        ret = read(fd, (char *)buf + offset, len - offset);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret <= 0) {
+            return -1;
+        }
+        offset += ret;
+    }
+    return 0;
+}
+
+/* Reads responses off the client end of the command socket */
+static void *response_loop(void *param)
+{
+    char buf[8 * 1024];
+    uint32_t header;
+    int32_t type, token;
+    size_t len;
+    int i;
+
+    for (;;) {
+        if (read_fully(s_fdClient, &header, sizeof(header)) < 0) {
+            break;
+        }
+        len = ntohl(header);
+        if (len > sizeof(buf) || len < 2 * sizeof(int32_t)
+            || read_fully(s_fdClient, buf, len) < 0) {
+            fprintf(stderr, "bad response record (%u bytes)\n", (unsigned)len);
+            break;
+        }
+
+        memcpy(&type, buf, sizeof(type));
+        memcpy(&token, buf + sizeof(type), sizeof(token));
+
+        pthread_mutex_lock(&s_statsMutex);
+        if (type == 0) {
+            int64_t t = now_us();
+
+            /* skip the prefix of the capture that is fully answered */
+            while (s_firstUnanswered < s_numRecords
+                    && (s_records[s_firstUnanswered].r.type
+                            != RIL_CAPTURE_COMMAND
+                        || s_records[s_firstUnanswered].answered)) {
+                s_firstUnanswered++;
+            }
+
+            for (i = s_firstUnanswered; i < s_numRecords; i++) {
+                Record *p_rec = &s_records[i];
+
+                if (p_rec->r.type == RIL_CAPTURE_COMMAND && p_rec->sentAt != 0
+                    && !p_rec->answered && p_rec->r.token == token) {
+                    p_rec->answered = 1;
+                    if (s_responses < s_numRecords) {
+                        s_latencies[s_responses] = t - p_rec->sentAt;
+                    }
+                    break;
+                }
+            }
+            s_responses++;
+        } else {
+            s_unsols++;
+        }
+        pthread_cond_broadcast(&s_statsCond);
+        pthread_mutex_unlock(&s_statsMutex);
+    }
+
+    return NULL;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+int main(int argc, char **argv)
+{
+    int sv[2];
+    int i, opt;
+    int commands = 0;
+    int redacted = 0;
+    int64_t start, elapsed, origin;
+    struct timespec deadline;
+    pthread_t tid;
+
+    while ((opt = getopt(argc, argv, "f")) != -1) {
+        switch (opt) {
+            case 'f':
+                s_fast = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+
+    if (load_capture(argv[optind]) < 0 || s_numRecords == 0) {
+        exit(-1);
+    }
+
+    s_latencies = calloc(s_numRecords, sizeof(int64_t));
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        exit(-1);
+    }
+    s_fdClient = sv[1];
+
+    RIL_startEventLoop();
+    RIL_setcallbacks(&s_fakeCallbacks);
+    RIL_setCommandSocket(sv[0]);
+
+    pthread_create(&tid, NULL, response_loop, NULL);
+
+    origin = s_records[0].r.timestamp;
+    start = now_us();
+
+    for (i = 0; i < s_numRecords; i++) {
+        Record *p_rec = &s_records[i];
+        uint32_t header;
+
+        if (!s_fast) {
+            sleep_until(start + (p_rec->r.timestamp - origin) * 1000);
+        }
+
+        switch (p_rec->r.type) {
+            case RIL_CAPTURE_COMMAND:
+                if (p_rec->r.flags & RIL_CAPTURE_REDACTED) {
+                    redacted++;
+                    break;
+                }
+
+                header = htonl(p_rec->r.length);
+
+                pthread_mutex_lock(&s_statsMutex);
+                p_rec->sentAt = now_us();
+                pthread_mutex_unlock(&s_statsMutex);
+
+                if (write(s_fdClient, &header, sizeof(header)) != sizeof(header)
+                    || write(s_fdClient, p_rec->payload, p_rec->r.length)
+                        != (ssize_t)p_rec->r.length) {
+                    perror("writing command");
+                    exit(-1);
+                }
+                commands++;
+                break;
+
+            case RIL_CAPTURE_UNSOL:
+                raise_unsol(p_rec->r.request);
+                break;
+        }
+    }
+
+    /* wait for the outstanding responses, giving up after 10s of silence */
+    pthread_mutex_lock(&s_statsMutex);
+    while (s_responses < commands) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 10;
+        if (pthread_cond_timedwait(&s_statsCond, &s_statsMutex, &deadline)
+                == ETIMEDOUT) {
+            fprintf(stderr, "timed out waiting for %d responses\n",
+                    commands - s_responses);
+            break;
+        }
+    }
+    elapsed = now_us() - start;
+
+    printf("commands %d responses %d unsols %d in %lld.%03llds (%s)\n",
+            commands, s_responses, s_unsols,
+            (long long)(elapsed / 1000000), (long long)(elapsed / 1000 % 1000),
+            s_fast ? "max speed" : "captured timing");
+
+    if (redacted > 0) {
+        printf("%d redacted commands not replayed\n", redacted);
+    }
+
+    if (s_responses > 0) {
+        qsort(s_latencies, s_responses, sizeof(int64_t), compare_int64);
+
+        printf("%.1f requests/s, latency us: p50 %lld p90 %lld p99 %lld max %lld\n",
+                elapsed > 0 ? s_responses * 1000000.0 / elapsed : 0.0,
+                (long long)s_latencies[s_responses / 2],
+                (long long)s_latencies[s_responses * 9 / 10],
+                (long long)s_latencies[s_responses * 99 / 100],
+                (long long)s_latencies[s_responses - 1]);
+    }
+    pthread_mutex_unlock(&s_statsMutex);
+
+    return 0;
+}